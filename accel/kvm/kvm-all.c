@@ -65,9 +65,22 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+#define kvm_slots_lock(kml)      qemu_mutex_lock(&(kml)->slots_lock)
+#define kvm_slots_unlock(kml)    qemu_mutex_unlock(&(kml)->slots_lock)
+
+/* KVM_CLEAR_DIRTY_LOG works on ranges of 64 pages */
+#define KVM_CLEAR_LOG_SHIFT  6
+#define KVM_CLEAR_LOG_ALIGN  (qemu_real_host_page_size << KVM_CLEAR_LOG_SHIFT)
+#define KVM_CLEAR_LOG_MASK   (-KVM_CLEAR_LOG_ALIGN)
+
+/* How often the reaper harvests the dirty rings, in microseconds */
+#define KVM_DIRTY_RING_REAP_INTERVAL    (1000 * 1000)
+
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    /* KVM keeps the dirty ring of a parked vcpu going */
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -106,6 +119,16 @@ struct KVMState
 #endif
     KVMMemoryListener memory_listener;
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
+    /* listener of each address space id, to resolve dirty ring slots */
+    KVMMemoryListener **as_ml;
+    int nr_as;
+    /* KVM_CLEAR_DIRTY_LOG write protects the pages, not KVM_GET_DIRTY_LOG */
+    bool manual_dirty_log_protect;
+    /* entries in each vcpu dirty ring, 0 when the dirty ring is off */
+    uint32_t kvm_dirty_ring_size;
+    /* harvested entries that KVM_RESET_DIRTY_RINGS has yet to recycle */
+    bool kvm_dirty_ring_reset_pending;
+    QemuThread dirty_ring_reaper;
 
     /* memory encryption */
     void *memcrypt_handle;
@@ -182,8 +205,14 @@ static KVMSlot *kvm_get_free_slot(KVMMemoryListener *kml)
 bool kvm_has_free_slot(MachineState *ms)
 {
     KVMState *s = KVM_STATE(ms->accelerator);
+    bool result;
+    KVMMemoryListener *kml = &s->memory_listener;
 
-    return kvm_get_free_slot(&s->memory_listener);
+    kvm_slots_lock(kml);
+    result = !!kvm_get_free_slot(kml);
+    kvm_slots_unlock(kml);
+
+    return result;
 }
 
 static KVMSlot *kvm_alloc_slot(KVMMemoryListener *kml)
@@ -244,18 +273,21 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
                                        hwaddr *phys_addr)
 {
     KVMMemoryListener *kml = &s->memory_listener;
-    int i;
+    int i, ret = 0;
 
+    kvm_slots_lock(kml);
     for (i = 0; i < s->nr_slots; i++) {
         KVMSlot *mem = &kml->slots[i];
 
         if (ram >= mem->ram && ram < mem->ram + mem->memory_size) {
             *phys_addr = mem->start_addr + (ram - mem->ram);
-            return 1;
+            ret = 1;
+            break;
         }
     }
+    kvm_slots_unlock(kml);
 
-    return 0;
+    return ret;
 }
 
 static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot, bool new)
@@ -283,6 +315,198 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot, boo
     return ret;
 }
 
+/*
+ * Dirty ring
+ *
+ * With the dirty ring, KVM pushes the guest frames written by each vcpu
+ * into a ring that is shared with us, instead of setting bits in a
+ * bitmap per memory slot.  Harvesting the rings costs in proportion to
+ * the number of pages dirtied, however big the guest is.  Harvested
+ * pages go straight into the ram_list dirty bitmaps, so a bitmap sync
+ * only has to collect what is left in the rings.
+ *
+ * Harvesting is done with the BQL held: by the reaper thread, by a vcpu
+ * whose ring is full, and by the memory listener before a sync or the
+ * removal of a slot.  The BQL also keeps the slots stable meanwhile.
+ */
+
+static void kvm_dirty_ring_mark_range(ram_addr_t start, ram_addr_t length)
+{
+    if (length) {
+        cpu_physical_memory_set_dirty_range(start, length,
+                                            DIRTY_CLIENTS_NOCODE);
+    }
+}
+
+/*
+ * Translate a dirty ring entry into a ram_addr_t.  Returns false if
+ * the slot went away, in which case the entry is just dropped.
+ */
+static bool kvm_dirty_ring_page_addr(KVMState *s, uint32_t slot_id,
+                                     uint64_t offset, ram_addr_t *addr)
+{
+    uint32_t as_id = slot_id >> 16;
+    KVMSlot *mem;
+
+    slot_id &= 0xffff;
+    if (as_id >= s->nr_as || !s->as_ml[as_id] || slot_id >= s->nr_slots) {
+        return false;
+    }
+
+    mem = &s->as_ml[as_id]->slots[slot_id];
+    if (offset >= mem->memory_size / qemu_real_host_page_size) {
+        return false;
+    }
+
+    *addr = mem->ram_start_offset + offset * qemu_real_host_page_size;
+    return true;
+}
+
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns;
+    uint32_t fetch = cpu->kvm_fetch_index;
+    uint32_t count = 0;
+    ram_addr_t start = 0, length = 0;
+
+    if (!dirty_gfns) {
+        return 0;
+    }
+
+    while (true) {
+        struct kvm_dirty_gfn *cur;
+        ram_addr_t addr;
+
+        cur = &dirty_gfns[fetch & (s->kvm_dirty_ring_size - 1)];
+        if (!(atomic_load_acquire(&cur->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+
+        if (kvm_dirty_ring_page_addr(s, cur->slot, cur->offset, &addr)) {
+            /* vcpus tend to dirty pages in sequence, merge those */
+            if (addr == start + length) {
+                length += qemu_real_host_page_size;
+            } else {
+                kvm_dirty_ring_mark_range(start, length);
+                start = addr;
+                length = qemu_real_host_page_size;
+            }
+        }
+
+        /* Tell KVM the entry can be recycled on the next reset */
+        atomic_store_release(&cur->flags, KVM_DIRTY_GFN_F_RESET);
+        fetch++;
+        count++;
+    }
+    kvm_dirty_ring_mark_range(start, length);
+
+    cpu->kvm_fetch_index = fetch;
+
+    return count;
+}
+
+/*
+ * Harvest the dirty rings of all vcpus, and have KVM write protect the
+ * harvested pages again.  Must be called with the BQL held.  Returns
+ * the number of pages harvested.
+ */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int64_t stamp = get_clock();
+    int ret;
+
+    CPU_FOREACH(cpu) {
+        total += kvm_dirty_ring_reap_one(s, cpu);
+    }
+
+    /*
+     * A failed reset leaves the entries in the rings; it is retried on the
+     * next harvest, if need be from KVM_EXIT_DIRTY_RING_FULL.
+     */
+    if (total || s->kvm_dirty_ring_reset_pending) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        s->kvm_dirty_ring_reset_pending = ret < 0;
+        if (ret < 0) {
+            error_report("KVM_RESET_DIRTY_RINGS failed: %s", strerror(-ret));
+        } else if (ret < total) {
+            error_report("KVM_RESET_DIRTY_RINGS reset %d dirty ring entries "
+                         "but %" PRIu64 " were harvested", ret, total);
+        }
+    }
+
+    trace_kvm_dirty_ring_reap(total, (get_clock() - stamp) / 1000);
+
+    return total;
+}
+
+static void do_kvm_cpu_kick(CPUState *cpu, run_on_cpu_data arg)
+{
+    /* Leaving guest mode is enough, KVM flushes the PML buffer */
+}
+
+/*
+ * Hardware like Intel PML buffers dirty pages before KVM pushes them to
+ * the ring, and only flushes them when the vcpu exits guest mode.
+ */
+static void kvm_dirty_ring_flush(KVMState *s)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        run_on_cpu(cpu, do_kvm_cpu_kick, RUN_ON_CPU_NULL);
+    }
+    kvm_dirty_ring_reap(s);
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        g_usleep(KVM_DIRTY_RING_REAP_INTERVAL);
+
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        qemu_mutex_unlock_iothread();
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int kvm_dirty_ring_init(KVMState *s, uint32_t size)
+{
+    uint64_t bytes = (uint64_t)size * sizeof(struct kvm_dirty_gfn);
+    int max_bytes;
+    int ret;
+
+    max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (max_bytes <= 0 || !KVM_DIRTY_LOG_PAGE_OFFSET) {
+        error_report("KVM does not support the dirty ring");
+        return -ENOSYS;
+    }
+    if (bytes > max_bytes) {
+        error_report("kvm-dirty-ring-size %" PRIu32 " is too big, KVM "
+                     "supports at most %zu entries", size,
+                     max_bytes / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, bytes);
+    if (ret) {
+        error_report("Enabling the KVM dirty ring with %" PRIu32
+                     " entries failed: %s", size, strerror(-ret));
+        return ret;
+    }
+
+    s->kvm_dirty_ring_size = size;
+    return 0;
+}
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -304,16 +528,28 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        kvm_dirty_ring_reap_one(s, cpu);
+        ret = munmap(cpu->kvm_dirty_gfns,
+                     s->kvm_dirty_ring_size * sizeof(struct kvm_dirty_gfn));
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, CPUState *vcpu)
 {
+    unsigned long vcpu_id = kvm_arch_vcpu_id(vcpu);
     struct KVMParkedVcpu *cpu;
 
     QLIST_FOREACH(cpu, &s->kvm_parked_vcpus, node) {
@@ -322,6 +558,7 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
@@ -338,7 +575,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, cpu);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -368,6 +605,20 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_size *
+                                   sizeof(struct kvm_dirty_gfn),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -409,19 +660,24 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
 {
     hwaddr start_addr, size;
     KVMSlot *mem;
+    int ret = 0;
 
     size = kvm_align_section(section, &start_addr);
     if (!size) {
         return 0;
     }
 
+    kvm_slots_lock(kml);
+
     mem = kvm_lookup_matching_slot(kml, start_addr, size);
-    if (!mem) {
-        /* We don't have a slot if we want to trap every access. */
-        return 0;
+    if (mem) {
+        ret = kvm_slot_update_flags(kml, mem, section->mr);
     }
+    /* else we don't have a slot if we want to trap every access. */
+
+    kvm_slots_unlock(kml);
 
-    return kvm_slot_update_flags(kml, mem, section->mr);
+    return ret;
 }
 
 static void kvm_log_start(MemoryListener *listener,
@@ -478,6 +734,11 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
+ * With manual dirty log protection the bitmap is kept in the slot, so
+ * that kvm_physical_log_clear() only clears what was synced.
+ *
+ * Must be called with the slots lock held.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
  */
@@ -511,22 +772,161 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        d.dirty_bitmap = g_malloc0(size);
+        if (!mem->dirty_bmap) {
+            /* Allocate on the first log_sync, once and for all */
+            mem->dirty_bmap = g_malloc0(size);
+        }
 
+        d.dirty_bitmap = mem->dirty_bmap;
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
             DPRINTF("ioctl failed %d\n", errno);
-            g_free(d.dirty_bitmap);
             return -1;
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
-        g_free(d.dirty_bitmap);
     }
 
     return 0;
 }
 
+/*
+ * kvm_log_clear_one_slot - write protect again part of a slot
+ *
+ * Only the pages that the last KVM_GET_DIRTY_LOG reported, and that are
+ * therefore in QEMU's bitmaps already, are cleared: clearing any other
+ * page would lose its dirty bit.  The range is widened to what
+ * KVM_CLEAR_DIRTY_LOG accepts without clearing more than asked for.
+ *
+ * @start: offset of the range in the slot
+ * @size: size of the range
+ */
+static int kvm_log_clear_one_slot(KVMSlot *mem, int as_id, uint64_t start,
+                                  uint64_t size)
+{
+    KVMState *s = kvm_state;
+    uint64_t end, bmap_start, start_delta, bmap_npages, npages, last, i;
+    struct kvm_clear_dirty_log d;
+    unsigned long *bmap_clear = NULL, psize = qemu_real_host_page_size;
+    int ret;
+
+    /* The start must be aligned to 64 pages */
+    bmap_start = start & KVM_CLEAR_LOG_MASK;
+    start_delta = start - bmap_start;
+    bmap_start /= psize;
+
+    /*
+     * And the size too, unless the range goes until the end of the
+     * slot.
+     */
+    bmap_npages = DIV_ROUND_UP(size + start_delta, KVM_CLEAR_LOG_ALIGN)
+        << KVM_CLEAR_LOG_SHIFT;
+    end = mem->memory_size / psize;
+    if (bmap_npages > end - bmap_start) {
+        bmap_npages = end - bmap_start;
+    }
+    start_delta /= psize;
+    npages = size / psize;
+
+    /* log_clear is never called before log_sync */
+    assert(mem->dirty_bmap);
+    if (start_delta || bmap_npages != npages) {
+        /* Copy the bits of the range, and none of the padding around it */
+        bmap_clear = bitmap_new(bmap_npages);
+        last = bmap_start + start_delta + npages;
+        for (i = find_next_bit(mem->dirty_bmap, last, bmap_start + start_delta);
+             i < last; i = find_next_bit(mem->dirty_bmap, last, i + 1)) {
+            set_bit(i - bmap_start, bmap_clear);
+        }
+        d.dirty_bitmap = bmap_clear;
+    } else {
+        d.dirty_bitmap = mem->dirty_bmap + BIT_WORD(bmap_start);
+    }
+
+    d.first_page = bmap_start;
+    /* It should never overflow.  If it happens, say something */
+    assert(bmap_npages <= UINT32_MAX);
+    d.num_pages = bmap_npages;
+    d.slot = mem->slot | (as_id << 16);
+
+    ret = kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d);
+    if (ret < 0 && ret != -ENOENT) {
+        error_report("%s: KVM_CLEAR_DIRTY_LOG failed, slot=%d, "
+                     "start=0x%" PRIx64 ", size=0x%" PRIx32 ", errno=%d",
+                     __func__, d.slot, (uint64_t)d.first_page,
+                     (uint32_t)d.num_pages, ret);
+    } else {
+        ret = 0;
+        trace_kvm_clear_dirty_log(d.slot, d.first_page, d.num_pages);
+    }
+
+    /*
+     * The pages are protected again, so nobody must clear them a second
+     * time before they are synced: that would lose their dirty bit.
+     */
+    bitmap_clear(mem->dirty_bmap, bmap_start + start_delta, npages);
+    g_free(bmap_clear);
+
+    return ret;
+}
+
+/*
+ * kvm_physical_log_clear - write protect again the pages of a section
+ */
+static int kvm_physical_log_clear(KVMMemoryListener *kml,
+                                  MemoryRegionSection *section)
+{
+    KVMState *s = kvm_state;
+    uint64_t start, size, offset, count;
+    KVMSlot *mem;
+    int ret = 0, i;
+
+    if (!s->manual_dirty_log_protect) {
+        /* KVM_GET_DIRTY_LOG has protected the pages already */
+        return 0;
+    }
+
+    start = section->offset_within_address_space;
+    size = int128_get64(section->size);
+    if (!size) {
+        return 0;
+    }
+
+    kvm_slots_lock(kml);
+
+    for (i = 0; i < s->nr_slots; i++) {
+        mem = &kml->slots[i];
+        /* Skip slots that are empty or do not overlap the section */
+        if (!mem->memory_size ||
+            mem->start_addr > start + size - 1 ||
+            start > mem->start_addr + mem->memory_size - 1) {
+            continue;
+        }
+        /* No dirty log was synced for this slot */
+        if (!mem->dirty_bmap) {
+            continue;
+        }
+
+        if (start >= mem->start_addr) {
+            /* The slot starts before the section, or with it */
+            offset = start - mem->start_addr;
+            count = MIN(mem->memory_size - offset, size);
+        } else {
+            /* The slot starts after the section */
+            offset = 0;
+            count = MIN(mem->memory_size, size - (mem->start_addr - start));
+        }
+        ret = kvm_log_clear_one_slot(mem, kml->as_id, offset, count);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    kvm_slots_unlock(kml);
+
+    return ret;
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -792,10 +1192,17 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             return;
         }
         if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_physical_sync_dirty_bitmap(kml, section);
+            if (kvm_state->kvm_dirty_ring_size) {
+                /* the rings can't be resolved once the slot is gone */
+                kvm_dirty_ring_reap(kvm_state);
+            } else {
+                kvm_physical_sync_dirty_bitmap(kml, section);
+            }
         }
 
         /* unregister the slot */
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         mem->memory_size = 0;
         mem->flags = 0;
         err = kvm_set_user_memory_region(kml, mem, false);
@@ -812,6 +1219,9 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = memory_region_get_ram_addr(mr) +
+                            section->offset_within_region +
+                            (start_addr - section->offset_within_address_space);
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem, true);
@@ -828,7 +1238,9 @@ static void kvm_region_add(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
     memory_region_ref(section->mr);
+    kvm_slots_lock(kml);
     kvm_set_phys_mem(kml, section, true);
+    kvm_slots_unlock(kml);
 }
 
 static void kvm_region_del(MemoryListener *listener,
@@ -836,7 +1248,9 @@ static void kvm_region_del(MemoryListener *listener,
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
+    kvm_slots_lock(kml);
     kvm_set_phys_mem(kml, section, false);
+    kvm_slots_unlock(kml);
     memory_region_unref(section->mr);
 }
 
@@ -846,12 +1260,35 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    kvm_slots_lock(kml);
     r = kvm_physical_sync_dirty_bitmap(kml, section);
+    kvm_slots_unlock(kml);
     if (r < 0) {
         abort();
     }
 }
 
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    int r;
+
+    r = kvm_physical_log_clear(kml, section);
+    if (r < 0) {
+        error_report_once("%s: kvm log clear failed: mr=%s "
+                          "offset=%" HWADDR_PRIx " size=%" PRIx64, __func__,
+                          section->mr->name, section->offset_within_region,
+                          int128_get64(section->size));
+        abort();
+    }
+}
+
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    kvm_dirty_ring_flush(kvm_state);
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -926,8 +1363,12 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 {
     int i;
 
+    qemu_mutex_init(&kml->slots_lock);
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    if (as_id < s->nr_as) {
+        s->as_ml[as_id] = kml;
+    }
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -937,7 +1378,14 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
+    if (s->kvm_dirty_ring_size) {
+        kml->listener.log_sync_global = kvm_log_sync_global;
+    } else {
+        kml->listener.log_sync = kvm_log_sync;
+    }
+    if (s->manual_dirty_log_protect) {
+        kml->listener.log_clear = kvm_log_clear;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1702,6 +2150,38 @@ static int kvm_init(MachineState *ms)
     kvm_ioeventfd_any_length_allowed =
         (kvm_check_extension(s, KVM_CAP_IOEVENTFD_ANY_LENGTH) > 0);
 
+    s->nr_as = kvm_check_extension(s, KVM_CAP_MULTI_ADDRESS_SPACE);
+    if (s->nr_as <= 0) {
+        s->nr_as = 1;
+    }
+    s->as_ml = g_new0(KVMMemoryListener *, s->nr_as);
+
+    /* The dirty ring must be enabled before any vcpu is created */
+    if (machine_kvm_dirty_ring_size(ms)) {
+        ret = kvm_dirty_ring_init(s, machine_kvm_dirty_ring_size(ms));
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    /*
+     * Without the dirty ring, have KVM_GET_DIRTY_LOG leave the pages
+     * writable: migration protects them again chunk by chunk, right
+     * before sending them, instead of the guest faulting on all of its
+     * memory after every sync.
+     */
+    if (!s->kvm_dirty_ring_size &&
+        kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT)) {
+        ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT, 0, 1);
+        if (ret) {
+            warn_report("Trying to enable KVM_CAP_MANUAL_DIRTY_LOG_PROTECT "
+                        "but failed: %s.  Falling back to the legacy mode.",
+                        strerror(-ret));
+        } else {
+            s->manual_dirty_log_protect = true;
+        }
+    }
+
     kvm_state = s;
 
     /*
@@ -1748,6 +2228,12 @@ static int kvm_init(MachineState *ms)
         qemu_balloon_inhibit(true);
     }
 
+    if (s->kvm_dirty_ring_size) {
+        qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     return 0;
 
 err:
@@ -1759,6 +2245,7 @@ err:
         close(s->fd);
     }
     g_free(s->memory_listener.slots);
+    g_free(s->as_ml);
 
     return ret;
 }
@@ -2055,6 +2542,17 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(cpu, run);
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /*
+             * KVM won't run this vcpu again until some entries of its
+             * ring are harvested and reset.
+             */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SYSTEM_EVENT:
             switch (run->system_event.type) {
             case KVM_SYSTEM_EVENT_SHUTDOWN:
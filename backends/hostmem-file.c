@@ -36,6 +36,7 @@ struct HostMemoryBackendFile {
     uint64_t align;
     bool discard_data;
     bool is_pmem;
+    bool is_template;
 };
 
 static void
@@ -79,13 +80,35 @@ file_backend_memory_alloc(HostMemoryBackend *backend, Error **errp)
         }
     }
 
+    /*
+     * A template file holds the RAM of a frozen guest; it is mapped
+     * privately so that every clone only pays for the pages it dirties.
+     * Anything that writes the whole mapping up front defeats that.
+     */
+    if (fb->is_template) {
+        if (backend->share) {
+            error_setg(errp, "'x-template' is not compatible with 'share'");
+            return;
+        }
+        if (backend->prealloc || mem_prealloc) {
+            error_setg(errp, "'x-template' is not compatible with 'prealloc'");
+            return;
+        }
+        if (fb->discard_data) {
+            error_setg(errp,
+                       "'x-template' is not compatible with 'discard-data'");
+            return;
+        }
+    }
+
     backend->force_prealloc = mem_prealloc;
     name = host_memory_backend_get_name(backend);
     memory_region_init_ram_from_file(&backend->mr, OBJECT(backend),
                                      name,
                                      backend->size, fb->align,
                                      (backend->share ? RAM_SHARED : 0) |
-                                     (fb->is_pmem ? RAM_PMEM : 0),
+                                     (fb->is_pmem ? RAM_PMEM : 0) |
+                                     (fb->is_template ? RAM_TEMPLATE : 0),
                                      fb->mem_path, errp);
     g_free(name);
 #endif
@@ -191,6 +214,25 @@ static void file_memory_backend_set_pmem(Object *o, bool value, Error **errp)
     fb->is_pmem = value;
 }
 
+static bool file_memory_backend_get_template(Object *o, Error **errp)
+{
+    return MEMORY_BACKEND_FILE(o)->is_template;
+}
+
+static void file_memory_backend_set_template(Object *o, bool value,
+                                             Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(o);
+    HostMemoryBackendFile *fb = MEMORY_BACKEND_FILE(o);
+
+    if (host_memory_backend_mr_inited(backend)) {
+        error_setg(errp, "cannot change property 'x-template' of %s",
+                   object_get_typename(o));
+        return;
+    }
+    fb->is_template = value;
+}
+
 static void file_backend_unparent(Object *obj)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -225,6 +267,9 @@ file_backend_class_init(ObjectClass *oc, void *data)
     object_class_property_add_bool(oc, "pmem",
         file_memory_backend_get_pmem, file_memory_backend_set_pmem,
         &error_abort);
+    object_class_property_add_bool(oc, "x-template",
+        file_memory_backend_get_template, file_memory_backend_set_template,
+        &error_abort);
 }
 
 static void file_backend_instance_finalize(Object *o)
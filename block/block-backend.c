@@ -253,6 +253,26 @@ static int blk_root_inactivate(BdrvChild *child)
     return 0;
 }
 
+/*
+ * Requests of a BlockBackend are accounted to its AioContext, see
+ * blk_inc_in_flight().  Move them along when the AioContext changes.
+ */
+static void blk_root_attached_aio_context(AioContext *new_context,
+                                          void *opaque)
+{
+    BlockBackend *blk = opaque;
+
+    atomic_add(&new_context->block_in_flight, atomic_read(&blk->in_flight));
+}
+
+static void blk_root_detach_aio_context(void *opaque)
+{
+    BlockBackend *blk = opaque;
+
+    atomic_sub(&blk_get_aio_context(blk)->block_in_flight,
+               atomic_read(&blk->in_flight));
+}
+
 static void blk_root_attach(BdrvChild *child)
 {
     BlockBackend *blk = child->opaque;
@@ -260,6 +280,13 @@ static void blk_root_attach(BdrvChild *child)
 
     trace_blk_root_attach(child, blk, child->bs);
 
+    /* Until now, requests were accounted to the main loop */
+    atomic_sub(&qemu_get_aio_context()->block_in_flight,
+               atomic_read(&blk->in_flight));
+    blk_root_attached_aio_context(bdrv_get_aio_context(child->bs), blk);
+    bdrv_add_aio_context_notifier(child->bs, blk_root_attached_aio_context,
+                                  blk_root_detach_aio_context, blk);
+
     QLIST_FOREACH(notifier, &blk->aio_notifiers, list) {
         bdrv_add_aio_context_notifier(child->bs,
                 notifier->attached_aio_context,
@@ -275,6 +302,12 @@ static void blk_root_detach(BdrvChild *child)
 
     trace_blk_root_detach(child, blk, child->bs);
 
+    bdrv_remove_aio_context_notifier(child->bs, blk_root_attached_aio_context,
+                                     blk_root_detach_aio_context, blk);
+    blk_root_detach_aio_context(blk);
+    atomic_add(&qemu_get_aio_context()->block_in_flight,
+               atomic_read(&blk->in_flight));
+
     QLIST_FOREACH(notifier, &blk->aio_notifiers, list) {
         bdrv_remove_aio_context_notifier(child->bs,
                 notifier->attached_aio_context,
@@ -1256,10 +1289,12 @@ int blk_make_zero(BlockBackend *blk, BdrvRequestFlags flags)
 void blk_inc_in_flight(BlockBackend *blk)
 {
     atomic_inc(&blk->in_flight);
+    atomic_inc(&blk_get_aio_context(blk)->block_in_flight);
 }
 
 void blk_dec_in_flight(BlockBackend *blk)
 {
+    atomic_dec(&blk_get_aio_context(blk)->block_in_flight);
     atomic_dec(&blk->in_flight);
     aio_wait_kick();
 }
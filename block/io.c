@@ -500,6 +500,21 @@ static void bdrv_drain_assert_idle(BlockDriverState *bs)
 
 unsigned int bdrv_drain_all_count = 0;
 
+/* Returns true if one of @contexts has in-flight block requests */
+static bool bdrv_drain_all_poll_contexts(GPtrArray *contexts)
+{
+    guint i;
+
+    for (i = 0; i < contexts->len; i++) {
+        AioContext *ctx = g_ptr_array_index(contexts, i);
+
+        if (atomic_read(&ctx->block_in_flight)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static bool bdrv_drain_all_poll(void)
 {
     BlockDriverState *bs = NULL;
@@ -532,6 +547,7 @@ static bool bdrv_drain_all_poll(void)
 void bdrv_drain_all_begin(void)
 {
     BlockDriverState *bs = NULL;
+    GPtrArray *contexts;
 
     if (qemu_in_coroutine()) {
         bdrv_co_yield_to_drain(NULL, true, false, NULL, true, true);
@@ -544,18 +560,39 @@ void bdrv_drain_all_begin(void)
     assert(bdrv_drain_all_count < INT_MAX);
     bdrv_drain_all_count++;
 
+    /* BlockBackends without a root node are in the main loop */
+    contexts = g_ptr_array_new();
+    g_ptr_array_add(contexts, qemu_get_aio_context());
+
     /* Quiesce all nodes, without polling in-flight requests yet. The graph
      * cannot change during this loop. */
     while ((bs = bdrv_next_all_states(bs))) {
         AioContext *aio_context = bdrv_get_aio_context(bs);
+        guint i;
 
         aio_context_acquire(aio_context);
         bdrv_do_drained_begin(bs, false, NULL, true, false);
         aio_context_release(aio_context);
+
+        for (i = 0; i < contexts->len; i++) {
+            if (g_ptr_array_index(contexts, i) == aio_context) {
+                break;
+            }
+        }
+        if (i == contexts->len) {
+            g_ptr_array_add(contexts, aio_context);
+        }
     }
 
-    /* Now poll the in-flight requests */
-    AIO_WAIT_WHILE(NULL, bdrv_drain_all_poll());
+    /* Now poll the in-flight requests.  Walking every node after each
+     * completion is quadratic in the number of nodes, so only walk them when
+     * the per-AioContext counters are zero.  The walk catches whatever the
+     * counters do not cover, such as block jobs that have yet to pause; in
+     * the common case it runs once and finds nothing to wait for.
+     */
+    AIO_WAIT_WHILE(NULL, bdrv_drain_all_poll_contexts(contexts) ||
+                         bdrv_drain_all_poll());
+    g_ptr_array_free(contexts, true);
 
     while ((bs = bdrv_next_all_states(bs))) {
         bdrv_drain_assert_idle(bs);
@@ -704,9 +741,16 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
     return true;
 }
 
+/*
+ * Requests are also accounted to the node's AioContext, so that
+ * bdrv_drain_all_begin() can wait for them without walking the whole graph
+ * each time it is woken up.  bdrv_detach_aio_context() and
+ * bdrv_attach_aio_context() move the count along with the node.
+ */
 void bdrv_inc_in_flight(BlockDriverState *bs)
 {
     atomic_inc(&bs->in_flight);
+    atomic_inc(&bdrv_get_aio_context(bs)->block_in_flight);
 }
 
 void bdrv_wakeup(BlockDriverState *bs)
@@ -716,6 +760,7 @@ void bdrv_wakeup(BlockDriverState *bs)
 
 void bdrv_dec_in_flight(BlockDriverState *bs)
 {
+    atomic_dec(&bdrv_get_aio_context(bs)->block_in_flight);
     atomic_dec(&bs->in_flight);
     bdrv_wakeup(bs);
 }
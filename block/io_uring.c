@@ -0,0 +1,805 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "exec/ramlist.h"
+#include "exec/cpu-common.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+/*
+ * Ring size.  In-flight requests are also capped at this value so that the
+ * completion queue, which the kernel sizes at twice the submission queue,
+ * can never overflow.
+ */
+#define MAX_ENTRIES 128
+
+/* Number of slots in the registered file table */
+#define MAX_FIXED_FILES 64
+
+/* The kernel refuses to register a single buffer larger than 1 GiB */
+#define MAX_FIXED_BUFFER_SIZE (1ULL << 30)
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    bool fixed_buf;                 /* submitted with READ/WRITE_FIXED */
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may require resubmission, see
+     * luring_resubmit_short_read().
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+    unsigned int flags;
+
+    /* io queue for submit at batch.  Protected by AioContext lock. */
+    LuringQueue io_q;
+
+    /* I/O completion processing.  Only runs in I/O thread.  */
+    QEMUBH *completion_bh;
+
+    /*
+     * Registered file table.  Free slots hold -1.  NULL if the kernel does
+     * not support sparse file tables, in which case plain file descriptors
+     * are used.
+     */
+    int *fixed_files;
+    unsigned int nr_fixed_files;    /* highest used slot + 1 */
+
+    /*
+     * Guest RAM registered as fixed buffers, split in chunks the kernel
+     * accepts and sorted by address.  Only used if LURING_FIXED_BUFFERS is
+     * set.  When guest RAM changes, new requests stop using the table
+     * (fixed_bufs_valid is cleared) and the table is registered again once
+     * all requests that refer to the old one have completed.
+     */
+    RAMBlockNotifier ram_notifier;
+    GArray *ram_blocks;             /* struct iovec per RAMBlock */
+    struct iovec *fixed_bufs;
+    unsigned int nr_fixed_bufs;
+    unsigned int fixed_bufs_in_flight;
+    bool fixed_bufs_valid;
+    bool fixed_bufs_dirty;
+};
+
+static void ioq_submit(LuringState *s);
+
+/*
+ * Fixed files
+ */
+
+static int luring_fixed_file_slot(LuringState *s, int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nr_fixed_files; i++) {
+        if (s->fixed_files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void luring_init_fixed_files(LuringState *s)
+{
+    int *files = g_new(int, MAX_FIXED_FILES);
+    int i, ret;
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        files[i] = -1;
+    }
+
+    ret = io_uring_register_files(&s->ring, files, MAX_FIXED_FILES);
+    if (ret < 0) {
+        /* Sparse file tables need Linux 5.5 */
+        g_free(files);
+        return;
+    }
+    s->fixed_files = files;
+}
+
+/**
+ * luring_register_file:
+ * @s: io_uring state
+ * @fd: file descriptor
+ *
+ * Adds @fd to the registered file table, so that requests on @fd do not
+ * have to look up the file on each submission.  This is a no-op when fixed
+ * files are not available, unless SQPOLL is in use: the polling thread can
+ * only access registered files.
+ *
+ * Returns 0 on success, or -errno on failure.
+ */
+int luring_register_file(LuringState *s, int fd, Error **errp)
+{
+    int slot, ret;
+
+    if (!s->fixed_files) {
+        if (s->flags & LURING_SQPOLL) {
+            error_setg(errp, "io_uring SQPOLL requires a kernel that supports "
+                       "updating registered files");
+            return -ENOTSUP;
+        }
+        return 0;
+    }
+
+    if (luring_fixed_file_slot(s, fd) >= 0) {
+        return 0;
+    }
+
+    for (slot = 0; slot < MAX_FIXED_FILES; slot++) {
+        if (s->fixed_files[slot] == -1) {
+            break;
+        }
+    }
+    if (slot == MAX_FIXED_FILES) {
+        if (s->flags & LURING_SQPOLL) {
+            error_setg(errp, "Too many files for io_uring SQPOLL "
+                       "(at most %d per AioContext)", MAX_FIXED_FILES);
+            return -ENOSPC;
+        }
+        return 0;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    trace_luring_register_file(s, fd, slot, ret);
+    if (ret < 0) {
+        if (s->flags & LURING_SQPOLL) {
+            error_setg_errno(errp, -ret, "Failed to register file with "
+                             "io_uring");
+            return ret;
+        }
+        return 0;
+    }
+
+    s->fixed_files[slot] = fd;
+    s->nr_fixed_files = MAX(s->nr_fixed_files, slot + 1);
+    return 0;
+}
+
+/**
+ * luring_unregister_file:
+ * @s: io_uring state
+ * @fd: file descriptor
+ *
+ * Removes @fd from the registered file table.  There must be no in-flight
+ * requests on @fd.
+ */
+void luring_unregister_file(LuringState *s, int fd)
+{
+    int slot, unused = -1;
+
+    if (!s->fixed_files) {
+        return;
+    }
+
+    slot = luring_fixed_file_slot(s, fd);
+    if (slot < 0) {
+        return;
+    }
+
+    trace_luring_unregister_file(s, fd, slot);
+    io_uring_register_files_update(&s->ring, slot, &unused, 1);
+    s->fixed_files[slot] = -1;
+    while (s->nr_fixed_files && s->fixed_files[s->nr_fixed_files - 1] == -1) {
+        s->nr_fixed_files--;
+    }
+}
+
+/*
+ * Fixed buffers
+ */
+
+static int luring_iovec_cmp(const void *a, const void *b)
+{
+    const struct iovec *ia = a, *ib = b;
+    uintptr_t ba = (uintptr_t)ia->iov_base, bb = (uintptr_t)ib->iov_base;
+
+    return ba < bb ? -1 : ba > bb;
+}
+
+/* Returns the index of the fixed buffer that contains [@base, @base + @len) */
+static int luring_fixed_buf_index(LuringState *s, void *base, size_t len)
+{
+    uintptr_t addr = (uintptr_t)base;
+    unsigned int lo = 0, hi = s->nr_fixed_bufs;
+
+    /* Find the last buffer that starts at or before @addr */
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if ((uintptr_t)s->fixed_bufs[mid].iov_base <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+    lo--;
+
+    if (addr + len > (uintptr_t)s->fixed_bufs[lo].iov_base +
+                     s->fixed_bufs[lo].iov_len) {
+        return -1;
+    }
+    return lo;
+}
+
+static void luring_unregister_fixed_buffers(LuringState *s)
+{
+    if (s->nr_fixed_bufs) {
+        io_uring_unregister_buffers(&s->ring);
+    }
+    g_free(s->fixed_bufs);
+    s->fixed_bufs = NULL;
+    s->nr_fixed_bufs = 0;
+}
+
+/*
+ * Registers the current list of RAMBlocks with the kernel.  The caller must
+ * make sure that no request, queued in the submission ring or in flight,
+ * still refers to the old table.
+ */
+static void luring_register_fixed_buffers(LuringState *s)
+{
+    GArray *bufs;
+    unsigned int i;
+    int ret;
+
+    assert(!s->fixed_bufs_in_flight);
+    bufs = g_array_new(false, false, sizeof(struct iovec));
+    s->fixed_bufs_dirty = false;
+    luring_unregister_fixed_buffers(s);
+
+    for (i = 0; i < s->ram_blocks->len; i++) {
+        struct iovec *block = &g_array_index(s->ram_blocks, struct iovec, i);
+        size_t offset;
+
+        for (offset = 0; offset < block->iov_len;
+             offset += MAX_FIXED_BUFFER_SIZE) {
+            struct iovec chunk = {
+                .iov_base = block->iov_base + offset,
+                .iov_len  = MIN(block->iov_len - offset,
+                                MAX_FIXED_BUFFER_SIZE),
+            };
+            g_array_append_val(bufs, chunk);
+        }
+    }
+
+    if (!bufs->len) {
+        g_array_free(bufs, true);
+        return;
+    }
+
+    g_array_sort(bufs, luring_iovec_cmp);
+    ret = io_uring_register_buffers(&s->ring, (struct iovec *)bufs->data,
+                                    bufs->len);
+    trace_luring_register_buffers(s, bufs->len, ret);
+    if (ret < 0) {
+        /* Typically RLIMIT_MEMLOCK is too small to pin all of guest RAM */
+        warn_report("io_uring: failed to register guest RAM as fixed "
+                    "buffers: %s; falling back to vectored I/O",
+                    strerror(-ret));
+        g_array_free(bufs, true);
+        s->flags &= ~LURING_FIXED_BUFFERS;
+        return;
+    }
+
+    s->nr_fixed_bufs = bufs->len;
+    s->fixed_bufs = (struct iovec *)g_array_free(bufs, false);
+    s->fixed_bufs_valid = true;
+}
+
+/* Called with the AioContext lock held */
+static void luring_fixed_buffers_changed(LuringState *s)
+{
+    s->fixed_bufs_valid = false;
+    s->fixed_bufs_dirty = true;
+
+    /* Otherwise wait until the requests using the old table complete */
+    if (!s->fixed_bufs_in_flight) {
+        luring_register_fixed_buffers(s);
+    }
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+    struct iovec block = { .iov_base = host, .iov_len = size };
+
+    aio_context_acquire(s->aio_context);
+    if (s->flags & LURING_FIXED_BUFFERS) {
+        g_array_append_val(s->ram_blocks, block);
+        luring_fixed_buffers_changed(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+    unsigned int i;
+
+    if (!host) {
+        return;
+    }
+
+    aio_context_acquire(s->aio_context);
+    if (s->flags & LURING_FIXED_BUFFERS) {
+        for (i = 0; i < s->ram_blocks->len; i++) {
+            if (g_array_index(s->ram_blocks, struct iovec, i).iov_base ==
+                host) {
+                g_array_remove_index_fast(s->ram_blocks, i);
+                luring_fixed_buffers_changed(s);
+                break;
+            }
+        }
+    }
+    aio_context_release(s->aio_context);
+}
+
+static int luring_init_ramblock(RAMBlock *rb, void *opaque)
+{
+    LuringState *s = opaque;
+    struct iovec block = {
+        .iov_base = qemu_ram_get_host_addr(rb),
+        .iov_len  = qemu_ram_get_used_length(rb),
+    };
+
+    if (block.iov_base) {
+        g_array_append_val(s->ram_blocks, block);
+    }
+    return 0;
+}
+
+/*
+ * Submission
+ */
+
+/*
+ * Copies a prepared request into the submission ring, switching to a fixed
+ * file and a fixed buffer where possible.  This is done as late as possible
+ * so that the tables can change while requests wait in the submit queue.
+ */
+static void luring_prep_sqe(LuringState *s, struct io_uring_sqe *sqe,
+                            LuringAIOCB *luringcb)
+{
+    int slot;
+
+    *sqe = luringcb->sqeq;
+    luringcb->fixed_buf = false;
+
+    if (s->fixed_files) {
+        slot = luring_fixed_file_slot(s, sqe->fd);
+        if (slot >= 0) {
+            sqe->fd = slot;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+    }
+
+    if (s->fixed_bufs_valid && sqe->len == 1 &&
+        (sqe->opcode == IORING_OP_READV || sqe->opcode == IORING_OP_WRITEV)) {
+        struct iovec *iov = (struct iovec *)(uintptr_t)sqe->addr;
+        int index = luring_fixed_buf_index(s, iov->iov_base, iov->iov_len);
+
+        if (index >= 0) {
+            sqe->opcode = sqe->opcode == IORING_OP_READV ?
+                          IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->addr = (uintptr_t)iov->iov_base;
+            sqe->len = iov->iov_len;
+            sqe->buf_index = index;
+            luringcb->fixed_buf = true;
+            s->fixed_bufs_in_flight++;
+        }
+    }
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * Completion
+ */
+
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * Short reads are rare but may occur, e.g. when a buffered read crosses a
+ * page cache eviction.  Resubmit the remainder of the request instead of
+ * returning a truncated result to the guest.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov;
+    size_t remaining;
+
+    trace_luring_resubmit_short_read(s, luringcb, nread);
+
+    /* Update read position */
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    /* Shorten qiov */
+    resubmit_qiov = &luringcb->resubmit_qiov;
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    /* Update sqe */
+    luringcb->sqeq.off += nread;
+    luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
+    luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+
+    luring_resubmit(s, luringcb);
+}
+
+/**
+ * luring_process_completions:
+ * @s: io_uring state
+ *
+ * Fetches completed I/O requests, consumes cqes and invokes their callbacks.
+ * The function is somewhat tricky because it supports nested event loops,
+ * for example when a request callback invokes aio_poll().
+ *
+ * Function schedules BH completion so it can be called again in a nested
+ * event loop.  When there are no events left to complete the BH is being
+ * canceled.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+        int total_bytes;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        if (luringcb->fixed_buf) {
+            s->fixed_bufs_in_flight--;
+        }
+        trace_luring_process_completion(s, luringcb, ret);
+
+        /* total_read is non-zero only for resubmitted read requests */
+        total_bytes = ret + luringcb->total_read;
+
+        if (ret < 0) {
+            if (ret == -EINTR) {
+                luring_resubmit(s, luringcb);
+                continue;
+            }
+        } else if (!luringcb->qiov) {
+            /* Flush */
+            ret = 0;
+        } else if (total_bytes == luringcb->qiov->size) {
+            ret = 0;
+        } else if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                continue;
+            }
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                              luringcb->qiov->size - total_bytes);
+            ret = 0;
+        } else {
+            ret = -ENOSPC;
+        }
+
+        luringcb->ret = ret;
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+        /*
+         * If the coroutine is already entered it must be in ioq_submit()
+         * and will notice luringcb->ret has been filled in when it
+         * eventually runs later.  Coroutines cannot be entered recursively
+         * so avoid doing that!
+         */
+        if (!qemu_coroutine_entered(luringcb->co)) {
+            aio_co_wake(luringcb->co);
+        }
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+    int ret;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.submit_queue) ||
+           io_uring_sq_ready(&s->ring)) {
+        /*
+         * Fill the ring, keeping requests that were copied into it by an
+         * earlier, refused io_uring_submit() call.
+         */
+        while (s->io_q.in_flight + io_uring_sq_ready(&s->ring) < MAX_ENTRIES &&
+               (luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue))) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+            if (!sqe) {
+                break;
+            }
+            luring_prep_sqe(s, sqe, luringcb);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        }
+
+        ret = io_uring_submit(&s->ring);
+        trace_luring_io_uring_submit(s, ret);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /*
+             * -EAGAIN and -EBUSY mean that the kernel wants us to reap
+             * completions first; anything left in the queue is retried from
+             * the completion path.
+             */
+            break;
+        }
+
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue  -= ret;
+
+        if (s->io_q.in_flight >= MAX_ENTRIES) {
+            break;
+        }
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /*
+         * We can try to complete something just right away if there are
+         * still requests in-flight.
+         */
+        luring_process_completions(s);
+    }
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    aio_context_acquire(s->aio_context);
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+
+    if (s->fixed_bufs_dirty && !s->fixed_bufs_in_flight) {
+        luring_register_fixed_buffers(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    trace_luring_io_plug(s);
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    trace_luring_io_unplug(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+/**
+ * luring_do_submit:
+ * @fd: file descriptor for I/O
+ * @luringcb: AIO control block
+ * @s: AIO state
+ * @offset: offset for request
+ * @type: type of request
+ *
+ * Fetches sqes from ring, adds to pending queue and preps them
+ */
+static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
+                            uint64_t offset, int type)
+{
+    struct io_uring_sqe *sqes = &luringcb->sqeq;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                             luringcb->qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                            luringcb->qiov->niov, offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        abort();
+    }
+    io_uring_sqe_set_data(sqes, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset,
+                           qiov ? qiov->size : 0, type);
+    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
+                       s);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL,
+                       qemu_luring_poll_cb, s);
+}
+
+LuringState *luring_init(unsigned int flags, Error **errp)
+{
+    int rc;
+    LuringState *s = g_new0(LuringState, 1);
+    struct io_uring_params p = { 0 };
+
+    trace_luring_init_state(s, sizeof(*s), flags);
+
+    if (flags & LURING_SQPOLL) {
+        p.flags |= IORING_SETUP_SQPOLL;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &p);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+    s->flags = flags;
+    ioq_init(&s->io_q);
+    luring_init_fixed_files(s);
+
+    if (flags & LURING_FIXED_BUFFERS) {
+        s->ram_blocks = g_array_new(false, false, sizeof(struct iovec));
+        s->ram_notifier.ram_block_added = luring_ram_block_added;
+        s->ram_notifier.ram_block_removed = luring_ram_block_removed;
+        ram_block_notifier_add(&s->ram_notifier);
+        qemu_ram_foreach_block(luring_init_ramblock, s);
+        luring_register_fixed_buffers(s);
+    }
+
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    if (s->ram_blocks) {
+        ram_block_notifier_remove(&s->ram_notifier);
+        g_array_free(s->ram_blocks, true);
+    }
+    g_free(s->fixed_bufs);
+    g_free(s->fixed_files);
+    io_uring_queue_exit(&s->ring);
+    trace_luring_cleanup_state(s);
+    g_free(s);
+}
@@ -450,6 +450,29 @@ vu_log_write(VuDev *dev, uint64_t address, uint64_t length)
     vu_log_kick(dev);
 }
 
+/* Log a write to guest memory that we access at @va */
+static void
+vu_log_write_va(VuDev *dev, void *va, uint64_t length)
+{
+    uint64_t addr = (uintptr_t)va;
+    int i;
+
+    if (!(dev->features & (1ULL << VHOST_F_LOG_ALL)) ||
+        !dev->log_table) {
+        return;
+    }
+
+    for (i = 0; i < dev->nregions; i++) {
+        VuDevRegion *r = &dev->regions[i];
+        uint64_t start = r->mmap_addr + r->mmap_offset;
+
+        if (addr >= start && addr < start + r->size) {
+            vu_log_write(dev, addr - start + r->gpa, length);
+            return;
+        }
+    }
+}
+
 static void
 vu_kick_cb(VuDev *dev, int condition, void *data)
 {
@@ -476,6 +499,13 @@ static bool
 vu_get_features_exec(VuDev *dev, VhostUserMsg *vmsg)
 {
     vmsg->payload.u64 =
+        /*
+         * The following VIRTIO feature bits are supported by our virtqueue
+         * implementation:
+         */
+        1ULL << VIRTIO_RING_F_EVENT_IDX |
+        1ULL << VIRTIO_F_RING_PACKED |
+
         1ULL << VHOST_F_LOG_ALL |
         1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
 
@@ -818,6 +848,13 @@ vu_set_vring_num_exec(VuDev *dev, VhostUserMsg *vmsg)
     DPRINT("State.num:   %d\n", num);
     dev->vq[index].vring.num = num;
 
+    /* Only needed by the packed layout, which may not be negotiated yet */
+    dev->vq[index].used_elems = realloc(dev->vq[index].used_elems,
+                                        sizeof(VuVirtqUsedElem) * num);
+    if (num && !dev->vq[index].used_elems) {
+        vu_panic(dev, "Failed to allocate used elements for vq: %d", index);
+    }
+
     return false;
 }
 
@@ -852,6 +889,11 @@ vu_set_vring_addr_exec(VuDev *dev, VhostUserMsg *vmsg)
         return false;
     }
 
+    /* The packed ring has no used index in shared memory to resume from */
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return false;
+    }
+
     vq->used_idx = vq->vring.used->idx;
 
     if (vq->last_avail_idx != vq->used_idx) {
@@ -878,6 +920,20 @@ vu_set_vring_base_exec(VuDev *dev, VhostUserMsg *vmsg)
 
     DPRINT("State.index: %d\n", index);
     DPRINT("State.num:   %d\n", num);
+
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        /*
+         * Bits 0-14 hold last_avail_idx and bit 15 its wrap counter,
+         * bits 16-30 hold used_idx and bit 31 its wrap counter.
+         */
+        dev->vq[index].shadow_avail_idx = dev->vq[index].last_avail_idx =
+            num & 0x7fff;
+        dev->vq[index].last_avail_wrap_counter = !!(num & 0x8000);
+        dev->vq[index].used_idx = (num >> 16) & 0x7fff;
+        dev->vq[index].used_wrap_counter = !!(num & 0x80000000);
+        return false;
+    }
+
     dev->vq[index].shadow_avail_idx = dev->vq[index].last_avail_idx = num;
 
     return false;
@@ -890,6 +946,12 @@ vu_get_vring_base_exec(VuDev *dev, VhostUserMsg *vmsg)
 
     DPRINT("State.index: %d\n", index);
     vmsg->payload.state.num = dev->vq[index].last_avail_idx;
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vmsg->payload.state.num |=
+            dev->vq[index].last_avail_wrap_counter << 15 |
+            dev->vq[index].used_idx << 16 |
+            (uint32_t)dev->vq[index].used_wrap_counter << 31;
+    }
     vmsg->size = sizeof(vmsg->payload.state);
 
     dev->vq[index].started = false;
@@ -931,6 +993,39 @@ vu_check_queue_msg_file(VuDev *dev, VhostUserMsg *vmsg)
     return true;
 }
 
+static inline bool
+is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+    return avail != used && avail == wrap_counter;
+}
+
+static inline bool
+is_desc_used(uint16_t flags, bool wrap_counter)
+{
+    bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+    return avail == used && used == wrap_counter;
+}
+
+/* Move a packed ring index forward, returns true if it wrapped around. */
+static inline bool
+vring_packed_idx_add(VuVirtq *vq, uint16_t *idx, bool *wrap_counter,
+                     unsigned int num)
+{
+    *idx += num;
+    if (*idx >= vq->vring.num) {
+        *idx -= vq->vring.num;
+        *wrap_counter ^= 1;
+        return true;
+    }
+
+    return false;
+}
+
 static int
 inflight_desc_compare(const void *a, const void *b)
 {
@@ -945,6 +1040,137 @@ inflight_desc_compare(const void *a, const void *b)
     return -1;
 }
 
+/*
+ * Rebuild the free list of the packed inflight descriptor pool: every
+ * entry that is not part of the chain of an inflight buffer is free.
+ */
+static int
+vu_inflight_packed_init_pool(VuVirtq *vq)
+{
+    VuVirtqInflight *inflight = vq->inflight;
+    VuDescStatePacked *pool = inflight->desc_packed + inflight->desc_num;
+    bool used[VIRTQUEUE_MAX_SIZE] = { false };
+    unsigned int i, j;
+    uint16_t next;
+
+    if (inflight->desc_num > VIRTQUEUE_MAX_SIZE) {
+        return -1;
+    }
+
+    for (i = 0; i < inflight->desc_num; i++) {
+        VuDescStatePacked *head = &inflight->desc_packed[i];
+
+        if (!head->inflight) {
+            continue;
+        }
+
+        next = head->next;
+        for (j = 1; j < head->num; j++) {
+            if (next >= inflight->desc_num || used[next]) {
+                return -1;
+            }
+            used[next] = true;
+            next = pool[next].next;
+        }
+    }
+
+    vq->inflight_free = inflight->desc_num;
+    for (i = inflight->desc_num; i-- > 0;) {
+        if (!used[i]) {
+            pool[i].inflight = 0;
+            pool[i].next = vq->inflight_free;
+            vq->inflight_free = i;
+        }
+    }
+
+    return 0;
+}
+
+static int
+vu_check_queue_inflights_packed(VuDev *dev, VuVirtq *vq)
+{
+    VuVirtqInflight *inflight = vq->inflight;
+    VuDescStatePacked *head;
+    struct vring_packed_desc *desc;
+    uint16_t used_idx = inflight->used_idx & 0x7fff;
+    bool used_wrap_counter = !!(inflight->used_idx & 0x8000);
+    int i;
+
+    vq->resubmit_num = 0;
+    vq->resubmit_list = NULL;
+    vq->counter = 0;
+
+    if (used_idx >= vq->vring.num ||
+        inflight->last_batch_head >= inflight->desc_num) {
+        return -1;
+    }
+
+    /*
+     * The last buffer may have been made used in the descriptor ring
+     * before its inflight entry was released.
+     */
+    head = &inflight->desc_packed[inflight->last_batch_head];
+    desc = &vq->vring.desc_packed[used_idx];
+    if (head->inflight && desc->id == inflight->last_batch_head &&
+        is_desc_used(desc->flags, used_wrap_counter)) {
+        head->inflight = 0;
+
+        barrier();
+
+        vring_packed_idx_add(vq, &used_idx, &used_wrap_counter, head->num);
+        inflight->used_idx = used_idx | used_wrap_counter << 15;
+    }
+
+    if (vu_inflight_packed_init_pool(vq)) {
+        return -1;
+    }
+
+    for (i = 0; i < inflight->desc_num; i++) {
+        if (inflight->desc_packed[i].inflight == 1) {
+            vq->inuse += inflight->desc_packed[i].num;
+        }
+    }
+
+    if (vq->inuse > vq->vring.num) {
+        return -1;
+    }
+
+    vq->used_idx = vq->last_avail_idx = used_idx;
+    vq->used_wrap_counter = vq->last_avail_wrap_counter = used_wrap_counter;
+    vring_packed_idx_add(vq, &vq->last_avail_idx,
+                         &vq->last_avail_wrap_counter, vq->inuse);
+    vq->shadow_avail_idx = vq->last_avail_idx;
+
+    if (vq->inuse) {
+        vq->resubmit_list = malloc(sizeof(VuVirtqInflightDesc) * vq->inuse);
+        if (!vq->resubmit_list) {
+            return -1;
+        }
+
+        for (i = 0; i < inflight->desc_num; i++) {
+            if (inflight->desc_packed[i].inflight) {
+                vq->resubmit_list[vq->resubmit_num].index = i;
+                vq->resubmit_list[vq->resubmit_num].counter =
+                                        inflight->desc_packed[i].counter;
+                vq->resubmit_num++;
+            }
+        }
+
+        if (vq->resubmit_num > 1) {
+            qsort(vq->resubmit_list, vq->resubmit_num,
+                  sizeof(VuVirtqInflightDesc), inflight_desc_compare);
+        }
+        vq->counter = vq->resubmit_list[0].counter + 1;
+    }
+
+    /* in case of I/O hang after reconnecting */
+    if (eventfd_write(vq->kick_fd, 1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
 static int
 vu_check_queue_inflights(VuDev *dev, VuVirtq *vq)
 {
@@ -962,9 +1188,18 @@ vu_check_queue_inflights(VuDev *dev, VuVirtq *vq)
     if (unlikely(!vq->inflight->version)) {
         /* initialize the buffer */
         vq->inflight->version = INFLIGHT_VERSION;
+        if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+            vq->inflight->used_idx =
+                vq->used_idx | vq->used_wrap_counter << 15;
+            return vu_inflight_packed_init_pool(vq);
+        }
         return 0;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return vu_check_queue_inflights_packed(dev, vq);
+    }
+
     vq->used_idx = vq->vring.used->idx;
     vq->resubmit_num = 0;
     vq->resubmit_list = NULL;
@@ -1347,11 +1582,21 @@ vu_set_postcopy_end(VuDev *dev, VhostUserMsg *vmsg)
     return true;
 }
 
+/*
+ * The master sends the negotiated features before the inflight fd
+ * messages, so the region can be sized for the ring layout in use.
+ * Packed rings need a second array as the descriptor pool.
+ */
 static inline uint64_t
-vu_inflight_queue_size(uint16_t queue_size)
+vu_inflight_queue_size(VuDev *dev, uint16_t queue_size)
 {
-    return ALIGN_UP(sizeof(VuDescStateSplit) * queue_size +
-           sizeof(uint16_t), INFLIGHT_ALIGNMENT);
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return ALIGN_UP(sizeof(VuVirtqInflight) +
+               sizeof(VuDescStatePacked) * queue_size * 2, INFLIGHT_ALIGNMENT);
+    }
+
+    return ALIGN_UP(sizeof(VuVirtqInflight) +
+           sizeof(VuDescStateSplit) * queue_size, INFLIGHT_ALIGNMENT);
 }
 
 static bool
@@ -1374,7 +1619,7 @@ vu_get_inflight_fd(VuDev *dev, VhostUserMsg *vmsg)
     DPRINT("set_inflight_fd num_queues: %"PRId16"\n", num_queues);
     DPRINT("set_inflight_fd queue_size: %"PRId16"\n", queue_size);
 
-    mmap_size = vu_inflight_queue_size(queue_size) * num_queues;
+    mmap_size = vu_inflight_queue_size(dev, queue_size) * num_queues;
 
     addr = qemu_memfd_alloc("vhost-inflight", mmap_size,
                             F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
@@ -1428,6 +1673,12 @@ vu_set_inflight_fd(VuDev *dev, VhostUserMsg *vmsg)
     DPRINT("set_inflight_fd num_queues: %"PRId16"\n", num_queues);
     DPRINT("set_inflight_fd queue_size: %"PRId16"\n", queue_size);
 
+    if (mmap_size < vu_inflight_queue_size(dev, queue_size) * num_queues) {
+        vu_panic(dev, "set_inflight_fd: region too small for %d queues",
+                 num_queues);
+        return false;
+    }
+
     rc = mmap(0, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
               fd, mmap_offset);
 
@@ -1451,7 +1702,7 @@ vu_set_inflight_fd(VuDev *dev, VhostUserMsg *vmsg)
     for (i = 0; i < num_queues; i++) {
         dev->vq[i].inflight = (VuVirtqInflight *)rc;
         dev->vq[i].inflight->desc_num = queue_size;
-        rc = (void *)((char *)rc + vu_inflight_queue_size(queue_size));
+        rc = (void *)((char *)rc + vu_inflight_queue_size(dev, queue_size));
     }
 
     return false;
@@ -1612,6 +1863,9 @@ vu_deinit(VuDev *dev)
             vq->resubmit_list = NULL;
         }
 
+        free(vq->used_elems);
+        vq->used_elems = NULL;
+
         vq->inflight = NULL;
     }
 
@@ -1667,6 +1921,8 @@ vu_init(VuDev *dev,
         dev->vq[i] = (VuVirtq) {
             .call_fd = -1, .kick_fd = -1, .err_fd = -1,
             .notification = true,
+            .last_avail_wrap_counter = true,
+            .used_wrap_counter = true,
         };
     }
 }
@@ -1754,12 +2010,15 @@ virtqueue_get_head(VuDev *dev, VuVirtq *vq,
 }
 
 static int
-virtqueue_read_indirect_desc(VuDev *dev, struct vring_desc *desc,
+virtqueue_read_indirect_desc(VuDev *dev, void *desc,
                              uint64_t addr, size_t len)
 {
-    struct vring_desc *ori_desc;
+    void *ori_desc;
     uint64_t read_len;
 
+    QEMU_BUILD_BUG_ON(sizeof(struct vring_desc) !=
+                      sizeof(struct vring_packed_desc));
+
     if (len > (VIRTQUEUE_MAX_SIZE * sizeof(struct vring_desc))) {
         return -1;
     }
@@ -1778,7 +2037,7 @@ virtqueue_read_indirect_desc(VuDev *dev, struct vring_desc *desc,
         memcpy(desc, ori_desc, read_len);
         len -= read_len;
         addr += read_len;
-        desc += read_len;
+        desc = (char *)desc + read_len;
     }
 
     return 0;
@@ -1812,6 +2071,135 @@ virtqueue_read_next_desc(VuDev *dev, struct vring_desc *desc,
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
+static inline uint16_t
+vring_packed_desc_flags(VuVirtq *vq, unsigned int i)
+{
+    return atomic_read(&vq->vring.desc_packed[i].flags);
+}
+
+/*
+ * Copy the ring descriptors of the packed ring buffer starting at slot
+ * @idx to @descs. Returns the number of descriptors, or -1 on error.
+ */
+static int
+vu_queue_packed_read_descs(VuDev *dev, VuVirtq *vq, unsigned int idx,
+                           struct vring_packed_desc *descs)
+{
+    unsigned int num = 0;
+
+    do {
+        /* If we've got too many, that implies a descriptor loop. */
+        if (num == vq->vring.num || num == VIRTQUEUE_MAX_SIZE) {
+            vu_panic(dev, "Looped descriptor");
+            return -1;
+        }
+
+        descs[num] = vq->vring.desc_packed[idx];
+        if (++idx == vq->vring.num) {
+            idx = 0;
+        }
+    } while (descs[num++].flags & VRING_DESC_F_NEXT);
+
+    return num;
+}
+
+/*
+ * Return the descriptors making up a packed ring buffer: either its
+ * @num ring descriptors, or the indirect table they point to, in which
+ * case @num is updated. @desc_buf is used if the table can't be
+ * accessed in place.
+ */
+static struct vring_packed_desc *
+vu_queue_packed_buffer(VuDev *dev, struct vring_packed_desc *descs,
+                       unsigned int *num, struct vring_packed_desc *desc_buf)
+{
+    struct vring_packed_desc *desc;
+    uint64_t desc_addr = descs[0].addr, read_len;
+    unsigned int desc_len = descs[0].len;
+
+    if (!(descs[0].flags & VRING_DESC_F_INDIRECT)) {
+        return descs;
+    }
+
+    if (*num != 1 || desc_len % sizeof(struct vring_packed_desc) ||
+        desc_len > VIRTQUEUE_MAX_SIZE * sizeof(struct vring_packed_desc)) {
+        vu_panic(dev, "Invalid size for indirect buffer table");
+        return NULL;
+    }
+
+    read_len = desc_len;
+    desc = vu_gpa_to_va(dev, &read_len, desc_addr);
+    if (unlikely(desc && read_len != desc_len)) {
+        /* Failed to use zero copy */
+        desc = NULL;
+        if (!virtqueue_read_indirect_desc(dev, desc_buf,
+                                          desc_addr,
+                                          desc_len)) {
+            desc = desc_buf;
+        }
+    }
+    if (!desc) {
+        vu_panic(dev, "Invalid indirect buffer table");
+        return NULL;
+    }
+
+    *num = desc_len / sizeof(struct vring_packed_desc);
+    return desc;
+}
+
+static int
+vu_queue_packed_get_avail_bytes(VuDev *dev, VuVirtq *vq,
+                                unsigned int *in_total,
+                                unsigned int *out_total,
+                                unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    struct vring_packed_desc descs[VIRTQUEUE_MAX_SIZE];
+    struct vring_packed_desc desc_buf[VIRTQUEUE_MAX_SIZE];
+    struct vring_packed_desc *desc;
+    uint16_t idx = vq->last_avail_idx;
+    bool wrap_counter = vq->last_avail_wrap_counter;
+    unsigned int total_bufs = 0, num, i;
+    int ndescs;
+
+    while (is_desc_avail(vring_packed_desc_flags(vq, idx), wrap_counter)) {
+        /* Read the descriptors only once we know they are available. */
+        smp_rmb();
+
+        ndescs = vu_queue_packed_read_descs(dev, vq, idx, descs);
+        if (ndescs < 0) {
+            return -1;
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        total_bufs += ndescs;
+        if (total_bufs > vq->vring.num) {
+            vu_panic(dev, "Looped descriptor");
+            return -1;
+        }
+
+        num = ndescs;
+        desc = vu_queue_packed_buffer(dev, descs, &num, desc_buf);
+        if (!desc) {
+            return -1;
+        }
+
+        for (i = 0; i < num; i++) {
+            if (desc[i].flags & VRING_DESC_F_WRITE) {
+                *in_total += desc[i].len;
+            } else {
+                *out_total += desc[i].len;
+            }
+            if (*in_total >= max_in_bytes && *out_total >= max_out_bytes) {
+                return 0;
+            }
+        }
+
+        vring_packed_idx_add(vq, &idx, &wrap_counter, ndescs);
+    }
+
+    return 0;
+}
+
 void
 vu_queue_get_avail_bytes(VuDev *dev, VuVirtq *vq, unsigned int *in_bytes,
                          unsigned int *out_bytes,
@@ -1829,6 +2217,14 @@ vu_queue_get_avail_bytes(VuDev *dev, VuVirtq *vq, unsigned int *in_bytes,
         goto done;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        if (vu_queue_packed_get_avail_bytes(dev, vq, &in_total, &out_total,
+                                            max_in_bytes, max_out_bytes)) {
+            goto err;
+        }
+        goto done;
+    }
+
     while ((rc = virtqueue_num_heads(dev, vq, idx)) > 0) {
         unsigned int max, desc_len, num_bufs, indirect = 0;
         uint64_t desc_addr, read_len;
@@ -1945,6 +2341,11 @@ vu_queue_empty(VuDev *dev, VuVirtq *vq)
         return true;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return !is_desc_avail(vring_packed_desc_flags(vq, vq->last_avail_idx),
+                              vq->last_avail_wrap_counter);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return false;
     }
@@ -1952,6 +2353,45 @@ vu_queue_empty(VuDev *dev, VuVirtq *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
+static bool
+vring_packed_need_event(VuVirtq *vq, bool wrap, uint16_t off_wrap,
+                        uint16_t new, uint16_t old)
+{
+    int off = off_wrap & ~(1 << 15);
+
+    if (wrap != off_wrap >> 15) {
+        off -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+static bool
+vring_packed_notify(VuDev *dev, VuVirtq *vq)
+{
+    struct vring_packed_desc_event *e = vq->vring.driver_event;
+    uint16_t old, new, flags;
+    bool v;
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+
+    flags = atomic_read(&e->flags);
+    if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (flags == VRING_PACKED_EVENT_FLAG_ENABLE) {
+        return true;
+    }
+
+    /* The driver writes off_wrap before enabling descriptor events. */
+    smp_rmb();
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         atomic_read(&e->off_wrap), new, old);
+}
+
 static bool
 vring_notify(VuDev *dev, VuVirtq *vq)
 {
@@ -1967,6 +2407,10 @@ vring_notify(VuDev *dev, VuVirtq *vq)
         return true;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return vring_packed_notify(dev, vq);
+    }
+
     if (!vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -2026,11 +2470,41 @@ vring_set_avail_event(VuVirtq *vq, uint16_t val)
     *((uint16_t *) &vq->vring.used->ring[vq->vring.num]) = val;
 }
 
+static inline void
+vring_packed_set_avail_event(VuVirtq *vq)
+{
+    if (!vq->notification) {
+        return;
+    }
+
+    vq->vring.device_event->off_wrap =
+        vq->last_avail_idx | vq->last_avail_wrap_counter << 15;
+}
+
+static void
+vring_packed_set_notification(VuDev *dev, VuVirtq *vq, int enable)
+{
+    struct vring_packed_desc_event *e = vq->vring.device_event;
+
+    if (!enable) {
+        e->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+        /* Make sure off_wrap is written before flags */
+        smp_wmb();
+        e->flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        e->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+}
+
 void
 vu_queue_set_notification(VuDev *dev, VuVirtq *vq, int enable)
 {
     vq->notification = enable;
-    if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vring_packed_set_notification(dev, vq, enable);
+    } else if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -2170,6 +2644,65 @@ vu_queue_map_desc(VuDev *dev, VuVirtq *vq, unsigned int idx, size_t sz)
     /* Now copy what we have collected and mapped */
     elem = virtqueue_alloc_element(sz, out_num, in_num);
     elem->index = idx;
+    elem->ndescs = 1;
+    for (i = 0; i < out_num; i++) {
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    return elem;
+}
+
+static void *
+vu_queue_map_desc_packed(VuDev *dev, VuVirtq *vq,
+                         struct vring_packed_desc *descs,
+                         unsigned int ndescs, size_t sz)
+{
+    struct vring_packed_desc desc_buf[VIRTQUEUE_MAX_SIZE];
+    struct vring_packed_desc *desc;
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    unsigned int out_num = 0, in_num = 0, num = ndescs, i;
+    /* The buffer id is in the last descriptor of the chain */
+    uint16_t id = descs[ndescs - 1].id;
+    VuVirtqElement *elem;
+
+    if (id >= vq->vring.num) {
+        vu_panic(dev, "Guest says buffer id %u is available", id);
+        return NULL;
+    }
+
+    desc = vu_queue_packed_buffer(dev, descs, &num, desc_buf);
+    if (!desc) {
+        return NULL;
+    }
+
+    /* Collect all the descriptors */
+    for (i = 0; i < num; i++) {
+        if (desc[i].flags & VRING_DESC_F_WRITE) {
+            virtqueue_map_desc(dev, &in_num, iov + out_num,
+                               VIRTQUEUE_MAX_SIZE - out_num, true,
+                               desc[i].addr, desc[i].len);
+        } else {
+            if (in_num) {
+                vu_panic(dev, "Incorrect order for descriptors");
+                return NULL;
+            }
+            virtqueue_map_desc(dev, &out_num, iov,
+                               VIRTQUEUE_MAX_SIZE, false,
+                               desc[i].addr, desc[i].len);
+        }
+    }
+
+    if (unlikely(dev->broken)) {
+        return NULL;
+    }
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = ndescs;
     for (i = 0; i < out_num; i++) {
         elem->out_sg[i] = iov[i];
     }
@@ -2180,6 +2713,76 @@ vu_queue_map_desc(VuDev *dev, VuVirtq *vq, unsigned int idx, size_t sz)
     return elem;
 }
 
+/* Give the descriptors after the head of an inflight chain back to the pool */
+static void
+vu_inflight_packed_free_chain(VuVirtq *vq, VuDescStatePacked *head)
+{
+    VuDescStatePacked *pool = vq->inflight->desc_packed +
+                              vq->inflight->desc_num;
+    uint16_t next = head->next, n;
+    unsigned int i;
+
+    for (i = 1; i < head->num && next < vq->inflight->desc_num; i++) {
+        n = pool[next].next;
+        pool[next].next = vq->inflight_free;
+        vq->inflight_free = next;
+        next = n;
+    }
+}
+
+/*
+ * For the packed ring, entries are indexed by buffer id and hold a copy
+ * of the descriptors: the slots they come from get reused for used
+ * descriptors, possibly before the buffer itself completes.
+ */
+static int
+vu_queue_inflight_get_packed(VuDev *dev, VuVirtq *vq,
+                             struct vring_packed_desc *descs,
+                             unsigned int ndescs)
+{
+    VuDescStatePacked *pool, *head, *d;
+    uint16_t id = descs[ndescs - 1].id;
+    unsigned int i;
+
+    if (!has_feature(dev->protocol_features,
+        VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD)) {
+        return 0;
+    }
+
+    if (unlikely(!vq->inflight || id >= vq->inflight->desc_num)) {
+        return -1;
+    }
+
+    pool = vq->inflight->desc_packed + vq->inflight->desc_num;
+    head = &vq->inflight->desc_packed[id];
+
+    /* The buffer was rewound and popped again */
+    if (head->inflight) {
+        head->inflight = 0;
+        vu_inflight_packed_free_chain(vq, head);
+    }
+
+    head->desc = descs[0];
+    for (d = head, i = 1; i < ndescs; i++) {
+        if (vq->inflight_free >= vq->inflight->desc_num) {
+            return -1;
+        }
+        d->next = vq->inflight_free;
+        d = &pool[vq->inflight_free];
+        vq->inflight_free = d->next;
+        d->inflight = 0;
+        d->desc = descs[i];
+    }
+    head->num = ndescs;
+    head->counter = vq->counter++;
+
+    barrier();
+
+    head->inflight = 1;
+
+    return 0;
+}
+
 static int
 vu_queue_inflight_get(VuDev *dev, VuVirtq *vq, int desc_idx)
 {
@@ -2229,6 +2832,20 @@ vu_queue_inflight_post_put(VuDev *dev, VuVirtq *vq, int desc_idx)
 
     barrier();
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        VuDescStatePacked *head = &vq->inflight->desc_packed[desc_idx];
+
+        head->inflight = 0;
+
+        barrier();
+
+        vq->inflight->used_idx =
+            vq->used_idx | vq->used_wrap_counter << 15;
+        vu_inflight_packed_free_chain(vq, head);
+
+        return 0;
+    }
+
     vq->inflight->desc[desc_idx].inflight = 0;
 
     barrier();
@@ -2238,6 +2855,66 @@ vu_queue_inflight_post_put(VuDev *dev, VuVirtq *vq, int desc_idx)
     return 0;
 }
 
+/* Map an inflight packed ring buffer again from its recorded descriptors */
+static void *
+vu_queue_map_inflight_packed(VuDev *dev, VuVirtq *vq, uint16_t id, size_t sz)
+{
+    VuDescStatePacked *pool = vq->inflight->desc_packed +
+                              vq->inflight->desc_num;
+    VuDescStatePacked *d = &vq->inflight->desc_packed[id];
+    struct vring_packed_desc descs[VIRTQUEUE_MAX_SIZE];
+    unsigned int i, num = d->num;
+
+    if (!num || num > VIRTQUEUE_MAX_SIZE) {
+        vu_panic(dev, "Invalid inflight buffer %u", id);
+        return NULL;
+    }
+
+    descs[0] = d->desc;
+    for (i = 1; i < num; i++) {
+        if (d->next >= vq->inflight->desc_num) {
+            vu_panic(dev, "Invalid inflight buffer %u", id);
+            return NULL;
+        }
+        d = &pool[d->next];
+        descs[i] = d->desc;
+    }
+
+    return vu_queue_map_desc_packed(dev, vq, descs, num, sz);
+}
+
+static void *
+vu_queue_packed_pop(VuDev *dev, VuVirtq *vq, size_t sz)
+{
+    struct vring_packed_desc descs[VIRTQUEUE_MAX_SIZE];
+    VuVirtqElement *elem;
+    int ndescs;
+
+    ndescs = vu_queue_packed_read_descs(dev, vq, vq->last_avail_idx, descs);
+    if (ndescs < 0) {
+        return NULL;
+    }
+
+    elem = vu_queue_map_desc_packed(dev, vq, descs, ndescs, sz);
+    if (!elem) {
+        return NULL;
+    }
+
+    vring_packed_idx_add(vq, &vq->last_avail_idx,
+                         &vq->last_avail_wrap_counter, ndescs);
+    vq->shadow_avail_idx = vq->last_avail_idx;
+
+    if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+    }
+
+    vq->inuse += ndescs;
+
+    vu_queue_inflight_get_packed(dev, vq, descs, ndescs);
+
+    return elem;
+}
+
 void *
 vu_queue_pop(VuDev *dev, VuVirtq *vq, size_t sz)
 {
@@ -2252,7 +2929,14 @@ vu_queue_pop(VuDev *dev, VuVirtq *vq, size_t sz)
 
     if (unlikely(vq->resubmit_list && vq->resubmit_num > 0)) {
         i = (--vq->resubmit_num);
-        elem = vu_queue_map_desc(dev, vq, vq->resubmit_list[i].index, sz);
+        if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+            elem = vu_queue_map_inflight_packed(dev, vq,
+                                                vq->resubmit_list[i].index,
+                                                sz);
+        } else {
+            elem = vu_queue_map_desc(dev, vq, vq->resubmit_list[i].index,
+                                     sz);
+        }
 
         if (!vq->resubmit_num) {
             free(vq->resubmit_list);
@@ -2276,6 +2960,10 @@ vu_queue_pop(VuDev *dev, VuVirtq *vq, size_t sz)
         return NULL;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return vu_queue_packed_pop(dev, vq, sz);
+    }
+
     if (!virtqueue_get_head(dev, vq, vq->last_avail_idx++, &head)) {
         return NULL;
     }
@@ -2301,15 +2989,31 @@ static void
 vu_queue_detach_element(VuDev *dev, VuVirtq *vq, VuVirtqElement *elem,
                         size_t len)
 {
-    vq->inuse--;
+    vq->inuse -= elem->ndescs;
     /* unmap, when DMA support is added */
 }
 
+static void
+vu_queue_packed_rewind(VuVirtq *vq, unsigned int num)
+{
+    if (vq->last_avail_idx < num) {
+        vq->last_avail_idx = vq->vring.num + vq->last_avail_idx - num;
+        vq->last_avail_wrap_counter ^= 1;
+    } else {
+        vq->last_avail_idx -= num;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+}
+
 void
 vu_queue_unpop(VuDev *dev, VuVirtq *vq, VuVirtqElement *elem,
                size_t len)
 {
-    vq->last_avail_idx--;
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_rewind(vq, elem->ndescs);
+    } else {
+        vq->last_avail_idx--;
+    }
     vu_queue_detach_element(dev, vq, elem, len);
 }
 
@@ -2319,7 +3023,11 @@ vu_queue_rewind(VuDev *dev, VuVirtq *vq, unsigned int num)
     if (num > vq->inuse) {
         return false;
     }
-    vq->last_avail_idx -= num;
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_rewind(vq, num);
+    } else {
+        vq->last_avail_idx -= num;
+    }
     vq->inuse -= num;
     return true;
 }
@@ -2395,6 +3103,43 @@ vu_log_queue_fill(VuDev *dev, VuVirtq *vq,
               == VIRTQUEUE_READ_DESC_MORE));
 }
 
+/*
+ * The descriptors of a packed ring buffer may already have been
+ * overwritten by used descriptors, so log through the mapped iovecs.
+ */
+static void
+vu_log_queue_fill_packed(VuDev *dev, const VuVirtqElement *elem,
+                         unsigned int len)
+{
+    unsigned int i;
+    size_t min;
+
+    for (i = 0; i < elem->in_num && len > 0; i++) {
+        min = MIN(elem->in_sg[i].iov_len, (size_t)len);
+        vu_log_write_va(dev, elem->in_sg[i].iov_base, min);
+        len -= min;
+    }
+}
+
+/*
+ * The packed ring has no separate used ring to fill: remember the element
+ * and write the used descriptors out at flush time, so that the head one
+ * can be made visible to the guest last.
+ */
+static void
+vu_queue_packed_fill(VuDev *dev, VuVirtq *vq,
+                     const VuVirtqElement *elem,
+                     unsigned int len, unsigned int idx)
+{
+    vu_log_queue_fill_packed(dev, elem, len);
+
+    assert(idx < vq->vring.num);
+
+    vq->used_elems[idx].id = elem->index;
+    vq->used_elems[idx].len = len;
+    vq->used_elems[idx].ndescs = elem->ndescs;
+}
+
 void
 vu_queue_fill(VuDev *dev, VuVirtq *vq,
               const VuVirtqElement *elem,
@@ -2407,6 +3152,11 @@ vu_queue_fill(VuDev *dev, VuVirtq *vq,
         return;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_fill(dev, vq, elem, len, idx);
+        return;
+    }
+
     vu_log_queue_fill(dev, vq, elem, len);
 
     idx = (idx + vq->used_idx) % vq->vring.num;
@@ -2427,6 +3177,58 @@ void vring_used_idx_set(VuDev *dev, VuVirtq *vq, uint16_t val)
     vq->used_idx = val;
 }
 
+/* Write the used descriptor @off slots after used_idx */
+static void
+vring_packed_used_write(VuDev *dev, VuVirtq *vq,
+                        const VuVirtqUsedElem *uelem, unsigned int off)
+{
+    struct vring_packed_desc *desc;
+    uint16_t idx = vq->used_idx, flags = 0;
+    bool wrap_counter = vq->used_wrap_counter;
+
+    vring_packed_idx_add(vq, &idx, &wrap_counter, off);
+    if (wrap_counter) {
+        flags = 1 << VRING_PACKED_DESC_F_AVAIL |
+                1 << VRING_PACKED_DESC_F_USED;
+    }
+
+    desc = &vq->vring.desc_packed[idx];
+    desc->id = uelem->id;
+    desc->len = uelem->len;
+    /* Make sure id and len are written before the flags */
+    smp_wmb();
+    atomic_set(&desc->flags, flags);
+
+    vu_log_write_va(dev, desc, sizeof(*desc));
+}
+
+static void
+vu_queue_packed_flush(VuDev *dev, VuVirtq *vq, unsigned int count)
+{
+    unsigned int i, ndescs;
+
+    if (!count) {
+        return;
+    }
+
+    /*
+     * Write all but the first used descriptor, then the first one: the
+     * driver doesn't look past it, so it sees the whole batch at once.
+     */
+    ndescs = vq->used_elems[0].ndescs;
+    for (i = 1; i < count; i++) {
+        vring_packed_used_write(dev, vq, &vq->used_elems[i], ndescs);
+        ndescs += vq->used_elems[i].ndescs;
+    }
+    vring_packed_used_write(dev, vq, &vq->used_elems[0], 0);
+
+    vq->inuse -= ndescs;
+    if (vring_packed_idx_add(vq, &vq->used_idx, &vq->used_wrap_counter,
+                             ndescs)) {
+        vq->signalled_used_valid = false;
+    }
+}
+
 void
 vu_queue_flush(VuDev *dev, VuVirtq *vq, unsigned int count)
 {
@@ -2437,6 +3239,11 @@ vu_queue_flush(VuDev *dev, VuVirtq *vq, unsigned int count)
         return;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_flush(dev, vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
 
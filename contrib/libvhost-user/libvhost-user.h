@@ -261,9 +261,21 @@ typedef void (*vu_queue_handler_cb) (VuDev *dev, int qidx);
 
 typedef struct VuRing {
     unsigned int num;
-    struct vring_desc *desc;
-    struct vring_avail *avail;
-    struct vring_used *used;
+    union {
+        struct vring_desc *desc;
+        /* VIRTIO_F_RING_PACKED: the descriptor ring */
+        struct vring_packed_desc *desc_packed;
+    };
+    union {
+        struct vring_avail *avail;
+        /* VIRTIO_F_RING_PACKED: the driver event suppression area */
+        struct vring_packed_desc_event *driver_event;
+    };
+    union {
+        struct vring_used *used;
+        /* VIRTIO_F_RING_PACKED: the device event suppression area */
+        struct vring_packed_desc_event *device_event;
+    };
     uint64_t log_guest_addr;
     uint32_t flags;
 } VuRing;
@@ -285,6 +297,31 @@ typedef struct VuDescStateSplit {
     uint64_t counter;
 } VuDescStateSplit;
 
+typedef struct VuDescStatePacked {
+    /* Indicate whether this buffer is inflight or not.
+     * Only available for head-descriptor. */
+    uint8_t inflight;
+
+    /* Padding */
+    uint8_t padding[3];
+
+    /* Number of descriptors in the chain.
+     * Only available for head-descriptor. */
+    uint16_t num;
+
+    /* Index of the next descriptor of the chain in the descriptor pool,
+     * also used to link the free entries of the pool together. */
+    uint16_t next;
+
+    /* Used to preserve the order of fetching available descriptors.
+     * Only available for head-descriptor. */
+    uint64_t counter;
+
+    /* Copy of the descriptor: the ring slot it was read from may be
+     * overwritten by a used descriptor before the buffer completes. */
+    struct vring_packed_desc desc;
+} VuDescStatePacked;
+
 typedef struct VuVirtqInflight {
     /* The feature flags of this region. Now it's initialized to 0. */
     uint64_t features;
@@ -297,14 +334,23 @@ typedef struct VuVirtqInflight {
      * size. Slave could get it from queue size field of VhostUserInflight. */
     uint16_t desc_num;
 
-    /* The head of list that track the last batch of used descriptors. */
+    /* The head of list that track the last batch of used descriptors.
+     * For packed virtqueues, the buffer id of the last used buffer. */
     uint16_t last_batch_head;
 
-    /* Storing the idx value of used ring */
+    /* Storing the idx value of used ring.  For packed virtqueues, bit 15
+     * holds the used wrap counter. */
     uint16_t used_idx;
 
-    /* Used to track the state of each descriptor in descriptor table */
-    VuDescStateSplit desc[0];
+    union {
+        /* Used to track the state of each descriptor in descriptor table */
+        VuDescStateSplit desc[0];
+
+        /* For packed virtqueues, desc_num entries indexed by buffer id
+         * followed by a pool of desc_num entries for the rest of the
+         * descriptor chains. */
+        VuDescStatePacked desc_packed[0];
+    };
 } VuVirtqInflight;
 
 typedef struct VuVirtqInflightDesc {
@@ -312,6 +358,12 @@ typedef struct VuVirtqInflightDesc {
     uint64_t counter;
 } VuVirtqInflightDesc;
 
+typedef struct VuVirtqUsedElem {
+    uint16_t id;
+    uint16_t ndescs;
+    uint32_t len;
+} VuVirtqUsedElem;
+
 typedef struct VuVirtq {
     VuRing vring;
 
@@ -319,6 +371,9 @@ typedef struct VuVirtq {
 
     VuVirtqInflightDesc *resubmit_list;
 
+    /* First free entry of the packed inflight descriptor pool */
+    uint16_t inflight_free;
+
     uint16_t resubmit_num;
 
     uint64_t counter;
@@ -331,6 +386,13 @@ typedef struct VuVirtq {
 
     uint16_t used_idx;
 
+    /* Wrap counters of last_avail_idx and used_idx, for packed virtqueues */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /* Elements filled but not yet flushed, for packed virtqueues */
+    VuVirtqUsedElem *used_elems;
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -410,6 +472,8 @@ typedef struct VuVirtqElement {
     unsigned int in_num;
     struct iovec *in_sg;
     struct iovec *out_sg;
+    /* Number of ring descriptors used by the element (packed ring) */
+    unsigned int ndescs;
 } VuVirtqElement;
 
 /**
@@ -574,7 +638,8 @@ void vu_queue_unpop(VuDev *dev, VuVirtq *vq, VuVirtqElement *elem,
  * @num: number of elements to push back
  *
  * Pretend that elements weren't popped from the virtqueue.  The next
- * virtqueue_pop() will refetch the oldest element.
+ * virtqueue_pop() will refetch the oldest element.  With the packed ring
+ * layout @num counts descriptors rather than elements.
  *
  * Returns: true on success, false if @num is greater than the number of in use
  * elements.
@@ -15,6 +15,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/uio.h>
 
 size_t fuse_buf_size(const struct fuse_bufvec *bufv)
 {
@@ -251,6 +254,75 @@ static ssize_t fuse_buf_copy_one(const struct fuse_buf *dst, size_t dst_off,
 	}
 }
 
+/*
+ * Write the memory buffers of srcv to the single seekable fd of dst with
+ * pwritev(), so a request whose data is scattered over many buffers (e.g.
+ * guest memory) needs neither a bounce buffer nor one syscall per buffer.
+ */
+static ssize_t fuse_buf_writev(const struct fuse_buf *dst,
+			       struct fuse_bufvec *srcv, size_t len)
+{
+	struct iovec *iov, *cur;
+	size_t iovcnt = 0;
+	size_t copied = 0;
+	size_t i;
+
+	iov = malloc(sizeof(*iov) * (srcv->count - srcv->idx));
+	if (!iov)
+		return -ENOMEM;
+
+	for (i = srcv->idx; i < srcv->count && len; i++) {
+		const struct fuse_buf *buf = &srcv->buf[i];
+		size_t off = i == srcv->idx ? srcv->off : 0;
+		size_t this_len = min_size(buf->size - off, len);
+
+		if (!this_len)
+			continue;
+		iov[iovcnt].iov_base = buf->mem + off;
+		iov[iovcnt].iov_len = this_len;
+		iovcnt++;
+		len -= this_len;
+	}
+
+	cur = iov;
+	while (iovcnt) {
+		size_t cnt = min_size(iovcnt, IOV_MAX);
+		size_t want = 0;
+		ssize_t res;
+
+		for (i = 0; i < cnt; i++)
+			want += cur[i].iov_len;
+
+		res = pwritev(dst->fd, cur, cnt, dst->pos + copied);
+		if (res == -1) {
+			if (!copied) {
+				free(iov);
+				return -errno;
+			}
+			break;
+		}
+		if (res == 0)
+			break;
+
+		copied += res;
+		if (res < want && !(dst->flags & FUSE_BUF_FD_RETRY))
+			break;
+
+		while (iovcnt && res >= cur->iov_len) {
+			res -= cur->iov_len;
+			cur++;
+			iovcnt--;
+		}
+		if (res) {
+			cur->iov_base += res;
+			cur->iov_len -= res;
+		}
+	}
+
+	free(iov);
+	return copied;
+}
+
 static const struct fuse_buf *fuse_bufvec_current(struct fuse_bufvec *bufv)
 {
 	if (bufv->idx < bufv->count)
@@ -275,6 +347,26 @@ static int fuse_bufvec_advance(struct fuse_bufvec *bufv, size_t len)
 	return 1;
 }
 
+/* Can fuse_buf_copy() be done with a single fuse_buf_writev()? */
+static int fuse_buf_can_writev(struct fuse_bufvec *dstv,
+			       struct fuse_bufvec *srcv)
+{
+	const struct fuse_buf *dst = fuse_bufvec_current(dstv);
+	size_t i;
+
+	if (dstv->count != 1 || !dst || dstv->off)
+		return 0;
+	if ((dst->flags & (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK)) !=
+	    (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK))
+		return 0;
+
+	for (i = srcv->idx; i < srcv->count; i++) {
+		if (srcv->buf[i].flags & FUSE_BUF_IS_FD)
+			return 0;
+	}
+	return 1;
+}
+
 ssize_t fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
 		      enum fuse_buf_copy_flags flags)
 {
@@ -283,6 +375,27 @@ ssize_t fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
 	if (dstv == srcv)
 		return fuse_buf_size(dstv);
 
+	if (fuse_buf_can_writev(dstv, srcv)) {
+		const struct fuse_buf *dst = fuse_bufvec_current(dstv);
+		size_t left;
+		ssize_t res;
+
+		res = fuse_buf_writev(dst, srcv, dst->size);
+		if (res <= 0)
+			return res;
+
+		fuse_bufvec_advance(dstv, res);
+		for (left = res; left && fuse_bufvec_current(srcv); ) {
+			const struct fuse_buf *src = fuse_bufvec_current(srcv);
+			size_t this_len = min_size(left, src->size - srcv->off);
+
+			left -= this_len;
+			if (!fuse_bufvec_advance(srcv, this_len))
+				break;
+		}
+		return res;
+	}
+
 	for (;;) {
 		const struct fuse_buf *src = fuse_bufvec_current(srcv);
 		const struct fuse_buf *dst = fuse_bufvec_current(dstv);
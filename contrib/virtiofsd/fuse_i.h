@@ -71,6 +71,7 @@ struct fuse_session {
 	int error;
         char *vu_socket_path;
         int   vu_socketfd;
+        int   thread_pool_size;
         struct fv_VuDev *virtio_dev;
 };
 
@@ -2527,6 +2527,7 @@ static const struct fuse_opt fuse_ll_opts[] = {
 	LL_OPTION("--debug", debug, 1),
 	LL_OPTION("allow_root", deny_others, 1),
         LL_OPTION("vhost_user_socket=%s", vu_socket_path, 0),
+        LL_OPTION("thread_pool_size=%d", thread_pool_size, 0),
 	FUSE_OPT_END
 };
 
@@ -2544,6 +2545,8 @@ void fuse_lowlevel_help(void)
 "    -o allow_other             allow access by all users\n"
 "    -o allow_root              allow access by root\n"
 "    -o vhost_user_socket=PATH  path for the vhost-user socket\n"
+"    -o thread_pool_size=NUM    worker threads per queue (default: 0,\n"
+"                               requests are processed by the queue thread)\n"
 "    -o auto_unmount            auto unmount on process termination\n");
 }
 
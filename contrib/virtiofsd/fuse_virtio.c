@@ -19,6 +19,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <glib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -45,9 +46,23 @@ struct fv_QueueInfo {
         int       kick_fd;
         int       kill_fd; /* For killing the thread */
 
-        /* The element for the command currently being processed */
-        VuVirtqElement *qe;
-        bool      reply_sent;
+        /* Serializes vring accesses from the queue thread and the workers */
+        pthread_mutex_t vq_lock;
+        /* The following fields are protected by vq_lock */
+        unsigned int notify_holds;
+        unsigned int notify_pushed;
+        unsigned int in_flight;
+        pthread_cond_t in_flight_cond;
+
+        /* Worker threads, NULL if requests are processed inline */
+        GThreadPool *pool;
+};
+
+/* A request popped off a queue; freed once its element is pushed back */
+struct fv_Request {
+        VuVirtqElement elem; /* must be first, allocated by vu_queue_pop */
+        struct fuse_chan ch;
+        bool reply_sent;
 };
 
 /* We pass the dev element into libvhost-user
@@ -169,6 +184,76 @@ static void copy_iov(struct iovec *src_iov, int src_count,
         }
 }
 
+/*
+ * Guest notifications are coalesced: vu_queue_notify() is only called when
+ * the last holder releases its hold, so elements pushed during one pass of
+ * fv_queue_thread over the ring or by workers completing concurrently share a
+ * single notification.  Holds must only be kept for short periods so that a
+ * slow request never delays the notification for a fast one.
+ */
+static void fv_notify_hold(struct fv_QueueInfo *qi)
+{
+        pthread_mutex_lock(&qi->vq_lock);
+        qi->notify_holds++;
+        pthread_mutex_unlock(&qi->vq_lock);
+}
+
+/* Push @elem (if not NULL) and drop a hold taken with fv_notify_hold() */
+static void fv_notify_release(struct fv_QueueInfo *qi, VuVirtqElement *elem,
+                              unsigned int len)
+{
+        VuDev *dev = &qi->virtio_dev->dev;
+        VuVirtq *q = vu_get_queue(dev, qi->qidx);
+
+        pthread_mutex_lock(&qi->vq_lock);
+        if (elem) {
+                vu_queue_push(dev, q, elem, len);
+                qi->notify_pushed++;
+        }
+        assert(qi->notify_holds);
+        if (!--qi->notify_holds && qi->notify_pushed) {
+                vu_queue_notify(dev, q);
+                qi->notify_pushed = 0;
+        }
+        pthread_mutex_unlock(&qi->vq_lock);
+}
+
+static void fv_queue_push(struct fv_QueueInfo *qi, VuVirtqElement *elem,
+                          unsigned int len)
+{
+        fv_notify_hold(qi);
+        fv_notify_release(qi, elem, len);
+}
+
+/* Fill @dst with the part of @src_iov that starts @skip bytes in and is at
+ * most @len bytes long.  @dst must have room for @src_count elements.
+ * Returns the number of elements used.
+ */
+static int iov_slice(const struct iovec *src_iov, int src_count,
+                     size_t skip, size_t len, struct iovec *dst)
+{
+        int n = 0;
+
+        for (; src_count && len; src_iov++, src_count--) {
+                size_t this_len = src_iov->iov_len;
+
+                if (skip >= this_len) {
+                        skip -= this_len;
+                        continue;
+                }
+                this_len -= skip;
+                if (this_len > len) {
+                        this_len = len;
+                }
+                dst[n].iov_base = src_iov->iov_base + skip;
+                dst[n].iov_len = this_len;
+                n++;
+                skip = 0;
+                len -= this_len;
+        }
+        return n;
+}
+
 /* Called back by ll whenever it wants to send a reply/message back
  * The 1st element of the iov starts with the fuse_out_header
  * 'unique'==0 means it's a notify message.
@@ -176,8 +261,8 @@ static void copy_iov(struct iovec *src_iov, int src_count,
 int virtio_send_msg(struct fuse_session *se, struct fuse_chan *ch,
                     struct iovec *iov, int count)
 {
+        struct fv_Request *req;
         VuVirtqElement *elem;
-        VuVirtq *q;
         int ret = 0;
 
         assert(count >= 1);
@@ -192,9 +277,9 @@ int virtio_send_msg(struct fuse_session *se, struct fuse_chan *ch,
         assert (out->unique);
         /* For virtio we always have ch */
         assert(ch);
-        assert(!ch->qi->reply_sent);
-        elem = ch->qi->qe;
-        q = &ch->qi->virtio_dev->dev.vq[ch->qi->qidx];
+        req = container_of(ch, struct fv_Request, ch);
+        assert(!req->reply_sent);
+        elem = &req->elem;
 
         /* The 'in' part of the elem is to qemu */
         unsigned int in_num = elem->in_num;
@@ -220,10 +305,10 @@ int virtio_send_msg(struct fuse_session *se, struct fuse_chan *ch,
                 goto err;
         }
 
+        fv_notify_hold(ch->qi);
         copy_iov(iov, count, in_sg, in_num, tosend_len);
-        vu_queue_push(&se->virtio_dev->dev, q, elem, tosend_len);
-        vu_queue_notify(&se->virtio_dev->dev, q);
-        ch->qi->reply_sent = true;
+        fv_notify_release(ch->qi, elem, tosend_len);
+        req->reply_sent = true;
 
 err:
 
@@ -240,8 +325,8 @@ int virtio_send_data_iov(struct fuse_session *se, struct fuse_chan *ch,
                          struct fuse_bufvec *buf, size_t len)
 {
         int ret = 0;
+        struct fv_Request *req;
         VuVirtqElement *elem;
-        VuVirtq *q;
 
         assert(count >= 1);
         assert(iov[0].iov_len >= sizeof(struct fuse_out_header));
@@ -263,9 +348,9 @@ int virtio_send_data_iov(struct fuse_session *se, struct fuse_chan *ch,
 
         /* For virtio we always have ch */
         assert(ch);
-        assert(!ch->qi->reply_sent);
-        elem = ch->qi->qe;
-        q = &ch->qi->virtio_dev->dev.vq[ch->qi->qidx];
+        req = container_of(ch, struct fv_Request, ch);
+        assert(!req->reply_sent);
+        elem = &req->elem;
 
         /* The 'in' part of the elem is to qemu */
         unsigned int in_num = elem->in_num;
@@ -291,79 +376,43 @@ int virtio_send_data_iov(struct fuse_session *se, struct fuse_chan *ch,
                 goto err;
         }
 
-        // TODO: Limit to 'len'
-
         /* First copy the header data from iov->in_sg */
         copy_iov(iov, count, in_sg, in_num, iov_len);
 
-        /* Build a copy of the the in_sg iov so we can skip bits in it,
-         * including changing the offsets
+        /* The file data is read straight into guest memory, into the part
+         * of in_sg after the header and limited to 'len'; short reads are
+         * retried from where they stopped.
          */
-        struct iovec *in_sg_cpy = calloc(sizeof(struct iovec), in_num);
-        memcpy(in_sg_cpy, in_sg, sizeof(struct iovec) * in_num);
-        /* These get updated as we skip */
-        struct iovec *in_sg_ptr = in_sg_cpy;
-        int in_sg_cpy_count = in_num;
-
-        /* skip over parts of in_sg that contained the header iov */
+        struct iovec *in_sg_data = calloc(sizeof(struct iovec), in_num);
         size_t skip_size = iov_len;
+        assert(in_sg_data);
+        while (len) {
+                int in_sg_data_count = iov_slice(in_sg, in_num, skip_size,
+                                                 len, in_sg_data);
+                ssize_t preadv_res = preadv(buf->buf[0].fd, in_sg_data,
+                                            in_sg_data_count,
+                                            buf->buf[0].pos);
 
-        size_t in_sg_left = 0;
-        do {
-                while ( skip_size != 0 && in_sg_cpy_count) {
-                        if (skip_size >= in_sg_ptr[0].iov_len) {
-                                skip_size -= in_sg_ptr[0].iov_len;
-                                in_sg_ptr++;
-                                in_sg_cpy_count--;
-                        } else {
-                                in_sg_ptr[0].iov_len -= skip_size;
-                                in_sg_ptr[0].iov_base += skip_size;
-                                break;
-                        }
-                }
-
-                int i;
-                for (i = 0, in_sg_left = 0; i < in_sg_cpy_count; i++) {
-                        in_sg_left += in_sg_ptr[i].iov_len;
-                }
                 if (se->debug)
-                        fprintf(stderr,
-                                "%s: after skip skip_size=%zd in_sg_cpy_count=%d in_sg_left=%zd\n",
-                                __func__, skip_size, in_sg_cpy_count, in_sg_left);
-                ret = preadv(buf->buf[0].fd, in_sg_ptr, in_sg_cpy_count, buf->buf[0].pos);
-
-                if (se->debug)
-                        fprintf(stderr, "%s: preadv_res=%d len=%zd\n",
-                                __func__, ret, len);
-                if (ret < len && ret) {
-                        if (se->debug)
-                                fprintf(stderr, "%s: ret < len\n", __func__);
-                        /* Skip over this much next time around */
-                        skip_size = ret;
-                        buf->buf[0].pos += ret;
-                        len -= ret;
-
-                        /* Lets do another read */
-                        continue;
+                        fprintf(stderr, "%s: preadv_res=%zd len=%zd\n",
+                                __func__, preadv_res, len);
+                if (preadv_res == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        ret = -errno;
+                        free(in_sg_data);
+                        goto err;
                 }
-                if (!ret) {
-                        /* EOF case? */
-                        if (se->debug)
-                                fprintf(stderr, "%s: !ret in_sg_left=%zd\n",
-                                        __func__, in_sg_left);
+                if (!preadv_res) {
+                        /* EOF */
                         break;
                 }
-                if (ret != len) {
-                        if (se->debug)
-                                fprintf(stderr, "%s: ret!=len\n", __func__);
-                        ret = -EIO;
-                        free(in_sg_cpy);
-                        goto err;
-                }
-                in_sg_left -= ret;
-                len -= ret;
-        } while (in_sg_left);
-        free(in_sg_cpy);
+                buf->buf[0].pos += preadv_res;
+                skip_size += preadv_res;
+                len -= preadv_res;
+        }
+        free(in_sg_data);
 
         // Need to fix out->len on EOF
         if (len) {
@@ -375,15 +424,171 @@ int virtio_send_data_iov(struct fuse_session *se, struct fuse_chan *ch,
 
         ret = 0;
 
-        vu_queue_push(&se->virtio_dev->dev, q, elem, tosend_len);
-        vu_queue_notify(&se->virtio_dev->dev, q);
+        fv_queue_push(ch->qi, elem, tosend_len);
 
 err:
-        ch->qi->reply_sent = true;
+        req->reply_sent = true;
 
         return ret;
 }
 
+/* Process one request, either inline in fv_queue_thread or in a worker */
+static void fv_queue_worker(gpointer data, gpointer user_data)
+{
+        struct fv_Request   *req = data;
+        struct fv_QueueInfo *qi = user_data;
+        struct fuse_session *se = qi->virtio_dev->se;
+        VuVirtqElement      *elem = &req->elem;
+        struct fuse_buf     fbuf;
+        bool allocated_bufv = false;
+        struct fuse_bufvec bufv;
+        struct fuse_bufvec *pbufv;
+        size_t write_hdr_len = sizeof(struct fuse_in_header) +
+                               sizeof(struct fuse_write_in);
+        struct iovec hdr_iov;
+
+        fuse_mutex_init(&req->ch.lock);
+        req->ch.fd = (int)0xdaff0d111;
+        req->ch.ctr = 1;
+        req->ch.qi = qi;
+
+        fbuf.flags = 0;
+        fbuf.mem = malloc(se->bufsize);
+        assert(fbuf.mem);
+        assert(se->bufsize > sizeof(struct fuse_in_header));
+
+        /* The 'out' part of the elem is from qemu */
+        unsigned int out_num = elem->out_num;
+        struct iovec *out_sg = elem->out_sg;
+        size_t out_len = iov_length(out_sg, out_num);
+        if (se->debug)
+                fprintf(stderr, "%s: elem %d: with %d out desc of length %zd\n",
+                        __func__, elem->index, out_num,  out_len);
+
+        /* The elem should contain a 'fuse_in_header' (in to fuse)
+         * plus the data based on the len in the header.
+         */
+        if (out_len < sizeof(struct fuse_in_header)) {
+                fprintf(stderr, "%s: elem %d too short for in_header\n",
+                        __func__, elem->index);
+                assert(0); // TODO
+        }
+        if (out_len > se->bufsize) {
+                fprintf(stderr, "%s: elem %d too large for buffer\n",
+                        __func__, elem->index);
+                assert(0); // TODO
+        }
+        // Copy just the fuse_in_header and look at it
+        hdr_iov.iov_base = fbuf.mem;
+        hdr_iov.iov_len = sizeof(struct fuse_in_header);
+        copy_iov(out_sg, out_num, &hdr_iov, 1, hdr_iov.iov_len);
+
+        if (out_len > write_hdr_len && se->conn.proto_minor >= 9 &&
+            ((struct fuse_in_header *)fbuf.mem)->opcode == FUSE_WRITE) {
+                // For a write we don't actually need to copy the
+                // data, we can just do it straight out of guest memory
+                // but we must sitll copy the headers in case the guest
+                // was nasty and changed them while we were using them.
+                // The headers may share descriptors with the data, so
+                // split by bytes rather than by descriptor.
+                if (se->debug)
+                        fprintf(stderr, "%s: Write special case\n", __func__);
+
+                hdr_iov.iov_len = write_hdr_len;
+                copy_iov(out_sg, out_num, &hdr_iov, 1, write_hdr_len);
+                fbuf.size = write_hdr_len;
+
+                // Allocate the bufv, with space for the rest of the iov
+                allocated_bufv = true;
+                pbufv = malloc(sizeof(struct fuse_bufvec) +
+                               sizeof(struct fuse_buf) * out_num);
+                assert(pbufv);
+
+                pbufv->count = 1;
+                pbufv->buf[0] = fbuf;
+
+                struct iovec *data_iov = calloc(sizeof(struct iovec), out_num);
+                int data_count, i;
+
+                assert(data_iov);
+                data_count = iov_slice(out_sg, out_num, write_hdr_len,
+                                       out_len - write_hdr_len, data_iov);
+                for (i = 0; i < data_count; i++) {
+                        struct fuse_buf *b = &pbufv->buf[pbufv->count++];
+
+                        b->pos = ~0; // Dummy
+                        b->flags = 0;
+                        b->mem = data_iov[i].iov_base;
+                        b->size = data_iov[i].iov_len;
+                }
+                free(data_iov);
+        } else {
+                // Normal (non fast write) path
+
+                // Copy the whole buffer
+                copy_from_iov(&fbuf, out_num, out_sg);
+                fbuf.size = out_len;
+
+                // TODO! Endianness of header
+
+                // TODO: Add checks for fuse_session_exited
+                bufv.buf[0] = fbuf;
+                bufv.count = 1;
+                pbufv = &bufv;
+        }
+        pbufv->idx = 0;
+        pbufv->off = 0;
+        fuse_session_process_buf_int(se, pbufv, &req->ch);
+
+        if (allocated_bufv) free(pbufv);
+
+        if (!req->reply_sent) {
+                if (se->debug) {
+                        fprintf(stderr,
+                                "%s: elem %d no reply sent\n",
+                                __func__, elem->index);
+                }
+                /* I think we've still got to recycle the element */
+                fv_queue_push(qi, elem, 0);
+        }
+        pthread_mutex_destroy(&req->ch.lock);
+        free(fbuf.mem);
+        free(req);
+
+        if (qi->pool) {
+                pthread_mutex_lock(&qi->vq_lock);
+                if (!--qi->in_flight)
+                        pthread_cond_broadcast(&qi->in_flight_cond);
+                pthread_mutex_unlock(&qi->vq_lock);
+        }
+}
+
+/*
+ * FUSE_INIT must have completed before any other request is looked at, and
+ * FUSE_DESTROY must only run once every other request has completed, so these
+ * are never handed to the worker pool.
+ */
+static bool fv_request_is_barrier(struct fv_Request *req)
+{
+        struct fuse_in_header in;
+
+        if (req->elem.out_num < 1 ||
+            req->elem.out_sg[0].iov_len < sizeof(in))
+                return false;
+
+        memcpy(&in, req->elem.out_sg[0].iov_base, sizeof(in));
+        return in.opcode == FUSE_INIT || in.opcode == FUSE_DESTROY;
+}
+
+/* Wait for all requests handed to the pool to complete */
+static void fv_queue_drain(struct fv_QueueInfo *qi)
+{
+        pthread_mutex_lock(&qi->vq_lock);
+        while (qi->in_flight)
+                pthread_cond_wait(&qi->in_flight_cond, &qi->vq_lock);
+        pthread_mutex_unlock(&qi->vq_lock);
+}
+
 /* Thread function for individual queues, created when a queue is 'started' */
 static void *fv_queue_thread(void *opaque)
 {
@@ -391,16 +596,13 @@ static void *fv_queue_thread(void *opaque)
         struct VuDev        *dev = &qi->virtio_dev->dev;
         struct VuVirtq      *q = vu_get_queue(dev, qi->qidx);
         struct fuse_session *se = qi->virtio_dev->se;
-        struct fuse_chan    ch;
-        struct fuse_buf     fbuf;
 
-        fbuf.mem = NULL;
-        fbuf.flags = 0;
-
-        fuse_mutex_init(&ch.lock);
-        ch.fd = (int)0xdaff0d111;
-        ch.ctr = 1;
-        ch.qi = qi;
+        if (se->thread_pool_size) {
+                qi->pool = g_thread_pool_new(fv_queue_worker, qi,
+                                             se->thread_pool_size, FALSE,
+                                             NULL);
+                assert(qi->pool);
+        }
 
         fprintf(stderr, "%s: Start for queue %d kick_fd %d\n",
                 __func__, qi->qidx, qi->kick_fd);
@@ -452,7 +654,9 @@ static void *fv_queue_thread(void *opaque)
                }
                /* out is from guest, in is too guest */
                unsigned int in_bytes, out_bytes;
+               pthread_mutex_lock(&qi->vq_lock);
                vu_queue_get_avail_bytes(dev, q, &in_bytes, &out_bytes, ~0, ~0);
+               pthread_mutex_unlock(&qi->vq_lock);
 
                if (se->debug)
                        fprintf(stderr, "%s: Queue %d gave evalue: %zx available: in: %u out: %u\n",
@@ -461,128 +665,46 @@ static void *fv_queue_thread(void *opaque)
                if (!out_bytes) {
                        continue;
                }
+
+               /* Replies completed during this pass share one notification */
+               fv_notify_hold(qi);
                while (1) {
-                       bool allocated_bufv = false;
-                       struct fuse_bufvec bufv;
-                       struct fuse_bufvec *pbufv;
+                       struct fv_Request *req;
 
                        /* An element contains one request and the space to send our response
                         * They're spread over multiple descriptors in a scatter/gather set
                         * and we can't trust the guest to keep them still; so copy in/out.
                         */
-                       VuVirtqElement *elem = vu_queue_pop(dev, q, sizeof(VuVirtqElement));
-                       if (!elem) {
+                       pthread_mutex_lock(&qi->vq_lock);
+                       req = vu_queue_pop(dev, q, sizeof(struct fv_Request));
+                       pthread_mutex_unlock(&qi->vq_lock);
+                       if (!req) {
                                break;
                        }
-
-                       qi->qe = elem;
-                       qi->reply_sent = false;
-
-                       if (!fbuf.mem) {
-                               fbuf.mem = malloc(se->bufsize);
-                               assert(fbuf.mem);
-                               assert(se->bufsize > sizeof(struct fuse_in_header));
-                       }
-                       /* The 'out' part of the elem is from qemu */
-                       unsigned int out_num = elem->out_num;
-                       struct iovec *out_sg = elem->out_sg;
-                       size_t out_len = iov_length(out_sg, out_num);
-                       if (se->debug)
-                               fprintf(stderr, "%s: elem %d: with %d out desc of length %zd\n",
-                                       __func__, elem->index, out_num,  out_len);
-
-                       /* The elem should contain a 'fuse_in_header' (in to fuse)
-                        * plus the data based on the len in the header.
-                        */
-                       if (out_len < sizeof(struct fuse_in_header)) {
-                               fprintf(stderr, "%s: elem %d too short for in_header\n",
-                                       __func__, elem->index);
-                               assert(0); // TODO
-                       }
-                       if (out_len > se->bufsize) {
-                               fprintf(stderr, "%s: elem %d too large for buffer\n",
-                                       __func__, elem->index);
-                               assert(0); // TODO
-                       }
-                       // Copy just the first element and look at it
-                       copy_from_iov(&fbuf, 1, out_sg);
-
-                       if (out_num > 2 &&
-                           out_sg[0].iov_len == sizeof(struct fuse_in_header) &&
-                           ((struct fuse_in_header *)fbuf.mem)->opcode ==
-                               FUSE_WRITE &&
-                           out_sg[1].iov_len == sizeof(struct fuse_write_in)) {
-                               // For a write we don't actually need to copy the
-                               // data, we can just do it straight out of guest memory
-                               // but we must sitll copy the headers in case the guest
-                               // was nasty and changed them while we were using them.
-                               if (se->debug)
-                                       fprintf(stderr, "%s: Write special case\n", __func__);
-
-                               // copy the fuse_write_in header afte rthe fuse_in_header
-                               fbuf.mem += out_sg->iov_len;
-                               copy_from_iov(&fbuf, 1, out_sg + 1);
-                               fbuf.mem -= out_sg->iov_len;
-                               fbuf.size = out_sg[0].iov_len + out_sg[1].iov_len;
-
-                               // Allocate the bufv, with space for the rest of the iov
-                               allocated_bufv = true;
-                               pbufv = malloc(sizeof(struct fuse_bufvec) +
-                                              sizeof(struct fuse_buf) * (out_num - 2));
-
-                               pbufv->count = 1;
-                               pbufv->buf[0] = fbuf;
-
-                               size_t iovindex, pbufvindex;
-                               iovindex = 2; // 2 headers, separate iovs
-                               pbufvindex = 1; // 2 headers, 1 fusebuf
-
-                               for(; iovindex < out_num; iovindex++, pbufvindex++) {
-                                       pbufv->count++;
-                                       pbufv->buf[pbufvindex].pos = ~0; // Dummy
-                                       pbufv->buf[pbufvindex].flags = 0;
-                                       pbufv->buf[pbufvindex].mem = out_sg[iovindex].iov_base;
-                                       pbufv->buf[pbufvindex].size = out_sg[iovindex].iov_len;
-                               }
+                       req->reply_sent = false;
+
+                       if (!qi->pool) {
+                               fv_queue_worker(req, qi);
+                       } else if (fv_request_is_barrier(req)) {
+                               fv_notify_release(qi, NULL, 0);
+                               fv_queue_drain(qi);
+                               fv_notify_hold(qi);
+                               fv_queue_worker(req, qi);
                        } else {
-                               // Normal (non fast write) path
-
-                               // Copy the rest of the buffer
-                               fbuf.mem += out_sg->iov_len;
-                               copy_from_iov(&fbuf, out_num - 1, out_sg + 1);
-                               fbuf.mem -= out_sg->iov_len;
-                               fbuf.size = out_len;
-
-                               // TODO! Endianness of header
-
-                               // TODO: Add checks for fuse_session_exited
-                               bufv.buf[0] = fbuf;
-                               bufv.count = 1;
-                               pbufv = &bufv;
-                       }
-                       pbufv->idx = 0;
-                       pbufv->off = 0;
-                       fuse_session_process_buf_int(se, pbufv, &ch);
-
-                       if (allocated_bufv) free(pbufv);
-
-                       if (!qi->reply_sent) {
-			       if (se->debug) {
-				       fprintf(stderr,
-					       "%s: elem %d no reply sent\n",
-					       __func__, elem->index);
-			       }
-                               /* I think we've still got to recycle the element */
-                               vu_queue_push(dev, q, elem, 0);
-                               vu_queue_notify(dev, q);
+                               pthread_mutex_lock(&qi->vq_lock);
+                               qi->in_flight++;
+                               pthread_mutex_unlock(&qi->vq_lock);
+                               g_thread_pool_push(qi->pool, req, NULL);
                        }
-                       qi->qe = NULL;
-                       free(elem);
-                       elem = NULL;
-                }
+               }
+               fv_notify_release(qi, NULL, 0);
+        }
+
+        if (qi->pool) {
+                /* Let the workers finish everything that was popped */
+                g_thread_pool_free(qi->pool, FALSE, TRUE);
+                qi->pool = NULL;
         }
-        pthread_mutex_destroy(&ch.lock);
-        free(fbuf.mem);
 
         return NULL;
 }
@@ -621,9 +743,12 @@ static void fv_queue_set_started(VuDev *dev, int qidx, bool started)
                 }
                 if (!vud->qi[qidx]) {
                         vud->qi[qidx] = calloc(sizeof(struct fv_QueueInfo), 1);
+                        assert(vud->qi[qidx]);
                         vud->qi[qidx]->virtio_dev = vud;
                         vud->qi[qidx]->qidx = qidx;
-                        assert(vud->qi[qidx]);
+                        pthread_mutex_init(&vud->qi[qidx]->vq_lock, NULL);
+                        pthread_cond_init(&vud->qi[qidx]->in_flight_cond,
+                                          NULL);
                 } else {
                         /* Shouldn't have been started */
                         assert(vud->qi[qidx]->kick_fd == -1);
@@ -659,6 +784,12 @@ static void fv_queue_set_started(VuDev *dev, int qidx, bool started)
         }
 }
 
+/*
+ * Requests may complete out of order once a worker pool is configured, so on
+ * reconnect libvhost-user must not assume that every element below used_idx
+ * has been processed.  Ordering that FUSE itself relies on (FUSE_INIT and
+ * FUSE_DESTROY) is enforced in fv_queue_thread instead.
+ */
 static bool fv_queue_order(VuDev *dev, int qidx)
 {
         return false;
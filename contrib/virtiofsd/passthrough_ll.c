@@ -54,6 +54,10 @@
 #include <sys/xattr.h>
 #include <sys/mount.h>
 #include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
 
 #include <gmodule.h>
 
@@ -66,14 +70,29 @@ struct lo_map_elem {
 		struct lo_inode *inode;
 		struct lo_dirp *dirp;
 		int fd;
-		ssize_t freelist;
 	};
+	/*
+	 * Kept apart from the value so that a lookup racing with removal
+	 * never reads a freelist index as a pointer.
+	 */
+	ssize_t freelist;
 	bool in_use;
 };
 
-/* Maps FUSE fh or ino values to internal objects */
+/*
+ * Maps FUSE fh or ino values to internal objects.
+ *
+ * Elements are allocated in fixed-size chunks that never move while the map
+ * exists, so lo_map_get() runs without taking any lock.  Only adding and
+ * removing entries serializes on map->lock.
+ */
+#define LO_MAP_CHUNK_SHIFT 10
+#define LO_MAP_CHUNK_SIZE (1 << LO_MAP_CHUNK_SHIFT)
+#define LO_MAP_MAX_CHUNKS (1 << 14)
+
 struct lo_map {
-	struct lo_map_elem *elems;
+	pthread_mutex_t lock;
+	struct lo_map_elem **chunks;
 	size_t nelems;
 	ssize_t freelist;
 };
@@ -87,8 +106,30 @@ struct lo_inode {
 	int fd;
 	bool is_symlink;
 	struct lo_key key;
-	uint64_t refcount; /* protected by lo->mutex */
+	uint64_t refcount; /* protected by the mutex of the key's shard */
 	fuse_ino_t fuse_ino;
+
+	/*
+	 * Cached attributes, protected by the mutex of the key's shard.  They
+	 * are only cached while attr_watched says an inotify watch covers the
+	 * inode, see lo_attr_cache_store().
+	 */
+	struct stat attr;
+	bool attr_valid;
+	bool attr_watched;
+	uint64_t attr_gen; /* bumped whenever attr is dropped */
+
+	/* Directory watch and dentry cache, protected by lo->attr_cache_lock */
+	int wd; /* 0 if not watched */
+	GHashTable *dentries; /* name -> struct lo_key */
+};
+
+/* The inode table is split by key hash to spread lock contention */
+#define LO_INODE_SHARDS 64
+
+struct lo_inode_shard {
+	pthread_mutex_t mutex;
+	GHashTable *inodes; /* protected by mutex */
 };
 
 struct lo_cred {
@@ -102,8 +143,12 @@ enum {
 	CACHE_ALWAYS,
 };
 
+enum {
+	ATTR_CACHE_NONE,
+	ATTR_CACHE_INOTIFY,
+};
+
 struct lo_data {
-	pthread_mutex_t mutex;
 	int debug;
 	int norace;
 	int writeback;
@@ -115,14 +160,50 @@ struct lo_data {
 	int timeout_set;
 	int readdirplus_set;
 	int readdirplus_clear;
+	int readdirplus_threads;
+	GThreadPool *readdirplus_pool;
 	struct lo_inode root;
-	GHashTable *inodes; /* protected by lo->mutex */
-	struct lo_map ino_map; /* protected by lo->mutex */
-	struct lo_map dirp_map; /* protected by lo->mutex */
-	struct lo_map fd_map; /* protected by lo->mutex */
+	struct lo_inode_shard inode_shards[LO_INODE_SHARDS];
+	struct lo_map ino_map;
+	struct lo_map dirp_map;
+	struct lo_map fd_map;
 
 	/* An O_PATH file descriptor to /proc/self/fd/ */
 	int proc_self_fd;
+
+	/* In-daemon attribute and dentry cache */
+	int attr_cache;
+	int inotify_fd;
+	int attr_cache_sigfd;
+	pthread_rwlock_t attr_cache_lock;
+	GHashTable *attr_cache_watches; /* wd -> struct lo_inode */
+	uint64_t attr_cache_gen;
+	uint64_t attr_cache_hits;
+	uint64_t attr_cache_misses;
+	uint64_t attr_cache_invalidations;
+
+	/* DAX window bookkeeping */
+	struct fuse_session *se;
+	pthread_mutex_t dax_lock;
+	GTree *dax_chunks;	/* moffset -> struct lo_dax_chunk */
+	uint64_t dax_mapped_bytes;
+	uint64_t dax_maps;
+	uint64_t dax_hits;
+	uint64_t dax_slave_msgs;
+};
+
+/*
+ * A range of the DAX window that is mapped on the host.  Chunks only live
+ * as long as the guest's mapping: the window is guest memory, so anything
+ * left mapped after FUSE_REMOVEMAPPING would stay readable and writable by
+ * the guest.
+ */
+struct lo_dax_chunk {
+	uint64_t moffset;
+	uint64_t len;
+	uint64_t foffset;
+	uint64_t flags;		/* VHOST_USER_FS_FLAG_* */
+	struct lo_inode *inode;	/* holds a reference */
 };
 
 static const struct fuse_opt lo_opts[] = {
@@ -150,18 +231,28 @@ static const struct fuse_opt lo_opts[] = {
 	  offsetof(struct lo_data, cache), CACHE_AUTO },
 	{ "cache=always",
 	  offsetof(struct lo_data, cache), CACHE_ALWAYS },
+	{ "attr_cache=none",
+	  offsetof(struct lo_data, attr_cache), ATTR_CACHE_NONE },
+	{ "attr_cache=inotify",
+	  offsetof(struct lo_data, attr_cache), ATTR_CACHE_INOTIFY },
 	{ "norace",
 	  offsetof(struct lo_data, norace), 1 },
 	{ "readdirplus",
 	  offsetof(struct lo_data, readdirplus_set), 1 },
 	{ "no_readdirplus",
 	  offsetof(struct lo_data, readdirplus_clear), 1 },
+	{ "readdirplus_threads=%d",
+	  offsetof(struct lo_data, readdirplus_threads), 0 },
 	FUSE_OPT_END
 };
 static void unref_inode(struct lo_data *lo, struct lo_inode *inode, uint64_t n);
+static void lo_dax_print_stats(struct lo_data *lo);
 
 static struct lo_inode *lo_find(struct lo_data *lo, struct stat *st);
 
+static guint lo_key_hash(gconstpointer key);
+static gboolean lo_key_equal(gconstpointer a, gconstpointer b);
+
 static int is_dot_or_dotdot(const char *name)
 {
 	return name[0] == '.' && (name[1] == '\0' ||
@@ -185,139 +276,165 @@ static struct lo_data *lo_data(fuse_req_t req)
 
 static void lo_map_init(struct lo_map *map)
 {
-	map->elems = NULL;
+	pthread_mutex_init(&map->lock, NULL);
+	map->chunks = g_new0(struct lo_map_elem *, LO_MAP_MAX_CHUNKS);
 	map->nelems = 0;
 	map->freelist = -1;
 }
 
 static void lo_map_destroy(struct lo_map *map)
 {
-	free(map->elems);
+	size_t i;
+
+	for (i = 0; i < map->nelems >> LO_MAP_CHUNK_SHIFT; i++)
+		free(map->chunks[i]);
+	g_free(map->chunks);
+	pthread_mutex_destroy(&map->lock);
+}
+
+static struct lo_map_elem *lo_map_elem(struct lo_map *map, size_t key)
+{
+	return &map->chunks[key >> LO_MAP_CHUNK_SHIFT]
+			   [key & (LO_MAP_CHUNK_SIZE - 1)];
 }
 
+/* Assumes map->lock is held */
 static int lo_map_grow(struct lo_map *map, size_t new_nelems)
 {
-	struct lo_map_elem *new_elems;
+	struct lo_map_elem *chunk;
 	size_t i;
 
 	if (new_nelems <= map->nelems)
 		return 1;
 
-	new_elems = realloc(map->elems, sizeof(map->elems[0]) * new_nelems);
-	if (!new_elems)
+	if (new_nelems > (size_t)LO_MAP_MAX_CHUNKS << LO_MAP_CHUNK_SHIFT)
 		return 0;
 
-	for (i = map->nelems; i < new_nelems; i++) {
-		new_elems[i].freelist = i + 1;
-		new_elems[i].in_use = false;
-	}
-	new_elems[new_nelems - 1].freelist = -1;
+	while (map->nelems < new_nelems) {
+		chunk = calloc(LO_MAP_CHUNK_SIZE, sizeof(chunk[0]));
+		if (!chunk)
+			return 0;
 
-	map->elems = new_elems;
-	map->freelist = map->nelems;
-	map->nelems = new_nelems;
+		for (i = 0; i < LO_MAP_CHUNK_SIZE; i++)
+			chunk[i].freelist = map->nelems + i + 1;
+		chunk[LO_MAP_CHUNK_SIZE - 1].freelist = map->freelist;
+		map->freelist = map->nelems;
+
+		/* Publish the chunk before lookups can see keys inside it */
+		__atomic_store_n(&map->chunks[map->nelems >> LO_MAP_CHUNK_SHIFT],
+				 chunk, __ATOMIC_RELEASE);
+		__atomic_store_n(&map->nelems, map->nelems + LO_MAP_CHUNK_SIZE,
+				 __ATOMIC_RELEASE);
+	}
 	return 1;
 }
 
-static struct lo_map_elem *lo_map_alloc_elem(struct lo_map *map)
+/* Stores the value of @val under a free key and returns the key */
+static ssize_t lo_map_add(struct lo_map *map, const struct lo_map_elem *val)
 {
 	struct lo_map_elem *elem;
+	ssize_t key = -1;
+	ssize_t next;
 
-	if (map->freelist == -1 && !lo_map_grow(map, map->nelems + 256))
-		return NULL;
-
-	elem = &map->elems[map->freelist];
-	map->freelist = elem->freelist;
-
-	elem->in_use = true;
+	pthread_mutex_lock(&map->lock);
+	if (map->freelist == -1 &&
+	    !lo_map_grow(map, map->nelems + LO_MAP_CHUNK_SIZE))
+		goto out;
 
-	return elem;
+	key = map->freelist;
+	elem = lo_map_elem(map, key);
+	next = elem->freelist;
+	*elem = *val;
+	elem->freelist = -1;
+	map->freelist = next;
+	__atomic_store_n(&elem->in_use, true, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&map->lock);
+	return key;
 }
 
 static struct lo_map_elem *lo_map_reserve(struct lo_map *map, size_t key)
 {
+	struct lo_map_elem *elem = NULL;
 	ssize_t *prev;
 
+	pthread_mutex_lock(&map->lock);
 	if (!lo_map_grow(map, key + 1))
-		return NULL;
+		goto out;
 
 	for (prev = &map->freelist;
 	     *prev != -1;
-	     prev = &map->elems[*prev].freelist) {
+	     prev = &lo_map_elem(map, *prev)->freelist) {
 		if (*prev == key) {
-			struct lo_map_elem *elem = &map->elems[key];
-
+			elem = lo_map_elem(map, key);
 			*prev = elem->freelist;
-			elem->in_use = true;
-			return elem;
+			__atomic_store_n(&elem->in_use, true, __ATOMIC_RELEASE);
+			break;
 		}
 	}
-	return NULL;
+out:
+	pthread_mutex_unlock(&map->lock);
+	return elem;
 }
 
+/* Lock-free; the chunk holding @key is never freed while the map is live */
 static struct lo_map_elem *lo_map_get(struct lo_map *map, size_t key)
 {
-	if (key >= map->nelems)
+	struct lo_map_elem *elem;
+
+	if (key >= __atomic_load_n(&map->nelems, __ATOMIC_ACQUIRE))
 		return NULL;
-	if (!map->elems[key].in_use)
+	elem = lo_map_elem(map, key);
+	if (!__atomic_load_n(&elem->in_use, __ATOMIC_ACQUIRE))
 		return NULL;
-	return &map->elems[key];
+	return elem;
 }
 
 static void lo_map_remove(struct lo_map *map, size_t key)
 {
 	struct lo_map_elem *elem;
 
+	pthread_mutex_lock(&map->lock);
 	if (key >= map->nelems)
-		return;
+		goto out;
 
-	elem = &map->elems[key];
+	elem = lo_map_elem(map, key);
 	if (!elem->in_use)
-		return;
+		goto out;
 
-	elem->in_use = false;
+	__atomic_store_n(&elem->in_use, false, __ATOMIC_RELEASE);
 
 	elem->freelist = map->freelist;
 	map->freelist = key;
+out:
+	pthread_mutex_unlock(&map->lock);
 }
 
-/* Assumes lo->mutex is held */
 static ssize_t lo_add_fd_mapping(fuse_req_t req, int fd)
 {
-	struct lo_map_elem *elem;
+	struct lo_map_elem elem = { .fd = fd };
 
-	elem = lo_map_alloc_elem(&lo_data(req)->fd_map);
-	if (!elem)
-		return -1;
-
-	elem->fd = fd;
-	return elem - lo_data(req)->fd_map.elems;
+	return lo_map_add(&lo_data(req)->fd_map, &elem);
 }
 
-/* Assumes lo->mutex is held */
 static ssize_t lo_add_dirp_mapping(fuse_req_t req, struct lo_dirp *dirp)
 {
-	struct lo_map_elem *elem;
-
-	elem = lo_map_alloc_elem(&lo_data(req)->dirp_map);
-	if (!elem)
-		return -1;
+	struct lo_map_elem elem = { .dirp = dirp };
 
-	elem->dirp = dirp;
-	return elem - lo_data(req)->dirp_map.elems;
+	return lo_map_add(&lo_data(req)->dirp_map, &elem);
 }
 
-/* Assumes lo->mutex is held */
 static ssize_t lo_add_inode_mapping(fuse_req_t req, struct lo_inode *inode)
 {
-	struct lo_map_elem *elem;
+	struct lo_map_elem elem = { .inode = inode };
 
-	elem = lo_map_alloc_elem(&lo_data(req)->ino_map);
-	if (!elem)
-		return -1;
+	return lo_map_add(&lo_data(req)->ino_map, &elem);
+}
 
-	elem->inode = inode;
-	return elem - lo_data(req)->ino_map.elems;
+static struct lo_inode_shard *lo_inode_shard(struct lo_data *lo,
+					     const struct lo_key *key)
+{
+	return &lo->inode_shards[lo_key_hash(key) % LO_INODE_SHARDS];
 }
 
 static struct lo_inode *lo_inode(fuse_req_t req, fuse_ino_t ino)
@@ -325,10 +442,7 @@ static struct lo_inode *lo_inode(fuse_req_t req, fuse_ino_t ino)
 	struct lo_data *lo = lo_data(req);
 	struct lo_map_elem *elem;
 
-	pthread_mutex_lock(&lo->mutex);
 	elem = lo_map_get(&lo->ino_map, ino);
-	pthread_mutex_unlock(&lo->mutex);
-
 	if (!elem)
 		return NULL;
 
@@ -374,19 +488,492 @@ static void lo_init(void *userdata,
 
 }
 
+/*
+ * Attribute and dentry cache
+ *
+ * FUSE_GETATTR and FUSE_LOOKUP can be answered from attributes cached on the
+ * lo_inode, and FUSE_LOOKUP from a per-directory name -> key table, without
+ * any syscall.  Coherency with changes made behind our back comes from an
+ * inotify watch on every directory that has cached entries; changes made
+ * through this daemon invalidate explicitly once the syscall has returned.
+ *
+ * Every invalidation bumps attr_cache_gen.  Lookups sample it before going to
+ * the host filesystem and only cache their result if it did not change, so a
+ * stale result never overwrites an invalidation that raced with it.  Data
+ * writes only touch one inode; they bump its own attr_gen instead, which the
+ * lookups of that inode sample too.
+ *
+ * inotify does not see everything.  Stores through a shared mmap, which
+ * includes guest writes through the DAX window, generate no events.  Nor do
+ * changes made through a hard link in a directory that is not watched: the
+ * events go to that directory only.  Attributes cached for such files stay
+ * stale until an operation through this daemon invalidates them.
+ */
+#define LO_ATTR_CACHE_EVENTS (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | \
+			      IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | \
+			      IN_MOVED_TO | IN_ONLYDIR)
+
+static uint64_t lo_attr_cache_gen(struct lo_data *lo)
+{
+	return __atomic_load_n(&lo->attr_cache_gen, __ATOMIC_ACQUIRE);
+}
+
+static void lo_attr_cache_bump_gen(struct lo_data *lo)
+{
+	__atomic_fetch_add(&lo->attr_cache_gen, 1, __ATOMIC_RELEASE);
+}
+
+/* Assumes the shard mutex of the key is held */
+static struct lo_inode *lo_attr_cache_find(struct lo_data *lo,
+					   struct lo_inode_shard *shard,
+					   const struct lo_key *key)
+{
+	if (lo_key_equal(key, &lo->root.key))
+		return &lo->root;
+	return g_hash_table_lookup(shard->inodes, key);
+}
+
+/*
+ * Drop the cached attributes of the inode with @key, and stop caching them
+ * altogether if @unwatch is set (the entry through which the inode was
+ * watched has gone).
+ */
+static void lo_attr_cache_drop(struct lo_data *lo, const struct lo_key *key,
+			       bool unwatch)
+{
+	struct lo_inode_shard *shard = lo_inode_shard(lo, key);
+	struct lo_inode *inode;
+
+	pthread_mutex_lock(&shard->mutex);
+	inode = lo_attr_cache_find(lo, shard, key);
+	if (inode) {
+		if (inode->attr_valid)
+			__atomic_fetch_add(&lo->attr_cache_invalidations, 1,
+					   __ATOMIC_RELAXED);
+		inode->attr_valid = false;
+		inode->attr_gen++;
+		if (unwatch)
+			inode->attr_watched = false;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Assumes lo->attr_cache_lock is held for writing */
+static void lo_dentry_cache_drop(struct lo_data *lo, struct lo_inode *dir,
+				 const char *name)
+{
+	struct lo_key *key;
+
+	if (!dir->dentries)
+		return;
+
+	key = g_hash_table_lookup(dir->dentries, name);
+	if (key) {
+		lo_attr_cache_drop(lo, key, true);
+		g_hash_table_remove(dir->dentries, name);
+	}
+}
+
+/*
+ * Forget the cached attributes of @inode and, if @name is given, the entry
+ * @name of directory @inode and the attributes of its target.  Called after
+ * every operation of ours that changes them.
+ */
+static void lo_attr_cache_invalidate(struct lo_data *lo,
+				     struct lo_inode *inode, const char *name)
+{
+	if (lo->attr_cache == ATTR_CACHE_NONE || !inode)
+		return;
+
+	pthread_rwlock_wrlock(&lo->attr_cache_lock);
+	lo_attr_cache_bump_gen(lo);
+	if (name)
+		lo_dentry_cache_drop(lo, inode, name);
+	lo_attr_cache_drop(lo, &inode->key, false);
+	pthread_rwlock_unlock(&lo->attr_cache_lock);
+}
+
+/*
+ * Forget the cached attributes of @inode alone, for operations such as write
+ * that do not change any directory entry.  Unlike lo_attr_cache_invalidate()
+ * this takes neither attr_cache_lock nor a new generation.
+ */
+static void lo_attr_cache_invalidate_attr(struct lo_data *lo,
+					  struct lo_inode *inode)
+{
+	struct lo_inode_shard *shard;
+
+	if (lo->attr_cache == ATTR_CACHE_NONE || !inode)
+		return;
+
+	shard = lo_inode_shard(lo, &inode->key);
+	pthread_mutex_lock(&shard->mutex);
+	if (inode->attr_valid)
+		__atomic_fetch_add(&lo->attr_cache_invalidations, 1,
+				   __ATOMIC_RELAXED);
+	inode->attr_valid = false;
+	inode->attr_gen++;
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Sample the generation of @inode to pass to the store functions */
+static uint64_t lo_attr_cache_inode_gen(struct lo_data *lo,
+					struct lo_inode *inode)
+{
+	struct lo_inode_shard *shard = lo_inode_shard(lo, &inode->key);
+	uint64_t gen;
+
+	pthread_mutex_lock(&shard->mutex);
+	gen = inode->attr_gen;
+	pthread_mutex_unlock(&shard->mutex);
+
+	return gen;
+}
+
+static bool lo_attr_cache_lookup(struct lo_data *lo, struct lo_inode *inode,
+				 struct stat *st)
+{
+	struct lo_inode_shard *shard = lo_inode_shard(lo, &inode->key);
+	bool hit;
+
+	pthread_mutex_lock(&shard->mutex);
+	hit = inode->attr_valid;
+	if (hit)
+		*st = inode->attr;
+	pthread_mutex_unlock(&shard->mutex);
+
+	__atomic_fetch_add(hit ? &lo->attr_cache_hits : &lo->attr_cache_misses,
+			   1, __ATOMIC_RELAXED);
+	return hit;
+}
+
+/* Cache @st unless it may be stale, see the comment at the top */
+static void lo_attr_cache_store(struct lo_data *lo, struct lo_inode *inode,
+				const struct stat *st, uint64_t gen,
+				uint64_t inode_gen)
+{
+	struct lo_inode_shard *shard = lo_inode_shard(lo, &inode->key);
+
+	pthread_mutex_lock(&shard->mutex);
+	if (inode->attr_watched && lo_attr_cache_gen(lo) == gen &&
+	    inode->attr_gen == inode_gen) {
+		inode->attr = *st;
+		inode->attr_valid = true;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ * Start watching directory @dir.  inotify_add_watch() has no *at() variant,
+ * and the sandbox leaves no /proc to reach by absolute path, so the watch is
+ * added through the /proc/self/fd entry of @dir relative to the working
+ * directory, which setup_sandbox() made /proc/self/fd for this purpose.
+ */
+static bool lo_attr_cache_watch(struct lo_data *lo, struct lo_inode *dir)
+{
+	struct lo_inode_shard *shard = lo_inode_shard(lo, &dir->key);
+	char procname[64];
+	int wd;
+
+	if (dir->wd)
+		return true;
+
+	sprintf(procname, "%i", dir->fd);
+	wd = inotify_add_watch(lo->inotify_fd, procname, LO_ATTR_CACHE_EVENTS);
+	if (wd == -1) {
+		if (lo->debug)
+			fprintf(stderr, "attr cache: inotify_add_watch: %m\n");
+		return false;
+	}
+
+	dir->wd = wd;
+	dir->dentries = g_hash_table_new_full(g_str_hash, g_str_equal,
+					      g_free, g_free);
+	g_hash_table_insert(lo->attr_cache_watches, GINT_TO_POINTER(wd), dir);
+
+	/* Lookups that sampled the generation before the watch existed */
+	lo_attr_cache_bump_gen(lo);
+
+	pthread_mutex_lock(&shard->mutex);
+	dir->attr_watched = true;
+	pthread_mutex_unlock(&shard->mutex);
+	return true;
+}
+
+/* Assumes lo->attr_cache_lock is held for writing */
+static void lo_attr_cache_forget_watch(struct lo_data *lo,
+				       struct lo_inode *dir)
+{
+	g_hash_table_remove(lo->attr_cache_watches, GINT_TO_POINTER(dir->wd));
+	g_hash_table_destroy(dir->dentries);
+	dir->dentries = NULL;
+	dir->wd = 0;
+	lo_attr_cache_drop(lo, &dir->key, true);
+}
+
+/* Called before @dir is freed */
+static void lo_attr_cache_unwatch(struct lo_data *lo, struct lo_inode *dir)
+{
+	if (lo->attr_cache == ATTR_CACHE_NONE)
+		return;
+
+	pthread_rwlock_wrlock(&lo->attr_cache_lock);
+	if (dir->wd) {
+		inotify_rm_watch(lo->inotify_fd, dir->wd);
+		lo_attr_cache_forget_watch(lo, dir);
+	}
+	pthread_rwlock_unlock(&lo->attr_cache_lock);
+}
+
+/*
+ * Look up @name in @dir.  On a hit the returned inode has its refcount
+ * incremented and @st holds its attributes.
+ */
+static struct lo_inode *lo_dentry_cache_lookup(struct lo_data *lo,
+					       struct lo_inode *dir,
+					       const char *name,
+					       struct stat *st)
+{
+	struct lo_inode *inode = NULL;
+	struct lo_key *key = NULL;
+
+	pthread_rwlock_rdlock(&lo->attr_cache_lock);
+	if (dir->dentries)
+		key = g_hash_table_lookup(dir->dentries, name);
+	if (key) {
+		struct lo_inode_shard *shard = lo_inode_shard(lo, key);
+
+		pthread_mutex_lock(&shard->mutex);
+		inode = lo_attr_cache_find(lo, shard, key);
+		if (inode && inode->attr_valid) {
+			inode->refcount++;
+			*st = inode->attr;
+		} else {
+			inode = NULL;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+	pthread_rwlock_unlock(&lo->attr_cache_lock);
+
+	__atomic_fetch_add(inode ? &lo->attr_cache_hits :
+			   &lo->attr_cache_misses, 1, __ATOMIC_RELAXED);
+	return inode;
+}
+
+/*
+ * Make sure @dir is watched before its entries are looked up on the host,
+ * and return the generation to pass to lo_dentry_cache_store().
+ */
+static uint64_t lo_dentry_cache_prepare(struct lo_data *lo,
+					struct lo_inode *dir)
+{
+	uint64_t gen;
+
+	pthread_rwlock_wrlock(&lo->attr_cache_lock);
+	lo_attr_cache_watch(lo, dir);
+	gen = lo_attr_cache_gen(lo);
+	pthread_rwlock_unlock(&lo->attr_cache_lock);
+
+	return gen;
+}
+
+static void lo_dentry_cache_store(struct lo_data *lo, struct lo_inode *dir,
+				  const char *name, struct lo_inode *inode,
+				  const struct stat *st, uint64_t gen,
+				  uint64_t inode_gen)
+{
+	struct lo_inode_shard *shard = lo_inode_shard(lo, &inode->key);
+
+	pthread_rwlock_wrlock(&lo->attr_cache_lock);
+	if (dir->dentries && lo_attr_cache_gen(lo) == gen) {
+		g_hash_table_replace(dir->dentries, g_strdup(name),
+				     g_memdup(&inode->key, sizeof(inode->key)));
+
+		pthread_mutex_lock(&shard->mutex);
+		inode->attr_watched = true;
+		if (inode->attr_gen == inode_gen) {
+			inode->attr = *st;
+			inode->attr_valid = true;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+	pthread_rwlock_unlock(&lo->attr_cache_lock);
+}
+
+/* Assumes lo->attr_cache_lock is held for writing */
+static void lo_attr_cache_flush(struct lo_data *lo)
+{
+	GHashTableIter iter;
+	gpointer value;
+	int i;
+
+	g_hash_table_iter_init(&iter, lo->attr_cache_watches);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct lo_inode *dir = value;
+
+		g_hash_table_remove_all(dir->dentries);
+	}
+
+	for (i = 0; i < LO_INODE_SHARDS; i++) {
+		struct lo_inode_shard *shard = &lo->inode_shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		g_hash_table_iter_init(&iter, shard->inodes);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			((struct lo_inode *)value)->attr_valid = false;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+	lo_attr_cache_drop(lo, &lo->root.key, false);
+}
+
+static void lo_attr_cache_event(struct lo_data *lo,
+				const struct inotify_event *ev)
+{
+	struct lo_inode *dir;
+
+	pthread_rwlock_wrlock(&lo->attr_cache_lock);
+	lo_attr_cache_bump_gen(lo);
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		fprintf(stderr, "attr cache: inotify queue overflow\n");
+		lo_attr_cache_flush(lo);
+		goto out;
+	}
+
+	dir = g_hash_table_lookup(lo->attr_cache_watches,
+				  GINT_TO_POINTER(ev->wd));
+	if (!dir)
+		goto out;
+
+	if (ev->mask & IN_IGNORED) {
+		lo_attr_cache_forget_watch(lo, dir);
+		goto out;
+	}
+
+	if (ev->len && (ev->mask & (IN_ATTRIB | IN_MODIFY))) {
+		/* Only the attributes of the entry changed */
+		struct lo_key *key = g_hash_table_lookup(dir->dentries,
+							 ev->name);
+
+		if (key)
+			lo_attr_cache_drop(lo, key, false);
+		goto out;
+	}
+
+	if (ev->len)
+		lo_dentry_cache_drop(lo, dir, ev->name);
+	lo_attr_cache_drop(lo, &dir->key, false);
+out:
+	pthread_rwlock_unlock(&lo->attr_cache_lock);
+}
+
+static void lo_attr_cache_print_stats(struct lo_data *lo)
+{
+	fprintf(stderr, "attr cache: %" PRIu64 " hits, %" PRIu64 " misses, "
+		"%" PRIu64 " invalidations\n",
+		__atomic_load_n(&lo->attr_cache_hits, __ATOMIC_RELAXED),
+		__atomic_load_n(&lo->attr_cache_misses, __ATOMIC_RELAXED),
+		__atomic_load_n(&lo->attr_cache_invalidations,
+				__ATOMIC_RELAXED));
+}
+
+/*
+ * Processes inotify events if the attribute cache is enabled, and prints
+ * statistics on SIGUSR1
+ */
+static void *lo_attr_cache_thread(void *opaque)
+{
+	struct lo_data *lo = opaque;
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		struct pollfd pf[2];
+		ssize_t len;
+		char *p;
+
+		/* -1 without the attribute cache, which ppoll() skips */
+		pf[0].fd = lo->inotify_fd;
+		pf[0].events = POLLIN;
+		pf[0].revents = 0;
+		pf[1].fd = lo->attr_cache_sigfd;
+		pf[1].events = POLLIN;
+		pf[1].revents = 0;
+
+		if (ppoll(pf, 2, NULL, NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("attr cache ppoll");
+			break;
+		}
+
+		if (pf[1].revents & POLLIN) {
+			struct signalfd_siginfo si;
+
+			if (read(lo->attr_cache_sigfd, &si, sizeof(si)) ==
+			    sizeof(si)) {
+				if (lo->attr_cache != ATTR_CACHE_NONE)
+					lo_attr_cache_print_stats(lo);
+				lo_dax_print_stats(lo);
+			}
+		}
+
+		if (!(pf[0].revents & POLLIN))
+			continue;
+
+		len = read(lo->inotify_fd, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("attr cache read");
+			break;
+		}
+
+		for (p = buf; p < buf + len; ) {
+			const struct inotify_event *ev = (void *)p;
+
+			lo_attr_cache_event(lo, ev);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	/* Without events the cache can no longer be trusted */
+	if (lo->inotify_fd != -1) {
+		pthread_rwlock_wrlock(&lo->attr_cache_lock);
+		lo->attr_cache = ATTR_CACHE_NONE;
+		lo_attr_cache_flush(lo);
+		pthread_rwlock_unlock(&lo->attr_cache_lock);
+	}
+	return NULL;
+}
+
 static void lo_getattr(fuse_req_t req, fuse_ino_t ino,
 			     struct fuse_file_info *fi)
 {
 	int res;
 	struct stat buf;
 	struct lo_data *lo = lo_data(req);
+	struct lo_inode *inode = NULL;
+	uint64_t gen = 0, inode_gen = 0;
 
 	(void) fi;
 
+	if (lo->attr_cache != ATTR_CACHE_NONE) {
+		inode = lo_inode(req, ino);
+		if (inode && lo_attr_cache_lookup(lo, inode, &buf))
+			return (void) fuse_reply_attr(req, &buf, lo->timeout);
+		gen = lo_attr_cache_gen(lo);
+		if (inode)
+			inode_gen = lo_attr_cache_inode_gen(lo, inode);
+	}
+
 	res = fstatat(lo_fd(req, ino), "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return (void) fuse_reply_err(req, errno);
 
+	if (inode)
+		lo_attr_cache_store(lo, inode, &buf, gen, inode_gen);
+
 	fuse_reply_attr(req, &buf, lo->timeout);
 }
 
@@ -422,10 +1009,13 @@ retry:
 		goto fail_noretry;
 	}
 	if (last == path) {
+		struct lo_inode_shard *shard;
+
 		p = &lo->root;
-		pthread_mutex_lock(&lo->mutex);
+		shard = lo_inode_shard(lo, &p->key);
+		pthread_mutex_lock(&shard->mutex);
 		p->refcount++;
-		pthread_mutex_unlock(&lo->mutex);
+		pthread_mutex_unlock(&shard->mutex);
 	} else {
 		*last = '\0';
 		res = fstatat(AT_FDCWD, last == path ? "/" : path, &stat, 0);
@@ -505,10 +1095,7 @@ static int lo_fi_fd(fuse_req_t req, struct fuse_file_info *fi)
 	struct lo_data *lo = lo_data(req);
 	struct lo_map_elem *elem;
 
-	pthread_mutex_lock(&lo->mutex);
 	elem = lo_map_get(&lo->fd_map, fi->fh);
-	pthread_mutex_unlock(&lo->mutex);
-
 	if (!elem)
 		return -1;
 
@@ -608,10 +1195,12 @@ static void lo_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 			goto out_err;
 	}
 
+	lo_attr_cache_invalidate(lo, inode, NULL);
 	return lo_getattr(req, ino, fi);
 
 out_err:
 	saverr = errno;
+	lo_attr_cache_invalidate(lo, inode, NULL);
 	fuse_reply_err(req, saverr);
 }
 
@@ -622,14 +1211,15 @@ static struct lo_inode *lo_find(struct lo_data *lo, struct stat *st)
 		.ino = st->st_ino,
 		.dev = st->st_dev,
 	};
+	struct lo_inode_shard *shard = lo_inode_shard(lo, &key);
 
-	pthread_mutex_lock(&lo->mutex);
-	p = g_hash_table_lookup(lo->inodes, &key);
+	pthread_mutex_lock(&shard->mutex);
+	p = g_hash_table_lookup(shard->inodes, &key);
 	if (p) {
 		assert(p->refcount > 0);
 		p->refcount++;
 	}
-	pthread_mutex_unlock(&lo->mutex);
+	pthread_mutex_unlock(&shard->mutex);
 
 	return p;
 }
@@ -642,6 +1232,8 @@ static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 	int saverr;
 	struct lo_data *lo = lo_data(req);
 	struct lo_inode *inode, *dir = lo_inode(req, parent);
+	bool cache_dentry = false;
+	uint64_t gen = 0, inode_gen = 0;
 
 	memset(e, 0, sizeof(*e));
 	e->attr_timeout = lo->timeout;
@@ -652,6 +1244,17 @@ static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 		name = ".";
 	}
 
+	if (lo->attr_cache != ATTR_CACHE_NONE && dir &&
+	    strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+		inode = lo_dentry_cache_lookup(lo, dir, name, &e->attr);
+		if (inode) {
+			e->ino = inode->fuse_ino;
+			goto out;
+		}
+		gen = lo_dentry_cache_prepare(lo, dir);
+		cache_dentry = true;
+	}
+
 	newfd = openat(dir->fd, name, O_PATH | O_NOFOLLOW);
 	if (newfd == -1)
 		goto out_err;
@@ -665,6 +1268,9 @@ static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 		close(newfd);
 		newfd = -1;
 	} else {
+		struct lo_inode_shard *shard;
+		struct lo_inode *other;
+
 		saverr = ENOMEM;
 		inode = calloc(1, sizeof(struct lo_inode));
 		if (!inode)
@@ -677,12 +1283,26 @@ static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 		inode->key.ino = e->attr.st_ino;
 		inode->key.dev = e->attr.st_dev;
 
-		pthread_mutex_lock(&lo->mutex);
-		inode->fuse_ino = lo_add_inode_mapping(req, inode);
-                g_hash_table_insert(lo->inodes, &inode->key, inode);
-		pthread_mutex_unlock(&lo->mutex);
+		shard = lo_inode_shard(lo, &inode->key);
+		pthread_mutex_lock(&shard->mutex);
+		/* Another thread may have looked up the same inode meanwhile */
+		other = g_hash_table_lookup(shard->inodes, &inode->key);
+		if (other) {
+			other->refcount++;
+			pthread_mutex_unlock(&shard->mutex);
+			close(inode->fd);
+			free(inode);
+			inode = other;
+		} else {
+			inode->fuse_ino = lo_add_inode_mapping(req, inode);
+			g_hash_table_insert(shard->inodes, &inode->key, inode);
+			pthread_mutex_unlock(&shard->mutex);
+		}
 	}
 
+	if (cache_dentry)
+		inode_gen = lo_attr_cache_inode_gen(lo, inode);
+
 	res = fstatat(inode->fd, "", &e->attr,
 		      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
 	if (res == -1) {
@@ -690,8 +1310,13 @@ static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 		goto out_err;
 	}
 
+	if (cache_dentry)
+		lo_dentry_cache_store(lo, dir, name, inode, &e->attr, gen,
+				      inode_gen);
+
 	e->ino = inode->fuse_ino;
 
+out:
 	if (lo_debug(req))
 		fprintf(stderr, "  %lli/%s -> %lli\n",
 			(unsigned long long) parent, name, (unsigned long long) e->ino);
@@ -777,6 +1402,7 @@ static void lo_mknod_symlink(fuse_req_t req, fuse_ino_t parent,
 	int newfd = -1;
 	int res;
 	int saverr;
+	struct lo_data *lo = lo_data(req);
 	struct lo_inode *dir;
 	struct fuse_entry_param e;
 	struct lo_cred old = {};
@@ -807,6 +1433,7 @@ static void lo_mknod_symlink(fuse_req_t req, fuse_ino_t parent,
 	saverr = errno;
 
 	lo_restore_cred(&old);
+	lo_attr_cache_invalidate(lo, dir, name);
 
 	if (res == -1)
 		goto out;
@@ -883,6 +1510,7 @@ static void lo_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t parent,
 	int res;
 	struct lo_data *lo = lo_data(req);
 	struct lo_inode *inode;
+	struct lo_inode_shard *shard;
 	struct fuse_entry_param e;
 	int saverr;
 
@@ -902,6 +1530,10 @@ static void lo_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t parent,
 	e.entry_timeout = lo->timeout;
 
 	res = linkat_empty_nofollow(lo, inode, lo_fd(req, parent), name);
+	saverr = errno;
+	lo_attr_cache_invalidate(lo, inode, NULL);
+	lo_attr_cache_invalidate(lo, lo_inode(req, parent), name);
+	errno = saverr;
 	if (res == -1)
 		goto out_err;
 
@@ -909,9 +1541,10 @@ static void lo_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t parent,
 	if (res == -1)
 		goto out_err;
 
-	pthread_mutex_lock(&lo->mutex);
+	shard = lo_inode_shard(lo, &inode->key);
+	pthread_mutex_lock(&shard->mutex);
 	inode->refcount++;
-	pthread_mutex_unlock(&lo->mutex);
+	pthread_mutex_unlock(&shard->mutex);
 	e.ino = inode->fuse_ino;
 
 	if (lo_debug(req))
@@ -943,7 +1576,7 @@ static struct lo_inode *lookup_name(fuse_req_t req, fuse_ino_t parent,
 
 static void lo_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	int res;
+	int res, err;
 	struct lo_inode *inode;
 	struct lo_data *lo = lo_data(req);
 
@@ -959,7 +1592,11 @@ static void lo_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 	}
 
 	res = unlinkat(lo_fd(req, parent), name, AT_REMOVEDIR);
-        fuse_reply_err(req, res == -1 ? errno : 0);
+	err = res == -1 ? errno : 0;
+	/* Before replying, so that the next lookup cannot see stale entries */
+	lo_attr_cache_invalidate(lo, lo_inode(req, parent), name);
+	lo_attr_cache_invalidate(lo, inode, NULL);
+	fuse_reply_err(req, err);
 	unref_inode(lo, inode, 1);
 }
 
@@ -967,7 +1604,7 @@ static void lo_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
 		      fuse_ino_t newparent, const char *newname,
 		      unsigned int flags)
 {
-	int res;
+	int res, err;
 	struct lo_inode *oldinode;
 	struct lo_inode *newinode;
 	struct lo_data *lo = lo_data(req);
@@ -981,36 +1618,42 @@ static void lo_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
 	oldinode = lookup_name(req, parent, name);
 	newinode = lookup_name(req, newparent, newname);
 	if (!oldinode) {
-		fuse_reply_err(req, EIO);
+		err = EIO;
 		goto out;
 	}
 
 
 	if (flags) {
 #ifndef SYS_renameat2
-		fuse_reply_err(req, EINVAL);
+		err = EINVAL;
 #else
 		res = syscall(SYS_renameat2, lo_fd(req, parent), name,
 			      lo_fd(req, newparent), newname, flags);
 		if (res == -1 && errno == ENOSYS)
-			fuse_reply_err(req, EINVAL);
+			err = EINVAL;
 		else
-			fuse_reply_err(req, res == -1 ? errno : 0);
+			err = res == -1 ? errno : 0;
 #endif
 		goto out;
 	}
 
 	res = renameat(lo_fd(req, parent), name,
 			lo_fd(req, newparent), newname);
-        fuse_reply_err(req, res == -1 ? errno : 0);
+	err = res == -1 ? errno : 0;
 out:
+	/* Before replying, so that the next lookup cannot see stale entries */
+	lo_attr_cache_invalidate(lo, lo_inode(req, parent), name);
+	lo_attr_cache_invalidate(lo, lo_inode(req, newparent), newname);
+	lo_attr_cache_invalidate(lo, oldinode, NULL);
+	lo_attr_cache_invalidate(lo, newinode, NULL);
+	fuse_reply_err(req, err);
 	unref_inode(lo, oldinode, 1);
 	unref_inode(lo, newinode, 1);
 }
 
 static void lo_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	int res;
+	int res, err;
 	struct lo_inode *inode;
 	struct lo_data *lo = lo_data(req);
 
@@ -1026,26 +1669,34 @@ static void lo_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 	}
 
 	res = unlinkat(lo_fd(req, parent), name, 0);
-        fuse_reply_err(req, res == -1 ? errno : 0);
+	err = res == -1 ? errno : 0;
+	/* Before replying, so that the next lookup cannot see stale entries */
+	lo_attr_cache_invalidate(lo, lo_inode(req, parent), name);
+	lo_attr_cache_invalidate(lo, inode, NULL);
+	fuse_reply_err(req, err);
 	unref_inode(lo, inode, 1);
 }
 
 static void unref_inode(struct lo_data *lo, struct lo_inode *inode, uint64_t n)
 {
+	struct lo_inode_shard *shard;
+
 	if (!inode)
 		return;
 
-	pthread_mutex_lock(&lo->mutex);
+	shard = lo_inode_shard(lo, &inode->key);
+	pthread_mutex_lock(&shard->mutex);
 	assert(inode->refcount >= n);
 	inode->refcount -= n;
 	if (!inode->refcount) {
 		lo_map_remove(&lo->ino_map, inode->fuse_ino);
-                g_hash_table_remove(lo->inodes, &inode->key);
-		pthread_mutex_unlock(&lo->mutex);
+		g_hash_table_remove(shard->inodes, &inode->key);
+		pthread_mutex_unlock(&shard->mutex);
+		lo_attr_cache_unwatch(lo, inode);
 		close(inode->fd);
 		free(inode);
 	} else {
-		pthread_mutex_unlock(&lo->mutex);
+		pthread_mutex_unlock(&shard->mutex);
 	}
 }
 
@@ -1064,10 +1715,16 @@ static int unref_all_inodes_cb(gpointer key, gpointer value,
 
 static void unref_all_inodes(struct lo_data *lo)
 {
-	pthread_mutex_lock(&lo->mutex);
-	g_hash_table_foreach_remove(lo->inodes, unref_all_inodes_cb, lo);
-	pthread_mutex_unlock(&lo->mutex);
+	int i;
+
+	for (i = 0; i < LO_INODE_SHARDS; i++) {
+		struct lo_inode_shard *shard = &lo->inode_shards[i];
 
+		pthread_mutex_lock(&shard->mutex);
+		g_hash_table_foreach_remove(shard->inodes,
+					    unref_all_inodes_cb, lo);
+		pthread_mutex_unlock(&shard->mutex);
+	}
 }
 
 static void lo_forget_one(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
@@ -1122,21 +1779,45 @@ static void lo_readlink(fuse_req_t req, fuse_ino_t ino)
 	fuse_reply_readlink(req, buf);
 }
 
+/* One entry of a directory snapshot */
+struct lo_dirent {
+	ino_t ino;
+	unsigned char type;
+	size_t name; /* offset into lo_dirp.names */
+};
+
 struct lo_dirp {
 	int fd;
 	DIR *dp;
-	struct dirent *entry;
-	off_t offset;
+
+	/*
+	 * Snapshot of the directory, taken with a few large getdents64()
+	 * calls whenever it is read from offset 0.  The offset of entry i is
+	 * i + 1, so reads at later offsets index straight into it.
+	 */
+	pthread_mutex_t lock;
+	bool have_snapshot;
+	GArray *entries; /* struct lo_dirent */
+	GString *names;
 };
 
+/* Layout of the records returned by getdents64() */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+#define LO_GETDENTS_BUFSIZE (1024 * 1024)
+
 static struct lo_dirp *lo_dirp(fuse_req_t req, struct fuse_file_info *fi)
 {
 	struct lo_data *lo = lo_data(req);
 	struct lo_map_elem *elem;
 
-	pthread_mutex_lock(&lo->mutex);
 	elem = lo_map_get(&lo->dirp_map, fi->fh);
-	pthread_mutex_unlock(&lo->mutex);
 	if (!elem)
 		return NULL;
 
@@ -1162,8 +1843,9 @@ static void lo_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi
 	if (d->dp == NULL)
 		goto out_errno;
 
-	d->offset = 0;
-	d->entry = NULL;
+	pthread_mutex_init(&d->lock, NULL);
+	d->entries = g_array_new(FALSE, FALSE, sizeof(struct lo_dirent));
+	d->names = g_string_new(NULL);
 
 	fh = lo_add_dirp_mapping(req, d);
 	if (fh == -1)
@@ -1179,24 +1861,204 @@ out_errno:
 	error = errno;
 out_err:
 	if (d) {
+		if (d->entries) {
+			pthread_mutex_destroy(&d->lock);
+			g_array_free(d->entries, TRUE);
+			g_string_free(d->names, TRUE);
+		}
 		if (d->dp)
 			closedir(d->dp);
-		if (d->fd != -1)
+		else if (d->fd != -1)
 			close(d->fd);
 		free(d);
 	}
 	fuse_reply_err(req, error);
 }
 
+/* Assumes d->lock is held */
+static int lo_dirp_snapshot(struct lo_dirp *d)
+{
+	char *buf;
+	ssize_t n;
+	int err = 0;
+
+	d->have_snapshot = false;
+	g_array_set_size(d->entries, 0);
+	g_string_truncate(d->names, 0);
+
+	if (lseek(d->fd, 0, SEEK_SET) == -1)
+		return errno;
+
+	buf = malloc(LO_GETDENTS_BUFSIZE);
+	if (!buf)
+		return ENOMEM;
+
+	for (;;) {
+		ssize_t pos;
+
+		n = syscall(SYS_getdents64, d->fd, buf, LO_GETDENTS_BUFSIZE);
+		if (n == -1) {
+			err = errno;
+			break;
+		}
+		if (n == 0)
+			break;
+
+		for (pos = 0; pos < n; ) {
+			struct linux_dirent64 *de = (void *)(buf + pos);
+			struct lo_dirent ent = {
+				.ino = de->d_ino,
+				.type = de->d_type,
+				.name = d->names->len,
+			};
+
+			g_string_append_len(d->names, de->d_name,
+					    strlen(de->d_name) + 1);
+			g_array_append_val(d->entries, ent);
+			pos += de->d_reclen;
+		}
+	}
+	free(buf);
+
+	if (!err)
+		d->have_snapshot = true;
+	return err;
+}
+
+/* Lookup of one entry of a readdirplus reply */
+struct lo_readdirplus_job {
+	fuse_req_t req;
+	fuse_ino_t parent;
+	const char *name;
+	struct fuse_entry_param e;
+	int err;
+	bool used;
+	struct lo_readdirplus_batch *batch;
+};
+
+struct lo_readdirplus_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t pending;
+};
+
+static void lo_readdirplus_lookup(struct lo_readdirplus_job *job)
+{
+	job->err = lo_do_lookup(job->req, job->parent, job->name, &job->e);
+	if (job->err == ENOENT) {
+		/*
+		 * Removed since the snapshot; send it without attributes.
+		 * Reading the directory live used to stop at such an entry
+		 * instead, but a snapshot lists it anyway and the guest can
+		 * look it up itself.
+		 */
+		job->err = 0;
+		job->e.ino = 0;
+	}
+}
+
+static void lo_readdirplus_worker(gpointer data, gpointer user_data)
+{
+	struct lo_readdirplus_job *job = data;
+	struct lo_readdirplus_batch *batch = job->batch;
+
+	(void) user_data;
+
+	lo_readdirplus_lookup(job);
+
+	pthread_mutex_lock(&batch->lock);
+	if (!--batch->pending)
+		pthread_cond_signal(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * Look up the entries of the snapshot, starting at @offset, that fit in a
+ * reply of @size bytes.  The lookups run in parallel on lo->readdirplus_pool
+ * if there is one.  Returns the number of jobs in *@jobsp, or -1 if they
+ * could not be allocated.
+ */
+static ssize_t lo_readdirplus_prefetch(fuse_req_t req, fuse_ino_t ino,
+				      struct lo_dirp *d, off_t offset,
+				      size_t size,
+				      struct lo_readdirplus_job **jobsp)
+{
+	struct lo_data *lo = lo_data(req);
+	struct lo_readdirplus_job *jobs;
+	struct lo_readdirplus_batch batch;
+	size_t njobs = 0;
+	size_t i;
+
+	for (i = offset; i < d->entries->len; i++) {
+		struct lo_dirent *ent = &g_array_index(d->entries,
+						       struct lo_dirent, i);
+		size_t entsize = fuse_add_direntry_plus(req, NULL, 0,
+					d->names->str + ent->name, NULL, 0);
+
+		if (entsize > size)
+			break;
+		size -= entsize;
+		njobs++;
+	}
+
+	*jobsp = NULL;
+	if (!njobs)
+		return 0;
+
+	*jobsp = jobs = calloc(njobs, sizeof(jobs[0]));
+	if (!jobs)
+		return -1;
+
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+	batch.pending = 0;
+
+	for (i = 0; i < njobs; i++) {
+		struct lo_dirent *ent = &g_array_index(d->entries,
+						       struct lo_dirent,
+						       offset + i);
+		struct lo_readdirplus_job *job = &jobs[i];
+
+		job->req = req;
+		job->parent = ino;
+		job->name = d->names->str + ent->name;
+		job->batch = &batch;
+
+		if (is_dot_or_dotdot(job->name))
+			continue;
+
+		if (lo->readdirplus_pool) {
+			pthread_mutex_lock(&batch.lock);
+			batch.pending++;
+			pthread_mutex_unlock(&batch.lock);
+			g_thread_pool_push(lo->readdirplus_pool, job, NULL);
+		} else {
+			lo_readdirplus_lookup(job);
+		}
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending)
+		pthread_cond_wait(&batch.cond, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
+
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+	return njobs;
+}
+
 static void lo_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 			  off_t offset, struct fuse_file_info *fi, int plus)
 {
 	struct lo_data *lo = lo_data(req);
 	struct lo_dirp *d;
 	struct lo_inode *dinode;
+	struct lo_readdirplus_job *jobs = NULL;
+	ssize_t njobs = 0;
 	char *buf = NULL;
 	char *p;
 	size_t rem = size;
+	size_t i;
 	int err = EBADF;
 
 	dinode = lo_inode(req, ino);
@@ -1214,35 +2076,33 @@ static void lo_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 		goto error;
 	p = buf;
 
-	if (offset != d->offset) {
-		seekdir(d->dp, offset);
-		d->entry = NULL;
-		d->offset = offset;
+	pthread_mutex_lock(&d->lock);
+	if (offset == 0 || !d->have_snapshot) {
+		err = lo_dirp_snapshot(d);
+		if (err)
+			goto error_unlock;
 	}
-	while (1) {
-		size_t entsize;
-		off_t nextoff;
-		const char *name;
-
-		if (!d->entry) {
-			errno = 0;
-			d->entry = readdir(d->dp);
-			if (!d->entry) {
-				if (errno) {  // Error
-					err = errno;
-					goto error;
-				} else {  // End of stream
-					break; 
-				}
-			}
+
+	if (plus && offset < d->entries->len) {
+		err = ENOMEM;
+		njobs = lo_readdirplus_prefetch(req, ino, d, offset, size,
+						&jobs);
+		if (njobs < 0) {
+			njobs = 0;
+			goto error_unlock;
 		}
-		nextoff = d->entry->d_off;
-		name = d->entry->d_name;
+	}
+
+	for (i = offset; i < d->entries->len; i++) {
+		struct lo_dirent *ent = &g_array_index(d->entries,
+						       struct lo_dirent, i);
+		const char *name = d->names->str + ent->name;
+		off_t nextoff = i + 1;
+		size_t entsize;
 
-		fuse_ino_t entry_ino = 0;
 		struct fuse_entry_param e = (struct fuse_entry_param) {
-			.attr.st_ino = d->entry->d_ino,
-			.attr.st_mode = d->entry->d_type << 12,
+			.attr.st_ino = ent->ino,
+			.attr.st_mode = ent->type << 12,
 		};
 
 		/* Hide root's parent directory */
@@ -1252,33 +2112,43 @@ static void lo_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 		}
 
 		if (plus) {
-			if (!is_dot_or_dotdot(name)) {
-				err = lo_do_lookup(req, ino, name, &e);
-				if (err)
-					goto error;
-				entry_ino = e.ino;
+			struct lo_readdirplus_job *job;
+
+			if (i - offset >= (size_t)njobs)
+				break;
+			job = &jobs[i - offset];
+			if (job->err) {
+				err = job->err;
+				goto error_unlock;
 			}
+			if (job->e.ino)
+				e = job->e;
 
 			entsize = fuse_add_direntry_plus(req, p, rem, name,
 							 &e, nextoff);
+			if (entsize <= rem)
+				job->used = true;
 		} else {
 			entsize = fuse_add_direntry(req, p, rem, name,
 						    &e.attr, nextoff);
 		}
-		if (entsize > rem) {
-			if (entry_ino != 0) 
-				lo_forget_one(req, entry_ino, 1);
+		if (entsize > rem)
 			break;
-		}
-		
+
 		p += entsize;
 		rem -= entsize;
-
-		d->entry = NULL;
-		d->offset = nextoff;
 	}
 
-    err = 0;
+	err = 0;
+error_unlock:
+	pthread_mutex_unlock(&d->lock);
+
+	/* Drop the lookups of entries that did not make it into the reply */
+	for (i = 0; i < (size_t)njobs; i++) {
+		if (jobs[i].e.ino && !jobs[i].used)
+			lo_forget_one(req, jobs[i].e.ino, 1);
+	}
+	free(jobs);
 error:
     // If there's an error, we can only signal it if we haven't stored
     // any entries yet - otherwise we'd end up with wrong lookup
@@ -1316,10 +2186,11 @@ static void lo_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
 		return;
 	}
 
-	pthread_mutex_lock(&lo->mutex);
 	lo_map_remove(&lo->dirp_map, fi->fh);
-	pthread_mutex_unlock(&lo->mutex);
 
+	pthread_mutex_destroy(&d->lock);
+	g_array_free(d->entries, TRUE);
+	g_string_free(d->names, TRUE);
 	closedir(d->dp);
 	free(d);
 	fuse_reply_err(req, 0);
@@ -1357,6 +2228,7 @@ static void lo_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 		    (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
 	err = fd == -1 ? errno : 0;
 	lo_restore_cred(&old);
+	lo_attr_cache_invalidate(lo, lo_inode(req, parent), name);
 
 	if (!err) {
 		ssize_t fh = lo_add_fd_mapping(req, fd);
@@ -1442,6 +2314,8 @@ static void lo_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	fd = openat(lo->proc_self_fd, buf, fi->flags & ~O_NOFOLLOW);
 	if (fd == -1)
 		return (void) fuse_reply_err(req, errno);
+	if (fi->flags & O_TRUNC)
+		lo_attr_cache_invalidate_attr(lo, lo_inode(req, ino));
 
 	fh = lo_add_fd_mapping(req, fd);
 	if (fh == -1) {
@@ -1467,9 +2341,7 @@ static void lo_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi
 
 	fd = lo_fi_fd(req, fi);
 
-	pthread_mutex_lock(&lo->mutex);
 	lo_map_remove(&lo->fd_map, fi->fh);
-	pthread_mutex_unlock(&lo->mutex);
 
 	close(fd);
 	fuse_reply_err(req, 0);
@@ -1549,6 +2421,7 @@ static void lo_write_buf(fuse_req_t req, fuse_ino_t ino,
 			ino, out_buf.buf[0].size, (unsigned long) off);
 
 	res = fuse_buf_copy(&out_buf, in_buf, 0);
+	lo_attr_cache_invalidate_attr(lo_data(req), lo_inode(req, ino));
 	if(res < 0)
 		fuse_reply_err(req, -res);
 	else
@@ -1580,6 +2453,7 @@ static void lo_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
 
 	err = posix_fallocate(lo_fi_fd(req, fi), offset,
 			      length);
+	lo_attr_cache_invalidate_attr(lo_data(req), lo_inode(req, ino));
 
 	fuse_reply_err(req, err);
 }
@@ -1780,6 +2654,7 @@ static void lo_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 
 	ret = fsetxattr(fd, name, value, size, flags);
 	saverr = ret == -1 ? errno : 0;
+	lo_attr_cache_invalidate(lo_data(req), inode, NULL);
 
 out:
 	if (fd >= 0) {
@@ -1827,6 +2702,7 @@ static void lo_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 
 	ret = fremovexattr(fd, name);
 	saverr = ret == -1 ? errno : 0;
+	lo_attr_cache_invalidate(lo_data(req), inode, NULL);
 
 out:
 	if (fd >= 0) {
@@ -1856,6 +2732,7 @@ static void lo_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
 			flags);
 
 	res = copy_file_range(in_fd, &off_in, out_fd, &off_out, len, flags);
+	lo_attr_cache_invalidate_attr(lo_data(req), lo_inode(req, ino_out));
 	if (res < 0)
 		fuse_reply_err(req, -errno);
 	else
@@ -1863,11 +2740,164 @@ static void lo_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
 }
 #endif
 
+static gint lo_dax_cmp(gconstpointer a, gconstpointer b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Unmap requests collected into as few slave messages as possible */
+struct lo_dax_batch {
+	VhostUserFSSlaveMsg msg;
+	int n;
+	int err;	/* first failure, as a positive errno */
+};
+
+static void lo_dax_batch_flush(struct lo_data *lo, struct lo_dax_batch *b)
+{
+	if (!b->n)
+		return;
+
+	if (fuse_virtio_unmap(lo->se, &b->msg)) {
+		fprintf(stderr, "%s: unmap over virtio failed\n", __func__);
+		if (!b->err)
+			b->err = EIO;
+	}
+	lo->dax_slave_msgs++;
+	memset(&b->msg, 0, sizeof(b->msg));
+	b->n = 0;
+}
+
+static void lo_dax_batch_add(struct lo_data *lo, struct lo_dax_batch *b,
+			     uint64_t moffset, uint64_t len)
+{
+	if (b->n == VHOST_USER_FS_SLAVE_ENTRIES)
+		lo_dax_batch_flush(lo, b);
+
+	b->msg.c_offset[b->n] = moffset;
+	b->msg.len[b->n] = len;
+	b->n++;
+}
+
+/* Assumes lo->dax_lock is held */
+static void lo_dax_chunk_insert(struct lo_data *lo, struct lo_dax_chunk *c)
+{
+	g_tree_insert(lo->dax_chunks, &c->moffset, c);
+	lo->dax_mapped_bytes += c->len;
+}
+
+/* Assumes lo->dax_lock is held */
+static void lo_dax_chunk_free(struct lo_data *lo, struct lo_dax_chunk *c)
+{
+	g_tree_remove(lo->dax_chunks, &c->moffset);
+	lo->dax_mapped_bytes -= c->len;
+	unref_inode(lo, c->inode, 1);
+	free(c);
+}
+
+struct lo_dax_range {
+	uint64_t start;
+	uint64_t end;
+	GPtrArray *chunks;
+};
+
+static gboolean lo_dax_range_cb(gpointer key, gpointer value, gpointer data)
+{
+	struct lo_dax_chunk *c = value;
+	struct lo_dax_range *r = data;
+
+	if (c->moffset >= r->end)
+		return TRUE;
+	if (c->moffset + c->len > r->start)
+		g_ptr_array_add(r->chunks, c);
+	return FALSE;
+}
+
+/* Chunks overlapping [@start, @start + @len), in ascending order */
+static GPtrArray *lo_dax_overlapping(struct lo_data *lo, uint64_t start,
+				     uint64_t len)
+{
+	struct lo_dax_range r = {
+		.start = start,
+		.end = len > UINT64_MAX - start ? UINT64_MAX : start + len,
+		.chunks = g_ptr_array_new(),
+	};
+
+	g_tree_foreach(lo->dax_chunks, lo_dax_range_cb, &r);
+	return r.chunks;
+}
+
+/*
+ * Drop [@start, @start + @len) from the bookkeeping, trimming chunks that
+ * overlap it partially.  If @batch is given the range is unmapped too;
+ * otherwise the caller is about to map over it.  Assumes lo->dax_lock is
+ * held.
+ */
+static void lo_dax_forget_range(struct lo_data *lo, uint64_t start,
+				uint64_t len, struct lo_dax_batch *batch)
+{
+	GPtrArray *chunks = lo_dax_overlapping(lo, start, len);
+	uint64_t end = len > UINT64_MAX - start ? UINT64_MAX : start + len;
+	guint i;
+
+	for (i = 0; i < chunks->len; i++) {
+		struct lo_dax_chunk *c = g_ptr_array_index(chunks, i);
+		uint64_t cend = c->moffset + c->len;
+		struct lo_dax_chunk *tail = NULL;
+
+		if (cend > end) {
+			tail = malloc(sizeof(*tail));
+			if (tail) {
+				struct lo_inode_shard *shard;
+
+				*tail = *c;
+				tail->moffset = end;
+				tail->foffset += end - c->moffset;
+				tail->len = cend - end;
+				shard = lo_inode_shard(lo, &c->inode->key);
+				pthread_mutex_lock(&shard->mutex);
+				c->inode->refcount++;
+				pthread_mutex_unlock(&shard->mutex);
+			}
+		}
+
+		if (c->moffset < start) {
+			/* Keep the head */
+			lo->dax_mapped_bytes -= cend - start;
+			c->len = start - c->moffset;
+		} else {
+			lo_dax_chunk_free(lo, c);
+		}
+
+		if (tail)
+			lo_dax_chunk_insert(lo, tail);
+	}
+	g_ptr_array_free(chunks, TRUE);
+
+	if (batch)
+		lo_dax_batch_add(lo, batch, start, len);
+}
+
+static void lo_dax_print_stats(struct lo_data *lo)
+{
+	pthread_mutex_lock(&lo->dax_lock);
+	fprintf(stderr, "dax window: %" PRIu64 " bytes mapped in %d chunks; %"
+		PRIu64 " maps, %" PRIu64 " remap hits, %" PRIu64
+		" unmap messages\n",
+		lo->dax_mapped_bytes, g_tree_nnodes(lo->dax_chunks),
+		lo->dax_maps, lo->dax_hits, lo->dax_slave_msgs);
+	pthread_mutex_unlock(&lo->dax_lock);
+}
+
 static void lo_setupmapping(fuse_req_t req, fuse_ino_t ino, uint64_t foffset,
                             uint64_t len, uint64_t moffset, uint64_t flags,
                             struct fuse_file_info *fi)
 {
 	struct lo_data *lo = lo_data(req);
+	struct lo_inode *inode = lo_inode(req, ino);
+	struct lo_dax_chunk *c;
         int ret = 0, fd, res;
         VhostUserFSSlaveMsg msg = { 0 };
         uint64_t vhu_flags;
@@ -1886,12 +2916,29 @@ static void lo_setupmapping(fuse_req_t req, fuse_ino_t ino, uint64_t foffset,
 	msg.c_offset[0] = moffset;
 	msg.flags[0] = vhu_flags;
 
+	pthread_mutex_lock(&lo->dax_lock);
+
+	/* The guest already has this mapping, nothing to do */
+	c = g_tree_lookup(lo->dax_chunks, &moffset);
+	if (c && inode && c->inode == inode && c->len == len &&
+	    c->foffset == foffset && (c->flags & vhu_flags) == vhu_flags) {
+		lo->dax_hits++;
+		pthread_mutex_unlock(&lo->dax_lock);
+		fuse_reply_err(req, 0);
+		return;
+	}
+
+	/* Whatever is mapped there now gets replaced */
+	lo_dax_forget_range(lo, moffset, len, NULL);
+
 	if (fi)
 		fd = lo_fi_fd(req, fi);
 	else {
 		res = asprintf(&buf, "%i", lo_fd(req, ino));
-		if (res == -1)
-			return (void) fuse_reply_err(req, errno);
+		if (res == -1) {
+			ret = errno;
+			goto out;
+		}
 
 		/*
 		 * TODO: O_RDWR might not be allowed if file is read only or
@@ -1899,19 +2946,39 @@ static void lo_setupmapping(fuse_req_t req, fuse_ino_t ino, uint64_t foffset,
 		 */
 		fd = openat(lo->proc_self_fd, buf, O_RDWR);
 		free(buf);
-		if (fd == -1)
-			return (void) fuse_reply_err(req, errno);
-
+		if (fd == -1) {
+			ret = errno;
+			goto out;
+		}
 	}
 
         if (fuse_virtio_map(req, &msg, fd)) {
                 fprintf(stderr, "%s: map over virtio failed (ino=%" PRId64 "fd=%d moffset=0x%" PRIx64 ")\n",
                         __func__, ino, fi ? (int)fi->fh : lo_fd(req, ino), moffset);
                 ret = EINVAL;
-        }
+        } else if (inode) {
+		c = calloc(1, sizeof(*c));
+		if (c) {
+			struct lo_inode_shard *shard;
+
+			c->moffset = moffset;
+			c->len = len;
+			c->foffset = foffset;
+			c->flags = vhu_flags;
+			c->inode = inode;
+			shard = lo_inode_shard(lo, &inode->key);
+			pthread_mutex_lock(&shard->mutex);
+			inode->refcount++;
+			pthread_mutex_unlock(&shard->mutex);
+			lo_dax_chunk_insert(lo, c);
+		}
+	}
+	lo->dax_maps++;
 
 	if (!fi)
 		close(fd);
+out:
+	pthread_mutex_unlock(&lo->dax_lock);
 	fuse_reply_err(req, ret);
 }
 
@@ -1919,19 +2986,15 @@ static void lo_removemapping(fuse_req_t req, struct fuse_session *se,
                              fuse_ino_t ino, uint64_t moffset,
                              uint64_t len, struct fuse_file_info *fi)
 {
-        VhostUserFSSlaveMsg msg = { 0 };
-	int ret = 0;
+	struct lo_data *lo = lo_data(req);
+	struct lo_dax_batch batch = { 0 };
 
-	msg.len[0] = len;
-	msg.c_offset[0] = moffset;
-        if (fuse_virtio_unmap(se, &msg)) {
-                fprintf(stderr,
-                        "%s: unmap over virtio failed "
-                        "(offset=0x%lx, len=0x%lx)\n", __func__, moffset, len);
-                ret = EINVAL;
-        }
+	pthread_mutex_lock(&lo->dax_lock);
+	lo_dax_forget_range(lo, moffset, len, &batch);
+	lo_dax_batch_flush(lo, &batch);
+	pthread_mutex_unlock(&lo->dax_lock);
 
-	fuse_reply_err(req, ret);
+	fuse_reply_err(req, batch.err);
 }
 
 static void lo_destroy(void *userdata, struct fuse_session *se)
@@ -1947,6 +3010,12 @@ static void lo_destroy(void *userdata, struct fuse_session *se)
                         fprintf(stderr, "%s: unmap during destroy failed\n", __func__);
                 }
         }
+	lo_dax_print_stats(lo);
+	pthread_mutex_lock(&lo->dax_lock);
+	lo_dax_forget_range(lo, 0, UINT64_MAX, NULL);
+	pthread_mutex_unlock(&lo->dax_lock);
+	if (lo->attr_cache != ATTR_CACHE_NONE)
+		lo_attr_cache_print_stats(lo);
 	unref_all_inodes(lo);
 }
 
@@ -2111,6 +3180,16 @@ static void setup_mount_namespace(const char *source)
 static void setup_sandbox(struct lo_data *lo)
 {
 	setup_mount_namespace(lo->source);
+
+	/*
+	 * The attribute cache adds its inotify watches through relative
+	 * /proc/self/fd entries, see lo_attr_cache_watch().  Nothing else uses
+	 * relative paths, so the working directory can stay there.
+	 */
+	if (lo->attr_cache != ATTR_CACHE_NONE &&
+	    fchdir(lo->proc_self_fd) < 0) {
+		err(1, "fchdir(/proc/self/fd)");
+	}
 #ifdef CONFIG_SECCOMP
 	setup_seccomp();
 #endif
@@ -2135,6 +3214,41 @@ static void setup_root(struct lo_data *lo, struct lo_inode *root)
 	root->refcount = 2;
 }
 
+/*
+ * Must run before the sandbox is set up, and before any other thread is
+ * started so that they all inherit the blocked SIGUSR1.  The thread is
+ * started even without the attribute cache, for the DAX statistics.
+ */
+static void setup_attr_cache(struct lo_data *lo)
+{
+	pthread_t thread;
+	sigset_t mask;
+
+	lo->inotify_fd = -1;
+	if (lo->attr_cache != ATTR_CACHE_NONE) {
+		pthread_rwlock_init(&lo->attr_cache_lock, NULL);
+		lo->attr_cache_watches = g_hash_table_new(g_direct_hash,
+							  g_direct_equal);
+
+		lo->inotify_fd = inotify_init1(IN_CLOEXEC);
+		if (lo->inotify_fd == -1)
+			err(1, "inotify_init1");
+	}
+
+	/* SIGUSR1 prints the cache and DAX window statistics */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+		errx(1, "pthread_sigmask failed");
+	lo->attr_cache_sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (lo->attr_cache_sigfd == -1)
+		err(1, "signalfd");
+
+	if (pthread_create(&thread, NULL, lo_attr_cache_thread, lo) != 0)
+		errx(1, "failed to create attr cache thread");
+	pthread_detach(thread);
+}
+
 static void setup_proc_self_fd(struct lo_data *lo)
 {
 	lo->proc_self_fd = open("/proc/self/fd", O_PATH);
@@ -2200,17 +3314,22 @@ int main(int argc, char *argv[])
 	struct lo_data lo = { .debug = 0,
 	                      .writeback = 0,
 	                      .proc_self_fd = -1,
+	                      .readdirplus_threads = 0,
 	};
 	struct lo_map_elem *root_elem;
 	int ret = -1;
+	int i;
 
 	/* Don't mask creation mode, kernel already did that */
 	umask(0);
 
 	setup_nofile_rlimit();
 
-	pthread_mutex_init(&lo.mutex, NULL);
-	lo.inodes = g_hash_table_new(lo_key_hash, lo_key_equal);
+	for (i = 0; i < LO_INODE_SHARDS; i++) {
+		pthread_mutex_init(&lo.inode_shards[i].mutex, NULL);
+		lo.inode_shards[i].inodes = g_hash_table_new(lo_key_hash,
+							     lo_key_equal);
+	}
 	lo.root.fd = -1;
 	lo.root.fuse_ino = FUSE_ROOT_ID;
 	lo.cache = CACHE_AUTO;
@@ -2233,6 +3352,16 @@ int main(int argc, char *argv[])
 		printf("usage: %s [options]\n\n", argv[0]);
 		fuse_cmdline_help();
 		printf("    -o source=PATH             shared directory tree\n");
+		printf("    -o attr_cache=none|inotify\n"
+		       "                               cache attributes and dentries in the\n"
+		       "                               daemon, kept coherent with inotify\n"
+		       "                               (SIGUSR1 prints hit/miss counters);\n"
+		       "                               writes through a DAX mmap, or through\n"
+		       "                               hard links in unwatched directories,\n"
+		       "                               go unnoticed\n");
+		printf("    -o readdirplus_threads=NUM  threads looking up readdirplus\n"
+		       "                               entries in parallel (default: 0,\n"
+		       "                               look them up in the request thread)\n");
 		fuse_lowlevel_help();
 		ret = 0;
 		goto err_out1;
@@ -2278,9 +3407,23 @@ int main(int argc, char *argv[])
 		errx(1, "timeout is negative (%lf)", lo.timeout);
 	}
 
+	if (lo.readdirplus_threads < 0) {
+		errx(1, "readdirplus_threads is negative (%d)",
+		     lo.readdirplus_threads);
+	} else if (lo.readdirplus_threads > 0) {
+		lo.readdirplus_pool = g_thread_pool_new(lo_readdirplus_worker,
+							NULL,
+							lo.readdirplus_threads,
+							FALSE, NULL);
+	}
+
+	pthread_mutex_init(&lo.dax_lock, NULL);
+	lo.dax_chunks = g_tree_new(lo_dax_cmp);
+
 	se = fuse_session_new(&args, &lo_oper, sizeof(lo_oper), &lo);
 	if (se == NULL)
 	    goto err_out1;
+	lo.se = se;
 
 	if (fuse_set_signal_handlers(se) != 0)
 	    goto err_out2;
@@ -2293,6 +3436,8 @@ int main(int argc, char *argv[])
 	/* Must be after daemonize to get the right /proc/self/fd */
 	setup_proc_self_fd(&lo);
 
+	setup_attr_cache(&lo);
+
 	setup_sandbox(&lo);
 
 	setup_root(&lo, &lo.root);
@@ -24,6 +24,7 @@ static const int syscall_whitelist[] = {
 	SCMP_SYS(exit),
 	SCMP_SYS(exit_group),
 	SCMP_SYS(fallocate),
+	SCMP_SYS(fchdir),
 	SCMP_SYS(fchmodat),
 	SCMP_SYS(fchownat),
 	SCMP_SYS(fcntl),
@@ -42,6 +43,9 @@ static const int syscall_whitelist[] = {
 	SCMP_SYS(getdents64),
 	SCMP_SYS(getegid),
 	SCMP_SYS(geteuid),
+	SCMP_SYS(gettid),
+	SCMP_SYS(inotify_add_watch),
+	SCMP_SYS(inotify_rm_watch),
 	SCMP_SYS(linkat),
 	SCMP_SYS(lseek),
 	SCMP_SYS(madvise),
@@ -55,8 +59,10 @@ static const int syscall_whitelist[] = {
 	SCMP_SYS(open),
 	SCMP_SYS(openat),
 	SCMP_SYS(ppoll),
+	SCMP_SYS(prctl), /* glib thread pool names its threads */
 	SCMP_SYS(preadv),
 	SCMP_SYS(pwrite64),
+	SCMP_SYS(pwritev),
 	SCMP_SYS(read),
 	SCMP_SYS(readlinkat),
 	SCMP_SYS(recvmsg),
@@ -64,6 +70,8 @@ static const int syscall_whitelist[] = {
 	SCMP_SYS(renameat2),
 	SCMP_SYS(rt_sigaction),
 	SCMP_SYS(rt_sigreturn),
+	SCMP_SYS(sched_getattr),
+	SCMP_SYS(sched_setattr),
 	SCMP_SYS(sendmsg),
 	SCMP_SYS(setresgid),
 	SCMP_SYS(setresuid),
@@ -42,13 +42,26 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /* Per-virtqueue IOThreads from the iothread-vq-mapping property.  Only
+     * ioeventfd wakeups and virtqueue polling run in these threads.  The
+     * BlockBackend stays in ctx: popping, parsing and submitting requests
+     * happens with ctx acquired, and completions and guest notifications
+     * run in ctx, so all of it is serialized on ctx's lock.
+     */
+    IOThread **vq_iothreads;
+    AioContext **vq_ctx;            /* indexed by virtqueue */
+
+    /* Protected by ctx's lock */
+    bool quiesced;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
     if (s->batch_notifications) {
-        set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
+        /* Requests can fail in the IOThread of their virtqueue */
+        set_bit_atomic(virtio_get_queue_index(vq), s->batch_notify_vqs);
         qemu_bh_schedule(s->bh);
     } else {
         virtio_notify_irqfd(s->vdev, vq);
@@ -59,14 +72,11 @@ static void notify_guest_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
     unsigned nvqs = s->conf->num_queues;
-    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
-
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j];
+        unsigned long *word = &s->batch_notify_vqs[j / BITS_PER_LONG];
+        unsigned long bits = atomic_xchg(word, 0);
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -79,6 +89,50 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+static void virtio_blk_data_plane_free(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    for (i = 0; s->vq_iothreads && i < s->conf->num_iothread_vq_mapping; i++) {
+        if (s->vq_iothreads[i]) {
+            object_unref(OBJECT(s->vq_iothreads[i]));
+        }
+    }
+    g_free(s->vq_iothreads);
+    g_free(s->vq_ctx);
+    g_free(s);
+}
+
+/* Context: QEMU global mutex held */
+static bool virtio_blk_data_plane_map_vqs(VirtIOBlockDataPlane *s,
+                                          VirtIOBlkConf *conf, Error **errp)
+{
+    unsigned i;
+
+    s->vq_iothreads = g_new0(IOThread *, conf->num_iothread_vq_mapping);
+    for (i = 0; i < conf->num_iothread_vq_mapping; i++) {
+        const char *id = conf->iothread_vq_mapping[i];
+        IOThread *iothread = id ? iothread_by_id(id) : NULL;
+
+        if (!iothread) {
+            error_setg(errp, "iothread-vq-mapping[%u]: IOThread '%s' not found",
+                       i, id ? id : "");
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+        s->vq_iothreads[i] = iothread;
+    }
+
+    /* Queue N is processed by the (N % num_iothread_vq_mapping)-th IOThread */
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        IOThread *iothread = s->vq_iothreads[i % conf->num_iothread_vq_mapping];
+
+        s->vq_ctx[i] = iothread_get_aio_context(iothread);
+    }
+    return true;
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -90,7 +144,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread || conf->num_iothread_vq_mapping) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -119,8 +173,19 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
+    if (conf->num_iothread_vq_mapping &&
+        !virtio_blk_data_plane_map_vqs(s, conf, errp)) {
+        virtio_blk_data_plane_free(s);
+        return false;
+    }
+
+    /* The BlockBackend lives in the first mapped IOThread by default */
     if (conf->iothread) {
         s->iothread = conf->iothread;
+    } else if (conf->num_iothread_vq_mapping) {
+        s->iothread = s->vq_iothreads[0];
+    }
+    if (s->iothread) {
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
     } else {
@@ -150,18 +215,39 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
-    g_free(s);
+    virtio_blk_data_plane_free(s);
+}
+
+static AioContext *virtio_blk_data_plane_vq_ctx(VirtIOBlockDataPlane *s,
+                                                 unsigned i)
+{
+    return s->vq_ctx ? s->vq_ctx[i] : s->ctx;
 }
 
 static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
     VirtIOBlock *s = (VirtIOBlock *)vdev;
+    VirtIOBlockDataPlane *dp = s->dataplane;
+    bool progress = false;
 
-    assert(s->dataplane);
+    assert(dp);
     assert(s->dataplane_started);
 
-    return virtio_blk_handle_vq(s, vq);
+    /* The block layer cannot run requests of one BlockBackend in several
+     * AioContexts, so virtqueues in other IOThreads take the BlockBackend's
+     * AioContext lock and contend with each other for it.
+     *
+     * They are not stopped by draining the BlockBackend either, so check
+     * for quiescence under that lock.  virtio_blk_data_plane_drained_end()
+     * kicks the skipped virtqueues.
+     */
+    aio_context_acquire(dp->ctx);
+    if (!dp->quiesced) {
+        progress = virtio_blk_handle_vq(s, vq);
+    }
+    aio_context_release(dp->ctx);
+    return progress;
 }
 
 /* Context: QEMU global mutex held */
@@ -222,14 +308,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *vq_ctx = virtio_blk_data_plane_vq_ctx(s, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(vq_ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, vq_ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(vq_ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -246,12 +333,74 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    unsigned i;
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+        if (virtio_blk_data_plane_vq_ctx(s, i) == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_blk_data_plane_stop_vqs(VirtIOBlockDataPlane *s)
+{
+    unsigned i, j;
+
+    if (!s->vq_iothreads) {
+        aio_context_acquire(s->ctx);
+        aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(s->ctx);
+        return;
+    }
+
+    for (i = 0; i < s->conf->num_iothread_vq_mapping; i++) {
+        AioContext *ctx = iothread_get_aio_context(s->vq_iothreads[i]);
+
+        /* The same IOThread may appear several times in the mapping */
+        for (j = 0; j < i; j++) {
+            if (s->vq_iothreads[j] == s->vq_iothreads[i]) {
+                break;
+            }
+        }
+        if (j < i) {
+            continue;
+        }
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(ctx);
+    }
+}
+
+/* Context: QEMU global mutex held, BlockBackend's AioContext acquired */
+void virtio_blk_data_plane_drained_begin(VirtIOBlockDataPlane *s)
+{
+    s->quiesced = true;
+}
+
+/* Context: QEMU global mutex held, BlockBackend's AioContext acquired */
+void virtio_blk_data_plane_drained_end(VirtIOBlockDataPlane *s)
+{
+    VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
     unsigned i;
 
+    s->quiesced = false;
+
+    if (!vblk->dataplane_started || vblk->dataplane_disabled || !s->vq_ctx) {
+        return;
+    }
+
+    /* Process requests that arrived while the BlockBackend was drained */
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_ctx[i] != s->ctx) {
+            event_notifier_set(virtio_queue_get_host_notifier(vq));
+        }
     }
 }
 
@@ -278,8 +427,9 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    virtio_blk_data_plane_stop_vqs(s);
+
     aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
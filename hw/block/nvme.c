@@ -19,10 +19,16 @@
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>, \
  *              cmb_size_mb=<cmb_size_mb[optional]>, \
- *              num_queues=<N[optional]>
+ *              num_queues=<N[optional]>, \
+ *              iothread=<iothread_id[optional]>
  *
  * Note cmb_size_mb denotes size of CMB in MB. CMB is assumed to be at
  * offset 0 in BAR2 and supports only WDS, RDS and SQS for now.
+ *
+ * With iothread set, I/O queues are processed in that IOThread instead of
+ * the main loop. Once the guest configures shadow doorbells through the
+ * Doorbell Buffer Config command, their doorbells are also bound to
+ * ioeventfds so that doorbell writes no longer trap into QEMU.
  */
 
 #include "qemu/osdep.h"
@@ -35,8 +41,10 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "block/aio-wait.h"
 
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/cutils.h"
 #include "trace.h"
 #include "nvme.h"
@@ -94,6 +102,54 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (unlikely(v >= sq->size)) {
+        NVME_GUEST_ERR(nvme_ub_db_wr_invalid_sqtail,
+                       "shadow submission queue doorbell value"
+                       " beyond queue size, sqid=%"PRIu32","
+                       " new_tail=%"PRIu32", ignoring",
+                       (uint32_t)sq->sqid, v);
+        return;
+    }
+    sq->tail = v;
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (unlikely(v >= cq->size)) {
+        NVME_GUEST_ERR(nvme_ub_db_wr_invalid_cqhead,
+                       "shadow completion queue doorbell value"
+                       " beyond queue size, cqid=%"PRIu32","
+                       " new_head=%"PRIu32", ignoring",
+                       (uint32_t)cq->cqid, v);
+        return;
+    }
+    cq->head = v;
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
 static void nvme_irq_check(NvmeCtrl *n)
 {
     if (msix_enabled(&(n->parent_obj))) {
@@ -136,6 +192,37 @@ static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+/*
+ * Completion queues processed in an IOThread cannot touch the interrupt
+ * state, which is protected by the BQL.  They kick cq->irq_notifier instead
+ * and the main loop raises or lowers the interrupt from the queue state.
+ */
+static bool nvme_cq_in_iothread(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    return n->iothread && cq->cqid;
+}
+
+static void nvme_cq_irq_notifier_read(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, irq_notifier);
+    NvmeCtrl *n = cq->ctrl;
+    bool pending;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    aio_context_acquire(n->ctx);
+    pending = cq->tail != cq->head;
+    aio_context_release(n->ctx);
+
+    if (pending) {
+        nvme_irq_assert(n, cq);
+    } else {
+        nvme_irq_deassert(n, cq);
+    }
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, QEMUIOVector *iov, uint64_t prp1,
                              uint64_t prp2, uint32_t len, NvmeCtrl *n)
 {
@@ -253,6 +340,11 @@ static void nvme_post_cqes(void *opaque)
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
 
+    if (cq->db_addr) {
+        nvme_update_cq_eventidx(cq);
+        nvme_update_cq_head(cq);
+    }
+
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
@@ -272,7 +364,9 @@ static void nvme_post_cqes(void *opaque)
             sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
-    if (cq->tail != cq->head) {
+    if (nvme_cq_in_iothread(n, cq)) {
+        event_notifier_set(&cq->irq_notifier);
+    } else if (cq->tail != cq->head) {
         nvme_irq_assert(n, cq);
     }
 }
@@ -414,33 +508,183 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+/*
+ * With an IOThread, I/O queues are processed in n->ctx.  Run @cb there so
+ * that it cannot race with their timers, notifiers and request completions.
+ */
+static void nvme_run_in_ctx(NvmeCtrl *n, uint16_t qid, QEMUBHFunc *cb,
+    void *opaque)
+{
+    if (n->iothread && qid) {
+        aio_context_acquire(n->ctx);
+        aio_wait_bh_oneshot(n->ctx, cb, opaque);
+        aio_context_release(n->ctx);
+    } else {
+        cb(opaque);
+    }
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+    AioContext *ctx = sq->ctrl->ctx;
+
+    if (event_notifier_test_and_clear(e)) {
+        aio_context_acquire(ctx);
+        nvme_process_sq(sq);
+        aio_context_release(ctx);
+    }
+}
+
+static void nvme_cq_notifier(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+    AioContext *ctx = cq->ctrl->ctx;
+    NvmeSQueue *sq;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    aio_context_acquire(ctx);
+    if (nvme_cq_full(cq)) {
+        QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+            timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        }
+    }
+    nvme_post_cqes(cq);
+    aio_context_release(ctx);
+}
+
+static void nvme_sq_timer(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    AioContext *ctx = sq->ctrl->ctx;
+
+    aio_context_acquire(ctx);
+    nvme_process_sq(sq);
+    aio_context_release(ctx);
+}
+
+static void nvme_cq_timer(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    AioContext *ctx = cq->ctrl->ctx;
+
+    aio_context_acquire(ctx);
+    nvme_post_cqes(cq);
+    aio_context_release(ctx);
+}
+
+static void nvme_init_ioeventfd(NvmeCtrl *n, EventNotifier *e, hwaddr addr,
+    EventNotifierHandler *handler)
+{
+    memory_region_add_eventfd(&n->iomem, addr, 4, false, 0, e);
+    aio_set_event_notifier(n->ctx, e, true, handler, NULL);
+}
+
+static void nvme_init_sq_dbbuf(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    pci_dma_write(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+    nvme_update_sq_eventidx(sq);
+
+    /* Doorbell writes no longer carry the tail, it comes from the shadow */
+    if (n->iothread && !sq->ioeventfd_enabled &&
+        event_notifier_init(&sq->notifier, 0) == 0) {
+        nvme_init_ioeventfd(n, &sq->notifier, 0x1000 + (sq->sqid << 3),
+                            nvme_sq_notifier);
+        sq->ioeventfd_enabled = true;
+    }
+}
+
+static void nvme_init_cq_dbbuf(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+    uint32_t v = cpu_to_le32(cq->head);
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    pci_dma_write(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+    nvme_update_cq_eventidx(cq);
+
+    if (n->iothread && !cq->ioeventfd_enabled &&
+        event_notifier_init(&cq->notifier, 0) == 0) {
+        nvme_init_ioeventfd(n, &cq->notifier,
+                            0x1000 + (cq->cqid << 3) + (1 << 2),
+                            nvme_cq_notifier);
+        cq->ioeventfd_enabled = true;
+    }
+}
+
+static void nvme_stop_sq(NvmeSQueue *sq)
+{
+    timer_del(sq->timer);
+    if (sq->ioeventfd_enabled) {
+        aio_set_event_notifier(sq->ctrl->ctx, &sq->notifier, true,
+                               NULL, NULL);
+    }
+}
+
+static void nvme_stop_sq_bh(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    AioContext *ctx = sq->ctrl->ctx;
+
+    aio_context_acquire(ctx);
+    nvme_stop_sq(sq);
+    aio_context_release(ctx);
+}
+
+static void nvme_stop_cq(NvmeCQueue *cq)
+{
+    timer_del(cq->timer);
+    if (cq->ioeventfd_enabled) {
+        aio_set_event_notifier(cq->ctrl->ctx, &cq->notifier, true,
+                               NULL, NULL);
+    }
+}
+
+static void nvme_stop_cq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    AioContext *ctx = cq->ctrl->ctx;
+
+    aio_context_acquire(ctx);
+    nvme_stop_cq(cq);
+    aio_context_release(ctx);
+}
+
+/* The queue must have been stopped with nvme_stop_sq() */
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
     timer_del(sq->timer);
     timer_free(sq->timer);
+    if (sq->ioeventfd_enabled) {
+        memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                                  false, 0, &sq->notifier);
+        event_notifier_cleanup(&sq->notifier);
+    }
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
     }
 }
 
-static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
+static void nvme_del_sq_bh(void *opaque)
 {
-    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
     NvmeRequest *req, *next;
-    NvmeSQueue *sq;
     NvmeCQueue *cq;
-    uint16_t qid = le16_to_cpu(c->qid);
-
-    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
-        trace_nvme_err_invalid_del_sq(qid);
-        return NVME_INVALID_QID | NVME_DNR;
-    }
-
-    trace_nvme_del_sq(qid);
 
-    sq = n->sq[qid];
+    aio_context_acquire(n->ctx);
+    nvme_stop_sq(sq);
     while (!QTAILQ_EMPTY(&sq->out_req_list)) {
         req = QTAILQ_FIRST(&sq->out_req_list);
         assert(req->aiocb);
@@ -458,7 +702,24 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
             }
         }
     }
+    aio_context_release(n->ctx);
+}
 
+static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
+    NvmeSQueue *sq;
+    uint16_t qid = le16_to_cpu(c->qid);
+
+    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
+        trace_nvme_err_invalid_del_sq(qid);
+        return NVME_INVALID_QID | NVME_DNR;
+    }
+
+    trace_nvme_del_sq(qid);
+
+    sq = n->sq[qid];
+    nvme_run_in_ctx(n, qid, nvme_del_sq_bh, sq);
     nvme_free_sq(sq, n);
     return NVME_SUCCESS;
 }
@@ -475,6 +736,8 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
+    sq->ioeventfd_enabled = false;
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -483,12 +746,23 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    if (n->iothread && sqid) {
+        sq->timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                  nvme_sq_timer, sq);
+    } else {
+        sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
+    aio_context_acquire(n->ctx);
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+    /* The admin queue keeps using its MMIO doorbell */
+    if (n->dbbuf_enabled && sqid) {
+        nvme_init_sq_dbbuf(sq);
+    }
+    aio_context_release(n->ctx);
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -529,11 +803,22 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
+/* The queue must have been stopped with nvme_stop_cq() */
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
     timer_del(cq->timer);
     timer_free(cq->timer);
+    if (cq->ioeventfd_enabled) {
+        memory_region_del_eventfd(&n->iomem,
+                                  0x1000 + (cq->cqid << 3) + (1 << 2), 4,
+                                  false, 0, &cq->notifier);
+        event_notifier_cleanup(&cq->notifier);
+    }
+    if (nvme_cq_in_iothread(n, cq)) {
+        event_notifier_set_handler(&cq->irq_notifier, NULL);
+        event_notifier_cleanup(&cq->irq_notifier);
+    }
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -558,17 +843,29 @@ static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeCmd *cmd)
     }
     nvme_irq_deassert(n, cq);
     trace_nvme_del_cq(qid);
+    nvme_run_in_ctx(n, qid, nvme_stop_cq_bh, cq);
     nvme_free_cq(cq, n);
     return NVME_SUCCESS;
 }
 
-static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
+static int nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     uint16_t cqid, uint16_t vector, uint16_t size, uint16_t irq_enabled)
 {
     cq->ctrl = n;
     cq->cqid = cqid;
+    if (nvme_cq_in_iothread(n, cq)) {
+        int ret = event_notifier_init(&cq->irq_notifier, 0);
+
+        if (ret < 0) {
+            return ret;
+        }
+        event_notifier_set_handler(&cq->irq_notifier,
+                                   nvme_cq_irq_notifier_read);
+    }
     cq->size = size;
     cq->dma_addr = dma_addr;
+    cq->db_addr = cq->ei_addr = 0;
+    cq->ioeventfd_enabled = false;
     cq->phase = 1;
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
@@ -576,8 +873,19 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
+    if (nvme_cq_in_iothread(n, cq)) {
+        cq->timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                  nvme_cq_timer, cq);
+    } else {
+        cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    }
+    aio_context_acquire(n->ctx);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    if (n->dbbuf_enabled && cqid) {
+        nvme_init_cq_dbbuf(cq);
+    }
+    aio_context_release(n->ctx);
+    return 0;
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -615,8 +923,44 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     }
 
     cq = g_malloc0(sizeof(*cq));
-    nvme_init_cq(cq, n, prp1, cqid, vector, qsize + 1,
-        NVME_CQ_FLAGS_IEN(qflags));
+    if (nvme_init_cq(cq, n, prp1, cqid, vector, qsize + 1,
+                     NVME_CQ_FLAGS_IEN(qflags)) < 0) {
+        g_free(cq);
+        return NVME_INTERNAL_DEV_ERROR;
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    trace_nvme_dbbuf_config(dbs_addr, eis_addr);
+
+    if (unlikely(!dbs_addr || dbs_addr & (n->page_size - 1) ||
+                 !eis_addr || eis_addr & (n->page_size - 1))) {
+        trace_nvme_err_invalid_dbbuf_config(dbs_addr, eis_addr);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    aio_context_acquire(n->ctx);
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* Shadow doorbells only cover the I/O queues, as in the Linux driver */
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n->cq[i]);
+        }
+    }
+    aio_context_release(n->ctx);
+
     return NVME_SUCCESS;
 }
 
@@ -759,6 +1103,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         trace_nvme_err_invalid_admin_opc(cmd->opcode);
         return NVME_INVALID_OPCODE | NVME_DNR;
@@ -776,6 +1122,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
@@ -793,6 +1143,15 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        /*
+         * Publish how far we got, then look for entries the guest queued
+         * meanwhile without ringing the doorbell.
+         */
+        if (sq->db_addr) {
+            nvme_update_sq_eventidx(sq);
+            nvme_update_sq_tail(sq);
+        }
     }
 }
 
@@ -800,7 +1159,25 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
 
+    /*
+     * Stop submitting before the drain, but keep the completion queues
+     * running until the drained requests have been completed into them.
+     */
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->sq[i] != NULL) {
+            nvme_run_in_ctx(n, i, nvme_stop_sq_bh, n->sq[i]);
+        }
+    }
+
+    aio_context_acquire(n->ctx);
     blk_drain(n->conf.blk);
+    aio_context_release(n->ctx);
+
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->cq[i] != NULL) {
+            nvme_run_in_ctx(n, i, nvme_stop_cq_bh, n->cq[i]);
+        }
+    }
 
     for (i = 0; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
@@ -813,8 +1190,12 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
         }
     }
 
+    aio_context_acquire(n->ctx);
     blk_flush(n->conf.blk);
+    aio_context_release(n->ctx);
     n->bar.cc = 0;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    n->dbbuf_enabled = false;
 }
 
 static int nvme_start_ctrl(NvmeCtrl *n)
@@ -1162,7 +1543,9 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
+        aio_context_acquire(n->ctx);
         nvme_process_db(n, addr, data);
+        aio_context_release(n->ctx);
     }
 }
 
@@ -1264,7 +1647,7 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -1328,6 +1711,15 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
             cpu_to_le64(n->ns_size >>
                 id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
     }
+
+    if (n->iothread) {
+        n->ctx = iothread_get_aio_context(n->iothread);
+        aio_context_acquire(n->ctx);
+        blk_set_aio_context(n->conf.blk, n->ctx);
+        aio_context_release(n->ctx);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
 }
 
 static void nvme_exit(PCIDevice *pci_dev)
@@ -1335,6 +1727,11 @@ static void nvme_exit(PCIDevice *pci_dev)
     NvmeCtrl *n = NVME(pci_dev);
 
     nvme_clear_ctrl(n);
+    if (n->iothread) {
+        aio_context_acquire(n->ctx);
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+        aio_context_release(n->ctx);
+    }
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -1350,6 +1747,8 @@ static Property nvme_props[] = {
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
     DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
     DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_LINK("iothread", NvmeCtrl, iothread, TYPE_IOTHREAD,
+                     IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -118,6 +118,7 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
         VirtIOBlockReq *req = next;
         next = req->mr_next;
         trace_virtio_blk_rw_complete(vdev, req, ret);
+        s->merge_inflight--;
 
         if (req->qiov.nalloc != -1) {
             /* If nalloc is != -1 req->qiov is a local copy of the original
@@ -383,6 +384,8 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
     int64_t sector_num = mrb->reqs[start]->sector_num;
     bool is_write = mrb->is_write;
 
+    mrb->reqs[start]->dev->merge_inflight += num_reqs;
+
     if (num_reqs > 1) {
         int i;
         struct iovec *tmp_iov = qiov->iov;
@@ -439,16 +442,18 @@ static int multireq_compare(const void *a, const void *b)
     }
 }
 
-static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
+/* Returns the number of requests submitted to @blk */
+static int virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
 {
     int i = 0, start = 0, num_reqs = 0, niov = 0, nb_sectors = 0;
+    int submitted = 0;
     uint32_t max_transfer;
     int64_t sector_num = 0;
 
     if (mrb->num_reqs == 1) {
         submit_requests(blk, mrb, 0, 1, -1);
         mrb->num_reqs = 0;
-        return;
+        return 1;
     }
 
     max_transfer = blk_get_max_transfer(mrb->reqs[0]->dev->blk);
@@ -471,6 +476,7 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
                 nb_sectors > (max_transfer -
                               req->qiov.size) / BDRV_SECTOR_SIZE) {
                 submit_requests(blk, mrb, start, num_reqs, niov);
+                submitted++;
                 num_reqs = 0;
             }
         }
@@ -488,6 +494,133 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
 
     submit_requests(blk, mrb, start, num_reqs, niov);
     mrb->num_reqs = 0;
+    return submitted + 1;
+}
+
+/*
+ * Merge window
+ *
+ * Guests that keep a few sequential requests in flight often kick the
+ * virtqueue once per request, so virtio_blk_handle_vq() never sees two of
+ * them in the same batch.  With the merge-window-us property set, read/write
+ * requests stay in s->merge_mrb for a short while so that requests from
+ * later kicks can be merged with them.  The buffer is flushed when it fills
+ * up, when the I/O direction changes, before flushes and drains, and when
+ * the window expires.
+ *
+ * The window scales with the measured queue depth: when nothing else is in
+ * flight the guest is probably waiting for these requests, and holding them
+ * would only add latency.  Windows that do not lead to merges shrink the
+ * score and holding stops; it is probed again every
+ * VIRTIO_BLK_MERGE_PROBE_INTERVAL batches.
+ */
+
+#define VIRTIO_BLK_MERGE_WINDOW_MAX_US  1000
+#define VIRTIO_BLK_MERGE_QD_FULL        8 /* queue depth for a full window */
+#define VIRTIO_BLK_MERGE_SCORE_MAX      4
+#define VIRTIO_BLK_MERGE_PROBE_INTERVAL 64
+
+static void virtio_blk_merge_window_flush(VirtIOBlock *s)
+{
+    unsigned num_reqs = s->merge_mrb.num_reqs;
+    int submitted;
+
+    timer_del(s->merge_timer);
+    if (!num_reqs) {
+        return;
+    }
+
+    submitted = virtio_blk_submit_multireq(s->blk, &s->merge_mrb);
+    if (submitted < num_reqs) {
+        s->merge_score = MIN(s->merge_score + 1, VIRTIO_BLK_MERGE_SCORE_MAX);
+    } else if (s->merge_score) {
+        s->merge_score--;
+    }
+    trace_virtio_blk_merge_window_flush(VIRTIO_DEVICE(s), num_reqs,
+                                        submitted, s->merge_score);
+}
+
+/*
+ * Called on every kick, including those whose requests are only added to a
+ * window that is already open, so that the average follows the queue depth
+ * the guest actually keeps.
+ */
+static void virtio_blk_merge_sample_qd(VirtIOBlock *s)
+{
+    s->merge_qd_avg += s->merge_inflight * 2 - s->merge_qd_avg / 8;
+}
+
+/* How long requests may stay in s->merge_mrb, 0 to submit them now */
+static int64_t virtio_blk_merge_window_ns(VirtIOBlock *s)
+{
+    unsigned qd16;
+
+    if (!s->merge_inflight) {
+        return 0;
+    }
+
+    if (!s->merge_score) {
+        if (++s->merge_probe < VIRTIO_BLK_MERGE_PROBE_INTERVAL) {
+            return 0;
+        }
+        s->merge_probe = 0;
+    }
+
+    qd16 = MIN(s->merge_qd_avg, VIRTIO_BLK_MERGE_QD_FULL * 16);
+    return (int64_t)s->conf.merge_window_us * SCALE_US * qd16 /
+           (VIRTIO_BLK_MERGE_QD_FULL * 16);
+}
+
+/* Called at the end of a virtqueue batch with s->merge_mrb not empty */
+static void virtio_blk_merge_window_update(VirtIOBlock *s)
+{
+    int64_t window_ns;
+
+    if (timer_pending(s->merge_timer)) {
+        return;
+    }
+
+    window_ns = virtio_blk_merge_window_ns(s);
+    if (!window_ns) {
+        virtio_blk_merge_window_flush(s);
+        return;
+    }
+
+    trace_virtio_blk_merge_window_hold(VIRTIO_DEVICE(s),
+                                       s->merge_mrb.num_reqs, window_ns);
+    timer_mod(s->merge_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + window_ns);
+}
+
+static void virtio_blk_merge_timer_cb(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    aio_context_acquire(ctx);
+    blk_io_plug(s->blk);
+    virtio_blk_merge_window_flush(s);
+    blk_io_unplug(s->blk);
+    aio_context_release(ctx);
+}
+
+static void virtio_blk_merge_attach_aio_context(AioContext *ctx, void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    s->merge_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                   virtio_blk_merge_timer_cb, s);
+}
+
+static void virtio_blk_merge_detach_aio_context(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    /* Draining the BlockBackend has already flushed the buffer */
+    assert(!s->merge_mrb.num_reqs);
+    timer_del(s->merge_timer);
+    timer_free(s->merge_timer);
+    s->merge_timer = NULL;
 }
 
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
@@ -758,18 +891,23 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    MultiReqBuffer local_mrb = {};
+    MultiReqBuffer *mrb = s->conf.merge_window_us ? &s->merge_mrb : &local_mrb;
     bool progress = false;
 
     aio_context_acquire(blk_get_aio_context(s->blk));
     blk_io_plug(s->blk);
 
+    if (mrb == &s->merge_mrb) {
+        virtio_blk_merge_sample_qd(s);
+    }
+
     do {
         virtio_queue_set_notification(vq, 0);
 
         while ((req = virtio_blk_get_request(s, vq))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
+            if (virtio_blk_handle_request(req, mrb)) {
                 virtqueue_detach_element(req->vq, &req->elem, 0);
                 virtio_blk_free_request(req);
                 break;
@@ -779,8 +917,12 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         virtio_queue_set_notification(vq, 1);
     } while (!virtio_queue_empty(vq));
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
+    if (mrb->num_reqs) {
+        if (mrb == &s->merge_mrb) {
+            virtio_blk_merge_window_update(s);
+        } else {
+            virtio_blk_submit_multireq(s->blk, mrb);
+        }
     }
 
     blk_io_unplug(s->blk);
@@ -1047,7 +1189,7 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -1089,8 +1231,33 @@ static void virtio_blk_resize(void *opaque)
     virtio_notify_config(vdev);
 }
 
+static void virtio_blk_drained_begin(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    /* Held requests are not in flight, so draining would not wait for them */
+    if (s->conf.merge_window_us) {
+        virtio_blk_merge_window_flush(s);
+    }
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_drained_begin(s->dataplane);
+    }
+}
+
+static void virtio_blk_drained_end(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_drained_end(s->dataplane);
+    }
+}
+
 static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
+    .drained_begin = virtio_blk_drained_begin,
+    .drained_end = virtio_blk_drained_end,
 };
 
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
@@ -1149,6 +1316,13 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (conf->merge_window_us > VIRTIO_BLK_MERGE_WINDOW_MAX_US) {
+        error_setg(errp, "invalid merge-window-us property (%" PRIu32 "), "
+                   "must be at most %d", conf->merge_window_us,
+                   VIRTIO_BLK_MERGE_WINDOW_MAX_US);
+        return;
+    }
+
     if (virtio_has_feature(s->host_features, VIRTIO_BLK_F_WRITE_ZEROES) &&
         (!conf->max_write_zeroes_sectors ||
          conf->max_write_zeroes_sectors > BDRV_REQUEST_MAX_SECTORS)) {
@@ -1181,6 +1355,13 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     blk_set_dev_ops(s->blk, &virtio_block_ops, s);
     blk_set_guest_block_size(s->blk, s->conf.conf.logical_block_size);
 
+    if (conf->merge_window_us) {
+        virtio_blk_merge_attach_aio_context(blk_get_aio_context(s->blk), s);
+        blk_add_aio_context_notifier(s->blk,
+                                     virtio_blk_merge_attach_aio_context,
+                                     virtio_blk_merge_detach_aio_context, s);
+    }
+
     blk_iostatus_enable(s->blk);
 }
 
@@ -1189,6 +1370,20 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
 
+    if (s->conf.merge_window_us) {
+        AioContext *ctx = blk_get_aio_context(s->blk);
+
+        /* Flush held requests */
+        aio_context_acquire(ctx);
+        blk_drain(s->blk);
+        aio_context_release(ctx);
+
+        blk_remove_aio_context_notifier(s->blk,
+                                        virtio_blk_merge_attach_aio_context,
+                                        virtio_blk_merge_detach_aio_context,
+                                        s);
+        virtio_blk_merge_detach_aio_context(s);
+    }
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
@@ -1230,8 +1425,13 @@ static Property virtio_blk_properties[] = {
                     true),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 128),
+    DEFINE_PROP_UINT32("merge-window-us", VirtIOBlock, conf.merge_window_us,
+                       0),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_ARRAY("iothread-vq-mapping", VirtIOBlock,
+                      conf.num_iothread_vq_mapping, conf.iothread_vq_mapping,
+                      qdev_prop_string, char *),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
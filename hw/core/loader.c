@@ -1083,6 +1083,26 @@ int rom_add_option(const char *file, int32_t bootindex)
     return rom_add_file(file, "genroms", 0, bootindex, true, NULL, NULL);
 }
 
+/* Whether @rom is loaded into RAM mapped from a template, see x-template */
+static bool rom_in_template(Rom *rom)
+{
+    MemoryRegionSection section;
+    bool template;
+
+    if (rom->mr) {
+        return rom->mr->ram_block && qemu_ram_is_template(rom->mr->ram_block);
+    }
+
+    section = memory_region_find(rom->as->root, rom->addr, rom->datasize);
+    if (!section.mr) {
+        return false;
+    }
+    template = section.mr->ram_block &&
+               qemu_ram_is_template(section.mr->ram_block);
+    memory_region_unref(section.mr);
+    return template;
+}
+
 static void rom_reset(void *unused)
 {
     Rom *rom;
@@ -1091,6 +1111,23 @@ static void rom_reset(void *unused)
         if (rom->fw_file) {
             continue;
         }
+        /*
+         * A clone started from a template gets this RAM from the template
+         * file, which already holds the ROM data as the template guest
+         * left it.  Writing it would only break the sharing of the page,
+         * and overwrite what the guest may have changed.
+         */
+        if (runstate_check(RUN_STATE_INMIGRATE) && rom_in_template(rom)) {
+            if (rom->data && rom->isrom) {
+                /*
+                 * Free it so that a rom_reset after migration doesn't
+                 * overwrite a potentially modified 'rom'.
+                 */
+                g_free(rom->data);
+                rom->data = NULL;
+            }
+            continue;
+        }
         if (rom->data == NULL) {
             continue;
         }
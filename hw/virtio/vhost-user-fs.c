@@ -18,9 +18,27 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 #include "qemu/error-report.h"
+#include "qemu/bitmap.h"
 #include "hw/virtio/vhost-user-fs.h"
 #include "monitor/monitor.h"
 
+/* Account pages of the cache that became mapped (@map) or unmapped */
+static void vuf_cache_account(VHostUserFS *fs, uint64_t offset, uint64_t len,
+                              bool map)
+{
+    long first = offset / qemu_real_host_page_size;
+    long npages = DIV_ROUND_UP(offset + len, qemu_real_host_page_size) - first;
+    long mapped = bitmap_count_one_with_offset(fs->cache_map, first, npages);
+
+    if (map) {
+        bitmap_set(fs->cache_map, first, npages);
+        fs->cache_used += (uint64_t)(npages - mapped) * qemu_real_host_page_size;
+    } else {
+        bitmap_clear(fs->cache_map, first, npages);
+        fs->cache_used -= (uint64_t)mapped * qemu_real_host_page_size;
+    }
+}
+
 int vhost_user_fs_slave_map(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm,
                             int fd)
 {
@@ -67,8 +85,10 @@ int vhost_user_fs_slave_map(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm,
             res = -1;
             break;
         }
+        vuf_cache_account(fs, sm->c_offset[i], sm->len[i], true);
     }
 
+    fs->cache_map_requests++;
     if (res) {
         /* Something went wrong, unmap them all */
         vhost_user_fs_slave_unmap(dev, sm);
@@ -123,9 +143,12 @@ int vhost_user_fs_slave_unmap(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm)
                             i, sm->c_offset[i], sm->len[i],
                             sm->fd_offset[i], ptr);
             res = -1;
+            continue;
         }
+        vuf_cache_account(fs, sm->c_offset[i], sm->len[i], false);
     }
 
+    fs->cache_unmap_requests++;
     return res;
 }
 
@@ -359,6 +382,8 @@ static void vuf_device_realize(DeviceState *dev, Error **errp)
      */
     mprotect(memory_region_get_ram_ptr(&fs->cache), fs->conf.cache_size,
              PROT_NONE);
+    fs->cache_map = bitmap_new(fs->conf.cache_size / qemu_real_host_page_size);
+    fs->cache_used = 0;
 
     if (!vhost_user_init(&fs->vhost_user, &fs->conf.chardev, errp)) {
         return;
@@ -394,6 +419,8 @@ err_virtio:
     vhost_user_cleanup(&fs->vhost_user);
     virtio_cleanup(vdev);
     g_free(fs->vhost_dev.vqs);
+    g_free(fs->cache_map);
+    fs->cache_map = NULL;
     return;
 }
 
@@ -412,6 +439,21 @@ static void vuf_device_unrealize(DeviceState *dev, Error **errp)
     virtio_cleanup(vdev);
     g_free(fs->vhost_dev.vqs);
     fs->vhost_dev.vqs = NULL;
+    g_free(fs->cache_map);
+    fs->cache_map = NULL;
+}
+
+static void vuf_instance_init(Object *obj)
+{
+    VHostUserFS *fs = VHOST_USER_FS(obj);
+
+    /* DAX window utilization, in bytes, and slave request counters */
+    object_property_add_uint64_ptr(obj, "cache-used", &fs->cache_used,
+                                   &error_abort);
+    object_property_add_uint64_ptr(obj, "cache-map-requests",
+                                   &fs->cache_map_requests, &error_abort);
+    object_property_add_uint64_ptr(obj, "cache-unmap-requests",
+                                   &fs->cache_unmap_requests, &error_abort);
 }
 
 static Property vuf_properties[] = {
@@ -444,6 +486,7 @@ static const TypeInfo vuf_info = {
     .name = TYPE_VHOST_USER_FS,
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VHostUserFS),
+    .instance_init = vuf_instance_init,
     .class_init = vuf_class_init,
 };
 
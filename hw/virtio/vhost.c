@@ -1562,6 +1562,20 @@ int vhost_dev_set_inflight(struct vhost_dev *dev,
     return 0;
 }
 
+/*
+ * Send the acked features ahead of the inflight fd messages, so that the
+ * backend can lay out the region for the negotiated ring type.
+ */
+int vhost_dev_prepare_inflight(struct vhost_dev *hdev)
+{
+    if (!hdev->vhost_ops->vhost_get_inflight_fd ||
+        !hdev->vhost_ops->vhost_set_inflight_fd) {
+        return 0;
+    }
+
+    return vhost_dev_set_features(hdev, hdev->log_enabled);
+}
+
 int vhost_dev_get_inflight(struct vhost_dev *dev, uint16_t queue_size,
                            struct vhost_inflight *inflight)
 {
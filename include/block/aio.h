@@ -19,6 +19,9 @@
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#endif
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -124,6 +127,17 @@ struct AioContext {
     struct LinuxAioState *linux_aio;
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+
+    /* io_uring ring parameters, see aio_context_set_io_uring_params() */
+    bool io_uring_sqpoll;
+    bool io_uring_fixed_buffers;
+#endif
+
     /* TimerLists for calling timers - one per clock type.  Has its own
      * locking.
      */
@@ -131,6 +145,11 @@ struct AioContext {
 
     int external_disable_cnt;
 
+    /* In-flight requests of the block nodes and BlockBackends in this
+     * AioContext, see bdrv_inc_in_flight() and blk_inc_in_flight().
+     */
+    unsigned int block_in_flight;
+
     /* Number of AioHandlers without .io_poll() */
     int poll_disable_cnt;
 
@@ -147,6 +166,22 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring fd monitoring, preferred over epoll(7) when available */
+    struct io_uring fdmon_io_uring;
+    bool fdmon_io_uring_enabled;
+    bool fdmon_io_uring_multishot;
+    unsigned int fdmon_io_uring_ready;  /* handlers ready in this wait */
+
+    /* Handlers with pending POLL_ADD/POLL_REMOVE, see aio_set_fd_handler() */
+    QSLIST_HEAD(, AioHandler) fdmon_submit_list;
+
+    /* Deleted handlers waiting for their POLL_ADD to complete.  Only
+     * accessed from the AioContext's home thread.
+     */
+    QLIST_HEAD(, AioHandler) fdmon_removing;
+#endif
 };
 
 /**
@@ -387,6 +422,12 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Setup the LuringState bound to this AioContext */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+
+/* Return the LuringState bound to this AioContext */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -623,4 +664,16 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @sqpoll: let a kernel thread poll the submission ring
+ * @fixed_buffers: register guest RAM with the ring
+ *
+ * The parameters are applied when the io_uring ring of @ctx is created, and
+ * cannot be changed afterwards.
+ */
+void aio_context_set_io_uring_params(AioContext *ctx, bool sqpoll,
+                                     bool fixed_buffers, Error **errp);
+
 #endif
@@ -126,6 +126,12 @@ typedef struct IOMMUNotifier IOMMUNotifier;
 /* RAM is a persistent kind memory */
 #define RAM_PMEM (1 << 5)
 
+/* RAM is write-protected with userfaultfd (set during background snapshot) */
+#define RAM_UF_WRITEPROTECT (1 << 6)
+
+/* RAM is a private (copy-on-write) mapping of a pre-populated template file */
+#define RAM_TEMPLATE (1 << 7)
+
 static inline void iommu_notifier_init(IOMMUNotifier *n, IOMMUNotify fn,
                                        IOMMUNotifierFlag flags,
                                        hwaddr start, hwaddr end,
@@ -415,6 +421,10 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    /* Sync the whole address space at once, used when log_sync is NULL */
+    void (*log_sync_global)(MemoryListener *listener);
+    /* Write protect again a range whose dirty log was synced */
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -1673,6 +1683,22 @@ bool memory_region_is_mapped(MemoryRegion *mr);
 MemoryRegionSection memory_region_find(MemoryRegion *mr,
                                        hwaddr addr, uint64_t size);
 
+/**
+ * memory_region_clear_dirty_bitmap: clear the dirty log of a range in
+ *                                   the accelerator
+ *
+ * Accelerators that don't write protect pages again when their dirty
+ * log is synced wait for this call before doing it, so that guest writes
+ * don't fault again before the pages are actually consumed.  Only pages
+ * that were already synced are cleared.
+ *
+ * @mr: the memory region
+ * @start: start of the range, relative to @mr
+ * @len: length of the range
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_global_dirty_log_sync: synchronize the dirty log for all memory
  *
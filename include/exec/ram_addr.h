@@ -42,6 +42,14 @@ struct RAMBlock {
     size_t page_size;
     /* dirty bitmap used during migration */
     unsigned long *bmap;
+    /*
+     * Chunks of 1 << clear_bmap_shift pages whose dirty log was synced
+     * but not yet cleared in the accelerator.  Migration clears a chunk
+     * just before it sends its first page, so the guest doesn't fault
+     * on the whole block right after every sync.
+     */
+    unsigned long *clear_bmap;
+    uint8_t clear_bmap_shift;
     /* bitmap of pages that haven't been sent even once
      * only maintained and used in postcopy at the moment
      * where it's used to send the dirtymap at the start
@@ -50,8 +58,42 @@ struct RAMBlock {
     unsigned long *unsentmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /*
+     * fixed-ram migration: pages present in the file, and where the
+     * bitmap and the pages of the block are in the file
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 
+/* Number of clear_bmap bits covering @pages pages */
+static inline long clear_bmap_size(uint64_t pages, uint8_t shift)
+{
+    return DIV_ROUND_UP(pages, 1UL << shift);
+}
+
+/* Mark the chunks covering pages [start, start + npages) for clearing */
+static inline void clear_bmap_set(RAMBlock *rb, uint64_t start,
+                                  uint64_t npages)
+{
+    uint8_t shift = rb->clear_bmap_shift;
+
+    if (!npages) {
+        return;
+    }
+    bitmap_set_atomic(rb->clear_bmap, start >> shift,
+                      ((start + npages - 1) >> shift) - (start >> shift) + 1);
+}
+
+/* Returns true if the chunk of @page still had to be cleared */
+static inline bool clear_bmap_test_and_clear(RAMBlock *rb, uint64_t page)
+{
+    uint8_t shift = rb->clear_bmap_shift;
+
+    return bitmap_test_and_clear_atomic(rb->clear_bmap, page >> shift, 1);
+}
+
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
 {
     return (b && b->host && offset < b->used_length) ? true : false;
@@ -453,6 +495,17 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
         }
 
         rcu_read_unlock();
+
+        if (rb->clear_bmap) {
+            /*
+             * Postpone clearing the accelerator's dirty log until the
+             * pages are about to be sent, chunk by chunk.
+             */
+            clear_bmap_set(rb, start >> TARGET_PAGE_BITS,
+                           length >> TARGET_PAGE_BITS);
+        } else {
+            memory_region_clear_dirty_bitmap(rb->mr, start, length);
+        }
     } else {
         ram_addr_t offset = rb->offset;
 
@@ -60,6 +60,11 @@ typedef struct {
 
     /*< public >*/
     MemoryRegion cache;
+    /* One bit per host page of the cache, set while it maps a file */
+    unsigned long *cache_map;
+    uint64_t cache_used;
+    uint64_t cache_map_requests;
+    uint64_t cache_unmap_requests;
 } VHostUserFS;
 
 /* Callbacks from the vhost-user code for slave commands */
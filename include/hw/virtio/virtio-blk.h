@@ -34,17 +34,29 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    uint32_t num_iothread_vq_mapping;
+    char **iothread_vq_mapping;     /* IOThread ids, see dataplane */
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
     uint16_t queue_size;
     uint32_t max_discard_sectors;
     uint32_t max_write_zeroes_sectors;
+    uint32_t merge_window_us;
 };
 
 struct VirtIOBlockDataPlane;
 
 struct VirtIOBlockReq;
+
+#define VIRTIO_BLK_MAX_MERGE_REQS 32
+
+typedef struct MultiReqBuffer {
+    struct VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int num_reqs;
+    bool is_write;
+} MultiReqBuffer;
+
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
@@ -59,6 +71,16 @@ typedef struct VirtIOBlock {
     struct VirtIOBlockDataPlane *dataplane;
     uint64_t host_features;
     size_t config_size;
+
+    /* Requests held back for merging across virtqueue kicks, protected by
+     * the BlockBackend's AioContext lock
+     */
+    MultiReqBuffer merge_mrb;
+    QEMUTimer *merge_timer;
+    unsigned merge_inflight;    /* read/write requests in the block layer */
+    unsigned merge_qd_avg;      /* moving average of merge_inflight, x16 */
+    unsigned merge_score;       /* recent merge window flushes that merged */
+    unsigned merge_probe;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -75,14 +97,6 @@ typedef struct VirtIOBlockReq {
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
-#define VIRTIO_BLK_MAX_MERGE_REQS 32
-
-typedef struct MultiReqBuffer {
-    VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
-    unsigned int num_reqs;
-    bool is_write;
-} MultiReqBuffer;
-
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
 
 #endif
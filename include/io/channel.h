@@ -45,6 +45,7 @@ enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_FD_PASS,
     QIO_CHANNEL_FEATURE_SHUTDOWN,
     QIO_CHANNEL_FEATURE_LISTEN,
+    QIO_CHANNEL_FEATURE_SEEKABLE,
 };
 
 
@@ -137,6 +138,16 @@ struct QIOChannelClass {
                      off_t offset,
                      int whence,
                      Error **errp);
+    ssize_t (*io_pwrite)(QIOChannel *ioc,
+                         const char *buf,
+                         size_t buflen,
+                         off_t offset,
+                         Error **errp);
+    ssize_t (*io_pread)(QIOChannel *ioc,
+                        char *buf,
+                        size_t buflen,
+                        off_t offset,
+                        Error **errp);
     void (*io_set_aio_fd_handler)(QIOChannel *ioc,
                                   AioContext *ctx,
                                   IOHandler *io_read,
@@ -602,6 +613,47 @@ off_t qio_channel_io_seek(QIOChannel *ioc,
                           int whence,
                           Error **errp);
 
+/**
+ * qio_channel_pwrite:
+ * @ioc: the channel object
+ * @buf: the memory region to write data from
+ * @buflen: the number of bytes in @buf
+ * @offset: the position in the channel to write at
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Write data to the channel at @offset, without moving the
+ * current I/O position.  Only channels that report the
+ * QIO_CHANNEL_FEATURE_SEEKABLE feature support this.
+ *
+ * Returns: the number of bytes written, or -1 on error
+ */
+ssize_t qio_channel_pwrite(QIOChannel *ioc,
+                           const char *buf,
+                           size_t buflen,
+                           off_t offset,
+                           Error **errp);
+
+/**
+ * qio_channel_pread:
+ * @ioc: the channel object
+ * @buf: the memory region to read data into
+ * @buflen: the number of bytes in @buf
+ * @offset: the position in the channel to read from
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Read data from the channel at @offset, without moving the
+ * current I/O position.  Only channels that report the
+ * QIO_CHANNEL_FEATURE_SEEKABLE feature support this.
+ *
+ * Returns: the number of bytes read, 0 at end of file,
+ * or -1 on error
+ */
+ssize_t qio_channel_pread(QIOChannel *ioc,
+                          char *buf,
+                          size_t buflen,
+                          off_t offset,
+                          Error **errp);
+
 
 /**
  * qio_channel_create_watch:
@@ -36,6 +36,10 @@ typedef struct {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* AioContext io_uring parameters */
+    bool io_uring_sqpoll;
+    bool io_uring_fixed_buffers;
 } IOThread;
 
 #define IOTHREAD(obj) \
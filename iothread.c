@@ -193,6 +193,17 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    aio_context_set_io_uring_params(iothread->ctx,
+                                    iothread->io_uring_sqpoll,
+                                    iothread->io_uring_fixed_buffers,
+                                    &local_error);
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     /* This assumes we are called from a thread with useful CPU affinity for us
      * to inherit.
      */
@@ -268,6 +279,58 @@ out:
     error_propagate(errp, local_err);
 }
 
+typedef struct {
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+} IoUringParamInfo;
+
+static IoUringParamInfo io_uring_sqpoll_info = {
+    offsetof(IOThread, io_uring_sqpoll),
+};
+static IoUringParamInfo io_uring_fixed_buffers_info = {
+    offsetof(IOThread, io_uring_fixed_buffers),
+};
+
+static void iothread_get_io_uring_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IoUringParamInfo *info = opaque;
+    bool *field = (void *)iothread + info->offset;
+
+    visit_type_bool(v, name, field, errp);
+}
+
+static void iothread_set_io_uring_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IoUringParamInfo *info = opaque;
+    bool *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    bool old_value = *field;
+    bool value;
+
+    visit_type_bool(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    *field = value;
+
+    if (iothread->ctx) {
+        aio_context_set_io_uring_params(iothread->ctx,
+                                        iothread->io_uring_sqpoll,
+                                        iothread->io_uring_fixed_buffers,
+                                        &local_err);
+        if (local_err) {
+            *field = old_value;
+        }
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -285,6 +348,15 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add(klass, "io-uring-sqpoll", "bool",
+                              iothread_get_io_uring_param,
+                              iothread_set_io_uring_param,
+                              NULL, &io_uring_sqpoll_info, &error_abort);
+    object_class_property_add(klass, "io-uring-fixed-buffers", "bool",
+                              iothread_get_io_uring_param,
+                              iothread_set_io_uring_param,
+                              NULL, &io_uring_fixed_buffers_info,
+                              &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -2057,6 +2057,13 @@ static void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
      */
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
         if (!listener->log_sync) {
+            /*
+             * A global sync can't be restricted to @mr, so it is done
+             * for the whole address space whatever @mr is.
+             */
+            if (listener->log_sync_global) {
+                listener->log_sync_global(listener);
+            }
             continue;
         }
         as = listener->address_space;
@@ -2071,15 +2078,61 @@ static void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryRegionSection mrs;
+    MemoryListener *listener;
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+    hwaddr sec_start, sec_end;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (!listener->log_clear) {
+            continue;
+        }
+        as = listener->address_space;
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            /* Only ranges that are being logged have anything to clear */
+            if (!fr->dirty_log_mask || fr->mr != mr) {
+                continue;
+            }
+
+            mrs = section_from_flat_range(fr, view);
+
+            sec_start = MAX(mrs.offset_within_region, start);
+            sec_end = mrs.offset_within_region + int128_get64(mrs.size);
+            sec_end = MIN(sec_end, start + len);
+            if (sec_start >= sec_end) {
+                continue;
+            }
+
+            /* Shrink the section to the part that overlaps the range */
+            mrs.offset_within_address_space +=
+                sec_start - mrs.offset_within_region;
+            mrs.offset_within_region = sec_start;
+            mrs.size = int128_make64(sec_end - sec_start);
+            listener->log_clear(listener, &mrs);
+        }
+        flatview_unref(view);
+    }
+}
+
 DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
                                                             hwaddr addr,
                                                             hwaddr size,
                                                             unsigned client)
 {
+    DirtyBitmapSnapshot *snap;
+
     assert(mr->ram_block);
     memory_region_sync_dirty_bitmap(mr);
-    return cpu_physical_memory_snapshot_and_clear_dirty(
+    snap = cpu_physical_memory_snapshot_and_clear_dirty(
                 memory_region_get_ram_addr(mr) + addr, size, client);
+    memory_region_clear_dirty_bitmap(mr, addr, size);
+    return snap;
 }
 
 bool memory_region_snapshot_get_dirty(MemoryRegion *mr, DirtyBitmapSnapshot *snap,
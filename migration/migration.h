@@ -27,6 +27,14 @@ struct PostcopyBlocktimeContext;
 
 #define  MIGRATION_RESUME_ACK_VALUE  (1)
 
+/*
+ * Channels RAM pages are received on; with postcopy preempt the pages
+ * requested by the destination use their own channel.
+ */
+#define RAM_CHANNEL_PRECOPY     0
+#define RAM_CHANNEL_POSTCOPY    1
+#define RAM_CHANNEL_MAX         2
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -59,7 +67,8 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* One temporary page per channel, see RAM_CHANNEL_* */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
@@ -85,6 +94,15 @@ struct MigrationIncomingState {
     QemuSemaphore postcopy_pause_sem_dst;
     QemuSemaphore postcopy_pause_sem_fault;
 
+    /* Channel of the urgent pages, with postcopy preempt */
+    QEMUFile *postcopy_qemufile_dst;
+    /* Posted when the channel arrives, or when the thread has to quit */
+    QemuSemaphore postcopy_qemufile_dst_done;
+    bool           have_preempt_thread;
+    QemuThread     preempt_thread;
+    /* Set this when we want the preempt thread to quit */
+    bool           preempt_thread_quit;
+
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
 };
@@ -96,6 +114,15 @@ void migration_incoming_state_destroy(void);
  */
 void fill_destination_postcopy_migration_info(MigrationInfo *info);
 
+/*
+ * Chunks of dirty log clearing must be at least 64 pages, so that they
+ * are always aligned to a word of the dirty bitmaps.
+ */
+#define CLEAR_BITMAP_SHIFT_MIN             6
+/* 1 << 18 pages, i.e. 1GB chunks with 4K pages */
+#define CLEAR_BITMAP_SHIFT_DEFAULT         18
+#define CLEAR_BITMAP_SHIFT_MAX             31
+
 #define TYPE_MIGRATION "migration"
 
 #define MIGRATION_CLASS(klass) \
@@ -120,7 +147,19 @@ struct MigrationState
     size_t xfer_limit;
     QemuThread thread;
     QEMUBH *cleanup_bh;
+    /* Restarts the guest once a background snapshot has been taken */
+    QEMUBH *vm_start_bh;
     QEMUFile *to_dst_file;
+    /*
+     * Channel of the pages requested by the destination, with postcopy
+     * preempt.  Set from the main loop once connected; only the migration
+     * thread writes to it.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    /* Connections of the preempt channel that are still in progress */
+    int postcopy_preempt_connecting;
+    /* Set whenever one of them is done */
+    QemuEvent postcopy_preempt_connect_event;
     /*
      * Protects to_dst_file pointer.  We need to make sure we won't
      * yield or hang during the critical section, since this lock will
@@ -234,6 +273,16 @@ struct MigrationState
      * do not trigger spurious decompression errors.
      */
     bool decompress_error_check;
+
+    /*
+     * The dirty log of the accelerator is cleared in chunks of
+     * 1 << clear_bitmap_shift target pages, each one just before the
+     * first of its pages is sent.
+     */
+    uint8_t clear_bitmap_shift;
+
+    /* Threads that help the migration thread merge the dirty log */
+    uint8_t bitmap_sync_threads;
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
@@ -269,8 +318,16 @@ bool migrate_ignore_shared(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_multifd_zero_page(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_background_snapshot(void);
+bool migrate_fixed_ram(void);
+bool migrate_lazy_restore(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
+MultiFDCompression migrate_multifd_compression(void);
+int migrate_multifd_zlib_level(void);
+int migrate_multifd_zstd_level(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
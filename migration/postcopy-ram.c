@@ -20,9 +20,11 @@
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "qemu-file-channel.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "socket.h"
 #include "qapi/error.h"
 #include "qemu/notify.h"
 #include "sysemu/sysemu.h"
@@ -529,6 +531,22 @@ static void postcopy_balloon_inhibit(bool state)
     }
 }
 
+static void postcopy_free_tmp_pages(MigrationIncomingState *mis)
+{
+    int i;
+
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
+    }
+    if (mis->postcopy_tmp_zero_page) {
+        munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
+        mis->postcopy_tmp_zero_page = NULL;
+    }
+}
+
 /*
  * At the end of a migration where postcopy_ram_incoming_init was called.
  */
@@ -539,6 +557,24 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
+        if (mis->have_preempt_thread) {
+            /*
+             * After a clean end of postcopy the source closes the channel,
+             * so that the thread places all the pages before it quits.
+             * Otherwise don't wait for the source.
+             */
+            if (mis->state != MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+                !mis->postcopy_qemufile_dst) {
+                atomic_set(&mis->preempt_thread_quit, true);
+                qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+                if (mis->postcopy_qemufile_dst) {
+                    qemu_file_shutdown(mis->postcopy_qemufile_dst);
+                }
+            }
+            qemu_thread_join(&mis->preempt_thread);
+            mis->have_preempt_thread = false;
+        }
+
         /* Let the fault thread quit */
         atomic_set(&mis->fault_thread_quit, 1);
         postcopy_fault_thread_notify(mis);
@@ -574,14 +610,7 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     postcopy_state_set(POSTCOPY_INCOMING_END);
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
-    }
-    if (mis->postcopy_tmp_zero_page) {
-        munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
-        mis->postcopy_tmp_zero_page = NULL;
-    }
+    postcopy_free_tmp_pages(mis);
     trace_postcopy_ram_incoming_cleanup_blocktime(
             get_postcopy_total_blocktime());
 
@@ -589,6 +618,37 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     return 0;
 }
 
+/*
+ * At the end of a lazy restore, once every page has been placed.
+ * Unlike postcopy, this happens while the VM runs and the incoming
+ * migration may be over already, so the postcopy state is left alone.
+ */
+int postcopy_lazy_restore_cleanup(MigrationIncomingState *mis)
+{
+    int ret = 0;
+
+    trace_postcopy_lazy_restore_cleanup();
+
+    if (mis->have_fault_thread) {
+        atomic_set(&mis->fault_thread_quit, 1);
+        postcopy_fault_thread_notify(mis);
+        qemu_thread_join(&mis->fault_thread);
+
+        if (foreach_not_ignored_block(cleanup_range, mis)) {
+            ret = -1;
+        }
+
+        close(mis->userfault_fd);
+        close(mis->userfault_event_fd);
+        mis->have_fault_thread = false;
+    }
+
+    postcopy_balloon_inhibit(false);
+    postcopy_free_tmp_pages(mis);
+
+    return ret;
+}
+
 /*
  * Disable huge pages on an area
  */
@@ -913,7 +973,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        if (!mis->to_src_file) {
+        if (!mis->to_src_file && !migrate_lazy_restore()) {
             /*
              * Possibly someone tells us that the return path is
              * broken already using the event. We should hold until
@@ -991,6 +1051,17 @@ static void *postcopy_ram_fault_thread(void *opaque)
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
 
+            /* A lazy restore reads the page from the file right here */
+            if (migrate_lazy_restore()) {
+                ret = ram_lazy_restore_page(mis, rb, rb_offset);
+                if (ret) {
+                    error_report("%s: ram_lazy_restore_page() get %d",
+                                 __func__, ret);
+                    break;
+                }
+                continue;
+            }
+
 retry:
             /*
              * Send the request to the source - we want to request one
@@ -1081,12 +1152,90 @@ retry:
             }
         }
     }
+
+    /*
+     * Nobody places the pages of a lazy restore anymore, the guest would
+     * wait for them forever
+     */
+    if (migrate_lazy_restore() && !atomic_read(&mis->fault_thread_quit)) {
+        ram_lazy_restore_stop(-EIO);
+    }
+
     rcu_unregister_thread();
     trace_postcopy_ram_fault_thread_exit();
     g_free(pfd);
     return NULL;
 }
 
+/*
+ * Returns a zeroed host page used to place zero huge pages, which the
+ * kernel can't do with UFFDIO_ZEROPAGE
+ */
+static void *postcopy_get_tmp_zero_page(MigrationIncomingState *mis)
+{
+    if (!mis->postcopy_tmp_zero_page) {
+        mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS,
+                                           -1, 0);
+        if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+            mis->postcopy_tmp_zero_page = NULL;
+            error_report("%s: %s mapping large zero page",
+                         __func__, strerror(errno));
+            return NULL;
+        }
+        memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+    }
+
+    return mis->postcopy_tmp_zero_page;
+}
+
+/*
+ * Postcopy preempt thread: places the pages that the source sends on the
+ * channel of the urgent pages, concurrently with the listen thread that
+ * places the background pages.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f;
+    int ret = 0;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+
+    /* The source connects the channel once it has started postcopy */
+    qemu_sem_wait(&mis->postcopy_qemufile_dst_done);
+    f = mis->postcopy_qemufile_dst;
+    if (f) {
+        qemu_file_set_blocking(f, true);
+    }
+
+    while (f && !atomic_read(&mis->preempt_thread_quit)) {
+        ret = ram_load_postcopy_preempt(f);
+        if (ret) {
+            break;
+        }
+    }
+
+    if (ret < 0 && !atomic_read(&mis->preempt_thread_quit)) {
+        error_report("%s: failed to load the urgent pages: %s",
+                     __func__, strerror(-ret));
+        /*
+         * Pages that were on their way are lost, fail the main channel
+         * too so that postcopy pauses instead of waiting for them.
+         */
+        if (mis->state == MIGRATION_STATUS_POSTCOPY_ACTIVE &&
+            mis->from_src_file) {
+            qemu_file_shutdown(mis->from_src_file);
+        }
+    }
+
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
 int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 {
     /* Open the fd for the kernel to give us userfaults */
@@ -1121,6 +1270,18 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     qemu_sem_destroy(&mis->fault_thread_sem);
     mis->have_fault_thread = true;
 
+    if (migrate_postcopy_preempt()) {
+        /* Both threads may place zero huge pages, don't allocate it lazily */
+        if (!postcopy_get_tmp_zero_page(mis)) {
+            return -1;
+        }
+        mis->preempt_thread_quit = false;
+        qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     /* Mark so that we get notified of accesses to unwritten areas */
     if (foreach_not_ignored_block(ram_block_enable_notify, mis)) {
         error_report("ram_block_enable_notify failed");
@@ -1234,22 +1395,12 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                                                                       host));
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
-                int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
-                error_report("%s: %s mapping large zero page",
-                             __func__, strerror(e));
-                return -e;
-            }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+        void *zero_page = postcopy_get_tmp_zero_page(mis);
+
+        if (!zero_page) {
+            return -ENOMEM;
         }
-        return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
-                                   rb);
+        return postcopy_place_page(mis, host, zero_page, rb);
     }
 }
 
@@ -1261,20 +1412,21 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
  * Returns: Pointer to allocated page
  *
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
-{
-    if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                             MAP_ANONYMOUS, -1, 0);
-        if (mis->postcopy_tmp_page == MAP_FAILED) {
-            mis->postcopy_tmp_page = NULL;
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
+{
+    if (!mis->postcopy_tmp_pages[channel]) {
+        mis->postcopy_tmp_pages[channel] = mmap(NULL, mis->largest_page_size,
+                                                PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE | MAP_ANONYMOUS,
+                                                -1, 0);
+        if (mis->postcopy_tmp_pages[channel] == MAP_FAILED) {
+            mis->postcopy_tmp_pages[channel] = NULL;
             error_report("%s: %s", __func__, strerror(errno));
             return NULL;
         }
     }
 
-    return mis->postcopy_tmp_page;
+    return mis->postcopy_tmp_pages[channel];
 }
 
 #else
@@ -1301,6 +1453,12 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     return -1;
 }
 
+int postcopy_lazy_restore_cleanup(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
 int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
 {
     assert(0);
@@ -1334,7 +1492,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
     assert(0);
     return NULL;
@@ -1492,3 +1650,97 @@ void postcopy_unregister_shared_ufd(struct PostCopyFD *pcfd)
         }
     }
 }
+
+/*
+ * Postcopy preempt: the pages the destination faulted on are sent on a
+ * channel of their own, so that they don't wait behind the background
+ * pages queued in the socket buffers of the main channel.
+ */
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+    QEMUFile *f;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        /* Not fatal, the main channel keeps carrying the urgent pages */
+        warn_report_err(local_err);
+        object_unref(OBJECT(ioc));
+        goto out;
+    }
+
+    qio_channel_set_name(ioc, "migration-postcopy-preempt");
+    qio_channel_set_delay(ioc, false);
+    f = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+
+    /* Migration may have ended or paused while we were connecting */
+    if (s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        qemu_fclose(f);
+        goto out;
+    }
+
+    trace_postcopy_preempt_send_channel_connected();
+    atomic_mb_set(&s->postcopy_qemufile_src, f);
+
+out:
+    atomic_dec(&s->postcopy_preempt_connecting);
+    qemu_event_set(&s->postcopy_preempt_connect_event);
+}
+
+/*
+ * Called when postcopy starts.  Until the channel is connected, the
+ * urgent pages are sent on the main channel.
+ */
+void postcopy_preempt_setup(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return;
+    }
+
+    if (!socket_send_channel_supported()) {
+        warn_report("postcopy-preempt needs a socket migration, "
+                    "sending the requested pages on the main channel");
+        return;
+    }
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        warn_report("postcopy-preempt doesn't support TLS, "
+                    "sending the requested pages on the main channel");
+        return;
+    }
+
+    atomic_inc(&s->postcopy_preempt_connecting);
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+}
+
+/*
+ * Called by the migration thread before it ends the preempt channel.
+ * Once the destination accepted the channel, it waits for its end,
+ * so it must not be connected behind our back after that.
+ */
+void postcopy_preempt_wait_channel(MigrationState *s)
+{
+    while (atomic_read(&s->postcopy_preempt_connecting)) {
+        qemu_event_reset(&s->postcopy_preempt_connect_event);
+        if (!atomic_read(&s->postcopy_preempt_connecting)) {
+            break;
+        }
+        qemu_event_wait(&s->postcopy_preempt_connect_event);
+    }
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f)
+{
+    if (mis->postcopy_qemufile_dst) {
+        error_report("%s: postcopy preempt channel already exists", __func__);
+        qemu_fclose(f);
+        return;
+    }
+
+    trace_postcopy_preempt_new_channel();
+    mis->postcopy_qemufile_dst = f;
+    /* Let the preempt thread start loading pages */
+    qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+}
@@ -34,6 +34,12 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis);
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
 
+/*
+ * At the end of a lazy restore, where postcopy_ram_incoming_init and
+ * postcopy_ram_enable_notify were called.
+ */
+int postcopy_lazy_restore_cleanup(MigrationIncomingState *mis);
+
 /*
  * Userfault requires us to mark RAM as NOHUGEPAGE prior to discard
  * however leaving it until after precopy means that most of the precopy
@@ -105,10 +111,10 @@ typedef enum {
 
 /*
  * Allocate a page of memory that can be mapped at a later point in time
- * using postcopy_place_page
+ * using postcopy_place_page; each RAM_CHANNEL_* has its own
  * Returns: Pointer to allocated page
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
@@ -189,4 +195,10 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/* Postcopy preempt: connect the channel of the urgent pages */
+void postcopy_preempt_setup(MigrationState *s);
+void postcopy_preempt_wait_channel(MigrationState *s);
+/* Postcopy preempt: the channel of the urgent pages was accepted */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f);
+
 #endif
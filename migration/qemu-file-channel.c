@@ -145,6 +145,86 @@ static int channel_set_blocking(void *opaque,
     return 0;
 }
 
+static ssize_t channel_pwrite(void *opaque,
+                              const uint8_t *buf,
+                              size_t size,
+                              int64_t offset)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t len;
+
+        len = qio_channel_pwrite(ioc, (const char *)buf + done, size - done,
+                                 offset + done, NULL);
+        if (len <= 0) {
+            /* XXX handle Error objects */
+            return -EIO;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
+
+static ssize_t channel_pread(void *opaque,
+                             uint8_t *buf,
+                             size_t size,
+                             int64_t offset)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t len;
+
+        len = qio_channel_pread(ioc, (char *)buf + done, size - done,
+                                offset + done, NULL);
+        if (len < 0) {
+            /* XXX handle Error objects */
+            return -EIO;
+        }
+        if (len == 0) {
+            break;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
+
+static int64_t channel_seek(void *opaque, int64_t offset)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        return -ENOTSUP;
+    }
+    if (qio_channel_io_seek(ioc, offset, SEEK_SET, NULL) < 0) {
+        return -EIO;
+    }
+    return offset;
+}
+
+
+static int64_t channel_tell(void *opaque)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    off_t ret;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        return -ENOTSUP;
+    }
+    ret = qio_channel_io_seek(ioc, 0, SEEK_CUR, NULL);
+    if (ret < 0) {
+        return -EIO;
+    }
+    return ret;
+}
+
 static QEMUFile *channel_get_input_return_path(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -165,6 +245,9 @@ static const QEMUFileOps channel_input_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .pread = channel_pread,
+    .seek = channel_seek,
+    .tell = channel_tell,
 };
 
 
@@ -174,6 +257,9 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .pwrite = channel_pwrite,
+    .seek = channel_seek,
+    .tell = channel_tell,
 };
 
 
@@ -745,6 +745,134 @@ int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src)
     return len;
 }
 
+/*
+ * Get the position in the underlying file of the next byte to be
+ * written or read.  Pending writes are flushed first.
+ *
+ * Returns the offset, or a negative errno value if the file can't be
+ * accessed at random offsets
+ */
+int64_t qemu_get_offset(QEMUFile *f)
+{
+    int64_t ret;
+
+    if (!f->ops->tell) {
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            return ret;
+        }
+        return f->ops->tell(f->opaque);
+    }
+
+    ret = f->ops->tell(f->opaque);
+    if (ret < 0) {
+        return ret;
+    }
+    /* Don't count what has been read ahead but not consumed */
+    return ret - (f->buf_size - f->buf_index);
+}
+
+/*
+ * Move the stream to @offset in the underlying file.  Pending writes
+ * are flushed first and data that was read ahead is dropped.  The
+ * stream position reported by qemu_ftell() is not affected.
+ *
+ * Returns 0 for success or a negative errno value
+ */
+int qemu_set_offset(QEMUFile *f, int64_t offset)
+{
+    int64_t ret;
+
+    if (!f->ops->seek) {
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->seek(f->opaque, offset);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Write @buf at @offset in the underlying file, bypassing the stream
+ * buffer.  The data counts towards the rate limit and qemu_ftell().
+ */
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t offset)
+{
+    ssize_t ret;
+
+    if (f->last_error) {
+        return;
+    }
+
+    if (!f->ops->pwrite) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+
+    ret = f->ops->pwrite(f->opaque, buf, size, offset);
+    if (ret != size) {
+        qemu_file_set_error(f, ret < 0 ? ret : -EIO);
+        return;
+    }
+
+    f->bytes_xfer += size;
+    f->pos += size;
+}
+
+/*
+ * Read @size bytes at @offset in the underlying file, bypassing the
+ * stream buffer.
+ *
+ * Returns the number of bytes read, which is less than @size on error
+ * or at end of file
+ */
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                          int64_t offset)
+{
+    ssize_t ret;
+
+    if (f->last_error) {
+        return 0;
+    }
+
+    if (!f->ops->pread) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return 0;
+    }
+
+    ret = f->ops->pread(f->opaque, buf, size, offset);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return 0;
+    }
+    if (ret != size) {
+        qemu_file_set_error(f, -EIO);
+    }
+
+    return ret;
+}
+
 /*
  * Get a string whose length is determined by a single preceding byte
  * A preallocated 256 byte buffer must be passed in.
@@ -99,6 +99,19 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Random access to the underlying file, for the formats that put data at
+ * fixed offsets.  Offsets are absolute positions in the file, not in the
+ * stream.  The read/write handlers must transfer all of the data or
+ * return a negative errno value; reads may stop early at end of file.
+ */
+typedef ssize_t (QEMUFilePwriteFunc)(void *opaque, const uint8_t *buf,
+                                     size_t size, int64_t offset);
+typedef ssize_t (QEMUFilePreadFunc)(void *opaque, uint8_t *buf,
+                                    size_t size, int64_t offset);
+typedef int64_t (QEMUFileSeekFunc)(void *opaque, int64_t offset);
+typedef int64_t (QEMUFileTellFunc)(void *opaque);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -106,6 +119,10 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFilePwriteFunc *pwrite;
+    QEMUFilePreadFunc *pread;
+    QEMUFileSeekFunc *seek;
+    QEMUFileTellFunc *tell;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -138,6 +155,13 @@ ssize_t qemu_put_compression_data(QEMUFile *f, z_stream *stream,
                                   const uint8_t *p, size_t size);
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 
+int64_t qemu_get_offset(QEMUFile *f);
+int qemu_set_offset(QEMUFile *f, int64_t offset);
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t offset);
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                          int64_t offset);
+
 /*
  * Note that you can only peek continuous bytes from where the current pointer
  * is; you aren't guaranteed to be able to peak to +n bytes unless you've
@@ -57,6 +57,18 @@
 #include "qemu/uuid.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "multifd.h"
+#include "sysemu/balloon.h"
+#include "qemu/event_notifier.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+#include <linux/userfaultfd.h>
+#endif
 
 /***********************************************************/
 /* ram save/restore */
@@ -77,6 +89,17 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/*
+ * fixed-ram: after its entry in the RAM_SAVE_FLAG_MEM_SIZE list, each
+ * block has a header giving the file offsets of its bitmap of present
+ * pages and of its pages.  The pages region is aligned so that it can
+ * be read with O_DIRECT or mapped, and the stream goes on after it.
+ */
+#define FIXED_RAM_HDR_VERSION 1
+#define FIXED_RAM_FILE_OFFSET_ALIGNMENT 0x100000
+/* version, page size, bitmap offset, pages offset */
+#define FIXED_RAM_HDR_SIZE (4 + 3 * 8)
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -351,6 +374,11 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* userfaultfd write-protecting the RAM of a background snapshot */
+    int uffdio_fd;
+    /* Queues the pages vCPUs fault on, see ram_write_tracking_start() */
+    QemuThread uffd_thread;
+    EventNotifier uffd_quit;
 };
 typedef struct RAMState RAMState;
 
@@ -578,127 +606,147 @@ exit:
 
 /* Multiple fd's */
 
-#define MULTIFD_MAGIC 0x11223344U
-#define MULTIFD_VERSION 1
+/* Multifd without compression */
 
-#define MULTIFD_FLAG_SYNC (1 << 0)
+/**
+ * nocomp_send_setup: setup send side
+ *
+ * For no compression this function does nothing.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    return 0;
+}
 
-/* This value needs to be a multiple of qemu_target_page_size() */
-#define MULTIFD_PACKET_SIZE (512 * 1024)
+/**
+ * nocomp_send_cleanup: cleanup send side
+ *
+ * For no compression this function does nothing.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+}
 
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    unsigned char uuid[16]; /* QemuUUID */
-    uint8_t id;
-    uint8_t unused1[7];     /* Reserved for future use */
-    uint64_t unused2[4];    /* Reserved for future use */
-} __attribute__((packed)) MultiFDInit_t;
+/**
+ * nocomp_send_prepare: prepare data to be able to send
+ *
+ * For no compression we just have to calculate the size of the
+ * packet.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    p->next_packet_size = used * qemu_target_page_size();
+    p->flags |= MULTIFD_FLAG_NOCOMP;
+    return 0;
+}
 
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t flags;
-    /* maximum number of allocated pages */
-    uint32_t pages_alloc;
-    uint32_t pages_used;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
-    char ramblock[256];
-    uint64_t offset[];
-} __attribute__((packed)) MultiFDPacket_t;
+/**
+ * nocomp_send_write: do the actual write of the data
+ *
+ * For no compression we just have to write the data.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_send_write(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+}
 
-typedef struct {
-    /* number of used pages */
-    uint32_t used;
-    /* number of allocated pages */
-    uint32_t allocated;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* offset of each page */
-    ram_addr_t *offset;
-    /* pointer to each page */
-    struct iovec *iov;
-    RAMBlock *block;
-} MultiFDPages_t;
+/**
+ * nocomp_recv_setup: setup receive side
+ *
+ * For no compression this function does nothing.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    return 0;
+}
 
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* sem where to wait for more work */
-    QemuSemaphore sem;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* should this thread finish */
-    bool quit;
-    /* thread has work to do */
-    int pending_job;
-    /* array of pages to sent */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-}  MultiFDSendParams;
+/**
+ * nocomp_recv_cleanup: cleanup receive side
+ *
+ * For no compression this function does nothing.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void nocomp_recv_cleanup(MultiFDRecvParams *p)
+{
+}
 
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* array of pages to receive */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-} MultiFDRecvParams;
+/**
+ * nocomp_recv_pages: read the data from the channel into actual pages
+ *
+ * For no compression we just need to read things into the correct place.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                             Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags != MULTIFD_FLAG_NOCOMP) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_NOCOMP);
+        return -1;
+    }
+    return qio_channel_readv_all(p->c, p->pages->iov, used, errp);
+}
+
+static MultiFDMethods multifd_nocomp_ops = {
+    .send_setup = nocomp_send_setup,
+    .send_cleanup = nocomp_send_cleanup,
+    .send_prepare = nocomp_send_prepare,
+    .send_write = nocomp_send_write,
+    .recv_setup = nocomp_recv_setup,
+    .recv_cleanup = nocomp_recv_cleanup,
+    .recv_pages = nocomp_recv_pages
+};
+
+static MultiFDMethods *multifd_ops[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_NONE] = &multifd_nocomp_ops,
+};
+
+void multifd_register_ops(int method, MultiFDMethods *ops)
+{
+    assert(0 < method && method < MULTIFD_COMPRESSION__MAX);
+    multifd_ops[method] = ops;
+}
+
+static uint32_t multifd_version(void)
+{
+    return migrate_multifd_zero_page() ? MULTIFD_VERSION_ZERO_PAGE :
+                                         MULTIFD_VERSION;
+}
 
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
@@ -706,7 +754,7 @@ static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
     int ret;
 
     msg.magic = cpu_to_be32(MULTIFD_MAGIC);
-    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.version = cpu_to_be32(multifd_version());
     msg.id = p->id;
     memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
 
@@ -736,9 +784,9 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
         return -1;
     }
 
-    if (msg.version != MULTIFD_VERSION) {
+    if (msg.version != multifd_version()) {
         error_setg(errp, "multifd: received packet version %d "
-                   "expected %d", msg.version, MULTIFD_VERSION);
+                   "expected %d", msg.version, multifd_version());
         return -1;
     }
 
@@ -793,12 +841,13 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     int i;
 
     packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->version = cpu_to_be32(multifd_version());
     packet->flags = cpu_to_be32(p->flags);
     packet->pages_alloc = cpu_to_be32(page_max);
-    packet->pages_used = cpu_to_be32(p->pages->used);
+    packet->pages_used = cpu_to_be32(p->pages->used - p->zero_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -814,6 +863,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     MultiFDPacket_t *packet = p->packet;
     uint32_t pages_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     RAMBlock *block;
+    uint32_t total;
     int i;
 
     packet->magic = be32_to_cpu(packet->magic);
@@ -825,10 +875,10 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
+    if (packet->version != multifd_version()) {
         error_setg(errp, "multifd: received packet "
                    "version %d and expected version %d",
-                   packet->version, MULTIFD_VERSION);
+                   packet->version, multifd_version());
         return -1;
     }
 
@@ -855,17 +905,20 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     p->pages->used = be32_to_cpu(packet->pages_used);
-    if (p->pages->used > packet->pages_alloc) {
+    p->zero_num = be32_to_cpu(packet->zero_pages);
+    total = p->pages->used + p->zero_num;
+    if (total < p->pages->used || total > packet->pages_alloc) {
         error_setg(errp, "multifd: received packet "
-                   "with %d pages and expected maximum pages are %d",
-                   p->pages->used, packet->pages_alloc) ;
+                   "with %u pages and %u zero pages and expected maximum "
+                   "pages are %u", p->pages->used, p->zero_num,
+                   packet->pages_alloc);
         return -1;
     }
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->pages->used) {
+    if (total) {
         /* make sure that ramblock is 0 terminated */
         packet->ramblock[255] = 0;
         block = qemu_ram_block_by_name(packet->ramblock);
@@ -876,7 +929,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         }
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < total; i++) {
         ram_addr_t offset = be64_to_cpu(packet->offset[i]);
 
         if (offset > (block->used_length - TARGET_PAGE_SIZE)) {
@@ -904,6 +957,10 @@ struct {
     uint64_t packet_num;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /* multifd ops */
+    MultiFDMethods *ops;
+    /* channels look for zero pages */
+    bool zero_page;
 } *multifd_send_state;
 
 /*
@@ -924,13 +981,28 @@ struct {
  * false.
  */
 
+/*
+ * Account what @p has written since the last call.  The channel thread
+ * only knows the real size of a packet once it is compressed, so the
+ * counters are updated from the migration thread with p->mutex held.
+ */
+static void multifd_account_sent(MultiFDSendParams *p)
+{
+    ram_counters.multifd_bytes += p->bytes_sent;
+    ram_counters.transferred += p->bytes_sent;
+    p->bytes_sent = 0;
+    /* they were counted as normal pages when they were queued */
+    ram_counters.normal -= p->zero_sent;
+    ram_counters.duplicate += p->zero_sent;
+    p->zero_sent = 0;
+}
+
 static void multifd_send_pages(void)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
 
     qemu_sem_wait(&multifd_send_state->channels_ready);
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
@@ -950,9 +1022,7 @@ static void multifd_send_pages(void)
     p->pages->block = NULL;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;;
+    multifd_account_sent(p);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 }
@@ -1011,6 +1081,7 @@ static void multifd_send_terminate_threads(Error *err)
 
 void multifd_save_cleanup(void)
 {
+    Error *local_err = NULL;
     int i;
 
     if (!migrate_use_multifd()) {
@@ -1035,6 +1106,12 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        multifd_send_state->ops->send_cleanup(p, &local_err);
+        if (local_err) {
+            migrate_set_error(migrate_get_current(), local_err);
+            error_free(local_err);
+            local_err = NULL;
+        }
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
     qemu_sem_destroy(&multifd_send_state->sem_sync);
@@ -1075,9 +1152,51 @@ static void multifd_send_sync_main(void)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&multifd_send_state->sem_sync);
     }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_account_sent(p);
+        qemu_mutex_unlock(&p->mutex);
+    }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/**
+ * multifd_send_zero_page_detect: find the zero pages of a packet
+ *
+ * Moves the pages that are all zeros to the tail of @pages, so that
+ * only their offsets are sent.  The order of the pages is not kept.
+ *
+ * Returns the number of zero pages
+ *
+ * @pages: pages that are going to be sent
+ */
+static uint32_t multifd_send_zero_page_detect(MultiFDPages_t *pages)
+{
+    uint32_t normal = pages->used;
+    uint32_t i = 0;
+
+    while (i < normal) {
+        ram_addr_t offset;
+        struct iovec iov;
+
+        if (!buffer_is_zero(pages->iov[i].iov_base, pages->iov[i].iov_len)) {
+            i++;
+            continue;
+        }
+        normal--;
+        offset = pages->offset[i];
+        pages->offset[i] = pages->offset[normal];
+        pages->offset[normal] = offset;
+        iov = pages->iov[i];
+        pages->iov[i] = pages->iov[normal];
+        pages->iov[normal] = iov;
+    }
+
+    return pages->used - normal;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -1102,15 +1221,29 @@ static void *multifd_send_thread(void *opaque)
             uint64_t packet_num = p->packet_num;
             uint32_t flags = p->flags;
 
-            p->next_packet_size = used * qemu_target_page_size();
+            p->next_packet_size = 0;
+            p->zero_num = 0;
+            if (used && multifd_send_state->zero_page) {
+                p->zero_num = multifd_send_zero_page_detect(p->pages);
+                used -= p->zero_num;
+            }
+            if (used) {
+                ret = multifd_send_state->ops->send_prepare(p, used,
+                                                            &local_err);
+                if (ret != 0) {
+                    qemu_mutex_unlock(&p->mutex);
+                    break;
+                }
+            }
             multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
-            p->num_pages += used;
+            p->num_pages += p->pages->used;
+            p->zero_sent += p->zero_num;
             p->pages->used = 0;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            trace_multifd_send(p->id, packet_num, used, p->zero_num, flags,
                                p->next_packet_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
@@ -1120,14 +1253,15 @@ static void *multifd_send_thread(void *opaque)
             }
 
             if (used) {
-                ret = qio_channel_writev_all(p->c, p->pages->iov,
-                                             used, &local_err);
+                ret = multifd_send_state->ops->send_write(p, used,
+                                                          &local_err);
                 if (ret != 0) {
                     break;
                 }
             }
 
             qemu_mutex_lock(&p->mutex);
+            p->bytes_sent += p->packet_len + p->next_packet_size;
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
 
@@ -1195,6 +1329,8 @@ int multifd_save_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->sem_sync, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_send_state->zero_page = migrate_multifd_zero_page();
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1212,6 +1348,19 @@ int multifd_save_setup(void)
         p->name = g_strdup_printf("multifdsend_%d", i);
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        Error *local_err = NULL;
+        int ret;
+
+        ret = multifd_send_state->ops->send_setup(p, &local_err);
+        if (ret) {
+            migrate_set_error(migrate_get_current(), local_err);
+            error_free(local_err);
+            return ret;
+        }
+    }
     return 0;
 }
 
@@ -1223,6 +1372,8 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* multifd ops */
+    MultiFDMethods *ops;
 } *multifd_recv_state;
 
 static void multifd_recv_terminate_threads(Error *err)
@@ -1278,6 +1429,7 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
@@ -1319,6 +1471,7 @@ static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
     Error *local_err = NULL;
+    uint32_t i;
     int ret;
 
     trace_multifd_recv_thread_start(p->id);
@@ -1326,6 +1479,7 @@ static void *multifd_recv_thread(void *opaque)
 
     while (true) {
         uint32_t used;
+        uint32_t zero;
         uint32_t flags;
 
         ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
@@ -1345,21 +1499,27 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        zero = p->zero_num;
         flags = p->flags;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, used, zero, flags,
                            p->next_packet_size);
         p->num_packets++;
-        p->num_pages += used;
+        p->num_pages += used + zero;
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
-            ret = qio_channel_readv_all(p->c, p->pages->iov,
-                                        used, &local_err);
+            ret = multifd_recv_state->ops->recv_pages(p, used, &local_err);
             if (ret != 0) {
                 break;
             }
         }
 
+        for (i = used; i < used + zero; i++) {
+            struct iovec *iov = &p->pages->iov[i];
+
+            ram_handle_compressed(iov->iov_base, 0, iov->iov_len);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1393,6 +1553,7 @@ int multifd_load_setup(void)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     atomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
@@ -1406,6 +1567,18 @@ int multifd_load_setup(void)
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+        Error *local_err = NULL;
+        int ret;
+
+        ret = multifd_recv_state->ops->recv_setup(p, &local_err);
+        if (ret) {
+            error_report_err(local_err);
+            return ret;
+        }
+    }
     return 0;
 }
 
@@ -1670,6 +1843,22 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
     bool ret;
 
     qemu_mutex_lock(&rs->bitmap_mutex);
+
+    /*
+     * The accelerator's dirty log for the chunk has to be cleared before
+     * any page of the chunk is sent, otherwise a write that happens
+     * while sending would not be seen by the next sync.  Clearing the
+     * whole chunk early is harmless.
+     */
+    if (rb->clear_bmap && clear_bmap_test_and_clear(rb, page)) {
+        uint8_t shift = rb->clear_bmap_shift;
+        hwaddr size = 1ULL << (TARGET_PAGE_BITS + shift);
+        hwaddr start = (((ram_addr_t)page) << TARGET_PAGE_BITS) & (-size);
+
+        trace_migration_bitmap_clear_dirty(rb->idstr, start, size, page);
+        memory_region_clear_dirty_bitmap(rb->mr, start, size);
+    }
+
     ret = test_and_clear_bit(page, rb->bmap);
 
     if (ret) {
@@ -1688,6 +1877,199 @@ static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
                                               &rs->num_dirty_pages_period);
 }
 
+/*
+ * Bitmap sync threads
+ *
+ * Merging the dirty log into the migration bitmap of a big guest takes
+ * a long time, and the BQL is held meanwhile.  The RAMBlocks are cut in
+ * ranges of BITMAP_SYNC_CHUNK bytes, which the sync threads and the
+ * migration thread merge in parallel.  The ranges start on a word of
+ * block->bmap and don't overlap, so the bitmaps need no locking.
+ */
+#define BITMAP_SYNC_CHUNK (1ULL << 30)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncJob;
+
+static struct {
+    QemuThread *threads;
+    int thread_count;
+    /* this mutex protects the following parameters */
+    QemuMutex lock;
+    /* the sync threads wait here for a new generation of jobs */
+    QemuCond work_cond;
+    /* the migration thread waits here for the jobs to be done */
+    QemuCond done_cond;
+    BitmapSyncJob *jobs;
+    int nr_jobs;
+    int allocated_jobs;
+    /* next job to run */
+    int next_job;
+    /* jobs taken or not, that are not done yet */
+    int pending;
+    /* results of the current jobs */
+    uint64_t num_dirty;
+    uint64_t real_dirty;
+    bool quit;
+} *bitmap_sync;
+
+/*
+ * Run jobs until none is left.  Called with bitmap_sync->lock held, which
+ * is dropped while a job runs.  Each job is copied out of the array under
+ * the lock, so nobody looks at the array once pending drops to zero and
+ * the migration thread can rebuild it.
+ */
+static void bitmap_sync_run_jobs(void)
+{
+    while (bitmap_sync->next_job < bitmap_sync->nr_jobs) {
+        BitmapSyncJob job = bitmap_sync->jobs[bitmap_sync->next_job++];
+        uint64_t num_dirty, real_dirty = 0;
+
+        qemu_mutex_unlock(&bitmap_sync->lock);
+        rcu_read_lock();
+        num_dirty = cpu_physical_memory_sync_dirty_bitmap(job.block,
+                                                          job.start,
+                                                          job.length,
+                                                          &real_dirty);
+        rcu_read_unlock();
+        qemu_mutex_lock(&bitmap_sync->lock);
+
+        bitmap_sync->num_dirty += num_dirty;
+        bitmap_sync->real_dirty += real_dirty;
+        if (!--bitmap_sync->pending) {
+            qemu_cond_signal(&bitmap_sync->done_cond);
+        }
+    }
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    rcu_register_thread();
+
+    qemu_mutex_lock(&bitmap_sync->lock);
+    while (!bitmap_sync->quit) {
+        if (bitmap_sync->next_job < bitmap_sync->nr_jobs) {
+            bitmap_sync_run_jobs();
+        } else {
+            qemu_cond_wait(&bitmap_sync->work_cond, &bitmap_sync->lock);
+        }
+    }
+    qemu_mutex_unlock(&bitmap_sync->lock);
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void bitmap_sync_threads_setup(void)
+{
+    int thread_count = migrate_get_current()->bitmap_sync_threads;
+    int i;
+
+    if (!thread_count || bitmap_sync) {
+        return;
+    }
+
+    bitmap_sync = g_new0(typeof(*bitmap_sync), 1);
+    qemu_mutex_init(&bitmap_sync->lock);
+    qemu_cond_init(&bitmap_sync->work_cond);
+    qemu_cond_init(&bitmap_sync->done_cond);
+    bitmap_sync->thread_count = thread_count;
+    bitmap_sync->threads = g_new0(QemuThread, thread_count);
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_create(bitmap_sync->threads + i, "mig/bitmap-sync",
+                           bitmap_sync_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void bitmap_sync_threads_cleanup(void)
+{
+    int i;
+
+    if (!bitmap_sync) {
+        return;
+    }
+
+    qemu_mutex_lock(&bitmap_sync->lock);
+    bitmap_sync->quit = true;
+    qemu_cond_broadcast(&bitmap_sync->work_cond);
+    qemu_mutex_unlock(&bitmap_sync->lock);
+
+    for (i = 0; i < bitmap_sync->thread_count; i++) {
+        qemu_thread_join(bitmap_sync->threads + i);
+    }
+    qemu_cond_destroy(&bitmap_sync->done_cond);
+    qemu_cond_destroy(&bitmap_sync->work_cond);
+    qemu_mutex_destroy(&bitmap_sync->lock);
+    g_free(bitmap_sync->threads);
+    g_free(bitmap_sync->jobs);
+    g_free(bitmap_sync);
+    bitmap_sync = NULL;
+}
+
+/* Called with bitmap_sync->lock held and no job pending */
+static void bitmap_sync_add_job(RAMBlock *block, ram_addr_t start,
+                                ram_addr_t length)
+{
+    BitmapSyncJob *job;
+
+    if (bitmap_sync->nr_jobs == bitmap_sync->allocated_jobs) {
+        bitmap_sync->allocated_jobs = MAX(16, bitmap_sync->allocated_jobs * 2);
+        bitmap_sync->jobs = g_renew(BitmapSyncJob, bitmap_sync->jobs,
+                                    bitmap_sync->allocated_jobs);
+    }
+    job = &bitmap_sync->jobs[bitmap_sync->nr_jobs++];
+    job->block = block;
+    job->start = start;
+    job->length = length;
+}
+
+/*
+ * Merge the dirty log of all the RAMBlocks into their migration bitmap.
+ * Called with rs->bitmap_mutex and the RCU read lock held.
+ */
+static void migration_bitmap_sync_blocks(RAMState *rs)
+{
+    RAMBlock *block;
+    ram_addr_t start;
+
+    if (!bitmap_sync) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            migration_bitmap_sync_range(rs, block, 0, block->used_length);
+        }
+        return;
+    }
+
+    qemu_mutex_lock(&bitmap_sync->lock);
+    bitmap_sync->nr_jobs = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        for (start = 0; start < block->used_length;
+             start += BITMAP_SYNC_CHUNK) {
+            bitmap_sync_add_job(block, start,
+                                MIN(BITMAP_SYNC_CHUNK,
+                                    block->used_length - start));
+        }
+    }
+    bitmap_sync->next_job = 0;
+    bitmap_sync->pending = bitmap_sync->nr_jobs;
+    bitmap_sync->num_dirty = 0;
+    bitmap_sync->real_dirty = 0;
+    qemu_cond_broadcast(&bitmap_sync->work_cond);
+
+    /* Don't just wait, take jobs too */
+    bitmap_sync_run_jobs();
+
+    while (bitmap_sync->pending) {
+        qemu_cond_wait(&bitmap_sync->done_cond, &bitmap_sync->lock);
+    }
+    rs->migration_dirty_pages += bitmap_sync->num_dirty;
+    rs->num_dirty_pages_period += bitmap_sync->real_dirty;
+    qemu_mutex_unlock(&bitmap_sync->lock);
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1757,7 +2139,6 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
 
 static void migration_bitmap_sync(RAMState *rs)
 {
-    RAMBlock *block;
     int64_t end_time;
     uint64_t bytes_xfer_now;
 
@@ -1772,9 +2153,7 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        migration_bitmap_sync_range(rs, block, 0, block->used_length);
-    }
+    migration_bitmap_sync_blocks(rs);
     ram_counters.remaining = ram_bytes_remaining();
     rcu_read_unlock();
     qemu_mutex_unlock(&rs->bitmap_mutex);
@@ -1875,7 +2254,22 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
  */
 static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    int len;
+
+    /*
+     * With fixed-ram, zero pages are the ones missing from the file, the
+     * destination RAM is zero already.
+     */
+    if (migrate_fixed_ram()) {
+        if (!is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+            return -1;
+        }
+        clear_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    len = save_zero_page_to_file(rs, rs->f, block, offset);
 
     if (len) {
         ram_counters.duplicate++;
@@ -1946,7 +2340,17 @@ static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
 static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
                             uint8_t *buf, bool async)
 {
-    ram_counters.transferred += save_page_header(rs, rs->f, block,
+    if (migrate_fixed_ram()) {
+        /* Overwrite any earlier copy of the page */
+        qemu_put_buffer_at(rs->f, buf, TARGET_PAGE_SIZE,
+                           block->pages_offset + offset);
+        set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.transferred += TARGET_PAGE_SIZE;
+        ram_counters.normal++;
+        return 1;
+    }
+
+    ram_counters.transferred += save_page_header(rs, rs->f, block,
                                                  offset | RAM_SAVE_FLAG_PAGE);
     if (async) {
         qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
@@ -1985,6 +2389,14 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     p = block->host + offset;
     trace_ram_save_page(block->idstr, (uint64_t)offset, p);
 
+    /*
+     * A background snapshot lets the guest write to the page as soon as
+     * it has been saved, so it must be copied out right away.
+     */
+    if (migrate_background_snapshot()) {
+        send_async = false;
+    }
+
     XBZRLE_cache_lock();
     if (!rs->ram_bulk_stage && !migration_in_postcopy() &&
         migrate_use_xbzrle()) {
@@ -2197,6 +2609,409 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
     }
 }
 
+/* Queue @len bytes at @start of @ramblock to be sent before anything else */
+static void ram_save_queue_block_pages(RAMState *rs, RAMBlock *ramblock,
+                                       ram_addr_t start, ram_addr_t len)
+{
+    struct RAMSrcPageRequest *new_entry =
+        g_malloc0(sizeof(struct RAMSrcPageRequest));
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
+    migration_make_urgent_request();
+    qemu_mutex_unlock(&rs->src_page_req_mutex);
+}
+
+/*
+ * Write tracking for background snapshots
+ *
+ * At the snapshot point the guest RAM is write-protected with
+ * userfaultfd, and each page is unprotected as soon as it has been
+ * saved.  A vCPU writing to a page that is not saved yet stalls until
+ * the page is saved: a thread sleeping on the userfaultfd queues it like
+ * a postcopy request, so the snapshot only ever sees the RAM content of
+ * the snapshot point, and the migration thread does not have to look at
+ * the userfaultfd for every page it sends.
+ */
+#if defined(__linux__) && defined(__NR_userfaultfd)
+
+static void uffd_unregister(int fd, void *addr, uint64_t len)
+{
+    struct uffdio_range range_struct;
+
+    range_struct.start = (uintptr_t)addr;
+    range_struct.len = len;
+    if (ioctl(fd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s: userfault unregister %s", __func__,
+                     strerror(errno));
+    }
+}
+
+/**
+ * uffd_open_wp: open a userfaultfd that reports write protection faults
+ *
+ * Returns the file descriptor or -1 on error
+ *
+ * @errp: pointer to an error
+ */
+static int uffd_open_wp(Error **errp)
+{
+    struct uffdio_api api_struct;
+    int fd;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "userfaultfd not available");
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(fd, UFFDIO_API, &api_struct)) {
+        error_setg_errno(errp, errno,
+                         "userfaultfd write protection not supported");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * uffd_register_wp: register a range for write protection faults
+ *
+ * Returns 0 for success or -1 on error
+ *
+ * @fd: userfaultfd from uffd_open_wp()
+ * @addr: start of the range
+ * @len: length of the range
+ * @errp: pointer to an error
+ */
+static int uffd_register_wp(int fd, void *addr, uint64_t len, Error **errp)
+{
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)addr;
+    reg_struct.range.len = len;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(fd, UFFDIO_REGISTER, &reg_struct)) {
+        error_setg_errno(errp, errno, "userfaultfd register failed");
+        return -1;
+    }
+
+    /* Only anonymous memory can be write-protected for now */
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_setg(errp, "memory does not support userfaultfd write "
+                   "protection");
+        uffd_unregister(fd, addr, len);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * uffd_change_protection: write-protect or unprotect a range
+ *
+ * Unprotecting wakes up the threads that faulted on the range.
+ *
+ * Returns 0 for success or negative errno on error
+ *
+ * @fd: userfaultfd the range is registered with
+ * @addr: start of the range
+ * @len: length of the range
+ * @wp: whether to protect or unprotect
+ */
+static int uffd_change_protection(int fd, void *addr, uint64_t len, bool wp)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = (uintptr_t)addr;
+    wp_struct.range.len = len;
+    wp_struct.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    if (ioctl(fd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        int err = errno;
+
+        error_report("%s: %s %p/%" PRIu64 " failed: %s", __func__,
+                     wp ? "protect" : "unprotect", addr, len, strerror(err));
+        return -err;
+    }
+
+    return 0;
+}
+
+/* Read-only memory can't change under the snapshot */
+static bool ramblock_skip_write_tracking(RAMBlock *block)
+{
+    return block->mr->readonly || block->mr->rom_device;
+}
+
+/**
+ * ram_write_tracking_check: check that the RAM can be write-tracked
+ *
+ * Returns true if all the migrated RAM blocks support userfaultfd
+ * write protection
+ *
+ * @errp: pointer to an error
+ */
+bool ram_write_tracking_check(Error **errp)
+{
+    RAMBlock *block;
+    bool ret = true;
+    int fd;
+
+    fd = uffd_open_wp(errp);
+    if (fd < 0) {
+        return false;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (ramblock_skip_write_tracking(block)) {
+            continue;
+        }
+        if (uffd_register_wp(fd, block->host, block->max_length, errp)) {
+            error_prepend(errp, "RAM block '%s': ", block->idstr);
+            ret = false;
+            break;
+        }
+        uffd_unregister(fd, block->host, block->max_length);
+    }
+    rcu_read_unlock();
+
+    close(fd);
+    return ret;
+}
+
+/**
+ * ram_write_tracking_prepare: populate the RAM before write-protecting it
+ *
+ * Write protection only applies to mapped pages, a page that is not
+ * populated yet would be filled without faulting.  Reading a page is
+ * enough to map it, and can be done while the guest runs.
+ */
+void ram_write_tracking_prepare(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        size_t pagesize = qemu_ram_pagesize(block);
+        ram_addr_t offset;
+
+        if (ramblock_skip_write_tracking(block)) {
+            continue;
+        }
+        for (offset = 0; offset < block->used_length; offset += pagesize) {
+            char tmp = *((volatile char *)block->host + offset);
+
+            /* Don't optimize the read out */
+            asm volatile("" : "+r" (tmp));
+        }
+    }
+    rcu_read_unlock();
+}
+
+/* Called within an RCU critical section */
+static void ram_write_tracking_release(RAMState *rs)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!(block->flags & RAM_UF_WRITEPROTECT)) {
+            continue;
+        }
+        uffd_change_protection(rs->uffdio_fd, block->host,
+                               block->used_length, false);
+        uffd_unregister(rs->uffdio_fd, block->host, block->max_length);
+        block->flags &= ~RAM_UF_WRITEPROTECT;
+        memory_region_unref(block->mr);
+    }
+
+    close(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
+}
+
+/* Called within an RCU critical section */
+static void ram_write_tracking_fault(RAMState *rs, const struct uffd_msg *msg)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    if (msg->event != UFFD_EVENT_PAGEFAULT ||
+        !(msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+        return;
+    }
+
+    block = qemu_ram_block_from_host((void *)(uintptr_t)
+                                     msg->arg.pagefault.address,
+                                     false, &offset);
+    if (!block) {
+        return;
+    }
+    offset = QEMU_ALIGN_DOWN(offset, qemu_ram_pagesize(block));
+    trace_ram_write_tracking_fault(block->idstr, offset);
+
+    ram_save_queue_block_pages(rs, block, offset, qemu_ram_pagesize(block));
+}
+
+static void *ram_write_tracking_thread(void *opaque)
+{
+    RAMState *rs = opaque;
+    struct uffd_msg msg[16];
+
+    rcu_register_thread();
+
+    for (;;) {
+        struct pollfd pfd[2] = {
+            { .fd = rs->uffdio_fd, .events = POLLIN },
+            { .fd = event_notifier_get_fd(&rs->uffd_quit), .events = POLLIN },
+        };
+        ssize_t res;
+        int i;
+
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: poll: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        if (!(pfd[0].revents & POLLIN)) {
+            continue;
+        }
+
+        res = read(rs->uffdio_fd, msg, sizeof(msg));
+        if (res < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            error_report("%s: read: %s", __func__, strerror(errno));
+            break;
+        }
+
+        rcu_read_lock();
+        for (i = 0; i < res / sizeof(msg[0]); i++) {
+            ram_write_tracking_fault(rs, &msg[i]);
+        }
+        rcu_read_unlock();
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/**
+ * ram_write_tracking_start: write-protect the RAM of a background snapshot
+ *
+ * Called with the VM stopped, at the snapshot point.
+ *
+ * Returns 0 for success or -1 on error
+ */
+int ram_write_tracking_start(void)
+{
+    RAMState *rs = ram_state;
+    Error *local_err = NULL;
+    RAMBlock *block;
+
+    rs->uffdio_fd = uffd_open_wp(&local_err);
+    if (rs->uffdio_fd < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (ramblock_skip_write_tracking(block)) {
+            continue;
+        }
+        if (uffd_register_wp(rs->uffdio_fd, block->host, block->max_length,
+                             &local_err)) {
+            error_report_err(local_err);
+            goto fail;
+        }
+        /* The block must outlive the protection */
+        block->flags |= RAM_UF_WRITEPROTECT;
+        memory_region_ref(block->mr);
+
+        if (uffd_change_protection(rs->uffdio_fd, block->host,
+                                   block->used_length, true)) {
+            goto fail;
+        }
+        trace_ram_write_tracking_ramblock_start(block->idstr,
+                                                block->used_length);
+    }
+
+    if (event_notifier_init(&rs->uffd_quit, false)) {
+        error_report("%s: failed to create event notifier", __func__);
+        goto fail;
+    }
+    qemu_thread_create(&rs->uffd_thread, "uffd_wp", ram_write_tracking_thread,
+                       rs, QEMU_THREAD_JOINABLE);
+    rcu_read_unlock();
+
+    /* The balloon would discard pages under the snapshot */
+    qemu_balloon_inhibit(true);
+    return 0;
+
+fail:
+    ram_write_tracking_release(rs);
+    rcu_read_unlock();
+    return -1;
+}
+
+static void ram_write_tracking_stop(RAMState *rs)
+{
+    if (rs->uffdio_fd < 0) {
+        return;
+    }
+
+    event_notifier_set(&rs->uffd_quit);
+    qemu_thread_join(&rs->uffd_thread);
+    event_notifier_cleanup(&rs->uffd_quit);
+
+    rcu_read_lock();
+    ram_write_tracking_release(rs);
+    rcu_read_unlock();
+
+    qemu_balloon_inhibit(false);
+}
+
+#else /* !__linux__ || !__NR_userfaultfd */
+
+bool ram_write_tracking_check(Error **errp)
+{
+    error_setg(errp, "background snapshot is not supported on this host");
+    return false;
+}
+
+void ram_write_tracking_prepare(void)
+{
+}
+
+int ram_write_tracking_start(void)
+{
+    return -1;
+}
+
+static void ram_write_tracking_stop(RAMState *rs)
+{
+}
+
+static int uffd_change_protection(int fd, void *addr, uint64_t len, bool wp)
+{
+    return -ENOSYS;
+}
+
+#endif
+
 /**
  * unqueue_page: gets a page of the queue
  *
@@ -2256,10 +3071,10 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
     do {
         block = unqueue_page(rs, &offset);
         /*
-         * We're sending this page, and since it's postcopy nothing else
-         * will dirty it, and we must make sure it doesn't get sent again
-         * even if this queue request was received after the background
-         * search already sent it.
+         * We're sending this page, and since it's postcopy or a background
+         * snapshot nothing else will dirty it, and we must make sure it
+         * doesn't get sent again even if this queue request was received
+         * after the background search already sent it.
          */
         if (block) {
             unsigned long page;
@@ -2369,17 +3184,7 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
         goto err;
     }
 
-    struct RAMSrcPageRequest *new_entry =
-        g_malloc0(sizeof(struct RAMSrcPageRequest));
-    new_entry->rb = ramblock;
-    new_entry->offset = start;
-    new_entry->len = len;
-
-    memory_region_ref(ramblock->mr);
-    qemu_mutex_lock(&rs->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
-    migration_make_urgent_request();
-    qemu_mutex_unlock(&rs->src_page_req_mutex);
+    ram_save_queue_block_pages(rs, ramblock, start, len);
     rcu_read_unlock();
 
     return 0;
@@ -2465,6 +3270,15 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    /*
+     * The multifd channels look for zero pages themselves, don't scan
+     * the page twice from the migration thread.
+     */
+    if (!save_page_use_compression(rs) && migrate_use_multifd() &&
+        migrate_multifd_zero_page()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2514,6 +3328,7 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
 
     if (ramblock_is_ignored(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
@@ -2541,11 +3356,76 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     } while ((pss->page & (pagesize_bits - 1)) &&
              offset_in_ramblock(pss->block, pss->page << TARGET_PAGE_BITS));
 
+    /* The pages have been copied out, the guest can write to them again */
+    if (pages > 0 && (pss->block->flags & RAM_UF_WRITEPROTECT)) {
+        int ret = uffd_change_protection(rs->uffdio_fd,
+                      pss->block->host + (start_page << TARGET_PAGE_BITS),
+                      (pss->page - start_page) << TARGET_PAGE_BITS, false);
+        if (ret) {
+            return ret;
+        }
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->page--;
     return pages;
 }
 
+/**
+ * ram_save_host_page_urgent: save a host page requested by the destination
+ *
+ * With postcopy preempt, the page is sent on its own channel and
+ * followed by an end of stream marker so that the destination places it
+ * right away.  Falls back to the main channel until the preempt channel
+ * is connected.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_host_page_urgent(RAMState *rs, PageSearchStatus *pss,
+                                     bool last_stage)
+{
+    QEMUFile *preempt = atomic_read(
+                            &migrate_get_current()->postcopy_qemufile_src);
+    QEMUFile *main_file = rs->f;
+    int pages, ret;
+
+    if (!preempt) {
+        return ram_save_host_page(rs, pss, last_stage);
+    }
+
+    /*
+     * Each channel has its own "last block" on the destination, send
+     * the block name again whenever we switch channel.
+     */
+    rs->f = preempt;
+    rs->last_sent_block = NULL;
+    pages = ram_save_host_page(rs, pss, last_stage);
+    if (pages > 0) {
+        qemu_put_be64(preempt, RAM_SAVE_FLAG_EOS);
+        ram_counters.transferred += 8;
+    }
+    qemu_fflush(preempt);
+    rs->f = main_file;
+    rs->last_sent_block = NULL;
+
+    trace_ram_save_host_page_urgent(pss->block->idstr,
+                                    (uint64_t)pss->page << TARGET_PAGE_BITS,
+                                    pages);
+
+    /* Fail the main channel too, so that postcopy pauses */
+    ret = qemu_file_get_error(preempt);
+    if (ret) {
+        qemu_file_set_error(main_file, ret);
+        return ret;
+    }
+
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2565,7 +3445,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
@@ -2583,13 +3463,16 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     do {
         again = true;
         found = get_queued_page(rs, &pss);
+        urgent = found;
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(rs, &pss, &again);
         }
 
-        if (found) {
+        if (urgent) {
+            pages = ram_save_host_page_urgent(rs, &pss, last_stage);
+        } else if (found) {
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
     } while (!pages && again);
@@ -2683,17 +3566,26 @@ static void ram_save_cleanup(void *opaque)
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against this migration_bitmap
      */
-    memory_global_dirty_log_stop();
+    if (migrate_background_snapshot()) {
+        ram_write_tracking_stop(*rsp);
+    } else {
+        memory_global_dirty_log_stop();
+    }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        g_free(block->clear_bmap);
+        block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    bitmap_sync_threads_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -3182,6 +4074,7 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    (*rsp)->uffdio_fd = -1;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -3196,8 +4089,10 @@ static int ram_state_init(RAMState **rsp)
 
 static void ram_list_init_bitmaps(void)
 {
+    MigrationState *ms = migrate_get_current();
     RAMBlock *block;
     unsigned long pages;
+    uint8_t shift = ms->clear_bitmap_shift;
 
     /* Skip setting bitmap if there is no RAM */
     if (ram_bytes_total()) {
@@ -3205,10 +4100,15 @@ static void ram_list_init_bitmaps(void)
             pages = block->max_length >> TARGET_PAGE_BITS;
             block->bmap = bitmap_new(pages);
             bitmap_set(block->bmap, 0, pages);
+            block->clear_bmap_shift = shift;
+            block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
             if (migrate_postcopy_ram()) {
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
             }
+            if (migrate_fixed_ram()) {
+                block->file_bmap = bitmap_new(pages);
+            }
         }
     }
 }
@@ -3221,8 +4121,14 @@ static void ram_init_bitmaps(RAMState *rs)
     rcu_read_lock();
 
     ram_list_init_bitmaps();
-    memory_global_dirty_log_start();
-    migration_bitmap_sync_precopy(rs);
+    /*
+     * A background snapshot saves every page once, as of the snapshot
+     * point; the write tracking replaces the dirty log.
+     */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync_precopy(rs);
+    }
 
     rcu_read_unlock();
     qemu_mutex_unlock_ramlist();
@@ -3327,12 +4233,78 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
-/*
- * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
- * long-running RCU critical section.  When rcu-reclaims in the code
- * start to become numerous it will be necessary to reduce the
- * granularity of these critical sections.
+/*
+ * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
+ * long-running RCU critical section.  When rcu-reclaims in the code
+ * start to become numerous it will be necessary to reduce the
+ * granularity of these critical sections.
+ */
+
+/**
+ * fixed_ram_insert_header: lay out the region of a block in the file
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block we are laying out
+ */
+static int fixed_ram_insert_header(QEMUFile *f, RAMBlock *block)
+{
+    long num_pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    int64_t offset;
+    int ret;
+
+    offset = qemu_get_offset(f);
+    if (offset < 0) {
+        error_report("fixed-ram needs a seekable migration file");
+        return -1;
+    }
+
+    block->bitmap_offset = offset + FIXED_RAM_HDR_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bitmap_size,
+                                   FIXED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    qemu_put_be32(f, FIXED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    /* The bitmap is written once complete, the pages as they are saved */
+    ret = qemu_set_offset(f, block->pages_offset + block->used_length);
+    if (ret) {
+        error_report("%s: can't seek past RAM block %s: %s", __func__,
+                     block->idstr, strerror(-ret));
+        return ret;
+    }
+
+    trace_fixed_ram_insert_header(block->idstr, block->bitmap_offset,
+                                  block->pages_offset);
+    return 0;
+}
+
+/**
+ * fixed_ram_write_bitmaps: write the bitmaps of present pages
+ *
+ * Called within an RCU critical section, once every page has been saved
+ *
+ * @f: QEMUFile where to send the data
  */
+static void fixed_ram_write_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        long num_pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+        unsigned long *le_bitmap = bitmap_new(num_pages);
+
+        bitmap_to_le(le_bitmap, block->file_bmap, num_pages);
+        qemu_put_buffer_at(f, (uint8_t *)le_bitmap, bitmap_size,
+                           block->bitmap_offset);
+        g_free(le_bitmap);
+    }
+}
 
 /**
  * ram_save_setup: Setup RAM for migration
@@ -3350,11 +4322,13 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     if (compress_threads_save_setup()) {
         return -1;
     }
+    bitmap_sync_threads_setup();
 
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp) != 0) {
             compress_threads_save_cleanup();
+            bitmap_sync_threads_cleanup();
             return -1;
         }
     }
@@ -3375,6 +4349,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             qemu_put_be64(f, block->mr->addr);
             qemu_put_byte(f, ramblock_is_ignored(block) ? 1 : 0);
         }
+        if (migrate_fixed_ram() && !ramblock_is_ignored(block)) {
+            if (fixed_ram_insert_header(f, block)) {
+                rcu_read_unlock();
+                return -1;
+            }
+        }
     }
 
     rcu_read_unlock();
@@ -3501,7 +4481,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rcu_read_lock();
 
-    if (!migration_in_postcopy()) {
+    if (!migration_in_postcopy() && !migrate_background_snapshot()) {
         migration_bitmap_sync_precopy(rs);
     }
 
@@ -3527,12 +4507,29 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     flush_compressed_data(rs);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
+    if (migrate_fixed_ram()) {
+        fixed_ram_write_bitmaps(f);
+    }
+
     rcu_read_unlock();
 
     multifd_send_sync_main();
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
+    if (migration_in_postcopy()) {
+        QEMUFile *preempt;
+
+        postcopy_preempt_wait_channel(migrate_get_current());
+        preempt = atomic_read(&migrate_get_current()->postcopy_qemufile_src);
+
+        /* A batch without pages tells the destination we are done */
+        if (preempt) {
+            qemu_put_be64(preempt, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(preempt);
+        }
+    }
+
     return ret;
 }
 
@@ -3608,10 +4605,13 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the RAM_CHANNEL_* the page arrived on
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                             int channel)
 {
-    static RAMBlock *block = NULL;
+    static RAMBlock *last_block[RAM_CHANNEL_MAX];
+    RAMBlock *block = last_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3628,6 +4628,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
     id[len] = 0;
 
     block = qemu_ram_block_by_name(id);
+    last_block[channel] = block;
     if (!block) {
         error_report("Can't find block %s", id);
         return NULL;
@@ -3982,6 +4983,347 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
     return 0;
 }
 
+/*
+ * Lazy restore
+ *
+ * With fixed-ram, every page has a known place in the migration file,
+ * so the destination doesn't need to read the pages before the guest
+ * starts.  As for postcopy, RAM is emptied and registered with
+ * userfaultfd: the postcopy fault thread reads the pages the guest
+ * touches from the file, and a prefetch thread places all the others.
+ * Both run on after the incoming migration has completed, and the
+ * migration file stays open until every page has been placed.
+ */
+
+/* How much the prefetch thread reads at once */
+#define LAZY_RESTORE_PREFETCH_SIZE (2 * 1024 * 1024)
+
+static struct {
+    /* The migration file the pages are read from */
+    QEMUFile *file;
+    /* Whether the incoming migration is over and handed the file to us */
+    bool own_file;
+    /* Whether ram_load_cleanup() left the bitmaps for us to free */
+    bool cleanup_deferred;
+    bool active;
+    bool quit;
+    /* Why the fault or prefetch thread stopped the restore, if it failed */
+    int error;
+    /*
+     * Taken around placing a page, so that the fault and prefetch
+     * threads don't both try to place the same page, and around
+     * scheduling or deleting bh
+     */
+    QemuMutex lock;
+    QemuThread prefetch_thread;
+    /* Finishes the restore once the prefetch thread is done */
+    QEMUBH *bh;
+} lazy_restore;
+
+/*
+ * Read the pages in [@offset, @offset + @len) of @block into @buf; the
+ * pages missing from the file are zero pages
+ */
+static int lazy_restore_read(RAMBlock *block, ram_addr_t offset, size_t len,
+                             uint8_t *buf)
+{
+    unsigned long first = offset >> TARGET_PAGE_BITS;
+    unsigned long last = (offset + len) >> TARGET_PAGE_BITS;
+    unsigned long page;
+
+    if (qemu_get_buffer_at(lazy_restore.file, buf, len,
+                           block->pages_offset + offset) != len) {
+        return -EIO;
+    }
+
+    /* The file may still hold an old copy of the pages that became zero */
+    for (page = find_next_zero_bit(block->file_bmap, last, first);
+         page < last;
+         page = find_next_zero_bit(block->file_bmap, last, page + 1)) {
+        memset(buf + ((page - first) << TARGET_PAGE_BITS), 0,
+               TARGET_PAGE_SIZE);
+    }
+
+    return 0;
+}
+
+static bool lazy_restore_page_is_zero(RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    unsigned long end = page + (qemu_ram_pagesize(block) >> TARGET_PAGE_BITS);
+
+    return find_next_bit(block->file_bmap, end, page) >= end;
+}
+
+/**
+ * ram_lazy_restore_page: place a host page the guest is waiting for
+ *
+ * Called from the postcopy fault thread.
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * @mis: the incoming migration state
+ * @rb: block of the page
+ * @offset: offset of the host page in the block
+ */
+int ram_lazy_restore_page(MigrationIncomingState *mis, RAMBlock *rb,
+                          ram_addr_t offset)
+{
+    void *host = rb->host + offset;
+    uint8_t *buf;
+    int ret = 0;
+
+    trace_ram_lazy_restore_page(rb->idstr, offset);
+
+    qemu_mutex_lock(&lazy_restore.lock);
+    if (ramblock_recv_bitmap_test_byte_offset(rb, offset)) {
+        /* The prefetch thread won, placing the page woke the guest up */
+        goto out;
+    }
+
+    if (lazy_restore_page_is_zero(rb, offset)) {
+        ret = postcopy_place_page_zero(mis, host, rb);
+        goto out;
+    }
+
+    buf = postcopy_get_tmp_page(mis, RAM_CHANNEL_PRECOPY);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    ret = lazy_restore_read(rb, offset, qemu_ram_pagesize(rb), buf);
+    if (!ret) {
+        ret = postcopy_place_page(mis, host, buf, rb);
+    }
+
+out:
+    qemu_mutex_unlock(&lazy_restore.lock);
+    return ret;
+}
+
+/* Place the pages of @block that the guest hasn't touched yet */
+static int lazy_restore_prefetch_block(MigrationIncomingState *mis,
+                                       RAMBlock *block, uint8_t *buf)
+{
+    size_t pagesize = qemu_ram_pagesize(block);
+    size_t chunk = QEMU_ALIGN_UP(LAZY_RESTORE_PREFETCH_SIZE, pagesize);
+    ram_addr_t offset, page;
+    int ret = 0;
+
+    for (offset = 0; offset < block->used_length; offset += chunk) {
+        size_t len = MIN(chunk, block->used_length - offset);
+        unsigned long first = offset >> TARGET_PAGE_BITS;
+        unsigned long last = (offset + len) >> TARGET_PAGE_BITS;
+        bool zero = find_next_bit(block->file_bmap, last, first) >= last;
+
+        if (atomic_read(&lazy_restore.quit)) {
+            break;
+        }
+
+        /* Read outside of the lock, the fault thread has priority */
+        if (!zero) {
+            ret = lazy_restore_read(block, offset, len, buf);
+            if (ret) {
+                break;
+            }
+        }
+
+        qemu_mutex_lock(&lazy_restore.lock);
+        for (page = offset; page < offset + len && !ret; page += pagesize) {
+            if (ramblock_recv_bitmap_test_byte_offset(block, page)) {
+                continue;
+            }
+            if (zero || lazy_restore_page_is_zero(block, page)) {
+                ret = postcopy_place_page_zero(mis, block->host + page, block);
+            } else {
+                ret = postcopy_place_page(mis, block->host + page,
+                                          buf + (page - offset), block);
+            }
+        }
+        qemu_mutex_unlock(&lazy_restore.lock);
+
+        if (ret) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+static void *ram_lazy_restore_prefetch_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    size_t size = MAX(LAZY_RESTORE_PREFETCH_SIZE, mis->largest_page_size);
+    uint8_t *buf = g_malloc(size);
+    RAMBlock *block;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ret = lazy_restore_prefetch_block(mis, block, buf);
+        if (ret) {
+            error_report("%s: failed to restore block %s: %s", __func__,
+                         block->idstr, strerror(-ret));
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    g_free(buf);
+    trace_ram_lazy_restore_prefetch_done(ret);
+
+    /* Every page is there, or never will be */
+    ram_lazy_restore_stop(ret);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void ram_lazy_restore_finish(MigrationIncomingState *mis)
+{
+    RAMBlock *rb;
+
+    trace_ram_lazy_restore_finish();
+
+    qemu_thread_join(&lazy_restore.prefetch_thread);
+    if (postcopy_lazy_restore_cleanup(mis)) {
+        error_report("%s: failed to stop listening for faults", __func__);
+    }
+    qemu_mutex_destroy(&lazy_restore.lock);
+    lazy_restore.active = false;
+
+    if (lazy_restore.cleanup_deferred) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
+            g_free(rb->receivedmap);
+            rb->receivedmap = NULL;
+            g_free(rb->file_bmap);
+            rb->file_bmap = NULL;
+        }
+        lazy_restore.cleanup_deferred = false;
+    }
+
+    if (lazy_restore.own_file) {
+        qemu_fclose(lazy_restore.file);
+        lazy_restore.own_file = false;
+    }
+    lazy_restore.file = NULL;
+}
+
+static void ram_lazy_restore_bh(void *opaque)
+{
+    int ret = lazy_restore.error;
+
+    qemu_mutex_lock(&lazy_restore.lock);
+    qemu_bh_delete(lazy_restore.bh);
+    lazy_restore.bh = NULL;
+    qemu_mutex_unlock(&lazy_restore.lock);
+
+    ram_lazy_restore_finish(opaque);
+
+    /*
+     * Finishing stopped listening for faults, which woke up the vCPUs
+     * waiting for a page, so they can now be stopped
+     */
+    if (ret) {
+        error_report("Lazy restore of RAM failed: %s", strerror(-ret));
+        qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_ERROR);
+    }
+}
+
+/**
+ * ram_lazy_restore_stop: end the lazy restore from its threads
+ *
+ * Called by the prefetch thread once it is done, and by the fault thread
+ * if it stops listening for faults on its own.  The restore is finished
+ * from the main loop.  After an error the guest may wait forever for a
+ * page that will never come, so QEMU shuts down.
+ *
+ * @ret: zero if every page has been placed, negative errno otherwise
+ */
+void ram_lazy_restore_stop(int ret)
+{
+    qemu_mutex_lock(&lazy_restore.lock);
+    if (!atomic_read(&lazy_restore.quit)) {
+        atomic_set(&lazy_restore.quit, true);
+        lazy_restore.error = ret;
+        qemu_bh_schedule(lazy_restore.bh);
+    }
+    qemu_mutex_unlock(&lazy_restore.lock);
+}
+
+/**
+ * ram_lazy_restore_start: start the guest-driven loading of RAM
+ *
+ * Called once the blocks of a fixed-ram stream have been parsed, before
+ * any device state is loaded: devices may read guest RAM while loading.
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * @f: the migration file
+ */
+static int ram_lazy_restore_start(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    /* Drop whatever was written to RAM at startup, e.g. ROMs */
+    if (postcopy_ram_incoming_init(mis) ||
+        postcopy_ram_enable_notify(mis)) {
+        error_report("%s: can't listen for faults", __func__);
+        postcopy_lazy_restore_cleanup(mis);
+        return -EINVAL;
+    }
+
+    lazy_restore.file = f;
+    lazy_restore.quit = false;
+    lazy_restore.error = 0;
+    lazy_restore.active = true;
+    qemu_mutex_init(&lazy_restore.lock);
+    lazy_restore.bh = qemu_bh_new(ram_lazy_restore_bh, mis);
+    qemu_thread_create(&lazy_restore.prefetch_thread, "lazy-restore",
+                       ram_lazy_restore_prefetch_thread, mis,
+                       QEMU_THREAD_JOINABLE);
+
+    trace_ram_lazy_restore_start();
+    return 0;
+}
+
+/**
+ * ram_lazy_restore_take_file: keep the migration file open
+ *
+ * Returns true if a lazy restore still reads from @f and takes care of
+ * closing it
+ *
+ * @f: the migration file, at the end of the incoming migration
+ */
+bool ram_lazy_restore_take_file(QEMUFile *f)
+{
+    if (!lazy_restore.active || lazy_restore.file != f) {
+        return false;
+    }
+
+    lazy_restore.own_file = true;
+    return true;
+}
+
+/* Stop a lazy restore on an incoming migration failure */
+void ram_lazy_restore_cancel(void)
+{
+    if (!lazy_restore.active) {
+        return;
+    }
+
+    qemu_mutex_lock(&lazy_restore.lock);
+    atomic_set(&lazy_restore.quit, true);
+    if (lazy_restore.bh) {
+        qemu_bh_delete(lazy_restore.bh);
+        lazy_restore.bh = NULL;
+    }
+    qemu_mutex_unlock(&lazy_restore.lock);
+    ram_lazy_restore_finish(migration_incoming_get_current());
+}
+
 static int ram_load_cleanup(void *opaque)
 {
     RAMBlock *rb;
@@ -3995,9 +5337,17 @@ static int ram_load_cleanup(void *opaque)
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
 
+    /* A lazy restore still needs the bitmaps, it frees them when done */
+    if (lazy_restore.active) {
+        lazy_restore.cleanup_deferred = true;
+        return 0;
+    }
+
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
         rb->receivedmap = NULL;
+        g_free(rb->file_bmap);
+        rb->file_bmap = NULL;
     }
 
     return 0;
@@ -4024,19 +5374,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the pages that arrive on the preempt channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the RAM_CHANNEL_* that f belongs to
  */
-static int ram_load_postcopy(QEMUFile *f)
+static int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+    void *postcopy_host_page = postcopy_get_tmp_page(mis, channel);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -4065,7 +5417,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -4139,7 +5491,9 @@ static int ram_load_postcopy(QEMUFile *f)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: %#x"
@@ -4170,6 +5524,40 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/**
+ * ram_load_postcopy_preempt: load a batch of pages from the preempt channel
+ *
+ * Waits for the source to send pages that the destination requested,
+ * and places them.  Every batch ends with RAM_SAVE_FLAG_EOS, and a batch
+ * without any page ends the channel.
+ *
+ * Returns 0 after a batch, 1 at the end of the channel, or -errno in
+ * case of error
+ *
+ * @f: QEMUFile of the postcopy preempt channel
+ */
+int ram_load_postcopy_preempt(QEMUFile *f)
+{
+    uint8_t *buf;
+    int ret;
+
+    /* Wait for the next batch outside of the RCU critical section */
+    if (qemu_peek_buffer(f, &buf, sizeof(uint64_t), 0) != sizeof(uint64_t)) {
+        ret = qemu_file_get_error(f);
+        return ret ? ret : -EIO;
+    }
+    if (ldq_be_p(buf) == RAM_SAVE_FLAG_EOS) {
+        qemu_file_skip(f, sizeof(uint64_t));
+        return 1;
+    }
+
+    rcu_read_lock();
+    ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+    rcu_read_unlock();
+
+    return ret;
+}
+
 static bool postcopy_is_advised(void)
 {
     PostcopyState ps = postcopy_state_get();
@@ -4222,6 +5610,95 @@ static void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+/**
+ * fixed_ram_load_block: load the pages of a block from its file region
+ *
+ * Reads the block header, then each run of present pages straight into
+ * guest RAM with a single read.  The pages missing from the file are
+ * zero pages; they are cleared, as something may have been written there
+ * at startup (e.g. the ROMs that rom_reset() copies into RAM).
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * @f: QEMUFile where to receive the data
+ * @block: block we are loading
+ */
+static int fixed_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    long num_pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    uint64_t page_size, bitmap_offset, pages_offset;
+    unsigned long *bitmap;
+    unsigned long set, clear, page;
+    uint32_t version;
+    int ret = 0;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+
+    if (version != FIXED_RAM_HDR_VERSION) {
+        error_report("%s: unsupported fixed-ram version %u for block %s",
+                     __func__, version, block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("%s: mismatched page size %" PRIu64 " for block %s",
+                     __func__, page_size, block->idstr);
+        return -EINVAL;
+    }
+
+    bitmap = bitmap_new(num_pages);
+    if (qemu_get_buffer_at(f, (uint8_t *)bitmap, bitmap_size,
+                           bitmap_offset) != bitmap_size) {
+        error_report("%s: can't read the bitmap of block %s", __func__,
+                     block->idstr);
+        ret = -EIO;
+        goto out;
+    }
+    bitmap_from_le(bitmap, bitmap, num_pages);
+
+    if (migrate_lazy_restore()) {
+        /* The pages are read once the guest runs, see ram_lazy_restore_page */
+        block->file_bmap = bitmap;
+        block->pages_offset = pages_offset;
+        bitmap = NULL;
+        goto skip;
+    }
+
+    for (set = find_first_bit(bitmap, num_pages); set < num_pages;
+         set = find_next_bit(bitmap, num_pages, clear + 1)) {
+        ram_addr_t offset = (ram_addr_t)set << TARGET_PAGE_BITS;
+        size_t len;
+
+        clear = find_next_zero_bit(bitmap, num_pages, set + 1);
+        len = (clear - set) << TARGET_PAGE_BITS;
+        if (qemu_get_buffer_at(f, block->host + offset, len,
+                               pages_offset + offset) != len) {
+            error_report("%s: can't read the pages of block %s", __func__,
+                         block->idstr);
+            ret = -EIO;
+            goto out;
+        }
+    }
+
+    for (page = find_first_zero_bit(bitmap, num_pages); page < num_pages;
+         page = find_next_zero_bit(bitmap, num_pages, page + 1)) {
+        ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+
+        ram_handle_compressed(block->host + offset, 0, TARGET_PAGE_SIZE);
+    }
+
+skip:
+    ret = qemu_set_offset(f, pages_offset + block->used_length);
+    trace_fixed_ram_load_block(block->idstr, bitmap_offset, pages_offset);
+
+out:
+    g_free(bitmap);
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0, invalid_flags = 0;
@@ -4252,7 +5729,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
     }
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -4275,7 +5752,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             /*
              * After going into COLO, we should load the Page into colo_cache.
@@ -4317,6 +5795,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     error_report("block %s should not be migrated !", id);
                     ret = -EINVAL;
                 } else if (block) {
+                    bool skip = ramblock_is_ignored(block);
+
                     if (length != block->used_length) {
                         Error *local_err = NULL;
 
@@ -4341,13 +5821,24 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     if (migrate_ignore_shared()) {
                         hwaddr addr = qemu_get_be64(f);
                         bool ignored = qemu_get_byte(f);
-                        if (ignored != ramblock_is_ignored(block)) {
+                        /*
+                         * A clone maps privately the template RAM that the
+                         * source left out of the stream because it was shared.
+                         */
+                        if (ignored && qemu_ram_is_template(block)) {
+                            skip = true;
+                            if (migrate_lazy_restore()) {
+                                error_report("Template RAM block %s cannot be "
+                                             "restored lazily", id);
+                                ret = -EINVAL;
+                            }
+                        }
+                        if (ignored != skip) {
                             error_report("RAM block %s should %s be migrated",
                                          id, ignored ? "" : "not");
                             ret = -EINVAL;
                         }
-                        if (ramblock_is_ignored(block) &&
-                            block->mr->addr != addr) {
+                        if (skip && block->mr->addr != addr) {
                             error_report("Mismatched GPAs for block %s "
                                          "%" PRId64 "!= %" PRId64,
                                          id, (uint64_t)addr,
@@ -4355,6 +5846,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_fixed_ram() && !skip) {
+                        ret = fixed_ram_load_block(f, block);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4365,6 +5859,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_lazy_restore()) {
+                ret = ram_lazy_restore_start(f);
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -60,6 +60,20 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 /* For incoming postcopy discard */
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+/* For the pages received on the postcopy preempt channel */
+int ram_load_postcopy_preempt(QEMUFile *f);
+
+/* For background snapshots */
+bool ram_write_tracking_check(Error **errp);
+void ram_write_tracking_prepare(void);
+int ram_write_tracking_start(void);
+
+/* For lazy restores */
+int ram_lazy_restore_page(MigrationIncomingState *mis, RAMBlock *rb,
+                          ram_addr_t offset);
+bool ram_lazy_restore_take_file(QEMUFile *f);
+void ram_lazy_restore_stop(int ret);
+void ram_lazy_restore_cancel(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
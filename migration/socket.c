@@ -19,6 +19,7 @@
 
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "qapi/error.h"
 #include "channel.h"
 #include "socket.h"
@@ -40,6 +41,12 @@ void socket_send_channel_create(QIOTaskFunc f, void *data)
                                      f, data, NULL, NULL);
 }
 
+/* Whether extra channels can be connected to the destination */
+bool socket_send_channel_supported(void)
+{
+    return outgoing_args.saddr != NULL;
+}
+
 int socket_send_channel_destroy(QIOChannel *send)
 {
     /* Remove channel */
@@ -157,6 +164,39 @@ void unix_start_outgoing_migration(MigrationState *s,
 }
 
 
+/* Listens for the channels of the incoming migration */
+static QIONetListener *incoming_listener;
+
+static void socket_incoming_listener_close(void)
+{
+    if (incoming_listener) {
+        qio_net_listener_disconnect(incoming_listener);
+        object_unref(OBJECT(incoming_listener));
+        incoming_listener = NULL;
+    }
+}
+
+static void socket_incoming_listener_close_bh(void *opaque)
+{
+    socket_incoming_listener_close();
+}
+
+/*
+ * The incoming migration is over.  Stop listening if some channel never
+ * came, e.g. the postcopy preempt channel of a migration that completed
+ * in precopy: a late connection would start a new incoming migration.
+ */
+void socket_incoming_migration_end(void)
+{
+    /* The postcopy listen thread ends the migration without the BQL */
+    if (qemu_mutex_iothread_locked()) {
+        socket_incoming_listener_close();
+    } else {
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                socket_incoming_listener_close_bh, NULL);
+    }
+}
+
 static void socket_accept_incoming_migration(QIONetListener *listener,
                                              QIOChannelSocket *cioc,
                                              gpointer opaque)
@@ -168,8 +208,7 @@ static void socket_accept_incoming_migration(QIONetListener *listener,
 
     if (migration_has_all_channels()) {
         /* Close listening socket as its no longer needed */
-        qio_net_listener_disconnect(listener);
-        object_unref(OBJECT(listener));
+        socket_incoming_listener_close();
     }
 }
 
@@ -187,6 +226,10 @@ static void socket_start_incoming_migration(SocketAddress *saddr,
         return;
     }
 
+    /* A postcopy recovery listens again */
+    socket_incoming_listener_close();
+    incoming_listener = listener;
+
     qio_net_listener_set_client_func_full(listener,
                                           socket_accept_incoming_migration,
                                           NULL, NULL,
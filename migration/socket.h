@@ -21,8 +21,11 @@
 #include "io/task.h"
 
 void socket_send_channel_create(QIOTaskFunc f, void *data);
+bool socket_send_channel_supported(void);
 int socket_send_channel_destroy(QIOChannel *send);
 
+void socket_incoming_migration_end(void);
+
 void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
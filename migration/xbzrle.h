@@ -18,4 +18,11 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/* For the unit test and benchmark: iterate over the encoder variants */
+bool test_xbzrle_encode_next_accel(void);
+const char *test_xbzrle_encode_accel_name(void);
+/* For the unit test: the portable encoder, the others must match it */
+int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen);
 #endif
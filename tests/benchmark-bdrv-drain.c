@@ -0,0 +1,93 @@
+/*
+ * Block layer drain_all latency benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+
+#define DRAIN_ITERATIONS 100
+
+/* Each disk is a raw format node on top of a null-co protocol node */
+static BlockBackend *open_disk(void)
+{
+    QDict *options = qdict_new();
+
+    qdict_put_str(options, "driver", "raw");
+    qdict_put_str(options, "file.driver", "null-co");
+    qdict_put_str(options, "file.latency-ns", "100000");
+
+    return blk_new_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+}
+
+static void read_cb(void *opaque, int ret)
+{
+    unsigned *completed = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    (*completed)++;
+}
+
+static void test_drain_all_speed(const void *opaque)
+{
+    unsigned nr_disks = GPOINTER_TO_UINT(opaque);
+    BlockBackend **blks = g_new(BlockBackend *, nr_disks);
+    char buf[512];
+    QEMUIOVector qiov;
+    double busy = 0.0, idle = 0.0;
+    unsigned completed;
+    unsigned i, j;
+
+    qemu_iovec_init_buf(&qiov, buf, sizeof(buf));
+
+    for (i = 0; i < nr_disks; i++) {
+        blks[i] = open_disk();
+    }
+
+    for (j = 0; j < DRAIN_ITERATIONS; j++) {
+        completed = 0;
+        for (i = 0; i < nr_disks; i++) {
+            blk_aio_preadv(blks[i], 0, &qiov, 0, read_cb, &completed);
+        }
+
+        g_test_timer_start();
+        bdrv_drain_all();
+        busy += g_test_timer_elapsed();
+        g_assert_cmpint(completed, ==, nr_disks);
+
+        g_test_timer_start();
+        bdrv_drain_all();
+        idle += g_test_timer_elapsed();
+    }
+
+    g_print("%u disks (%u nodes): ", nr_disks, nr_disks * 2);
+    g_print("drain_all %.1f us with one request per disk, %.1f us idle\n",
+            busy * 1e6 / DRAIN_ITERATIONS, idle * 1e6 / DRAIN_ITERATIONS);
+
+    for (i = 0; i < nr_disks; i++) {
+        blk_unref(blks[i]);
+    }
+    g_free(blks);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned i;
+    char name[64];
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 16; i <= 1024; i *= 4) {
+        snprintf(name, sizeof(name), "/bdrv-drain/drain-all/speed-%u", i);
+        g_test_add_data_func(name, GUINT_TO_POINTER(i), test_drain_all_speed);
+    }
+
+    return g_test_run();
+}
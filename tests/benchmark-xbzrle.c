@@ -0,0 +1,137 @@
+/*
+ * XBZRLE encoder/decoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NR_PAGES 256
+
+typedef struct {
+    const char *name;
+    /* number of modified runs per page, and their length */
+    int runs;
+    int run_len;
+} XbzrleDelta;
+
+static const XbzrleDelta deltas[] = {
+    { "unchanged", 0, 0 },
+    { "sparse", 4, 8 },
+    { "scattered", 64, 4 },
+    { "dense", 8, 256 },
+};
+
+static void make_pages(const XbzrleDelta *delta, uint8_t *old_buf,
+                       uint8_t *new_buf)
+{
+    int i, j;
+
+    for (i = 0; i < PAGE_SIZE * NR_PAGES; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, PAGE_SIZE * NR_PAGES);
+
+    for (i = 0; i < NR_PAGES; i++) {
+        uint8_t *page = new_buf + i * PAGE_SIZE;
+
+        for (j = 0; j < delta->runs; j++) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE - delta->run_len);
+            int k;
+
+            for (k = 0; k < delta->run_len; k++) {
+                page[start + k] ^= 0xff;
+            }
+        }
+    }
+}
+
+static double encode_speed(uint8_t *old_buf, uint8_t *new_buf,
+                           uint8_t *dst, int *dlen)
+{
+    double total = 0.0;
+    int i;
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            dlen[i] = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                           new_buf + i * PAGE_SIZE,
+                                           PAGE_SIZE, dst + i * PAGE_SIZE,
+                                           PAGE_SIZE);
+        }
+        total += PAGE_SIZE * NR_PAGES;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    return total / GiB / g_test_timer_last();
+}
+
+static double decode_speed(uint8_t *old_buf, uint8_t *dst, int *dlen)
+{
+    double total = 0.0;
+    int i;
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            /* pages that overflowed would be sent whole */
+            if (dlen[i] > 0) {
+                xbzrle_decode_buffer(dst + i * PAGE_SIZE, dlen[i],
+                                     old_buf + i * PAGE_SIZE, PAGE_SIZE);
+            }
+        }
+        total += PAGE_SIZE * NR_PAGES;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    return total / GiB / g_test_timer_last();
+}
+
+static void test_xbzrle_speed(void)
+{
+    size_t nr = ARRAY_SIZE(deltas);
+    uint8_t *old_buf = g_malloc(nr * PAGE_SIZE * NR_PAGES);
+    uint8_t *new_buf = g_malloc(nr * PAGE_SIZE * NR_PAGES);
+    uint8_t *dst = g_malloc(PAGE_SIZE * NR_PAGES);
+    int *dlen = g_new(int, NR_PAGES);
+    size_t i;
+
+    for (i = 0; i < nr; i++) {
+        make_pages(&deltas[i], old_buf + i * PAGE_SIZE * NR_PAGES,
+                   new_buf + i * PAGE_SIZE * NR_PAGES);
+    }
+
+    /* The encoders can only be walked down once, so do all deltas each */
+    do {
+        for (i = 0; i < nr; i++) {
+            g_print("xbzrle encode %-9s (%s): %.2f GiB/sec\n", deltas[i].name,
+                    test_xbzrle_encode_accel_name(),
+                    encode_speed(old_buf + i * PAGE_SIZE * NR_PAGES,
+                                 new_buf + i * PAGE_SIZE * NR_PAGES,
+                                 dst, dlen));
+        }
+    } while (test_xbzrle_encode_next_accel());
+
+    for (i = 0; i < nr; i++) {
+        encode_speed(old_buf + i * PAGE_SIZE * NR_PAGES,
+                     new_buf + i * PAGE_SIZE * NR_PAGES, dst, dlen);
+        g_print("xbzrle decode %-9s: %.2f GiB/sec\n", deltas[i].name,
+                decode_speed(old_buf + i * PAGE_SIZE * NR_PAGES, dst, dlen));
+    }
+
+    g_free(dlen);
+    g_free(dst);
+    g_free(new_buf);
+    g_free(old_buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/speed", test_xbzrle_speed);
+
+    return g_test_run();
+}
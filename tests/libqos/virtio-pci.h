@@ -22,6 +22,15 @@ typedef struct QVirtioPCIDevice {
     uint16_t config_msix_entry;
     uint64_t config_msix_addr;
     uint32_t config_msix_data;
+
+    int bar_idx;
+
+    /* Regions of the virtio 1.0 layout, as offsets within bar */
+    uint32_t common_cfg_offset;
+    uint32_t notify_cfg_offset;
+    uint32_t notify_off_multiplier;
+    uint32_t isr_cfg_offset;
+    uint32_t device_cfg_offset;
 } QVirtioPCIDevice;
 
 typedef struct QVirtQueuePCI {
@@ -29,9 +38,11 @@ typedef struct QVirtQueuePCI {
     uint16_t msix_entry;
     uint64_t msix_addr;
     uint32_t msix_data;
+    uint32_t notify_offset; /* virtio 1.0 only */
 } QVirtQueuePCI;
 
 extern const QVirtioBus qvirtio_pci;
+extern const QVirtioBus qvirtio_pci_modern;
 
 void virtio_pci_init(QVirtioPCIDevice *dev, QPCIBus *bus, QPCIAddress * addr);
 QVirtioPCIDevice *virtio_pci_new(QPCIBus *bus, QPCIAddress * addr);
@@ -46,6 +57,8 @@ void qvirtio_pci_destructor(QOSGraphObject *obj);
 void qvirtio_pci_start_hw(QOSGraphObject *obj);
 
 
+bool qvirtio_pci_init_virtio_pci_modern(QVirtioPCIDevice *dev);
+
 void qvirtio_pci_device_enable(QVirtioPCIDevice *d);
 void qvirtio_pci_device_disable(QVirtioPCIDevice *d);
 
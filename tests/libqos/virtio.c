@@ -33,15 +33,23 @@ uint64_t qvirtio_config_readq(QVirtioDevice *d, uint64_t addr)
     return d->bus->config_readq(d, addr);
 }
 
-uint32_t qvirtio_get_features(QVirtioDevice *d)
+uint64_t qvirtio_get_features(QVirtioDevice *d)
 {
     return d->bus->get_features(d);
 }
 
-void qvirtio_set_features(QVirtioDevice *d, uint32_t features)
+void qvirtio_set_features(QVirtioDevice *d, uint64_t features)
 {
     d->features = features;
     d->bus->set_features(d, features);
+
+    /* A virtio 1.0 device must accept the features before queue setup */
+    if (features & (1ull << VIRTIO_F_VERSION_1)) {
+        d->bus->set_status(d, d->bus->get_status(d) |
+                           VIRTIO_CONFIG_S_FEATURES_OK);
+        g_assert_cmphex(d->bus->get_status(d) & VIRTIO_CONFIG_S_FEATURES_OK,
+                        ==, VIRTIO_CONFIG_S_FEATURES_OK);
+    }
 }
 
 QVirtQueue *qvirtqueue_setup(QVirtioDevice *d,
@@ -191,6 +199,27 @@ void qvring_init(const QGuestAllocator *alloc, QVirtQueue *vq, uint64_t addr)
     writew(vq->used + 2 + sizeof(struct vring_used_elem) * vq->size, 0);
 }
 
+void qvring_packed_init(const QGuestAllocator *alloc, QVirtQueue *vq,
+                        uint64_t addr)
+{
+    vq->packed = true;
+    vq->desc = addr;
+    vq->avail = vq->desc + vq->size * sizeof(struct vring_packed_desc);
+    vq->used = vq->avail + sizeof(struct vring_packed_desc_event);
+
+    vq->free_head = 0;
+    vq->last_used_idx = 0;
+    vq->avail_wrap_counter = true;
+    vq->used_wrap_counter = true;
+    vq->packed_ndescs = 0;
+    vq->packed_chain_len = g_new0(uint16_t, vq->size);
+
+    /* All descriptors start out used in the (never seen) previous lap, and
+     * notifications are enabled in both directions.
+     */
+    qmemset(addr, 0, qvring_packed_size(vq->size));
+}
+
 QVRingIndirectDesc *qvring_indirect_desc_setup(QVirtioDevice *d,
                                         QGuestAllocator *alloc, uint16_t elem)
 {
@@ -236,10 +265,73 @@ void qvring_indirect_desc_add(QVRingIndirectDesc *indirect, uint64_t data,
     indirect->index++;
 }
 
+/*
+ * The head of a packed chain is written as still used by the previous lap
+ * of the ring, and only made available by qvirtqueue_kick(), so that the
+ * device never sees a partial chain.  The buffer id is the index of the head.
+ */
+static uint32_t qvirtqueue_packed_add(QVirtQueue *vq, uint64_t data,
+                                      uint32_t len, bool write, bool next)
+{
+    uint16_t slot = vq->free_head;
+    uint16_t flags = 0;
+
+    vq->num_free--;
+
+    if (!vq->packed_ndescs) {
+        vq->packed_head = slot;
+    }
+
+    if (write) {
+        flags |= VRING_DESC_F_WRITE;
+    }
+
+    if (next) {
+        flags |= VRING_DESC_F_NEXT;
+    }
+
+    if (vq->avail_wrap_counter) {
+        flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+    } else {
+        flags |= 1 << VRING_PACKED_DESC_F_USED;
+    }
+
+    if (slot == vq->packed_head) {
+        flags ^= 1 << VRING_PACKED_DESC_F_AVAIL;
+    }
+
+    /* vq->desc[slot].addr */
+    writeq(vq->desc + (16 * slot), data);
+    /* vq->desc[slot].len */
+    writel(vq->desc + (16 * slot) + 8, len);
+    /* vq->desc[slot].id */
+    writew(vq->desc + (16 * slot) + 12, vq->packed_head);
+    /* vq->desc[slot].flags */
+    writew(vq->desc + (16 * slot) + 14, flags);
+
+    vq->packed_ndescs++;
+    if (!next) {
+        vq->packed_chain_len[vq->packed_head] = vq->packed_ndescs;
+        vq->packed_ndescs = 0;
+    }
+
+    if (++vq->free_head == vq->size) {
+        vq->free_head = 0;
+        vq->avail_wrap_counter = !vq->avail_wrap_counter;
+    }
+
+    return slot;
+}
+
 uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len, bool write,
                                                                     bool next)
 {
     uint16_t flags = 0;
+
+    if (vq->packed) {
+        return qvirtqueue_packed_add(vq, data, len, write, next);
+    }
+
     vq->num_free--;
 
     if (write) {
@@ -263,6 +355,7 @@ uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len, bool write,
 uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect)
 {
     g_assert(vq->indirect);
+    g_assert(!vq->packed);
     g_assert_cmpint(vq->size, >=, indirect->elem);
     g_assert_cmpint(indirect->index, ==, indirect->elem);
 
@@ -279,15 +372,39 @@ uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect)
     return vq->free_head++; /* Return and increase, in this order */
 }
 
+static void qvirtqueue_packed_kick(QVirtioDevice *d, QVirtQueue *vq,
+                                   uint32_t free_head)
+{
+    /* vq->desc[free_head].flags */
+    uint16_t flags = readw(vq->desc + (16 * free_head) + 14);
+
+    /* Publish the chain */
+    writew(vq->desc + (16 * free_head) + 14,
+           flags ^ (1 << VRING_PACKED_DESC_F_AVAIL));
+
+    /* Must read after the head is published; device event area flags */
+    flags = readw(vq->used + offsetof(struct vring_packed_desc_event, flags));
+    if (flags != VRING_PACKED_EVENT_FLAG_DISABLE) {
+        d->bus->virtqueue_kick(d, vq);
+    }
+}
+
 void qvirtqueue_kick(QVirtioDevice *d, QVirtQueue *vq, uint32_t free_head)
 {
     /* vq->avail->idx */
-    uint16_t idx = readw(vq->avail + 2);
+    uint16_t idx;
     /* vq->used->flags */
     uint16_t flags;
     /* vq->used->avail_event */
     uint16_t avail_event;
 
+    if (vq->packed) {
+        qvirtqueue_packed_kick(d, vq, free_head);
+        return;
+    }
+
+    idx = readw(vq->avail + 2);
+
     /* vq->avail->ring[idx % vq->size] */
     writew(vq->avail + 4 + (2 * (idx % vq->size)), free_head);
     /* vq->avail->idx */
@@ -315,11 +432,50 @@ void qvirtqueue_kick(QVirtioDevice *d, QVirtQueue *vq, uint32_t free_head)
  *
  * Returns: true if an element was ready, false otherwise
  */
+static bool qvirtqueue_packed_get_buf(QVirtQueue *vq, uint32_t *desc_idx,
+                                      uint32_t *len)
+{
+    uint64_t elem_addr = vq->desc + (16 * vq->last_used_idx);
+    uint16_t flags = readw(elem_addr + 14);
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+    uint16_t id;
+
+    if (avail != used || used != vq->used_wrap_counter) {
+        return false;
+    }
+
+    id = readw(elem_addr + 12);
+    g_assert_cmpint(id, <, vq->size);
+    g_assert_cmpint(vq->packed_chain_len[id], !=, 0);
+
+    if (desc_idx) {
+        *desc_idx = id;
+    }
+
+    if (len) {
+        *len = readl(elem_addr + 8);
+    }
+
+    /* The used descriptor stands for the whole chain */
+    vq->last_used_idx += vq->packed_chain_len[id];
+    vq->packed_chain_len[id] = 0;
+    if (vq->last_used_idx >= vq->size) {
+        vq->last_used_idx -= vq->size;
+        vq->used_wrap_counter = !vq->used_wrap_counter;
+    }
+    return true;
+}
+
 bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx, uint32_t *len)
 {
     uint16_t idx;
     uint64_t elem_addr;
 
+    if (vq->packed) {
+        return qvirtqueue_packed_get_buf(vq, desc_idx, len);
+    }
+
     idx = readw(vq->used + offsetof(struct vring_used, idx));
     if (idx == vq->last_used_idx) {
         return false;
@@ -345,6 +501,7 @@ bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx, uint32_t *len)
 void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx)
 {
     g_assert(vq->event);
+    g_assert(!vq->packed);
 
     /* vq->avail->used_event */
     writew(vq->avail + 4 + (2 * vq->size), idx);
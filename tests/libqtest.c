@@ -32,6 +32,7 @@
 
 #define MAX_IRQ 256
 #define SOCKET_TIMEOUT 50
+#define SOCKET_MAX_FDS 16
 
 QTestState *global_qtest;
 
@@ -373,6 +374,38 @@ static void socket_send(int fd, const char *buf, size_t size)
     }
 }
 
+static void socket_send_fds(int socket_fd, int *fds, size_t fds_num,
+                            const char *buf, size_t buf_size)
+{
+    char control[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)] = { 0 };
+    size_t fdsize = sizeof(int) * fds_num;
+    struct iovec iov = { .iov_base = (char *)buf, .iov_len = buf_size };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    g_assert_cmpuint(fds_num, <=, SOCKET_MAX_FDS);
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fdsize);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(fdsize);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), fds, fdsize);
+
+    do {
+        ret = sendmsg(socket_fd, &msg, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    /* The file descriptors go with the first byte, send the rest as usual */
+    g_assert_cmpint(ret, >, 0);
+    socket_send(socket_fd, buf + ret, buf_size - ret);
+}
+
 static void socket_sendf(int fd, const char *fmt, va_list ap)
 {
     gchar *str = g_strdup_vprintf(fmt, ap);
@@ -546,6 +579,12 @@ QDict *qtest_qmp_receive(QTestState *s)
  * a particular EVENT is received.
  */
 void qmp_fd_vsend(int fd, const char *fmt, va_list ap)
+{
+    qmp_fd_vsend_fds(fd, NULL, 0, fmt, ap);
+}
+
+void qmp_fd_vsend_fds(int fd, int *fds, size_t fds_num,
+                      const char *fmt, va_list ap)
 {
     QObject *qobj;
 
@@ -569,7 +608,11 @@ void qmp_fd_vsend(int fd, const char *fmt, va_list ap)
             fprintf(stderr, "%s", str);
         }
         /* Send QMP request */
-        socket_send(fd, str, qstring_get_length(qstr));
+        if (fds_num) {
+            socket_send_fds(fd, fds, fds_num, str, qstring_get_length(qstr));
+        } else {
+            socket_send(fd, str, qstring_get_length(qstr));
+        }
 
         qobject_unref(qstr);
         qobject_unref(qobj);
@@ -581,6 +624,12 @@ void qtest_qmp_vsend(QTestState *s, const char *fmt, va_list ap)
     qmp_fd_vsend(s->qmp_fd, fmt, ap);
 }
 
+void qtest_qmp_vsend_fds(QTestState *s, int *fds, size_t fds_num,
+                         const char *fmt, va_list ap)
+{
+    qmp_fd_vsend_fds(s->qmp_fd, fds, fds_num, fmt, ap);
+}
+
 QDict *qmp_fdv(int fd, const char *fmt, va_list ap)
 {
     qmp_fd_vsend(fd, fmt, ap);
@@ -627,6 +676,19 @@ QDict *qtest_qmp(QTestState *s, const char *fmt, ...)
     return response;
 }
 
+QDict *qtest_qmp_fds(QTestState *s, int *fds, size_t fds_num,
+                     const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    qtest_qmp_vsend_fds(s, fds, fds_num, fmt, ap);
+    va_end(ap);
+
+    /* Receive reply */
+    return qtest_qmp_receive(s);
+}
+
 void qtest_qmp_send(QTestState *s, const char *fmt, ...)
 {
     va_list ap;
@@ -33,6 +33,7 @@ unsigned start_address;
 unsigned end_address;
 bool got_stop;
 static bool uffd_feature_thread_id;
+static bool uffd_feature_wp;
 
 #if defined(__linux__)
 #include <sys/syscall.h>
@@ -63,6 +64,7 @@ static bool ufd_version_check(void)
         return false;
     }
     uffd_feature_thread_id = api_struct.features & UFFD_FEATURE_THREAD_ID;
+    uffd_feature_wp = api_struct.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP;
 
     ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
                  (__u64)1 << _UFFDIO_UNREGISTER;
@@ -272,6 +274,22 @@ static void wait_for_migration_complete(QTestState *who)
     wait_for_migration_status(who, "completed");
 }
 
+/* The destination has no status until it starts loading */
+static void wait_for_incoming_complete(QTestState *who)
+{
+    QDict *rsp_return;
+    bool loading;
+
+    do {
+        usleep(1000);
+        rsp_return = migrate_query(who);
+        loading = qdict_haskey(rsp_return, "status");
+        qobject_unref(rsp_return);
+    } while (!loading);
+
+    wait_for_migration_complete(who);
+}
+
 static void wait_for_migration_pass(QTestState *who)
 {
     uint64_t initial_pass = get_migration_pass(who);
@@ -340,11 +358,14 @@ static void cleanup(const char *filename)
     g_free(path);
 }
 
-static char *get_shmem_opts(const char *mem_size, const char *shmem_path)
+/* A template maps the file privately and never writes to it */
+static char *get_shmem_opts(const char *mem_size, const char *shmem_path,
+                            bool template)
 {
     return g_strdup_printf("-object memory-backend-file,id=mem0,size=%s"
-                           ",mem-path=%s,share=on -numa node,memdev=mem0",
-                           mem_size, shmem_path);
+                           ",mem-path=%s,%s -numa node,memdev=mem0",
+                           mem_size, shmem_path,
+                           template ? "share=off,x-template=on" : "share=on");
 }
 
 static char *SocketAddress_to_str(SocketAddress *addr)
@@ -426,6 +447,19 @@ static void migrate_set_parameter(QTestState *who, const char *parameter,
     migrate_check_parameter(who, parameter, value);
 }
 
+static void migrate_set_parameter_str(QTestState *who, const char *parameter,
+                                      const char *value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %s } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+}
+
 static void migrate_pause(QTestState *who)
 {
     QDict *rsp;
@@ -484,6 +518,15 @@ static void migrate(QTestState *who, const char *uri, const char *fmt, ...)
     qobject_unref(rsp);
 }
 
+static void migrate_incoming(QTestState *who, const char *uri)
+{
+    QDict *rsp;
+
+    rsp = wait_command(who, "{ 'execute': 'migrate-incoming',"
+                            "  'arguments': { 'uri': %s } }", uri);
+    qobject_unref(rsp);
+}
+
 static void migrate_postcopy_start(QTestState *from, QTestState *to)
 {
     QDict *rsp;
@@ -498,13 +541,19 @@ static void migrate_postcopy_start(QTestState *from, QTestState *to)
     qtest_qmp_eventwait(to, "RESUME");
 }
 
+/*
+ * With @use_shmem, the RAM of both guests is backed by the same file; with
+ * @use_template too, the destination is a clone of the source: it maps the
+ * file as a template.
+ */
 static int test_migrate_start(QTestState **from, QTestState **to,
                                const char *uri, bool hide_stderr,
-                               bool use_shmem)
+                               bool use_shmem, bool use_template)
 {
     gchar *cmd_src, *cmd_dst;
     char *bootpath = NULL;
     char *extra_opts = NULL;
+    char *extra_dst = NULL;
     char *shmem_path = NULL;
     const char *arch = qtest_get_arch();
     const char *accel = "kvm:tcg";
@@ -521,7 +570,10 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     bootpath = g_strdup_printf("%s/bootsect", tmpfs);
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
         init_bootfile(bootpath, x86_bootsect);
-        extra_opts = use_shmem ? get_shmem_opts("150M", shmem_path) : NULL;
+        extra_opts = use_shmem ? get_shmem_opts("150M", shmem_path, false)
+                               : NULL;
+        extra_dst = use_shmem ? get_shmem_opts("150M", shmem_path,
+                                               use_template) : NULL;
         cmd_src = g_strdup_printf("-machine accel=%s -m 150M"
                                   " -name source,debug-threads=on"
                                   " -serial file:%s/src_serial"
@@ -534,12 +586,15 @@ static int test_migrate_start(QTestState **from, QTestState **to,
                                   " -drive file=%s,format=raw"
                                   " -incoming %s %s",
                                   accel, tmpfs, bootpath, uri,
-                                  extra_opts ? extra_opts : "");
+                                  extra_dst ? extra_dst : "");
         start_address = X86_TEST_MEM_START;
         end_address = X86_TEST_MEM_END;
     } else if (g_str_equal(arch, "s390x")) {
         init_bootfile_s390x(bootpath);
-        extra_opts = use_shmem ? get_shmem_opts("128M", shmem_path) : NULL;
+        extra_opts = use_shmem ? get_shmem_opts("128M", shmem_path, false)
+                               : NULL;
+        extra_dst = use_shmem ? get_shmem_opts("128M", shmem_path,
+                                               use_template) : NULL;
         cmd_src = g_strdup_printf("-machine accel=%s -m 128M"
                                   " -name source,debug-threads=on"
                                   " -serial file:%s/src_serial -bios %s %s",
@@ -550,11 +605,14 @@ static int test_migrate_start(QTestState **from, QTestState **to,
                                   " -serial file:%s/dest_serial -bios %s"
                                   " -incoming %s %s",
                                   accel, tmpfs, bootpath, uri,
-                                  extra_opts ? extra_opts : "");
+                                  extra_dst ? extra_dst : "");
         start_address = S390_TEST_MEM_START;
         end_address = S390_TEST_MEM_END;
     } else if (strcmp(arch, "ppc64") == 0) {
-        extra_opts = use_shmem ? get_shmem_opts("256M", shmem_path) : NULL;
+        extra_opts = use_shmem ? get_shmem_opts("256M", shmem_path, false)
+                               : NULL;
+        extra_dst = use_shmem ? get_shmem_opts("256M", shmem_path,
+                                               use_template) : NULL;
         cmd_src = g_strdup_printf("-machine accel=%s -m 256M -nodefaults"
                                   " -name source,debug-threads=on"
                                   " -serial file:%s/src_serial"
@@ -568,13 +626,16 @@ static int test_migrate_start(QTestState **from, QTestState **to,
                                   " -serial file:%s/dest_serial"
                                   " -incoming %s %s",
                                   accel, tmpfs, uri,
-                                  extra_opts ? extra_opts : "");
+                                  extra_dst ? extra_dst : "");
 
         start_address = PPC_TEST_MEM_START;
         end_address = PPC_TEST_MEM_END;
     } else if (strcmp(arch, "aarch64") == 0) {
         init_bootfile(bootpath, aarch64_kernel);
-        extra_opts = use_shmem ? get_shmem_opts("150M", shmem_path) : NULL;
+        extra_opts = use_shmem ? get_shmem_opts("150M", shmem_path, false)
+                               : NULL;
+        extra_dst = use_shmem ? get_shmem_opts("150M", shmem_path,
+                                               use_template) : NULL;
         cmd_src = g_strdup_printf("-machine virt,accel=%s,gic-version=max "
                                   "-name vmsource,debug-threads=on -cpu max "
                                   "-m 150M -serial file:%s/src_serial "
@@ -587,7 +648,7 @@ static int test_migrate_start(QTestState **from, QTestState **to,
                                   "-kernel %s "
                                   "-incoming %s %s",
                                   accel, tmpfs, bootpath, uri,
-                                  extra_opts ? extra_opts : "");
+                                  extra_dst ? extra_dst : "");
 
         start_address = ARM_TEST_MEM_START;
         end_address = ARM_TEST_MEM_END;
@@ -599,6 +660,7 @@ static int test_migrate_start(QTestState **from, QTestState **to,
 
     g_free(bootpath);
     g_free(extra_opts);
+    g_free(extra_dst);
 
     if (hide_stderr) {
         gchar *tmp;
@@ -712,18 +774,22 @@ static void test_deprecated(void)
 
 static int migrate_postcopy_prepare(QTestState **from_ptr,
                                      QTestState **to_ptr,
-                                     bool hide_error)
+                                     bool hide_error, bool preempt)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
 
-    if (test_migrate_start(&from, &to, uri, hide_error, false)) {
+    if (test_migrate_start(&from, &to, uri, hide_error, false, false)) {
         return -1;
     }
 
     migrate_set_capability(from, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
+    if (preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
 
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -764,7 +830,18 @@ static void test_postcopy(void)
 {
     QTestState *from, *to;
 
-    if (migrate_postcopy_prepare(&from, &to, false)) {
+    if (migrate_postcopy_prepare(&from, &to, false, false)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_preempt(void)
+{
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, false, true)) {
         return;
     }
     migrate_postcopy_start(from, to);
@@ -776,7 +853,7 @@ static void test_postcopy_recovery(void)
     QTestState *from, *to;
     char *uri;
 
-    if (migrate_postcopy_prepare(&from, &to, true)) {
+    if (migrate_postcopy_prepare(&from, &to, true, false)) {
         return;
     }
 
@@ -834,7 +911,7 @@ static void test_baddest(void)
     char *status;
     bool failed;
 
-    if (test_migrate_start(&from, &to, "tcp:0:0", true, false)) {
+    if (test_migrate_start(&from, &to, "tcp:0:0", true, false, false)) {
         return;
     }
     migrate(from, "tcp:0:0", "{}");
@@ -859,7 +936,7 @@ static void test_precopy_unix(void)
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
 
-    if (test_migrate_start(&from, &to, uri, false, false)) {
+    if (test_migrate_start(&from, &to, uri, false, false, false)) {
         return;
     }
 
@@ -902,7 +979,7 @@ static void test_ignore_shared(void)
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
 
-    if (test_migrate_start(&from, &to, uri, false, true)) {
+    if (test_migrate_start(&from, &to, uri, false, true, false)) {
         return;
     }
 
@@ -937,7 +1014,7 @@ static void test_xbzrle(const char *uri)
 {
     QTestState *from, *to;
 
-    if (test_migrate_start(&from, &to, uri, false, false)) {
+    if (test_migrate_start(&from, &to, uri, false, false, false)) {
         return;
     }
 
@@ -989,7 +1066,8 @@ static void test_precopy_tcp(void)
     char *uri;
     QTestState *from, *to;
 
-    if (test_migrate_start(&from, &to, "tcp:127.0.0.1:0", false, false)) {
+    if (test_migrate_start(&from, &to, "tcp:127.0.0.1:0",
+                           false, false, false)) {
         return;
     }
 
@@ -1027,6 +1105,285 @@ static void test_precopy_tcp(void)
     g_free(uri);
 }
 
+static void test_multifd_tcp(const char *method, bool zero_page)
+{
+    char *uri;
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, "defer", false, false, false)) {
+        return;
+    }
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter(from, "multifd-channels", 16);
+    migrate_set_parameter(to, "multifd-channels", 16);
+
+    migrate_set_parameter_str(from, "multifd-compression", method);
+    migrate_set_parameter_str(to, "multifd-compression", method);
+
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+    if (zero_page) {
+        migrate_set_capability(from, "multifd-zero-page", true);
+        migrate_set_capability(to, "multifd-zero-page", true);
+    }
+
+    /* Start incoming migration from the 1st socket */
+    migrate_incoming(to, "tcp:127.0.0.1:0");
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms it should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_multifd_tcp_none(void)
+{
+    test_multifd_tcp("none", false);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp("none", true);
+}
+
+static void test_multifd_tcp_zlib(void)
+{
+    test_multifd_tcp("zlib", false);
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_tcp_zstd(void)
+{
+    test_multifd_tcp("zstd", false);
+}
+#endif
+
+static void test_fixed_ram(bool lazy_restore)
+{
+    char *path = g_strdup_printf("%s/migfile", tmpfs);
+    char *uri;
+    QTestState *from, *to;
+    QDict *rsp;
+    int fd;
+
+    /*
+     * Both QEMUs inherit fd: the source writes the file, then the
+     * destination reads it back.
+     */
+    fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    g_assert_cmpint(fd, >=, 0);
+    g_free(path);
+
+    if (test_migrate_start(&from, &to, "defer", false, false, false)) {
+        close(fd);
+        return;
+    }
+
+    /* Everything goes in a single pass over the 150M of guest RAM */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    migrate_set_capability(from, "fixed-ram", true);
+    migrate_set_capability(to, "fixed-ram", true);
+    if (lazy_restore) {
+        migrate_set_capability(to, "lazy-restore", true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    rsp = qtest_qmp_fds(from, &fd, 1, "{ 'execute': 'getfd',"
+                        "  'arguments': { 'fdname': 'migfile' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    migrate(from, "fd:migfile", "{}");
+    wait_for_migration_complete(from);
+
+    /* The source moved the file offset we share with the destination */
+    g_assert_cmpint(lseek(fd, 0, SEEK_SET), ==, 0);
+
+    uri = g_strdup_printf("fd:%d", fd);
+    migrate_incoming(to, uri);
+    g_free(uri);
+
+    qtest_qmp_eventwait(to, "RESUME");
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    close(fd);
+    cleanup("migfile");
+}
+
+static void test_fixed_ram_fd(void)
+{
+    test_fixed_ram(false);
+}
+
+static void test_fixed_ram_lazy_restore(void)
+{
+    test_fixed_ram(true);
+}
+
+/*
+ * Snapshot the source while the guest keeps writing to its RAM, and load
+ * the snapshot into a destination that is kept stopped: its RAM must be
+ * that of a single point in time.
+ */
+static void test_background_snapshot(void)
+{
+    char *path = g_strdup_printf("%s/migfile", tmpfs);
+    char *uri;
+    QTestState *from, *to;
+    QDict *rsp;
+    int fd;
+
+    if (!uffd_feature_wp) {
+        g_test_skip("userfaultfd write protection not available");
+        g_free(path);
+        return;
+    }
+
+    fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    g_assert_cmpint(fd, >=, 0);
+    g_free(path);
+
+    if (test_migrate_start(&from, &to, "defer", false, false, false)) {
+        close(fd);
+        return;
+    }
+
+    migrate_set_capability(from, "background-snapshot", true);
+
+    /* Don't let the destination overwrite the snapshot once loaded */
+    qtest_qmp_discard_response(to, "{ 'execute' : 'stop'}");
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    rsp = qtest_qmp_fds(from, &fd, 1, "{ 'execute': 'getfd',"
+                        "  'arguments': { 'fdname': 'migfile' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    migrate(from, "fd:migfile", "{}");
+    wait_for_migration_complete(from);
+
+    /* The guest ran on through the snapshot */
+    g_assert(!got_stop);
+
+    g_assert_cmpint(lseek(fd, 0, SEEK_SET), ==, 0);
+
+    uri = g_strdup_printf("fd:%d", fd);
+    migrate_incoming(to, uri);
+    g_free(uri);
+
+    wait_for_incoming_complete(to);
+    check_guests_ram(to);
+
+    test_migrate_end(from, to, false);
+    close(fd);
+    cleanup("migfile");
+}
+
+/*
+ * Save a paused template with x-ignore-shared, so that only the device
+ * state goes to the file, and start a clone from it: the clone's RAM must
+ * be the template's, which it maps from the shared file.
+ */
+static void test_template(void)
+{
+    char *path = g_strdup_printf("%s/migfile", tmpfs);
+    char *uri;
+    QTestState *from, *to;
+    unsigned address;
+    QDict *rsp;
+    int fd;
+
+    fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    g_assert_cmpint(fd, >=, 0);
+    g_free(path);
+
+    if (test_migrate_start(&from, &to, "defer", false, true, true)) {
+        close(fd);
+        return;
+    }
+
+    migrate_set_capability(from, "x-ignore-shared", true);
+    migrate_set_capability(to, "x-ignore-shared", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /* The template must not change under its clones */
+    qtest_qmp_discard_response(from, "{ 'execute' : 'stop'}");
+    qtest_qmp_discard_response(to, "{ 'execute' : 'stop'}");
+
+    rsp = qtest_qmp_fds(from, &fd, 1, "{ 'execute': 'getfd',"
+                        "  'arguments': { 'fdname': 'migfile' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    migrate(from, "fd:migfile", "{}");
+    wait_for_migration_complete(from);
+
+    /* Check whether shared RAM has been really skipped */
+    g_assert_cmpint(read_ram_property_int(from, "transferred"), <, 1024 * 1024);
+
+    g_assert_cmpint(lseek(fd, 0, SEEK_SET), ==, 0);
+
+    uri = g_strdup_printf("fd:%d", fd);
+    migrate_incoming(to, uri);
+    g_free(uri);
+
+    wait_for_incoming_complete(to);
+
+    for (address = start_address; address < end_address;
+         address += TEST_MEM_PAGE_SIZE) {
+        uint8_t src_byte, dst_byte;
+
+        qtest_memread(from, address, &src_byte, 1);
+        qtest_memread(to, address, &dst_byte, 1);
+        g_assert_cmphex(src_byte, ==, dst_byte);
+    }
+
+    /* The clone runs on from where the template stopped */
+    qtest_qmp_discard_response(to, "{ 'execute' : 'cont'}");
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    close(fd);
+    cleanup("migfile");
+}
+
 int main(int argc, char **argv)
 {
     char template[] = "/tmp/migration-test-XXXXXX";
@@ -1075,12 +1432,30 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
+    qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
+#endif
+    qtest_add_func("/migration/fixed-ram/fd", test_fixed_ram_fd);
+    qtest_add_func("/migration/fixed-ram/lazy-restore",
+                   test_fixed_ram_lazy_restore);
+    qtest_add_func("/migration/background-snapshot",
+                   test_background_snapshot);
+    /* Like ignore_shared, upset on aarch64 TCG */
+    if (g_str_equal(qtest_get_arch(), "i386") ||
+        g_str_equal(qtest_get_arch(), "x86_64")) {
+        qtest_add_func("/migration/template", test_template);
+    }
 
     ret = g_test_run();
 
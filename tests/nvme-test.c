@@ -9,9 +9,16 @@
 
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
 #include "libqtest.h"
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
+#include "block/nvme.h"
+
+#define NVME_QUEUE_SIZE     8
+#define NVME_LBA_SIZE       512
+#define NVME_TIMEOUT_US     (30 * 1000 * 1000)
 
 typedef struct QNvme QNvme;
 
@@ -65,11 +72,195 @@ static void nvmetest_oob_cmb_test(void *obj, void *data, QGuestAllocator *alloc)
     g_assert_cmpint(qpci_io_readl(pdev, bar, cmb_bar_size - 1), !=, 0x44332211);
 }
 
+typedef struct QNvmeQueue {
+    uint16_t qid;
+    uint64_t sq;
+    uint64_t cq;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+} QNvmeQueue;
+
+typedef struct QNvmeTest {
+    QPCIDevice *pdev;
+    QPCIBar bar;
+    uint64_t dbs;   /* shadow doorbells, 0 if not configured */
+    uint64_t eis;   /* EventIdx buffer */
+    QNvmeQueue admin;
+    QNvmeQueue io;
+} QNvmeTest;
+
+static void nvme_queue_init(QNvmeQueue *q, QGuestAllocator *alloc,
+                            uint16_t qid)
+{
+    q->qid = qid;
+    q->sq = guest_alloc(alloc, NVME_QUEUE_SIZE * sizeof(NvmeCmd));
+    q->cq = guest_alloc(alloc, NVME_QUEUE_SIZE * sizeof(NvmeCqe));
+    qmemset(q->cq, 0, NVME_QUEUE_SIZE * sizeof(NvmeCqe));
+    q->sq_tail = q->cq_head = 0;
+    q->phase = 1;
+}
+
+/*
+ * Submit a command and poll for its completion, ringing the doorbells the
+ * way the Linux driver does: with shadow doorbells configured, I/O queues
+ * update the shadow buffer first.  Returns the status field of the CQE.
+ */
+static uint16_t nvme_cmd(QNvmeTest *t, QNvmeQueue *q, void *cmd)
+{
+    uint16_t cid = q->sq_tail;
+    gint64 start_time;
+    NvmeCqe cqe;
+
+    ((NvmeCmd *)cmd)->cid = cpu_to_le16(cid);
+    memwrite(q->sq + q->sq_tail * sizeof(NvmeCmd), cmd, sizeof(NvmeCmd));
+    q->sq_tail = (q->sq_tail + 1) % NVME_QUEUE_SIZE;
+    if (t->dbs && q->qid) {
+        writel(t->dbs + (q->qid << 3), q->sq_tail);
+    }
+    qpci_io_writel(t->pdev, t->bar, 0x1000 + (q->qid << 3), q->sq_tail);
+
+    start_time = g_get_monotonic_time();
+    for (;;) {
+        memread(q->cq + q->cq_head * sizeof(NvmeCqe), &cqe, sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 1) == q->phase) {
+            break;
+        }
+        clock_step(1000);
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TIMEOUT_US);
+    }
+    g_assert_cmpint(le16_to_cpu(cqe.cid), ==, cid);
+
+    if (++q->cq_head == NVME_QUEUE_SIZE) {
+        q->cq_head = 0;
+        q->phase ^= 1;
+    }
+    if (t->dbs && q->qid) {
+        writel(t->dbs + (q->qid << 3) + 4, q->cq_head);
+    }
+    qpci_io_writel(t->pdev, t->bar, 0x1000 + (q->qid << 3) + 4, q->cq_head);
+
+    /* The controller publishes how far it has consumed the queue */
+    if (t->dbs && q->qid) {
+        g_assert_cmpint(readl(t->eis + (q->qid << 3)), ==, q->sq_tail);
+    }
+
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+static void nvme_rw(QNvmeTest *t, uint8_t opcode, uint64_t buf, size_t size)
+{
+    NvmeRwCmd rw = {
+        .opcode = opcode,
+        .nsid = cpu_to_le32(1),
+        .prp1 = cpu_to_le64(buf),
+        .slba = cpu_to_le64(0),
+        .nlb = cpu_to_le16(size / NVME_LBA_SIZE - 1),
+    };
+
+    g_assert_cmpint(nvme_cmd(t, &t->io, &rw), ==, NVME_SUCCESS);
+}
+
+/*
+ * Bring up the controller with one I/O queue pair, optionally with shadow
+ * doorbells configured before the queues are created, and do I/O on it.
+ */
+static void nvmetest_io_common(QNvme *nvme, QGuestAllocator *alloc,
+                               bool dbbuf)
+{
+    QNvmeTest t = { .pdev = &nvme->dev };
+    NvmeIdentify identify = {
+        .opcode = NVME_ADM_CMD_IDENTIFY,
+        .cns = cpu_to_le32(0x01),
+    };
+    NvmeCreateCq create_cq = {
+        .opcode = NVME_ADM_CMD_CREATE_CQ,
+        .cqid = cpu_to_le16(1),
+        .qsize = cpu_to_le16(NVME_QUEUE_SIZE - 1),
+        .cq_flags = cpu_to_le16(NVME_Q_PC),
+    };
+    NvmeCreateSq create_sq = {
+        .opcode = NVME_ADM_CMD_CREATE_SQ,
+        .sqid = cpu_to_le16(1),
+        .qsize = cpu_to_le16(NVME_QUEUE_SIZE - 1),
+        .sq_flags = cpu_to_le16(NVME_Q_PC),
+        .cqid = cpu_to_le16(1),
+    };
+    const size_t size = 4 * KiB;
+    uint64_t buf;
+    uint8_t *data;
+    int i;
+
+    qpci_device_enable(t.pdev);
+    t.bar = qpci_iomap(t.pdev, 0, NULL);
+    g_assert_cmpint(NVME_CAP_DSTRD(qpci_io_readq(t.pdev, t.bar, 0)), ==, 0);
+
+    nvme_queue_init(&t.admin, alloc, 0);
+    qpci_io_writel(t.pdev, t.bar, offsetof(NvmeBar, aqa),
+                   (NVME_QUEUE_SIZE - 1) << 16 | (NVME_QUEUE_SIZE - 1));
+    qpci_io_writeq(t.pdev, t.bar, offsetof(NvmeBar, asq), t.admin.sq);
+    qpci_io_writeq(t.pdev, t.bar, offsetof(NvmeBar, acq), t.admin.cq);
+    qpci_io_writel(t.pdev, t.bar, offsetof(NvmeBar, cc),
+                   1 << CC_EN_SHIFT | 6 << CC_IOSQES_SHIFT |
+                   4 << CC_IOCQES_SHIFT);
+    g_assert(qpci_io_readl(t.pdev, t.bar, offsetof(NvmeBar, csts)) &
+             NVME_CSTS_READY);
+
+    buf = guest_alloc(alloc, size);
+    identify.prp1 = cpu_to_le64(buf);
+    g_assert_cmpint(nvme_cmd(&t, &t.admin, &identify), ==, NVME_SUCCESS);
+    g_assert(readw(buf + offsetof(NvmeIdCtrl, oacs)) & NVME_OACS_DBBUF);
+
+    if (dbbuf) {
+        NvmeCmd config = { .opcode = NVME_ADM_CMD_DBBUF_CONFIG };
+
+        t.dbs = guest_alloc(alloc, 4 * KiB);
+        t.eis = guest_alloc(alloc, 4 * KiB);
+        qmemset(t.dbs, 0, 4 * KiB);
+        qmemset(t.eis, 0, 4 * KiB);
+        config.prp1 = cpu_to_le64(t.dbs);
+        config.prp2 = cpu_to_le64(t.eis);
+        g_assert_cmpint(nvme_cmd(&t, &t.admin, &config), ==, NVME_SUCCESS);
+    }
+
+    nvme_queue_init(&t.io, alloc, 1);
+    create_cq.prp1 = cpu_to_le64(t.io.cq);
+    g_assert_cmpint(nvme_cmd(&t, &t.admin, &create_cq), ==, NVME_SUCCESS);
+    create_sq.prp1 = cpu_to_le64(t.io.sq);
+    g_assert_cmpint(nvme_cmd(&t, &t.admin, &create_sq), ==, NVME_SUCCESS);
+
+    /* Go around the queues a few times so that the phase flips */
+    data = g_malloc(size);
+    for (i = 0; i < 2 * NVME_QUEUE_SIZE; i++) {
+        qmemset(buf, 0xa5, size);
+        nvme_rw(&t, NVME_CMD_WRITE, buf, size);
+
+        /* The drive reads back zeroes, so this checks that data arrived */
+        nvme_rw(&t, NVME_CMD_READ, buf, size);
+        memread(buf, data, size);
+        g_assert(buffer_is_zero(data, size));
+    }
+    g_free(data);
+
+    guest_free(alloc, buf);
+}
+
+static void nvmetest_io(void *obj, void *data, QGuestAllocator *alloc)
+{
+    nvmetest_io_common(obj, alloc, false);
+}
+
+static void nvmetest_dbbuf_io(void *obj, void *data, QGuestAllocator *alloc)
+{
+    nvmetest_io_common(obj, alloc, true);
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
         .extra_device_opts = "addr=04.0,drive=drv0,serial=foo",
-        .before_cmd_line = "-drive id=drv0,if=none,file=null-co://,format=raw",
+        .before_cmd_line = "-drive id=drv0,if=none,file=null-co://,"
+                           "file.read-zeroes=on,format=raw",
     };
 
     add_qpci_address(&opts, &(QPCIAddress) { .devfn = QPCI_DEVFN(4, 0) });
@@ -81,6 +272,13 @@ static void nvme_register_nodes(void)
     qos_add_test("oob-cmb-access", "nvme", nvmetest_oob_cmb_test, &(QOSGraphTestOptions) {
         .edge.extra_device_opts = "cmb_size_mb=2"
     });
+    qos_add_test("io", "nvme", nvmetest_io, NULL);
+    qos_add_test("dbbuf-io", "nvme", nvmetest_dbbuf_io, NULL);
+    qos_add_test("dbbuf-io-iothread", "nvme", nvmetest_dbbuf_io,
+                 &(QOSGraphTestOptions) {
+        .edge.before_cmd_line = "-object iothread,id=nvme-iothread",
+        .edge.extra_device_opts = "iothread=nvme-iothread",
+    });
 }
 
 libqos_init(nvme_register_nodes);
@@ -18,6 +18,7 @@
 #include "qemu/error-report.h"
 #include "qemu/coroutine.h"
 #include "qemu/main-loop.h"
+#include "iothread.h"
 
 static AioContext *ctx;
 
@@ -876,6 +877,68 @@ static void test_queue_chaining(void)
     g_assert_cmpint(data_b.i, ==, data_b.max);
 }
 
+/*
+ * The main loop uses glib, which makes the AioContext fall back from
+ * io_uring, so the io_uring fd monitor is tested in an IOThread.  Use more
+ * handlers than the io_uring sq ring has entries, so that some must wait
+ * for a free sqe.
+ */
+
+#define MANY_NOTIFIERS 768
+
+static int many_n;
+
+static void many_ready_cb(EventNotifier *e)
+{
+    g_assert(event_notifier_test_and_clear(e));
+    atomic_inc(&many_n);
+}
+
+/* Fall back to epoll or ppoll from inside aio_poll(), like on an error */
+static void many_fall_back_bh(void *opaque)
+{
+    aio_prepare(opaque);
+}
+
+static void test_many_event_notifiers(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *ctx2 = iothread_get_aio_context(iothread);
+    EventNotifier *e = g_new(EventNotifier, MANY_NOTIFIERS);
+    int round, i;
+
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        event_notifier_init(&e[i], false);
+        aio_set_event_notifier(ctx2, &e[i], false, many_ready_cb, NULL);
+    }
+
+    for (round = 0; round < 3; round++) {
+        if (round == 1) {
+            aio_bh_schedule_oneshot(ctx2, many_fall_back_bh, ctx2);
+        }
+
+        atomic_set(&many_n, 0);
+        for (i = 0; i < MANY_NOTIFIERS; i++) {
+            event_notifier_set(&e[i]);
+        }
+        while (atomic_mb_read(&many_n) < MANY_NOTIFIERS) {
+            g_usleep(1000);
+        }
+        g_assert_cmpint(atomic_mb_read(&many_n), ==, MANY_NOTIFIERS);
+    }
+
+#ifdef CONFIG_LINUX_IO_URING
+    g_assert(!ctx2->fdmon_io_uring_enabled);
+#endif
+
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        aio_set_event_notifier(ctx2, &e[i], false, NULL, NULL);
+        event_notifier_cleanup(&e[i]);
+    }
+    g_free(e);
+    iothread_join(iothread);
+}
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -900,6 +963,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/event/many",              test_many_event_notifiers);
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
 
@@ -771,6 +771,100 @@ static void test_iothread_drain_subtree(void)
     test_iothread_common(BDRV_SUBTREE_DRAIN, 1);
 }
 
+#define TEST_MULTI_DISKS 3
+
+typedef struct TestMultiDisk {
+    BlockBackend *blk;
+    BlockDriverState *bs;
+    QEMUIOVector qiov;
+    int requests;
+    int completed;
+} TestMultiDisk;
+
+/* Runs in the disk's IOThread and submits the next request from there */
+static void test_iothread_multi_cb(void *opaque, int ret)
+{
+    TestMultiDisk *d = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    if (atomic_fetch_inc(&d->completed) + 1 < d->requests) {
+        g_assert(blk_aio_preadv(d->blk, 0, &d->qiov, 0,
+                                test_iothread_multi_cb, d) != NULL);
+    }
+}
+
+/*
+ * Keeps a request in flight on disks in TEST_MULTI_DISKS different
+ * IOThreads, and drains them all at once.  With @requests > 1 each
+ * completion submits another request while bdrv_drain_all_begin() is
+ * waiting, and drain must wait for those as well.
+ */
+static void test_iothread_drain_all_multi_common(int requests)
+{
+    IOThread *iothread[TEST_MULTI_DISKS];
+    TestMultiDisk disk[TEST_MULTI_DISKS];
+    int i;
+
+    for (i = 0; i < TEST_MULTI_DISKS; i++) {
+        char *name = g_strdup_printf("test-node%d", i);
+
+        iothread[i] = iothread_new();
+        disk[i] = (TestMultiDisk) {
+            .blk        = blk_new(BLK_PERM_ALL, BLK_PERM_ALL),
+            .bs         = bdrv_new_open_driver(&bdrv_test, name, BDRV_O_RDWR,
+                                               &error_abort),
+            .requests   = requests,
+        };
+        qemu_iovec_init_buf(&disk[i].qiov, NULL, 0);
+        blk_insert_bs(disk[i].blk, disk[i].bs, &error_abort);
+        blk_set_aio_context(disk[i].blk, iothread_get_aio_context(iothread[i]));
+        g_free(name);
+    }
+
+    for (i = 0; i < TEST_MULTI_DISKS; i++) {
+        AioContext *ctx = iothread_get_aio_context(iothread[i]);
+
+        aio_context_acquire(ctx);
+        g_assert(blk_aio_preadv(disk[i].blk, 0, &disk[i].qiov, 0,
+                                test_iothread_multi_cb, &disk[i]) != NULL);
+        aio_context_release(ctx);
+    }
+
+    bdrv_drain_all_begin();
+
+    for (i = 0; i < TEST_MULTI_DISKS; i++) {
+        AioContext *ctx = iothread_get_aio_context(iothread[i]);
+
+        g_assert_cmpint(atomic_read(&disk[i].completed), ==, requests);
+        g_assert_cmpint(disk[i].bs->in_flight, ==, 0);
+        g_assert_cmpint(atomic_read(&ctx->block_in_flight), ==, 0);
+    }
+
+    bdrv_drain_all_end();
+
+    for (i = 0; i < TEST_MULTI_DISKS; i++) {
+        AioContext *ctx = iothread_get_aio_context(iothread[i]);
+
+        aio_context_acquire(ctx);
+        blk_set_aio_context(disk[i].blk, qemu_get_aio_context());
+        aio_context_release(ctx);
+
+        bdrv_unref(disk[i].bs);
+        blk_unref(disk[i].blk);
+        iothread_join(iothread[i]);
+    }
+}
+
+static void test_iothread_drain_all_multi(void)
+{
+    test_iothread_drain_all_multi_common(1);
+}
+
+static void test_iothread_drain_all_resubmit(void)
+{
+    test_iothread_drain_all_multi_common(4);
+}
+
 
 typedef struct TestBlockJob {
     BlockJob common;
@@ -1576,6 +1670,10 @@ int main(int argc, char **argv)
     g_test_add_func("/bdrv-drain/iothread/drain", test_iothread_drain);
     g_test_add_func("/bdrv-drain/iothread/drain_subtree",
                     test_iothread_drain_subtree);
+    g_test_add_func("/bdrv-drain/iothread/drain_all/multi",
+                    test_iothread_drain_all_multi);
+    g_test_add_func("/bdrv-drain/iothread/drain_all/resubmit",
+                    test_iothread_drain_all_resubmit);
 
     g_test_add_func("/bdrv-drain/blockjob/drain_all", test_blockjob_drain_all);
     g_test_add_func("/bdrv-drain/blockjob/drain", test_blockjob_drain);
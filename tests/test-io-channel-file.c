@@ -85,6 +85,43 @@ static void test_io_channel_fd(void)
     g_assert_cmpstr(object_get_typename(OBJECT(ioc)),
                     ==,
                     TYPE_QIO_CHANNEL_FILE);
+    g_assert(qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE));
+
+    unlink(TEST_FILE);
+    object_unref(OBJECT(ioc));
+}
+
+
+static void test_io_channel_file_pwrite(void)
+{
+    QIOChannel *ioc;
+    const char zero[8] = { 0 };
+    char buf[8];
+
+    unlink(TEST_FILE);
+    ioc = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_RDWR | O_CREAT | O_TRUNC | O_BINARY, TEST_MASK,
+                          &error_abort));
+    g_assert(qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE));
+
+    g_assert_cmpint(qio_channel_write(ioc, "head", 4, &error_abort), ==, 4);
+    g_assert_cmpint(qio_channel_pwrite(ioc, "tail", 4, 4096, &error_abort),
+                    ==, 4);
+
+    /* Positional I/O leaves the current position alone */
+    g_assert_cmpint(qio_channel_io_seek(ioc, 0, SEEK_CUR, &error_abort),
+                    ==, 4);
+
+    g_assert_cmpint(qio_channel_pread(ioc, buf, 4, 4096, &error_abort),
+                    ==, 4);
+    g_assert(!memcmp(buf, "tail", 4));
+    g_assert_cmpint(qio_channel_pread(ioc, buf, 4, 0, &error_abort), ==, 4);
+    g_assert(!memcmp(buf, "head", 4));
+
+    /* The hole reads back as zeroes */
+    g_assert_cmpint(qio_channel_pread(ioc, buf, 8, 8, &error_abort), ==, 8);
+    g_assert(!memcmp(buf, zero, 8));
 
     unlink(TEST_FILE);
     object_unref(OBJECT(ioc));
@@ -105,6 +142,7 @@ static void test_io_channel_pipe(bool async)
 
     src = QIO_CHANNEL(qio_channel_file_new_fd(fd[1]));
     dst = QIO_CHANNEL(qio_channel_file_new_fd(fd[0]));
+    g_assert(!qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_SEEKABLE));
 
     test = qio_channel_test_new();
     qio_channel_test_run_threads(test, async, src, dst);
@@ -136,6 +174,7 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/file", test_io_channel_file);
     g_test_add_func("/io/channel/file/rdwr", test_io_channel_file_rdwr);
     g_test_add_func("/io/channel/file/fd", test_io_channel_fd);
+    g_test_add_func("/io/channel/file/pwrite", test_io_channel_file_pwrite);
 #ifndef _WIN32
     g_test_add_func("/io/channel/pipe/sync", test_io_channel_pipe_sync);
     g_test_add_func("/io/channel/pipe/async", test_io_channel_pipe_async);
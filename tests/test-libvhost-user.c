@@ -0,0 +1,359 @@
+/*
+ * libvhost-user tests: packed virtqueues and inflight I/O tracking
+ *
+ * The test plays the vhost-user master on one end of a socketpair and
+ * dispatches every message into a VuDev on the other end.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/memfd.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "contrib/libvhost-user/libvhost-user.h"
+#include <sys/eventfd.h>
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, payload.u64)
+#define VHOST_USER_VERSION  1
+
+#define QUEUE_SIZE  8
+#define MEM_SIZE    (64 * 1024)
+
+/* Guest physical layout of the single memory region */
+#define DESC_OFF    0x0
+#define DRIVER_OFF  0x1000
+#define DEVICE_OFF  0x2000
+#define DATA_OFF    0x3000
+
+#define INFLIGHT_ALIGNMENT 64
+
+typedef struct VuTest {
+    VuDev dev;
+    int sock;
+    int mem_fd;
+    uint8_t *mem;
+    int inflight_fd;
+    uint64_t inflight_size;
+    uint64_t features;
+} VuTest;
+
+static void vu_test_panic(VuDev *dev, const char *err)
+{
+    g_error("libvhost-user panic: %s", err);
+}
+
+static void vu_test_set_watch(VuDev *dev, int fd, int condition,
+                              vu_watch_cb cb, void *data)
+{
+}
+
+static void vu_test_remove_watch(VuDev *dev, int fd)
+{
+}
+
+static const VuDevIface vu_test_iface = { };
+
+/* Send one message to the backend and let it process it */
+static void vu_test_send(VuTest *t, int request, VhostUserMsg *msg,
+                         size_t size, int *fds, int fd_num)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))] = { };
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE + size,
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg;
+
+    msg->request = request;
+    msg->flags = VHOST_USER_VERSION;
+    msg->size = size;
+
+    if (fd_num) {
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(fd_num * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_len = CMSG_LEN(fd_num * sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fd_num * sizeof(int));
+    }
+
+    g_assert_cmpint(sendmsg(t->sock, &mh, 0), ==, iov.iov_len);
+    g_assert(vu_dispatch(&t->dev));
+}
+
+/* Read the reply to the last message, returns the fd it carried if any */
+static int vu_test_recv(VuTest *t, VhostUserMsg *msg)
+{
+    char control[CMSG_SPACE(sizeof(int))] = { };
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    int fd = -1;
+
+    g_assert_cmpint(recvmsg(t->sock, &mh, 0), ==, VHOST_USER_HDR_SIZE);
+    g_assert(msg->flags & VHOST_USER_REPLY_MASK);
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    g_assert_cmpint(read(t->sock, &msg->payload, msg->size), ==, msg->size);
+    return fd;
+}
+
+static void vu_test_send_u64(VuTest *t, int request, uint64_t u64)
+{
+    VhostUserMsg msg = { .payload.u64 = u64 };
+
+    vu_test_send(t, request, &msg, sizeof(msg.payload.u64), NULL, 0);
+}
+
+static void vu_test_send_state(VuTest *t, int request, unsigned int num)
+{
+    VhostUserMsg msg = { .payload.state = { .index = 0, .num = num } };
+
+    vu_test_send(t, request, &msg, sizeof(msg.payload.state), NULL, 0);
+}
+
+static void vu_test_send_eventfd(VuTest *t, int request)
+{
+    VhostUserMsg msg = { .payload.u64 = 0 };
+    int fd = eventfd(0, EFD_NONBLOCK);
+
+    g_assert_cmpint(fd, >=, 0);
+    vu_test_send(t, request, &msg, sizeof(msg.payload.u64), &fd, 1);
+}
+
+/*
+ * Connect a fresh VuDev, as after a backend restart.  The inflight region
+ * is allocated by the backend on the first connection and handed back on
+ * the following ones.
+ */
+static void vu_test_connect(VuTest *t, unsigned int vring_base)
+{
+    VhostUserMsg msg;
+    int sv[2];
+    int fd;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    t->sock = sv[0];
+    vu_init(&t->dev, sv[1], vu_test_panic, vu_test_set_watch,
+            vu_test_remove_watch, &vu_test_iface);
+
+    vu_test_send_u64(t, VHOST_USER_SET_FEATURES, t->features);
+    vu_test_send_u64(t, VHOST_USER_SET_PROTOCOL_FEATURES,
+                     1ULL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD);
+
+    if (t->inflight_fd < 0) {
+        msg = (VhostUserMsg) {
+            .payload.inflight = {
+                .num_queues = 1,
+                .queue_size = QUEUE_SIZE,
+            },
+        };
+        vu_test_send(t, VHOST_USER_GET_INFLIGHT_FD, &msg,
+                     sizeof(msg.payload.inflight), NULL, 0);
+        t->inflight_fd = vu_test_recv(t, &msg);
+        g_assert_cmpint(t->inflight_fd, >=, 0);
+        t->inflight_size = msg.payload.inflight.mmap_size;
+    }
+
+    msg = (VhostUserMsg) {
+        .payload.inflight = {
+            .mmap_size = t->inflight_size,
+            .num_queues = 1,
+            .queue_size = QUEUE_SIZE,
+        },
+    };
+    fd = dup(t->inflight_fd);
+    vu_test_send(t, VHOST_USER_SET_INFLIGHT_FD, &msg,
+                 sizeof(msg.payload.inflight), &fd, 1);
+
+    msg = (VhostUserMsg) {
+        .payload.memory = {
+            .nregions = 1,
+            .regions[0] = {
+                .guest_phys_addr = 0,
+                .memory_size = MEM_SIZE,
+                .userspace_addr = (uintptr_t)t->mem,
+            },
+        },
+    };
+    fd = dup(t->mem_fd);
+    vu_test_send(t, VHOST_USER_SET_MEM_TABLE, &msg,
+                 sizeof(msg.payload.memory), &fd, 1);
+
+    vu_test_send_state(t, VHOST_USER_SET_VRING_NUM, QUEUE_SIZE);
+
+    msg = (VhostUserMsg) {
+        .payload.addr = {
+            .index = 0,
+            .desc_user_addr = (uintptr_t)t->mem + DESC_OFF,
+            .avail_user_addr = (uintptr_t)t->mem + DRIVER_OFF,
+            .used_user_addr = (uintptr_t)t->mem + DEVICE_OFF,
+        },
+    };
+    vu_test_send(t, VHOST_USER_SET_VRING_ADDR, &msg,
+                 sizeof(msg.payload.addr), NULL, 0);
+
+    vu_test_send_state(t, VHOST_USER_SET_VRING_BASE, vring_base);
+    vu_test_send_eventfd(t, VHOST_USER_SET_VRING_CALL);
+    vu_test_send_eventfd(t, VHOST_USER_SET_VRING_KICK);
+}
+
+static void vu_test_disconnect(VuTest *t)
+{
+    vu_deinit(&t->dev);
+    close(t->sock);
+}
+
+static void vu_test_init(VuTest *t, uint64_t features)
+{
+    t->mem = qemu_memfd_alloc("vu-test-mem", MEM_SIZE, 0, &t->mem_fd,
+                              &error_abort);
+    t->inflight_fd = -1;
+    t->features = features;
+}
+
+static void vu_test_cleanup(VuTest *t)
+{
+    vu_test_disconnect(t);
+    qemu_memfd_free(t->mem, MEM_SIZE, t->mem_fd);
+    close(t->inflight_fd);
+}
+
+/* Make a descriptor available in the first lap of the packed ring */
+static void vu_test_add_desc(VuTest *t, unsigned int slot, uint16_t id,
+                             uint64_t addr, uint32_t len, uint16_t flags)
+{
+    struct vring_packed_desc *ring = (void *)(t->mem + DESC_OFF);
+
+    ring[slot].addr = addr;
+    ring[slot].len = len;
+    ring[slot].id = id;
+    smp_wmb();
+    ring[slot].flags = flags | 1 << VRING_PACKED_DESC_F_AVAIL;
+}
+
+static void test_inflight_size(void)
+{
+    uint64_t base = (1ULL << VIRTIO_F_VERSION_1);
+    VuTest split = { }, packed = { };
+
+    vu_test_init(&split, base);
+    vu_test_connect(&split, 0);
+    g_assert_cmpint(split.inflight_size, ==,
+                    ROUND_UP(sizeof(VuVirtqInflight) +
+                             sizeof(VuDescStateSplit) * QUEUE_SIZE,
+                             INFLIGHT_ALIGNMENT));
+    vu_test_cleanup(&split);
+
+    vu_test_init(&packed, base | (1ULL << VIRTIO_F_RING_PACKED));
+    vu_test_connect(&packed, 1 << 15 | 1U << 31);
+    g_assert_cmpint(packed.inflight_size, ==,
+                    ROUND_UP(sizeof(VuVirtqInflight) +
+                             sizeof(VuDescStatePacked) * QUEUE_SIZE * 2,
+                             INFLIGHT_ALIGNMENT));
+    vu_test_cleanup(&packed);
+}
+
+/*
+ * Complete the second of two buffers, so that its used descriptor
+ * overwrites the head of the first one in the ring, then restart the
+ * backend: the first buffer must be resubmitted from the inflight
+ * region, and nothing else.
+ */
+static void test_packed_resubmit(void)
+{
+    struct vring_packed_desc *ring;
+    VuTest t = { };
+    VuVirtq *vq;
+    VuVirtqElement *a, *b;
+    /* Both indices at 0, both wrap counters set */
+    unsigned int base = 1 << 15 | 1U << 31;
+
+    vu_test_init(&t, (1ULL << VIRTIO_F_VERSION_1) |
+                     (1ULL << VIRTIO_F_RING_PACKED));
+    ring = (void *)(t.mem + DESC_OFF);
+    vu_test_connect(&t, base);
+    vq = vu_get_queue(&t.dev, 0);
+
+    /* Buffer 5: slots 0-1, buffer 3: slot 2 */
+    vu_test_add_desc(&t, 1, 5, DATA_OFF + 0x100, 1, VRING_DESC_F_WRITE);
+    vu_test_add_desc(&t, 0, 5, DATA_OFF, 16, VRING_DESC_F_NEXT);
+    vu_test_add_desc(&t, 2, 3, DATA_OFF + 0x200, 512, VRING_DESC_F_WRITE);
+
+    a = vu_queue_pop(&t.dev, vq, sizeof(*a));
+    b = vu_queue_pop(&t.dev, vq, sizeof(*b));
+    g_assert_nonnull(a);
+    g_assert_nonnull(b);
+    g_assert_null(vu_queue_pop(&t.dev, vq, sizeof(*b)));
+    g_assert_cmpint(a->index, ==, 5);
+    g_assert_cmpint(a->ndescs, ==, 2);
+    g_assert_cmpint(b->index, ==, 3);
+
+    vu_queue_push(&t.dev, vq, b, 512);
+    free(b);
+    free(a);
+
+    g_assert_cmpint(ring[0].id, ==, 3);
+    g_assert_cmpint(ring[0].flags & (1 << VRING_PACKED_DESC_F_USED), !=, 0);
+
+    vu_test_disconnect(&t);
+    vu_test_connect(&t, base);
+    vq = vu_get_queue(&t.dev, 0);
+
+    a = vu_queue_pop(&t.dev, vq, sizeof(*a));
+    g_assert_nonnull(a);
+    g_assert_cmpint(a->index, ==, 5);
+    g_assert_cmpint(a->out_num, ==, 1);
+    g_assert_cmpint(a->in_num, ==, 1);
+    g_assert(a->out_sg[0].iov_len == 16);
+    g_assert(a->in_sg[0].iov_len == 1);
+    g_assert_null(vu_queue_pop(&t.dev, vq, sizeof(*a)));
+
+    vu_queue_push(&t.dev, vq, a, 1);
+    free(a);
+
+    g_assert_cmpint(ring[1].id, ==, 5);
+    g_assert_cmpint(ring[1].flags & (1 << VRING_PACKED_DESC_F_USED), !=, 0);
+    g_assert_cmpint(vq->inuse, ==, 0);
+
+    /* The next buffer goes right after the consumed ones */
+    vu_test_add_desc(&t, 3, 1, DATA_OFF + 0x300, 512, VRING_DESC_F_WRITE);
+    b = vu_queue_pop(&t.dev, vq, sizeof(*b));
+    g_assert_nonnull(b);
+    g_assert_cmpint(b->index, ==, 1);
+    vu_queue_push(&t.dev, vq, b, 0);
+    free(b);
+
+    vu_test_cleanup(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/libvhost-user/inflight-size", test_inflight_size);
+    g_test_add_func("/libvhost-user/packed/resubmit", test_packed_resubmit);
+
+    return g_test_run();
+}
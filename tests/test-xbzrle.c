@@ -174,6 +174,101 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_decode_runs(void)
+{
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    int i, j, rc, dlen;
+
+    /* Runs of every length, across the vector boundaries */
+    for (i = 0; i < 1000; i++) {
+        int runs = g_test_rand_int_range(1, 64);
+
+        memset(buffer, 0, PAGE_SIZE);
+        memset(test, 0, PAGE_SIZE);
+        for (j = 0; j < runs; j++) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, 130);
+
+            len = MIN(len, PAGE_SIZE - start);
+            memset(buffer + start, j + 1, len);
+        }
+
+        dlen = xbzrle_encode_buffer(test, buffer, PAGE_SIZE, compressed,
+                                    PAGE_SIZE);
+        if (dlen == -1) {
+            continue;
+        }
+        rc = xbzrle_decode_buffer(compressed, dlen, test, PAGE_SIZE);
+        g_assert(rc <= PAGE_SIZE);
+        g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
+/* The encoder in use must output exactly what the portable one does */
+static void test_encode_same_as_int(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    int i, j, k;
+
+    for (i = 0; i < 2000; i++) {
+        int runs = g_test_rand_int_range(0, 64);
+        int max_len = g_test_rand_int_range(1, 130);
+        /* Cut the output short now and then, for the overflow paths */
+        int dlen = g_test_rand_bit() ? PAGE_SIZE :
+                   g_test_rand_int_range(0, PAGE_SIZE);
+        int rc, expected_rc;
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            old_buf[j] = g_test_rand_int();
+        }
+        memcpy(new_buf, old_buf, PAGE_SIZE);
+        for (j = 0; j < runs; j++) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, max_len + 1);
+
+            len = MIN(len, PAGE_SIZE - start);
+            for (k = 0; k < len; k++) {
+                new_buf[start + k] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+
+        expected_rc = xbzrle_encode_buffer_int(old_buf, new_buf, PAGE_SIZE,
+                                               expected, dlen);
+        rc = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                                  dlen);
+        g_assert_cmpint(rc, ==, expected_rc);
+        if (rc > 0) {
+            g_assert(memcmp(compressed, expected, rc) == 0);
+        }
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+    g_free(expected);
+}
+
+static void test_encode_decode_accel(void)
+{
+    do {
+        test_encode_decode_zero();
+        test_encode_decode_unchanged();
+        test_encode_decode_1_byte();
+        test_encode_decode_overflow();
+        test_encode_decode_runs();
+        test_encode_same_as_int();
+    } while (test_xbzrle_encode_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +281,9 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_runs", test_encode_decode_runs);
+    /* Must come last, it walks down the list of accelerated encoders */
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
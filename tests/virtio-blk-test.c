@@ -10,6 +10,7 @@
 
 #include "qemu/osdep.h"
 #include "libqtest.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/bswap.h"
 #include "standard-headers/linux/virtio_blk.h"
 #include "standard-headers/linux/virtio_pci.h"
@@ -675,6 +676,302 @@ static void idx(void *obj, void *u_data, QGuestAllocator *t_alloc)
     qvirtqueue_cleanup(dev->bus, vq, t_alloc);
 }
 
+static uint64_t packed_request(QVirtioDevice *dev, QGuestAllocator *alloc,
+                               QVirtQueue *vq, QVirtioBlkReq *req)
+{
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t status;
+
+    req_addr = virtio_blk_request(alloc, dev, req, 512);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 512, req->type == VIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(dev, vq, free_head);
+
+    qvirtio_wait_used_elem(dev, vq, free_head, NULL, QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    return req_addr;
+}
+
+/*
+ * Run I/O through a packed virtqueue.  Three descriptors per request do not
+ * divide the ring size, so the loop also places chains across the end of the
+ * ring while both wrap counters flip a few times.
+ */
+static void packed(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev = obj;
+    QVirtioDevice *dev = &pdev->vdev;
+    QVirtQueue *vq;
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint64_t features;
+    char *data;
+    int i;
+
+    /* libqos accesses the rings in guest byte order, virtio 1.0 wants LE */
+    if (qtest_big_endian(global_qtest)) {
+        g_test_skip("virtio 1.0 rings are not supported on big-endian guests");
+        return;
+    }
+
+    features = qvirtio_get_features(dev);
+    g_assert(features & (1ull << VIRTIO_F_VERSION_1));
+    g_assert(features & (1ull << VIRTIO_F_RING_PACKED));
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+    g_assert(vq->packed);
+
+    qvirtio_set_driver_ok(dev);
+
+    for (i = 0; i < vq->size; i++) {
+        /* Write request */
+        req.type = VIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+        snprintf(req.data, 512, "TEST%d", i);
+        req_addr = packed_request(dev, t_alloc, vq, &req);
+        guest_free(t_alloc, req_addr);
+
+        /* Read request */
+        req.type = VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = i;
+        memset(req.data, 0, 512);
+        req_addr = packed_request(dev, t_alloc, vq, &req);
+
+        data = g_strdup_printf("TEST%d", i);
+        memread(req_addr + 16, req.data, 512);
+        g_assert_cmpstr(req.data, ==, data);
+        g_free(data);
+        g_free(req.data);
+
+        guest_free(t_alloc, req_addr);
+    }
+
+    /* 2 * size requests of 3 descriptors: exactly six laps of the ring */
+    g_assert_cmpint(vq->free_head, ==, 0);
+    g_assert_cmpint(vq->last_used_idx, ==, 0);
+    g_assert(vq->avail_wrap_counter && vq->used_wrap_counter);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+#define MQ_NUM_QUEUES 4
+
+static uint32_t mq_request(QVirtioDevice *dev, QGuestAllocator *alloc,
+                           QVirtQueue *vq, QVirtioBlkReq *req,
+                           uint64_t *req_addr)
+{
+    uint32_t free_head;
+
+    *req_addr = virtio_blk_request(alloc, dev, req, 512);
+
+    free_head = qvirtqueue_add(vq, *req_addr, 16, false, true);
+    qvirtqueue_add(vq, *req_addr + 16, 512, req->type == VIRTIO_BLK_T_IN,
+                   true);
+    qvirtqueue_add(vq, *req_addr + 528, 1, true, false);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    return free_head;
+}
+
+/*
+ * Spread the virtqueues over two IOThreads, see the iothread-vq-mapping
+ * property, and keep a request in flight on each of them at once.
+ */
+static void multiqueue(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev = obj;
+    QVirtioDevice *dev = &pdev->vdev;
+    QVirtQueue *vq[MQ_NUM_QUEUES];
+    uint32_t free_head[MQ_NUM_QUEUES];
+    uint64_t req_addr[MQ_NUM_QUEUES];
+    QVirtioBlkReq req;
+    uint64_t features;
+    char *data, *expected;
+    int i, round;
+
+    features = qvirtio_get_features(dev);
+    g_assert(features & (1u << VIRTIO_BLK_F_MQ));
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    g_assert_cmpint(qvirtio_config_readw(dev,
+                        offsetof(struct virtio_blk_config, num_queues)),
+                    ==, MQ_NUM_QUEUES);
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        vq[i] = qvirtqueue_setup(dev, t_alloc, i);
+    }
+
+    qvirtio_set_driver_ok(dev);
+
+    for (round = 0; round < 4; round++) {
+        /* Write requests */
+        for (i = 0; i < MQ_NUM_QUEUES; i++) {
+            req.type = VIRTIO_BLK_T_OUT;
+            req.ioprio = 1;
+            req.sector = round * MQ_NUM_QUEUES + i;
+            req.data = g_malloc0(512);
+            snprintf(req.data, 512, "TEST%d", round * MQ_NUM_QUEUES + i);
+            free_head[i] = mq_request(dev, t_alloc, vq[i], &req,
+                                      &req_addr[i]);
+            g_free(req.data);
+        }
+        for (i = 0; i < MQ_NUM_QUEUES; i++) {
+            qvirtio_wait_used_elem(dev, vq[i], free_head[i], NULL,
+                                   QVIRTIO_BLK_TIMEOUT_US);
+            g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+            guest_free(t_alloc, req_addr[i]);
+        }
+
+        /* Read requests, each from a sector written through another queue */
+        for (i = 0; i < MQ_NUM_QUEUES; i++) {
+            req.type = VIRTIO_BLK_T_IN;
+            req.ioprio = 1;
+            req.sector = round * MQ_NUM_QUEUES + (i + 1) % MQ_NUM_QUEUES;
+            req.data = g_malloc0(512);
+            free_head[i] = mq_request(dev, t_alloc, vq[i], &req,
+                                      &req_addr[i]);
+            g_free(req.data);
+        }
+        for (i = 0; i < MQ_NUM_QUEUES; i++) {
+            qvirtio_wait_used_elem(dev, vq[i], free_head[i], NULL,
+                                   QVIRTIO_BLK_TIMEOUT_US);
+            g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+
+            expected = g_strdup_printf("TEST%d", round * MQ_NUM_QUEUES +
+                                       (i + 1) % MQ_NUM_QUEUES);
+            data = g_malloc0(512);
+            memread(req_addr[i] + 16, data, 512);
+            g_assert_cmpstr(data, ==, expected);
+            g_free(expected);
+            g_free(data);
+            guest_free(t_alloc, req_addr[i]);
+        }
+    }
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtqueue_cleanup(dev->bus, vq[i], t_alloc);
+    }
+}
+
+#define MERGE_BURST  16
+#define MERGE_ROUNDS 16
+
+static int64_t blockstats_wr_merged(const char *device)
+{
+    QDict *rsp, *stats;
+    QList *list;
+    QListEntry *entry;
+    int64_t merged = -1;
+
+    rsp = qmp("{ 'execute': 'query-blockstats' }");
+    list = qdict_get_qlist(rsp, "return");
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *dev = qobject_to(QDict, entry->value);
+
+        if (!strcmp(qdict_get_str(dev, "device"), device)) {
+            stats = qdict_get_qdict(dev, "stats");
+            merged = qdict_get_int(stats, "wr_merged");
+        }
+    }
+    qobject_unref(rsp);
+
+    g_assert_cmpint(merged, >=, 0);
+    return merged;
+}
+
+/*
+ * Kick the virtqueue once per sequential write while the earlier writes are
+ * still in flight, see the merge-window-us property.  The requests never
+ * share a batch, so they can only be merged if the device holds them back.
+ * The descriptors are set up before the first kick so that the kicks follow
+ * each other closely.
+ */
+static void merge_window(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev = obj;
+    QVirtioDevice *dev = &pdev->vdev;
+    QVirtQueue *vq;
+    QVirtioBlkReq req;
+    uint32_t free_head[MERGE_BURST];
+    uint64_t req_addr[MERGE_BURST];
+    uint64_t features;
+    gint64 start_time;
+    int i, round, done;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+
+    qvirtio_set_driver_ok(dev);
+
+    g_assert_cmpint(blockstats_wr_merged("drive0"), ==, 0);
+
+    for (round = 0; round < MERGE_ROUNDS; round++) {
+        for (i = 0; i < MERGE_BURST; i++) {
+            req.type = VIRTIO_BLK_T_OUT;
+            req.ioprio = 1;
+            req.sector = round * MERGE_BURST + i;
+            req.data = g_malloc0(512);
+            req_addr[i] = virtio_blk_request(t_alloc, dev, &req, 512);
+            g_free(req.data);
+
+            free_head[i] = qvirtqueue_add(vq, req_addr[i], 16, false, true);
+            qvirtqueue_add(vq, req_addr[i] + 16, 512, false, true);
+            qvirtqueue_add(vq, req_addr[i] + 528, 1, true, false);
+        }
+
+        for (i = 0; i < MERGE_BURST; i++) {
+            qvirtqueue_kick(dev, vq, free_head[i]);
+        }
+
+        /* Merged requests may complete in any order */
+        start_time = g_get_monotonic_time();
+        for (done = 0; done < MERGE_BURST; ) {
+            uint32_t head;
+
+            if (qvirtqueue_get_buf(vq, &head, NULL)) {
+                done++;
+                continue;
+            }
+            clock_step(100);
+            g_assert(g_get_monotonic_time() - start_time <=
+                     QVIRTIO_BLK_TIMEOUT_US);
+        }
+
+        for (i = 0; i < MERGE_BURST; i++) {
+            g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+            guest_free(t_alloc, req_addr[i]);
+        }
+    }
+
+    g_assert_cmpint(blockstats_wr_merged("drive0"), >, 0);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void pci_hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioPCIDevice *dev1 = obj;
@@ -758,6 +1055,24 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_test_iothread_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line, " -object iothread,id=iothread0 "
+                    "-object iothread,id=iothread1 ");
+
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
+/* Keep requests in flight long enough for several kicks to follow them */
+static void *virtio_blk_test_merge_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -drive if=none,id=drive0,driver=null-co,"
+                    "latency-ns=20000000 ");
+
+    return arg;
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -775,6 +1090,19 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.edge.extra_device_opts = "disable-legacy=on,packed=on";
+    qos_add_test("packed", "virtio-blk-pci", packed, &opts);
+
+    opts.before = virtio_blk_test_iothread_setup;
+    opts.edge.extra_device_opts = "num-queues=" stringify(MQ_NUM_QUEUES)
+        ",len-iothread-vq-mapping=2,"
+        "iothread-vq-mapping[0]=iothread0,iothread-vq-mapping[1]=iothread1";
+    qos_add_test("multiqueue", "virtio-blk-pci", multiqueue, &opts);
+
+    opts.before = virtio_blk_test_merge_setup;
+    opts.edge.extra_device_opts = "merge-window-us=1000";
+    qos_add_test("merge-window", "virtio-blk-pci", merge_window, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
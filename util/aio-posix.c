@@ -19,10 +19,14 @@
 #include "qemu/rcu_queue.h"
 #include "qemu/sockets.h"
 #include "qemu/cutils.h"
+#include "qemu/error-report.h"
 #include "trace.h"
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+#include <poll.h>
+#endif
 
 struct AioHandler
 {
@@ -36,6 +40,14 @@ struct AioHandler
     void *opaque;
     bool is_external;
     QLIST_ENTRY(AioHandler) node;
+#ifdef CONFIG_LINUX_IO_URING
+    QSLIST_ENTRY(AioHandler) node_submitted;
+    QLIST_ENTRY(AioHandler) node_removing;
+    unsigned io_uring_flags;    /* FDMON_IO_URING_* */
+    bool io_uring_multishot;    /* handler drains the fd, see below */
+    bool io_uring_armed;        /* a POLL_ADD is in flight */
+    bool io_uring_removing;     /* a POLL_REMOVE is in flight */
+#endif
 };
 
 #ifdef CONFIG_EPOLL_CREATE1
@@ -187,6 +199,419 @@ static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
 
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+
+/*
+ * io_uring fd monitoring
+ *
+ * Each handler is armed with an IORING_OP_POLL_ADD whose user_data points to
+ * the handler.  Registration changes are not submitted right away; they are
+ * queued on ctx->fdmon_submit_list and go to the kernel together with the
+ * next wait, so that aio_poll() needs a single io_uring_enter() per
+ * iteration no matter how many handlers changed.
+ *
+ * Event notifiers use multishot polls, which stay armed across completions.
+ * Multishot polls only complete on wakeups, i.e. they are edge-triggered;
+ * that is fine for event notifiers because their handlers always drain the
+ * eventfd, but other handlers rely on level-triggered semantics and are
+ * armed with one-shot polls that are re-armed after each completion.
+ *
+ * Freeing a handler is tricky because the kernel may still complete its
+ * POLL_ADD.  Once the handler list is done with a handler, it is queued
+ * with FDMON_IO_URING_REMOVE and freed only after its POLL_ADD is gone.
+ *
+ * A full ring is not an error: when no sqe is available even after
+ * submitting and reaping completions, the change stays queued for the next
+ * aio_poll() iteration.  Only a hard error from io_uring_enter() makes the
+ * AioContext fall back to epoll or ppoll for good.
+ */
+
+/*
+ * sq ring size, the cq ring is twice as large.  Each handler needs one sqe
+ * to be armed and can have one cqe pending, so this covers a few hundred
+ * handlers without going through the slow paths of get_sqe().
+ */
+#define FDMON_IO_URING_ENTRIES  512
+
+/* AioHandler::io_uring_flags */
+enum {
+    FDMON_IO_URING_PENDING  = (1 << 0), /* on ctx->fdmon_submit_list */
+    FDMON_IO_URING_ADD      = (1 << 1), /* POLL_ADD needed */
+    FDMON_IO_URING_REMOVE   = (1 << 2), /* disarm and free the handler */
+};
+
+static bool aio_io_uring_enabled(AioContext *ctx)
+{
+    /* Fall back to ppoll when external clients are disabled. */
+    return !aio_external_disabled(ctx) && ctx->fdmon_io_uring_enabled;
+}
+
+static inline int poll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? POLLIN : 0) |
+           (pfd_events & G_IO_OUT ? POLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? POLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? POLLERR : 0);
+}
+
+static inline int pfd_events_from_poll(int poll_events)
+{
+    return (poll_events & POLLIN ? G_IO_IN : 0) |
+           (poll_events & POLLOUT ? G_IO_OUT : 0) |
+           (poll_events & POLLHUP ? G_IO_HUP : 0) |
+           (poll_events & POLLERR ? G_IO_ERR : 0);
+}
+
+/* Can be called from any thread with ctx->list_lock taken */
+static void aio_io_uring_enqueue(AioContext *ctx, AioHandler *node,
+                                 unsigned flags)
+{
+    unsigned old_flags;
+
+    old_flags = atomic_fetch_or(&node->io_uring_flags,
+                                FDMON_IO_URING_PENDING | flags);
+    if (!(old_flags & FDMON_IO_URING_PENDING)) {
+        QSLIST_INSERT_HEAD_ATOMIC(&ctx->fdmon_submit_list, node,
+                                  node_submitted);
+    }
+}
+
+static void process_cq_ring(AioContext *ctx);
+
+/*
+ * Returns NULL if the ring has no room for another sqe even after the
+ * pending ones were submitted.  The caller must then retry later.
+ */
+static struct io_uring_sqe *get_sqe(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->fdmon_io_uring;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    int ret;
+
+    if (likely(sqe)) {
+        return sqe;
+    }
+
+    /* No free sqes left, submit pending sqes first */
+    do {
+        ret = io_uring_submit(ring);
+        if (ret == -EBUSY || ret == -EAGAIN) {
+            /*
+             * The cq ring is full, or the kernel is short of memory.
+             * Make room by reaping completions, then try once more.
+             */
+            process_cq_ring(ctx);
+            ret = io_uring_submit(ring);
+        }
+    } while (ret == -EINTR);
+
+    if (ret < 0) {
+        /* aio_io_uring_wait() will see hard errors too */
+        return NULL;
+    }
+    return io_uring_get_sqe(ring);
+}
+
+static void add_poll_add_sqe(AioContext *ctx, AioHandler *node)
+{
+    struct io_uring_sqe *sqe = get_sqe(ctx);
+
+    if (!sqe) {
+        aio_io_uring_enqueue(ctx, node, FDMON_IO_URING_ADD);
+        return;
+    }
+
+    io_uring_prep_poll_add(sqe, node->pfd.fd,
+                           poll_events_from_pfd(node->pfd.events));
+#ifdef IORING_POLL_ADD_MULTI
+    if (node->io_uring_multishot && ctx->fdmon_io_uring_multishot) {
+        sqe->len |= IORING_POLL_ADD_MULTI;
+    }
+#endif
+    io_uring_sqe_set_data(sqe, node);
+    node->io_uring_armed = true;
+}
+
+static bool add_poll_remove_sqe(AioContext *ctx, AioHandler *node)
+{
+    struct io_uring_sqe *sqe = get_sqe(ctx);
+
+    if (!sqe) {
+        return false;
+    }
+
+    /* The completion has a zero user_data field */
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)node;
+    return true;
+}
+
+/* Add a timeout that self-cancels when another cqe becomes ready */
+static bool add_timeout_sqe(AioContext *ctx, struct __kernel_timespec *ts)
+{
+    struct io_uring_sqe *sqe = get_sqe(ctx);
+
+    if (!sqe) {
+        return false;
+    }
+
+    io_uring_prep_timeout(sqe, ts, 1, 0);
+    return true;
+}
+
+/* Turn the changes queued by aio_set_fd_handler() into sqes */
+static void fill_sq_ring(AioContext *ctx)
+{
+    QSLIST_HEAD(, AioHandler) submit_list;
+    AioHandler *node;
+    unsigned flags;
+
+    QSLIST_MOVE_ATOMIC(&submit_list, &ctx->fdmon_submit_list);
+
+    while ((node = QSLIST_FIRST(&submit_list))) {
+        QSLIST_REMOVE_HEAD(&submit_list, node_submitted);
+
+        /*
+         * FDMON_IO_URING_REMOVE is sticky so that process_cqe() knows the
+         * handler is going away.
+         */
+        flags = atomic_fetch_and(&node->io_uring_flags,
+                                 ~(FDMON_IO_URING_PENDING |
+                                   FDMON_IO_URING_ADD));
+        if (flags & FDMON_IO_URING_REMOVE) {
+            if (!node->io_uring_armed) {
+                g_free(node);
+            } else if (add_poll_remove_sqe(ctx, node)) {
+                node->io_uring_removing = true;
+                QLIST_INSERT_HEAD(&ctx->fdmon_removing, node, node_removing);
+            } else {
+                aio_io_uring_enqueue(ctx, node, FDMON_IO_URING_REMOVE);
+            }
+        } else if (flags & FDMON_IO_URING_ADD) {
+            add_poll_add_sqe(ctx, node);
+        }
+    }
+}
+
+/* Returns true if a handler became ready */
+static bool process_cqe(AioContext *ctx, struct io_uring_cqe *cqe)
+{
+    AioHandler *node = io_uring_cqe_get_data(cqe);
+    bool more = false;
+
+    /* Timeouts and POLL_REMOVE have a zero user_data field */
+    if (!node) {
+        return false;
+    }
+
+#ifdef IORING_CQE_F_MORE
+    more = cqe->flags & IORING_CQE_F_MORE;
+#endif
+    if (!more) {
+        node->io_uring_armed = false;
+    }
+
+    if (atomic_read(&node->io_uring_flags) & FDMON_IO_URING_REMOVE) {
+        /*
+         * If fill_sq_ring() has not seen the handler yet, it will free it
+         * once it finds it disarmed.
+         */
+        if (!more && node->io_uring_removing) {
+            QLIST_REMOVE(node, node_removing);
+            g_free(node);
+        }
+        return false;
+    }
+
+    /* Waiting to be freed by the handler list, do not re-arm */
+    if (node->deleted) {
+        return false;
+    }
+
+    if (cqe->res < 0) {
+        if (cqe->res == -EINVAL && node->io_uring_multishot &&
+            ctx->fdmon_io_uring_multishot) {
+            /* Multishot polls need Linux 5.13, use one-shot polls instead */
+            ctx->fdmon_io_uring_multishot = false;
+            add_poll_add_sqe(ctx, node);
+        }
+        return false;
+    }
+
+    node->pfd.revents |= pfd_events_from_poll(cqe->res);
+
+    /* One-shot polls, and multishot polls that the kernel ended, re-arm */
+    if (!node->io_uring_armed) {
+        add_poll_add_sqe(ctx, node);
+    }
+    return true;
+}
+
+/*
+ * Adds the number of handlers that became ready to ctx->fdmon_io_uring_ready.
+ * Each cqe is consumed before it is processed, because re-arming a handler
+ * can reap further completions through get_sqe().
+ */
+static void process_cq_ring(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->fdmon_io_uring;
+    struct io_uring_cqe *cqe;
+    struct io_uring_cqe copy;
+
+    while (io_uring_peek_cqe(ring, &cqe) == 0 && cqe) {
+        copy = *cqe;
+        io_uring_cqe_seen(ring, cqe);
+
+        if (process_cqe(ctx, &copy)) {
+            ctx->fdmon_io_uring_ready++;
+        }
+    }
+}
+
+/*
+ * Called with ctx->list_lock taken, or from aio_context_destroy().  All
+ * polls are cancelled, so handlers that were only kept alive for io_uring
+ * can be freed right away.
+ */
+static void aio_io_uring_disable(AioContext *ctx)
+{
+    QSLIST_HEAD(, AioHandler) submit_list;
+    AioHandler *node, *tmp;
+
+    if (!ctx->fdmon_io_uring_enabled) {
+        return;
+    }
+
+    io_uring_queue_exit(&ctx->fdmon_io_uring);
+    ctx->fdmon_io_uring_enabled = false;
+    ctx->fdmon_io_uring_ready = 0;
+
+    QSLIST_MOVE_ATOMIC(&submit_list, &ctx->fdmon_submit_list);
+    while ((node = QSLIST_FIRST(&submit_list))) {
+        QSLIST_REMOVE_HEAD(&submit_list, node_submitted);
+        if (atomic_xchg(&node->io_uring_flags, 0) & FDMON_IO_URING_REMOVE) {
+            g_free(node);
+        }
+    }
+
+    QLIST_FOREACH_SAFE(node, &ctx->fdmon_removing, node_removing, tmp) {
+        QLIST_REMOVE(node, node_removing);
+        g_free(node);
+    }
+}
+
+static int aio_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    struct __kernel_timespec ts;
+    unsigned wait_nr = 1; /* block until at least one cqe is ready */
+    int ret;
+
+    if (timeout == 0) {
+        wait_nr = 0; /* non-blocking */
+    } else if (timeout > 0) {
+        ts = (struct __kernel_timespec) {
+            .tv_sec = timeout / NANOSECONDS_PER_SECOND,
+            .tv_nsec = timeout % NANOSECONDS_PER_SECOND,
+        };
+        if (!add_timeout_sqe(ctx, &ts)) {
+            wait_nr = 0; /* no room for the timeout, do not block */
+        }
+    }
+
+    fill_sq_ring(ctx);
+
+    do {
+        ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, wait_nr);
+    } while (ret == -EINTR);
+
+    if (ret < 0 && ret != -EBUSY && ret != -EAGAIN) {
+        /* Pending cqes are lost, but the fallback polls every handler */
+        warn_report("io_uring fd monitoring failed: %s, falling back to %s",
+                    strerror(-ret),
+                    ctx->epoll_available ? "epoll" : "ppoll");
+        qemu_lockcnt_lock(&ctx->list_lock);
+        aio_io_uring_disable(ctx);
+        qemu_lockcnt_unlock(&ctx->list_lock);
+        return 0;
+    }
+
+    /* -EBUSY and -EAGAIN leave cqes to reap, the next wait submits again */
+    process_cq_ring(ctx);
+
+    ret = ctx->fdmon_io_uring_ready;
+    ctx->fdmon_io_uring_ready = 0;
+    return ret;
+}
+
+static bool aio_io_uring_setup(AioContext *ctx)
+{
+    int ret;
+
+    ret = io_uring_queue_init(FDMON_IO_URING_ENTRIES, &ctx->fdmon_io_uring, 0);
+    if (ret != 0) {
+        return false;
+    }
+
+    QSLIST_INIT(&ctx->fdmon_submit_list);
+    QLIST_INIT(&ctx->fdmon_removing);
+    ctx->fdmon_io_uring_enabled = true;
+#ifdef IORING_POLL_ADD_MULTI
+    ctx->fdmon_io_uring_multishot = true;
+#endif
+    return true;
+}
+
+/* Called with ctx->list_lock taken */
+static void aio_io_uring_add(AioContext *ctx, AioHandler *node)
+{
+    if (ctx->fdmon_io_uring_enabled) {
+        aio_io_uring_enqueue(ctx, node, FDMON_IO_URING_ADD);
+    }
+}
+
+/*
+ * Called with ctx->list_lock taken, once @node has been removed from
+ * ctx->aio_handlers.  Returns true if io_uring takes care of freeing @node.
+ */
+static bool aio_io_uring_release(AioContext *ctx, AioHandler *node)
+{
+    if (!ctx->fdmon_io_uring_enabled) {
+        return false;
+    }
+
+    aio_io_uring_enqueue(ctx, node, FDMON_IO_URING_REMOVE);
+    return true;
+}
+
+#else
+
+static bool aio_io_uring_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static int aio_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    g_assert_not_reached();
+}
+
+static void aio_io_uring_disable(AioContext *ctx)
+{
+}
+
+static void aio_io_uring_add(AioContext *ctx, AioHandler *node)
+{
+}
+
+static bool aio_io_uring_release(AioContext *ctx, AioHandler *node)
+{
+    return false;
+}
+
+#endif
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -225,13 +650,14 @@ static bool aio_remove_fd_handler(AioContext *ctx, AioHandler *node)
     return true;
 }
 
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        bool is_external,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        AioPollFn *io_poll,
-                        void *opaque)
+static void aio_set_fd_handler_common(AioContext *ctx,
+                                      int fd,
+                                      bool is_external,
+                                      IOHandler *io_read,
+                                      IOHandler *io_write,
+                                      AioPollFn *io_poll,
+                                      void *opaque,
+                                      bool is_event_notifier)
 {
     AioHandler *node;
     AioHandler *new_node = NULL;
@@ -267,6 +693,9 @@ void aio_set_fd_handler(AioContext *ctx,
         new_node->io_poll = io_poll;
         new_node->opaque = opaque;
         new_node->is_external = is_external;
+#ifdef CONFIG_LINUX_IO_URING
+        new_node->io_uring_multishot = is_event_notifier;
+#endif
 
         if (is_new) {
             new_node->pfd.fd = fd;
@@ -299,6 +728,12 @@ void aio_set_fd_handler(AioContext *ctx,
         /* Unregister deleted fd_handler */
         aio_epoll_update(ctx, node, false);
     }
+    if (new_node) {
+        aio_io_uring_add(ctx, new_node);
+    }
+    if (deleted && aio_io_uring_release(ctx, node)) {
+        deleted = false;
+    }
     qemu_lockcnt_unlock(&ctx->list_lock);
     aio_notify(ctx);
 
@@ -307,6 +742,18 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 }
 
+void aio_set_fd_handler(AioContext *ctx,
+                        int fd,
+                        bool is_external,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioPollFn *io_poll,
+                        void *opaque)
+{
+    aio_set_fd_handler_common(ctx, fd, is_external, io_read, io_write,
+                              io_poll, opaque, false);
+}
+
 void aio_set_fd_poll(AioContext *ctx, int fd,
                      IOHandler *io_poll_begin,
                      IOHandler *io_poll_end)
@@ -327,8 +774,10 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifierHandler *io_read,
                             AioPollFn *io_poll)
 {
-    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier), is_external,
-                       (IOHandler *)io_read, NULL, io_poll, notifier);
+    /* Event notifier handlers always drain the eventfd */
+    aio_set_fd_handler_common(ctx, event_notifier_get_fd(notifier),
+                              is_external, (IOHandler *)io_read, NULL,
+                              io_poll, notifier, true);
 }
 
 void aio_set_event_notifier_poll(AioContext *ctx,
@@ -378,6 +827,17 @@ bool aio_prepare(AioContext *ctx)
     /* Poll mode cannot be used with glib's event loop, disable it. */
     poll_set_started(ctx, false);
 
+    /* Neither can io_uring, because changes to the monitored file
+     * descriptors are only submitted by aio_poll().  Fall back to epoll.
+     */
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->fdmon_io_uring_enabled) {
+        qemu_lockcnt_lock(&ctx->list_lock);
+        aio_io_uring_disable(ctx);
+        qemu_lockcnt_unlock(&ctx->list_lock);
+    }
+#endif
+
     return false;
 }
 
@@ -445,7 +905,9 @@ static bool aio_dispatch_handlers(AioContext *ctx)
         if (node->deleted) {
             if (qemu_lockcnt_dec_if_lock(&ctx->list_lock)) {
                 QLIST_REMOVE(node, node);
-                g_free(node);
+                if (!aio_io_uring_release(ctx, node)) {
+                    g_free(node);
+                }
                 qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
             }
         }
@@ -644,7 +1106,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
         /* fill pollfds */
 
-        if (!aio_epoll_enabled(ctx)) {
+        if (!aio_io_uring_enabled(ctx) && !aio_epoll_enabled(ctx)) {
             QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
                 if (!node->deleted && node->pfd.events
                     && aio_node_check(ctx, node->is_external)) {
@@ -654,7 +1116,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
 
         /* wait until next event */
-        if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+        if (aio_io_uring_enabled(ctx)) {
+            ret = aio_io_uring_wait(ctx, timeout);
+        } else if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
             AioHandler epoll_handler;
 
             epoll_handler.pfd.fd = ctx->epollfd;
@@ -747,10 +1211,15 @@ void aio_context_setup(AioContext *ctx)
         ctx->epoll_available = true;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* epoll stays available as a fallback, see aio_prepare() */
+    aio_io_uring_setup(ctx);
+#endif
 }
 
 void aio_context_destroy(AioContext *ctx)
 {
+    aio_io_uring_disable(ctx);
 #ifdef CONFIG_EPOLL_CREATE1
     aio_epoll_disable(ctx);
 #endif
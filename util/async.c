@@ -277,6 +277,14 @@ aio_ctx_finalize(GSource     *source)
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring) {
+        luring_detach_aio_context(ctx->linux_io_uring, ctx);
+        luring_cleanup(ctx->linux_io_uring);
+        ctx->linux_io_uring = NULL;
+    }
+#endif
+
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
     qemu_bh_delete(ctx->co_schedule_bh);
 
@@ -341,6 +349,56 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
+{
+    unsigned int flags = 0;
+
+    if (ctx->linux_io_uring) {
+        return ctx->linux_io_uring;
+    }
+
+    if (ctx->io_uring_sqpoll) {
+        flags |= LURING_SQPOLL;
+    }
+    if (ctx->io_uring_fixed_buffers) {
+        flags |= LURING_FIXED_BUFFERS;
+    }
+
+    ctx->linux_io_uring = luring_init(flags, errp);
+    if (ctx->linux_io_uring) {
+        luring_attach_aio_context(ctx->linux_io_uring, ctx);
+    }
+    return ctx->linux_io_uring;
+}
+
+LuringState *aio_get_linux_io_uring(AioContext *ctx)
+{
+    assert(ctx->linux_io_uring);
+    return ctx->linux_io_uring;
+}
+#endif
+
+void aio_context_set_io_uring_params(AioContext *ctx, bool sqpoll,
+                                     bool fixed_buffers, Error **errp)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring &&
+        (ctx->io_uring_sqpoll != sqpoll ||
+         ctx->io_uring_fixed_buffers != fixed_buffers)) {
+        error_setg(errp, "io_uring parameters cannot be changed while "
+                   "the AioContext has an io_uring ring");
+        return;
+    }
+    ctx->io_uring_sqpoll = sqpoll;
+    ctx->io_uring_fixed_buffers = fixed_buffers;
+#else
+    if (sqpoll || fixed_buffers) {
+        error_setg(errp, "io_uring is not supported by this build");
+    }
+#endif
+}
+
 void aio_notify(AioContext *ctx)
 {
     /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs
@@ -432,6 +490,10 @@ AioContext *aio_context_new(Error **errp)
 #ifdef CONFIG_LINUX_AIO
     ctx->linux_aio = NULL;
 #endif
+
+#ifdef CONFIG_LINUX_IO_URING
+    ctx->linux_io_uring = NULL;
+#endif
     ctx->thread_pool = NULL;
     qemu_rec_mutex_init(&ctx->lock);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);